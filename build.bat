@@ -22,15 +22,17 @@ REM __SERVER__ server support
 REM __CONSOLE__ console support
 REM __FILEQ__ file based queues
 REM __ODBCQ__ ODBC based queues
+REM __SQLITEQ__ SQLite based queues (only when SQLITE is set, see cc.bat)
 
 REM our basic build options
 SET DEFS=-D__SERVER__ -D__CONSOLE__ -D__FILEQ__ -D__ODBCQ__
+IF DEFINED SQLITE SET DEFS=%DEFS% -D__SQLITEQ__
 
 REM sources
 SET SRC=dbuf.c util.c b64.c xmln.c xml.c mime.c task.c ^
-  crypt.c net.c log.c queue.c fileq.c odbcq.c filter.c ebxml.c ^
-  xcrypt.c payload.c cpa.c console.c cfg.c config.c server.c ^
-  basicauth.c find.c fpoller.c qpoller.c ebxml_sender.c ^
+  crypt.c net.c log.c queue.c fileq.c odbcq.c sqliteq.c filter.c ^
+  ebxml.c xcrypt.c payload.c cpa.c console.c cfg.c config.c ^
+  server.c basicauth.c find.c fpoller.c qpoller.c ebxml_sender.c ^
   ebxml_receiver.c applink.c
 
 SET OPTS=
@@ -158,6 +160,7 @@ GOTO :eof
 
 :testone
 IF %ok% == false GOTO :eof
+IF NOT DEFINED SQLITE IF %1 == sqliteq.c GOTO :eof
 call test.bat %1
 IF %ERRORLEVEL%==0 GOTO :eof
 ECHO %1 failed unit test!
@@ -16,10 +16,16 @@ SET LIBDIR=-L%TCC%\lib -L%TCCDIR%\lib
 REM include locations
 SET INC=-I%TCC%\include -I%TCC%\include\winapi -I%TCCDIR%\psdk ^
   -IC:\usr\prog\openssl\include 
+REM SQLite queues are optional - to build them in, set SQLITE to
+REM where SQLite is installed, for example...
+REM SET SQLITE=C:\usr\prog\sqlite
 REM 
 REM the rest should just "work"...
 REM librarys referenced
 SET LIB=-lws2_32 -lshell32 -luser32 -lssleay32 -llibeay32 -lodbc32
+IF DEFINED SQLITE SET LIBDIR=%LIBDIR% -L%SQLITE%
+IF DEFINED SQLITE SET INC=%INC% -I%SQLITE%
+IF DEFINED SQLITE SET LIB=%LIB% -lsqlite3
 REM compile
 CD src
 %TCC%\tcc.exe %LIBDIR% %LIB% %INC% %*
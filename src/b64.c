@@ -69,11 +69,13 @@ int b64_encode (char *dst, unsigned char *src, int len, int lb)
 	break;
       case 1:
 	v = (*src++ & 0x3) << 4;
-	v |= (*src & 0xf0) >> 4;
+	if (len)		/* don't read past the end		*/
+	  v |= (*src & 0xf0) >> 4;
 	break;
       case 2:
 	v = (*src++ & 0xf) << 2;
-	v |= (*src & 0xc0) >> 6;
+	if (len)
+	  v |= (*src & 0xc0) >> 6;
 	break;
       case 3:
 	v = *src++ & 0x3f;
@@ -93,6 +95,21 @@ int b64_encode (char *dst, unsigned char *src, int len, int lb)
   return (d - dst);
 }
 
+/*
+ * Return the length b64_encode() gives for len bytes with line
+ * breaks every lb characters, not including the EOS.
+ */
+int b64_size (int len, int lb)
+{
+  int n, sz;
+
+  n = (len * 4 + 2) / 3;	/* coded characters without padding	*/
+  sz = ((len + 2) / 3) * 4;	/* padded length			*/
+  if (lb)
+    sz += (n / lb) * 2;
+  return (sz);
+}
+
 /*
  * Decode a buffer.  dst should be at least 75% the size of src,
  * and can be the same buffer as src.
@@ -144,6 +161,59 @@ int b64_decode (unsigned char *dst, char *src)
   return (d - dst);
 }
 
+/*
+ * Decode part of a base 64 stream.  The len characters in src are
+ * appended to those carried over from the last call.  Only whole
+ * groups of four are decoded to dst, the rest are kept in carry for
+ * the next call.  Padding and non-b64 characters are skipped, and
+ * the b64 characters are packed in place in src.
+ *
+ * dst should be at least 75% the size of src plus 4
+ * carry must be at least 5 bytes and initially EOS
+ * Returns the decoded length.
+ */
+int b64_decode_part (unsigned char *dst, char *src, int len, char *carry)
+{
+  unsigned char *d;
+  char *s, *p;
+  int n;
+
+  d = dst;
+  n = strlen (carry);
+  for (s = p = src; len--; p++)
+  {
+    if (*p && (strchr (b64_tab, *p) != NULL))
+      *s++ = *p;
+  }
+  len = s - src;
+  /*
+   * complete any group we carried over first
+   */
+  p = src;
+  while (n && (n < 4) && len)
+  {
+    carry[n++] = *p++;
+    len--;
+  }
+  if (n == 4)
+  {
+    carry[4] = 0;
+    d += b64_decode (d, carry);
+    n = 0;
+  }
+  /*
+   * then decode all the whole groups and carry the rest
+   */
+  s = p + (len & ~3);
+  memcpy (carry + n, s, len & 3);
+  carry[n + (len & 3)] = 0;
+  n = *s;
+  *s = 0;
+  d += b64_decode (d, p);
+  *s = n;
+  return (d - dst);
+}
+
 #ifdef UNITTEST
 #include "unittest.h"
 
@@ -162,8 +232,8 @@ char Coded[] =
 
 int main (int argc, char **argv)
 {
-  char buf[512], buf2[512];
-  int i;
+  char buf[512], buf2[512], carry[5];
+  int i, n;
 
   i = b64_encode (buf, Plain, strlen (Plain), 76);
   if (i != strlen (Coded))
@@ -175,6 +245,33 @@ int main (int argc, char **argv)
     error ("decoded size doesn't match\n");
   if (strcmp (buf2, Plain))
     error ("decoding didn't match\n");
+  /*
+   * decode it again in odd sized pieces
+   */
+  strcpy (buf, Coded);
+  *carry = 0;
+  for (i = n = 0; i < strlen (Coded); i += 7)
+    n += b64_decode_part (buf2 + n, buf + i, 
+      strlen (Coded) - i < 7 ? strlen (Coded) - i : 7, carry);
+  n += b64_decode (buf2 + n, carry);
+  if ((n != strlen (Plain)) || strncmp (buf2, Plain, n))
+    error ("partial decoding didn't match\n");
+  /*
+   * sizes must match actual encoding, and whole lines encode the same
+   * in pieces as all at once
+   */
+  for (i = 0; i <= strlen (Plain); i++)
+  {
+    if (b64_size (i, 76) != b64_encode (buf, Plain, i, 76))
+      error ("size of %d bytes doesn't match encoding\n", i);
+    if ((b64_decode (buf2, buf) != i) || strncmp (buf2, Plain, i))
+      error ("encoding of %d bytes didn't decode\n", i);
+  }
+  for (i = n = 0; i < strlen (Plain); i += 57)
+    n += b64_encode (buf + n, Plain + i, 
+      strlen (Plain) - i < 57 ? strlen (Plain) - i : 57, 76);
+  if ((n != strlen (Coded)) || strcmp (buf, Coded))
+    error ("piece wise encoding didn't match\n");
   info ("%s %s\n", argv[0], Errors?"failed":"passed");
   exit (Errors);
 }
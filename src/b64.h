@@ -24,6 +24,11 @@
  * Returns the encoded length not including the EOS.
  */
 int b64_encode (char *dst, unsigned char *src, int len, int lb);
+/*
+ * Return the length b64_encode() gives for len bytes with line
+ * breaks every lb characters, not including the EOS.
+ */
+int b64_size (int len, int lb);
 /*
  * Decode a buffer.  dst should be at least 75% the size of src,
  * and can be the same buffer as src.
@@ -31,5 +36,14 @@ int b64_encode (char *dst, unsigned char *src, int len, int lb);
  * Returns the decoded length not including the EOS.
  */
 int b64_decode (unsigned char *dst, char *src);
+/*
+ * Decode part of a base 64 stream.  The len characters in src are
+ * appended to those carried over from the last call.  Only whole
+ * groups of four are decoded to dst, the rest are kept in carry (which
+ * should be 5 bytes and initially EOS) for the next call.  Call
+ * b64_decode (dst, carry) to finish.  Note src is modified. 
+ * Returns the decoded length.
+ */
+int b64_decode_part (unsigned char *dst, char *src, int len, char *carry);
 
 #endif /* __B64__ */
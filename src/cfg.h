@@ -29,6 +29,8 @@
 #define XPARTY "Phineas.PartyId"
 #define XRETRY "Phineas.Sender.MaxRetry"
 #define XDELAY "Phineas.Sender.DelayRetry"
+#define XMAXIDLE "Phineas.Sender.MaxIdle"
+#define XIDLETIMEOUT "Phineas.Sender.IdleTimeout"
 #define XSOAP "Phineas.SoapTemplate"
 #define XACK "Phineas.AckTemplate"
 #define XSENDCA "Phineas.Sender.CertificateAuthority"
@@ -60,6 +62,8 @@
 #define cfg_party(x) xml_get_text((x),XPARTY)
 #define cfg_retries(x) xml_get_int((x),XRETRY)
 #define cfg_delay(x) xml_get_int((x),XDELAY)
+#define cfg_maxidle(x) xml_get_int((x),XMAXIDLE)
+#define cfg_idletimeout(x) xml_get_int((x),XIDLETIMEOUT)
 #define cfg_soap(x) xml_get_text((x),XSOAP)
 #define cfg_senderca(x) xml_get_text((x),XSENDCA)
 #define cfg_timeout(x) 10000
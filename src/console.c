@@ -524,9 +524,9 @@ char *console_getStatusColor (QUEUEROW *r)
 
 
 /*
- * set the needed header info
+ * set the needed header info for page b in hdr
  */
-int console_header (DBUF *b, char *path)
+int console_header (DBUF *hdr, DBUF *b, char *path)
 {
   int i, l;
   char *ch, buf[DBUFSZ];
@@ -550,8 +550,8 @@ int console_header (DBUF *b, char *path)
    */
   l += sprintf (buf + l, "Connection: %s\r\nContent-Length: %d\r\n\r\n", 
     phineas_running () ? "Keep-alive" : "Close", dbuf_size (b));
-  debug ("inserting header:\n%s", buf);
-  dbuf_insert (b, 0, buf, l);
+  debug ("header:\n%s", buf);
+  dbuf_write (hdr, buf, l);
   return (0);
 }
 
@@ -606,9 +606,9 @@ DBUF *console_queue_row (QUEUE *q, int top, int rowid)
  */
 DBUF *console_queue (QUEUE *q, int top, int rowid)
 {
-  int row, id, i;
+  int row, n, id, i;
   DBUF *b;
-  QUEUEROW *r;
+  QUEUEROW *r, *rows[DISPLAYROWS];
   char buf[DBUFSZ];
 
   b = dbuf_alloc ();
@@ -619,10 +619,10 @@ DBUF *console_queue (QUEUE *q, int top, int rowid)
     return (b);
   }
   debug ("getting set of rows for %s\n", q->name);
-  if ((r = queue_prev (q, top)) == NULL)
+  if ((n = queue_page (q, top, DISPLAYROWS, rows)) == 0)
   {
     debug ("no rows from %d for %s\n", top, q->name);
-    if ((top == 0) || ((r = queue_prev (q, 0)) == NULL))
+    if ((top == 0) || ((n = queue_page (q, 0, DISPLAYROWS, rows)) == 0))
     {
       dbuf_printf (b, "<h3>No rows found for %s</h3>", q->name);
       return (b);
@@ -638,11 +638,11 @@ DBUF *console_queue (QUEUE *q, int top, int rowid)
     dbuf_printf (b, "<td>%s</td>", q->type->field[i]);
   }
   dbuf_printf (b, "</tr></thead>");
-  row = 0;
   if (rowid == 0)
-    rowid = atoi (r->field[0]);
-  while (r != NULL)
+    rowid = atoi (rows[0]->field[0]);
+  for (row = 0; row < n; row++)
   {
+    r = rows[row];
     id = atoi (r->field[0]);
     dbuf_printf (b, "<tr bgcolor='%s' %s >",
       console_getStatusColor (r),
@@ -660,9 +660,7 @@ DBUF *console_queue (QUEUE *q, int top, int rowid)
         dbuf_printf (b, "<td>&nbsp;</td>");
     }
     dbuf_printf (b, "</tr>");
-    r = queue_row_free (r);
-    if (++row < DISPLAYROWS)
-      r = queue_prev (q, id);
+    queue_row_free (r);
   }
   dbuf_printf (b, "</table></div>");
   if (row == DISPLAYROWS)
@@ -950,7 +948,6 @@ DBUF *console_doGet (XML *xml, char *req)
   if (strstr (uri, "console.html") == NULL)
   {
     debug ("returning non-console page for %s\n", uri);
-    console_header (page, uri);
     return (page);
   }
   console_version (page);
@@ -1026,7 +1023,6 @@ DBUF *console_doGet (XML *xml, char *req)
   dbuf_free (queuelist);
   dbuf_free (rowlist);
   dbuf_free (rowdetail);
-  console_header (page, uri);
   return (page);
 }
 
@@ -1041,14 +1037,23 @@ DBUF *console_doPost (XML *xml, char *req)
   return (config_setConfig (xml, req));
 }
 
-DBUF *console_response (XML *xml, char *req)
+/*
+ * respond to a console request, with the page header kept in hdr
+ */
+DBUF *console_response (XML *xml, char *req, DBUF *hdr)
 {
+  DBUF *page;
+  char uri[MAX_PATH];
+
   if (basicauth_check (xml, "Phineas.Console.BasicAuth", req))
     return (basicauth_response ("Phineas Console"));
   if (strstarts (req, "POST "))
-    return (console_doPost (xml, req));
+    page = console_doPost (xml, req);
   else
-    return (console_doGet (xml, req));
+    page = console_doGet (xml, req);
+  if ((page != NULL) && (console_geturi (uri, req) != NULL))
+    console_header (hdr, page, uri);
+  return (page);
 }
 
 #ifdef UNITTEST
@@ -1190,7 +1195,7 @@ char *Expected =
 int main (int argc, char **argv)
 {
   XML *xml;
-  DBUF *b;
+  DBUF *b, *h;
 
   if ((xml = xml_parse (PhineasConfig)) == NULL)
     fatal ("Failed parsing PhineasConfig\n");
@@ -1201,6 +1206,11 @@ int main (int argc, char **argv)
   b = console_doGet (xml, "GET /phineas/console/console.html?");
   if (b == NULL)
     fatal ("Couldn't get console page\n");
+  h = dbuf_alloc ();
+  console_header (h, b, "/phineas/console/console.html");
+  dbuf_write (h, dbuf_getbuf (b), dbuf_size (b));
+  dbuf_free (b);
+  b = h;
   strdiff (__FILE__,__LINE__, "console differs", dbuf_getbuf(b), Expected);
   debug ("page saved to console/test.htm\n");
   // writefile ("../console/test.htm", dbuf_getbuf (b), dbuf_size (b));
@@ -20,8 +20,10 @@
 #endif
 
 #include <stdio.h>
+#include <sys/stat.h>
 #include "util.h"
 #include "dbuf.h"
+#include "task.h"
 #include "log.h"
 #include "xml.h"
 #include "mime.h"
@@ -79,30 +81,250 @@ char *ebxml_beautify (char *buf)
 }
 
 /*
- * Load, allocate, and return an xml template
+ * Parsed xml templates, kept until their file changes.  Each
+ * is cached with the fields a caller fills in, already resolved
+ * to nodes, so a message only needs a copy of the template.
  */
-XML *ebxml_template (XML *xml, char *tag)
+#define EBXMLTEMPLATES 8
+
+typedef struct ebxmltemplate
+{
+  char path[MAX_PATH];		/* template file			*/
+  time_t mtime;			/* and when it was last changed		*/
+  long size;
+  XML *xml;			/* parsed template			*/
+  char **fields;		/* paths filled in by the caller	*/
+  int num;
+  void **nodes;			/* resolved fields in the template	*/
+} EBXMLTEMPLATE;
+
+typedef struct
+{
+  MUTEX mutex;
+  int next;			/* next slot to reuse			*/
+  EBXMLTEMPLATE t[EBXMLTEMPLATES];
+} EBXMLTEMPLATECACHE;
+
+EBXMLTEMPLATECACHE *EbxmlTemplates = NULL;
+
+/*
+ * initialize the template cache
+ */
+void ebxml_template_init (void)
+{
+  if (EbxmlTemplates != NULL)
+    return;
+  EbxmlTemplates = (EBXMLTEMPLATECACHE *)
+    malloc (sizeof (EBXMLTEMPLATECACHE));
+  memset (EbxmlTemplates, 0, sizeof (EBXMLTEMPLATECACHE));
+  init_mutex (EbxmlTemplates);
+}
+
+/*
+ * clear a cached template
+ */
+static void ebxml_template_clear (EBXMLTEMPLATE *t)
+{
+  t->xml = xml_free (t->xml);
+  if (t->nodes != NULL)
+    free (t->nodes);
+  memset (t, 0, sizeof (EBXMLTEMPLATE));
+}
+
+/*
+ * free the template cache
+ */
+void ebxml_template_free (void)
+{
+  int i;
+
+  if (EbxmlTemplates == NULL)
+    return;
+  for (i = 0; i < EBXMLTEMPLATES; i++)
+    ebxml_template_clear (EbxmlTemplates->t + i);
+  destroy_mutex (EbxmlTemplates);
+  free (EbxmlTemplates);
+  EbxmlTemplates = NULL;
+}
+
+/*
+ * Load a template and resolve it's fields to nodes
+ */
+static XML *ebxml_template_load (char *path, char **fields, int num,
+  void **nodes)
+{
+  int i;
+  XML *t;
+
+  if ((t = xml_load (path)) == NULL)
+  {
+    error ("Can't load template %s\n", path);
+    return (NULL);
+  }
+  for (i = 0; i < num; i++)
+    nodes[i] = xml_node (t, fields[i]);
+  return (t);
+}
+
+/*
+ * Find or load the cache entry for this template and field list.
+ * The cache must be locked.
+ */
+static EBXMLTEMPLATE *ebxml_template_find (char *path, struct stat *st,
+  char **fields, int num)
+{
+  int i;
+  EBXMLTEMPLATE *t;
+
+  for (i = 0; i < EBXMLTEMPLATES; i++)
+  {
+    t = EbxmlTemplates->t + i;
+    if ((t->fields == fields) && (strcmp (t->path, path) == 0))
+      break;
+  }
+  if (i == EBXMLTEMPLATES)
+  {
+    t = EbxmlTemplates->t + EbxmlTemplates->next;
+    EbxmlTemplates->next = (EbxmlTemplates->next + 1) % EBXMLTEMPLATES;
+  }
+  else if ((t->xml != NULL) && (t->mtime == st->st_mtime) &&
+    (t->size == st->st_size))
+    return (t);
+  ebxml_template_clear (t);
+  debug ("loading template %s\n", path);
+  if (num)
+    t->nodes = (void **) malloc (num * sizeof (void *));
+  if ((t->xml = ebxml_template_load (path, fields, num, t->nodes)) == NULL)
+  {
+    ebxml_template_clear (t);
+    return (NULL);
+  }
+  strcpy (t->path, path);
+  t->mtime = st->st_mtime;
+  t->size = st->st_size;
+  t->fields = fields;
+  t->num = num;
+  return (t);
+}
+
+/*
+ * Return a copy of an xml template, resolving num fields to
+ * nodes in the copy for xml_node_set_text() and friends.  The
+ * parsed template is cached until its file changes.  The caller
+ * should free the copy.
+ */
+XML *ebxml_template_fields (XML *xml, char *tag, char **fields, int num,
+  void **nodes)
 {
   char path[MAX_PATH];
+  struct stat st;
+  EBXMLTEMPLATE *t;
+  XML *copy = NULL;
 
-  if (pathf (path, xml_get_text (xml, tag)) == NULL)
+  if ((pathf (path, xml_get_text (xml, tag)) == NULL) ||
+    stat (path, &st))
   {
     error ("Can't load template for %s\n", tag);
     return (NULL);
   }
-  return (xml_load (path));
+  if (EbxmlTemplates == NULL)
+    return (ebxml_template_load (path, fields, num, nodes));
+  wait_mutex (EbxmlTemplates);
+  if ((t = ebxml_template_find (path, &st, fields, num)) != NULL)
+  {
+    if (num)
+      memcpy (nodes, t->nodes, num * sizeof (void *));
+    copy = xml_dup (t->xml, nodes, num);
+  }
+  end_mutex (EbxmlTemplates);
+  return (copy);
+}
+
+/*
+ * Load, allocate, and return an xml template
+ */
+XML *ebxml_template (XML *xml, char *tag)
+{
+  return (ebxml_template_fields (xml, tag, NULL, 0, NULL));
 }
 
 #ifdef UNITTEST
+#undef UNITTEST
 #undef debug
 #include "util.c"
+#include "dbuf.c"
 #include "xmln.c"
 #include "xml.c"
+#include "b64.c"
 #include "mime.c"
 
+#define TTEMPLATE "ebxml_template.tmp"
+
+/*
+ * write a template, making sure the cache sees it change
+ */
+void test_write (char *buf)
+{
+  FILE *fp;
+
+  if ((fp = fopen (TTEMPLATE, "w")) == NULL)
+  {
+    error ("Can't write %s\n", TTEMPLATE);
+    return;
+  }
+  fputs (buf, fp);
+  fclose (fp);
+}
+
 int main (int argc, char **argv)
 {
-  warn ("No unit tests defined\n");
+  XML *xml, *t, *t2;
+  void *f[2];
+  char *ch;
+  static char *fields[] = { "Env.Hdr.To", "Env.Hdr.From" };
+
+  xml = xml_parse ("<Phineas><Template>" TTEMPLATE "</Template></Phineas>");
+  test_write ("<Env><Hdr><To>nobody</To></Hdr><Body>stuff</Body></Env>");
+  ebxml_template_init ();
+
+  if ((t = ebxml_template_fields (xml, "Phineas.Template", fields, 2, f))
+    == NULL)
+    error ("Can't load template\n");
+  xml_node_set_text (f[0], "me");
+  xml_node_set_text (f[1], "you");
+  if (strcmp (xml_get_text (t, "Env.Hdr.To"), "me") ||
+    strcmp (xml_get_text (t, "Env.Hdr.From"), "you"))
+    error ("Fields not set in template copy\n");
+
+  if ((t2 = ebxml_template_fields (xml, "Phineas.Template", fields, 2, f))
+    == NULL)
+    error ("Can't copy cached template\n");
+  if (strcmp (xml_get_text (t2, "Env.Hdr.To"), "nobody") ||
+    strcmp (xml_get_text (t2, "Env.Body"), "stuff"))
+    error ("Cached template changed by a copy\n");
+  xml_node_set_text (f[0], "again");
+  if (strcmp (xml_get_text (t, "Env.Hdr.To"), "me"))
+    error ("Template copies share nodes\n");
+  xml_free (t);
+  xml_free (t2);
+
+  test_write ("<Env><Hdr><To>somebody</To></Hdr><Body>more stuff</Body>"
+    "</Env>");
+  if ((t = ebxml_template (xml, "Phineas.Template")) == NULL)
+    error ("Can't load changed template\n");
+  else if (strcmp (xml_get_text (t, "Env.Body"), "more stuff"))
+    error ("Changed template not reloaded\n");
+  xml_free (t);
+  if ((t = ebxml_template_fields (xml, "Phineas.Template", fields, 2, f))
+    == NULL)
+    error ("Can't load changed template\n");
+  else if (strcmp (xml_get_text (t, "Env.Hdr.To"), "somebody"))
+    error ("Changed template not reloaded for fields\n");
+  xml_free (t);
+
+  ebxml_template_free ();
+  xml_free (xml);
+  unlink (TTEMPLATE);
   info ("%s %s\n", argv[0], Errors ? "failed": "passed");
   exit (Errors);
 }
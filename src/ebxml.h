@@ -21,6 +21,7 @@
 #include "dbuf.h"
 #include "xml.h"
 #include "queue.h"
+#include "qpoller.h"
 #include "net.h"
 
 /*
@@ -89,6 +90,15 @@ char *ebxml_beautify (char *buf);
  */
 int ebxml_fprocessor (XML *xml, char *prefix, char *fname);
 
+/*
+ * A folder polling row builder for ebxml queues - register this with
+ * the fpoller to queue a scan's files in batches.
+ *
+ * This moves the file to a processed point and returns the queue
+ * row for it, not yet pushed.
+ */
+QUEUEROW *ebxml_frow (XML *xml, char *prefix, char *fname);
+
 /*
  * A queue polling processor for ebxml queues - register this with
  * the qpoller.
@@ -99,15 +109,47 @@ int ebxml_fprocessor (XML *xml, char *prefix, char *fname);
  */
 int ebxml_qprocessor (XML *xml, QUEUEROW *r);
 
+/*
+ * The stages of ebxml_qprocessor() for the qpoller to run as a
+ * pipeline - building the message, encrypting it, and sending it -
+ * so one message can be encrypted while another waits on it's
+ * reply.  Register these with ebxml_send_free() for cleanup.
+ */
+#define EBXMLSTAGES 3
+extern QPSTAGE EbxmlStages[];
+void ebxml_send_free (void *data);
+
 /*
  * Process an incoming request and return the response.  The caller
  * should free the response after sending.
  */
 char *ebxml_process_req (XML *xml, char *buf);
 
+/*
+ * Process an incoming request whose body was spooled to a file and
+ * return the response.  The caller should free the response after
+ * sending.
+ */
+char *ebxml_process_spool (XML *xml, char *req, char *spool);
+
+/*
+ * initialize and free the template cache
+ */
+void ebxml_template_init (void);
+void ebxml_template_free (void);
+
 /*
  * Load, allocate, and return an xml template
  */
 XML *ebxml_template (XML *xml, char *tag);
 
+/*
+ * Return a copy of an xml template, resolving num fields to
+ * nodes in the copy for xml_node_set_text() and friends.  The
+ * parsed template is cached until its file changes.  The caller
+ * should free the copy.
+ */
+XML *ebxml_template_fields (XML *xml, char *tag, char **fields, int num,
+  void **nodes);
+
 #endif /* __EBXML__ */
@@ -114,6 +114,29 @@ int ebxml_service_map (XML *xml, char *service, char *action)
   return (-1);
 }
 
+/*
+ * ACK template fields we fill in, resolved once by the template
+ * cache, in the order they were originally set
+ */
+static char *AckFields[] =
+{
+  SOAPTOPARTY, SOAPFROMPARTY, SOAPCPAID, SOAPCONVERSEID, SOAPACTION,
+  SOAPMESSAGEID, SOAPDATATIME, SOAPACKTIME, SOAPREFID, SOAPREFID "[1]",
+  SOAPACKREF
+};
+#define AF_TOPARTY 0
+#define AF_FROMPARTY 1
+#define AF_CPAID 2
+#define AF_CONVERSEID 3
+#define AF_ACTION 4
+#define AF_MESSAGEID 5
+#define AF_DATATIME 6
+#define AF_ACKTIME 7
+#define AF_REFID 8
+#define AF_REFID1 9
+#define AF_ACKREF 10
+#define AF_NUM 11
+
 /*
  * allocate and construct an ebXML reply message
  * caller should free the reply
@@ -122,6 +145,7 @@ char *ebxml_reply (XML *xml, XML *soap, QUEUEROW *r,
   char *status, char *error, char *appdata)
 {
   XML *txml;
+  void *f[AF_NUM];
   MIME *rmsg, *smsg, *msg;
   DBUF *b;
   char *ch,
@@ -143,17 +167,18 @@ char *ebxml_reply (XML *xml, XML *soap, QUEUEROW *r,
   /*
    * build the soap container...
    */
-  txml = ebxml_template (xml, XACK);
+  txml = ebxml_template_fields (xml, XACK, AckFields, AF_NUM, f);
   if (txml == NULL)
   {
     error ("can't get soap template\n");
     return (NULL);
   }
 
-  xml_set_text (txml, SOAPTOPARTY, xml_get_text (soap, SOAPFROMPARTY));
-  xml_set_text (txml, SOAPFROMPARTY, xml_get_text (soap, SOAPTOPARTY));
-  xml_set_text (txml, SOAPCPAID, xml_get_text (soap, SOAPCPAID));
-  xml_set_text (txml, SOAPCONVERSEID, xml_get_text (soap, SOAPCONVERSEID));
+  xml_node_set_text (f[AF_TOPARTY], xml_get_text (soap, SOAPFROMPARTY));
+  xml_node_set_text (f[AF_FROMPARTY], xml_get_text (soap, SOAPTOPARTY));
+  xml_node_set_text (f[AF_CPAID], xml_get_text (soap, SOAPCPAID));
+  xml_node_set_text (f[AF_CONVERSEID], 
+    xml_get_text (soap, SOAPCONVERSEID));
 
   if (strcmp (xml_get_text (soap, SOAPACTION), "Ping") == 0)
     ch = "Pong";
@@ -161,17 +186,17 @@ char *ebxml_reply (XML *xml, XML *soap, QUEUEROW *r,
     ch = "MessageError";
   else
     ch = "Acknowledgment";
-  xml_set_text (txml,  SOAPACTION, ch);
+  xml_node_set_text (f[AF_ACTION], ch);
   sprintf (buf, "%s@%s", pid, organization);
-  xml_set_text (txml, SOAPMESSAGEID, buf);
-  xml_set_text (txml, SOAPDATATIME, ptime (NULL, buf));
-  xml_set_text (txml, SOAPACKTIME, buf);
+  xml_node_set_text (f[AF_MESSAGEID], buf);
+  xml_node_set_text (f[AF_DATATIME], ptime (NULL, buf));
+  xml_node_set_text (f[AF_ACKTIME], buf);
 
   queue_field_set (r, "RECEIVEDTIME", buf);
   queue_field_set (r, "LASTUPDATETIME", buf);
-  xml_set_text (txml, SOAPREFID, "statusResponse@cdc.gov");
-  xml_set_text (txml, SOAPREFID "[1]", xml_get_text (soap, SOAPMESSAGEID)); 
-  xml_set_text (txml, SOAPACKREF, xml_get_text (soap, SOAPMESSAGEID));
+  xml_node_set_text (f[AF_REFID], "statusResponse@cdc.gov");
+  xml_node_set_text (f[AF_REFID1], xml_get_text (soap, SOAPMESSAGEID)); 
+  xml_node_set_text (f[AF_ACKREF], xml_get_text (soap, SOAPMESSAGEID));
 
   smsg = mime_alloc ();
   mime_setHeader (smsg, MIME_CONTENTID, "<ebxml-envelope@cdc.gov>", 0);
@@ -208,7 +233,8 @@ char *ebxml_reply (XML *xml, XML *soap, QUEUEROW *r,
   mime_setBoundary (msg, "");
   mime_setHeader (msg, "SOAPAction", "\"ebXML\"", 99);
   mime_setHeader (msg, "Date", today, 99);
-  mime_setHeader (msg, "Connection", "close", 99);
+  mime_setHeader (msg, "Connection", 
+    phineas_running () ? "Keep-alive" : "close", 99);
   mime_setHeader (msg, "Server", Software, 99);
   mime_setMultiPart (msg, smsg);
   if (rmsg != NULL)
@@ -268,6 +294,44 @@ int ebxml_request_row (QUEUEROW *r, XML *soap)
   return (0);
 }
 
+/*
+ * Check the SOAP envelope for a ping or our service map, and 
+ * initialize a queue entry.  Returns the reply if we are done with 
+ * this request, or NULL to continue with it's payload.
+ */
+static char *ebxml_request_service (XML *xml, XML *soap, int *service,
+  QUEUEROW **r)
+{
+  char *ch;
+
+  /*
+   * check for ping
+   */
+  ch = xml_get_text (soap, SOAPACTION);
+  if (strcmp (ch, "Ping") == 0)
+    return (ebxml_reply (xml, soap, NULL, "success", "none", "none"));
+  /*
+   * find the service map index and initialize a queue entry
+   */
+  if ((*service = 
+      ebxml_service_map (xml, xml_get_text (soap, SOAPSERVICE), ch)) < 0)
+  {
+    error ("Unknown service/action %s/%s\n",
+	xml_get_text (soap, SOAPSERVICE), ch);
+    return (ebxml_reply (xml, soap, NULL, "InsertFailed",
+      "Unknown Service/Action", "none"));
+  }
+  ch = cfg_service (xml, *service, "Queue");
+  if ((*r = queue_row_alloc (queue_find (ch))) == NULL)
+  {
+    error ("queue not found for %s\n", ch);
+    return (ebxml_reply (xml, soap, NULL, "InsertFailed", 
+      "Queue not found", "none"));
+  }
+  ebxml_request_row (*r, soap);
+  return (NULL);
+}
+
 /*
  * Process an incoming request and return the response.  The caller
  * should free the response after sending.
@@ -319,37 +383,8 @@ char *ebxml_process_req (XML *xml, char *buf)
     mime_free (msg);
     return (NULL);
   }
-  /*
-   * check for ping
-   */
-  ch = xml_get_text (soap, SOAPACTION);
-  if (strcmp (ch, "Ping") == 0)
-  {
-    ch = ebxml_reply (xml, soap, NULL, "success", "none", "none");
+  if ((ch = ebxml_request_service (xml, soap, &service, &r)) != NULL)
     goto done;
-  }
-  /*
-   * find the service map index and initialize a queue entry
-   */
-  if ((service = 
-      ebxml_service_map (xml, xml_get_text (soap, SOAPSERVICE), ch)) < 0)
-  {
-    error ("Unknown service/action %s/%s\n",
-	xml_get_text (soap, SOAPSERVICE), ch);
-    ch = ebxml_reply (xml, soap, NULL, "InsertFailed",
-      "Unknown Service/Action", "none");
-    goto done;
-  }
-  ch = cfg_service (xml, service, "Queue");
-  r = queue_row_alloc (queue_find (ch));
-  if (r == NULL)
-  {
-    error ("queue not found for %s\n", ch);
-    ch = ebxml_reply (xml, soap, NULL, "InsertFailed", 
-      "Queue not found", "none");
-    goto done;
-  }
-  ebxml_request_row (r, soap);
   /*
    * get the payload
    */
@@ -450,6 +485,179 @@ done:
   return (ch);
 }
 
+/*
+ * Process an incoming request whose body was spooled to a file and
+ * return the response.  The caller should free the response after 
+ * sending.  Only the request header and SOAP envelope are held in
+ * memory.  The payload is decoded or decrypted straight from the
+ * spool file to the service map Directory (or through it's Filter).
+ */
+char *ebxml_process_spool (XML *xml, char *req, char *spool)
+{
+  long len,			/* payload length		*/
+       body,			/* payload offset		*/
+       start[2], end[2];	/* MIME part offsets		*/
+  int service;			/* index to service map		*/
+  MIME *msg = NULL, 		/* the request headers		*/
+       *part = NULL;		/* one part of the message	*/
+  XML *soap = NULL;		/* the ebxml soap envelope	*/
+  QUEUEROW *r = NULL;		/* our audit table		*/
+  FILE *fp, *out;
+  char *ch,
+       *unc,			/* decryption informatin	*/
+       *pw,
+       *filter,
+       dn[DNSZ],
+       boundary[100],		/* MIME part boundary		*/
+       name[MAX_PATH],		/* payload file name		*/
+       fname[MAX_PATH],		/* where we decode payload	*/
+       path[MAX_PATH];		/* payload local disk path	*/
+
+  info ("Begin processing spooled ebXML request...\n");
+  if (basicauth_check (xml, XBASICAUTH, req))
+  {
+    DBUF *b = basicauth_response ("Phineas Receiver");
+    return (dbuf_extract (b));
+  }
+  if ((fp = fopen (spool, "rb")) == NULL)
+  {
+    error ("Can't open spooled request %s\n", spool);
+    return (NULL);
+  }
+  /*
+   * the request header has our boundary, which we use to find
+   * the SOAP and payload parts
+   */
+  msg = mime_alloc ();
+  msg->headers = stralloc (NULL, req);
+  if ((mime_getBoundary (msg, boundary, 100) < 1) ||
+    (mime_findParts (fp, boundary, start, end, 2) < 2))
+  {
+    error ("Failed to parse MIME payload\n");
+    ch = NULL;
+    goto done;
+  }
+  if ((part = mime_readPart (fp, start[0], end[0])) == NULL)
+  {
+    error ("Failed to get SOAP envelope\n");
+    ch = NULL;
+    goto done;
+  }
+  soap = xml_parse (mime_getBody (part));
+  part = mime_free (part);
+  if (soap == NULL)
+  {
+    error ("Failed to parse SOAP xml\n");
+    ch = NULL;
+    goto done;
+  }
+  if ((ch = ebxml_request_service (xml, soap, &service, &r)) != NULL)
+    goto done;
+  /*
+   * get the payload headers and name
+   */
+  if ((part = mime_readHeaders (fp, start[1], &body)) == NULL)
+  {
+    error ("Failed to get PAYLOAD envelope\n");
+    ch = ebxml_reply (xml, soap, r, "InsertFailed",
+      "Missing Payload Envelope", "none");
+    goto done;
+  }
+  if (payload_name (part, name) == NULL)
+  {
+    ch = "Missing Payload DISPOSITION";
+    error ("%s\n", ch);
+    ch = ebxml_reply (xml, soap, r, "InsertFailed", ch, "none");
+    goto done;
+  }
+  if (((len = mime_getLength (part)) < 1) || (body + len > end[1]))
+    len = end[1] - body;
+
+  /*
+   * encryption envelope
+   */
+  unc = cfg_service (xml, service, "Encryption.Unc");
+  pw = cfg_service (xml, service, "Encryption.Password");
+  strcpy (dn, cfg_service (xml, service, "Encryption.Id"));
+
+  /*
+   * prepare to write it to disk, using a filter if given
+   */
+  ppathf (path, cfg_service (xml, service, "Directory"), "%s", name);
+  queue_field_set (r, "PAYLOADNAME", name);
+  queue_field_set (r, "LOCALFILENAME", path);
+  if (mime_getHeader (part, MIME_CONTENT) == NULL)
+    queue_field_set (r, "ENCRYPTION", "no");
+  else
+    queue_field_set (r, "ENCRYPTION", "yes");
+  filter = cfg_service (xml, service, "Filter");
+  if (*filter)
+    sprintf (fname, "%s.payload", spool);
+  else
+    strcpy (fname, path);
+  info ("Writing ebXML payload to %s\n", fname);
+  if ((out = fopen (fname, "wb")) == NULL)
+  {
+    error ("Can't open %s for write\n", name);
+    ch = ebxml_reply (xml, soap, r, "InsertFailed",
+      "Can not save file", "none");
+    goto done;
+  }
+  fseek (fp, body, SEEK_SET);
+  len = payload_stream (part, fp, len, out, unc, dn, pw, &ch);
+  fclose (out);
+  if (len < 1)
+  {
+    error ("Failed processing payload - %s\n", ch);
+    unlink (fname);
+    ch = ebxml_reply (xml, soap, r, "InsertFailed", ch, "none");
+    goto done;
+  }
+  if (*filter)
+  {
+    char *emsg;
+
+    debug ("filter write %s with %s\n", path, filter);
+    len = filter_run (filter, fname, NULL, path, NULL, &emsg, 
+      cfg_timeout (xml));
+    unlink (fname);
+    if (*emsg)
+      warn ("filter %s returned %s\n", filter, emsg);
+    free (emsg);
+    if (len)
+    {
+      error ("Can't filter to %s\n", name);
+      ch = ebxml_reply (xml, soap, r, "InsertFailed",
+        "Can not process file", "none");
+      goto done;
+    }
+  }
+
+  /*
+   * construct a reply and insert a queue entry
+   */
+  ch = ebxml_reply (xml, soap, r, "InsertSuceeded", "none", "none");
+
+done:
+
+  debug ("completing spooled ebxml request processing\n");
+  fclose (fp);
+  if (r != NULL)
+  {
+    queue_push (r);
+    queue_row_free (r);
+  }
+  if (soap != NULL)
+    xml_free (soap);
+  if (part != NULL)
+    mime_free (part);
+  if (msg != NULL)
+    mime_free (msg);
+  debug ("ebXML reply: %s\n", ch);
+  info ("ebXML request processing completed\n");
+  return (ch);
+}
+
 #ifdef UNITTEST
 #undef UNITTEST
 #undef debug
@@ -55,9 +55,8 @@ DBUF *server_receive(NETCON *conn);
  */
 DBUF *ebxml_receive (NETCON *conn)
 {
-  long n;
-  int e;
-  char c, *ch;
+  long n, e;
+  char *ch, line[DBUFSZ];
   DBUF *b;
 
   b = dbuf_alloc ();
@@ -65,23 +64,20 @@ DBUF *ebxml_receive (NETCON *conn)
   /*
    * read to end of message request header - empty line
    */
-  while ((e = net_read (conn, &c, 1)) == 1)
+  while ((e = net_gets (conn, line, DBUFSZ)) > 0)
   {
-    dbuf_putc (b, c);
-    if (c == '\n')
-    {
-      if (n++ == 1)
-        break;
-    }
-    else if (c != '\r')
+    dbuf_write (b, line, e);
+    if (line[e - 1] != '\n')
       n = 0;
+    else if ((n == 1) && ((e == 1) || ((e == 2) && (*line == '\r'))))
+      break;
+    else
+      n = 1;
   }
-  if (e != 1)
+  if (e <= 0)
   {
-    if (e == 0)
-      error ("Acknowledgment header read failed or connection closed\n");
-    else
-      error ("Timed out reading acknowledgment header\n");
+    error ("Acknowledgment header read failed, timed out, "
+      "or connection closed\n");
     dbuf_free (b);
     return (NULL);
   }
@@ -97,18 +93,17 @@ DBUF *ebxml_receive (NETCON *conn)
 
 readbytes:
 
-  while (n--)
+  /*
+   * read the content straight into our (presized) buffer
+   */
+  if (n > 0)
   {
-    if ((e = net_read (conn, &c, 1)) != 1)
-    {
-      if (e == 0)
-        error ("Acknowledgment content read failed or connection closed");
-      else
-        error ("Timed out reading acknowledgment content\n");
-      // note we'll take what we get and hope it's enough...
-      break;
-    }
-    dbuf_putc (b, c);
+    dbuf_expand (b, n);
+    e = net_read (conn, dbuf_getbuf (b) + dbuf_size (b), n);
+    dbuf_setsize (b, dbuf_size (b) + e);
+    // note we'll take what we get and hope it's enough...
+    if (e < n)
+      error ("Acknowledgment content read failed or connection closed\n");
   }
   if (n = net_available (conn))
   {
@@ -143,59 +138,84 @@ int ebxml_pid (XML *xml, QUEUEROW *r, char *pid)
 }
 
 /*
- * Build and return the mime payload container
+ * Open the payload data, running it through the map's filter if
+ * one is given, and set it's length and file name.
  */
-MIME *ebxml_getpayload (XML *xml, QUEUEROW *r)
+FILE *ebxml_getdata (XML *xml, QUEUEROW *r, long *len, char *fname)
 {
-  int l, mapi;
-  XML *exml;
-  MIME *msg;
-  char *b,			/* buffer for payload		*/
-       *type,
-       *unc = NULL,		/* encryption info		*/
-       *pw = NULL,
-       dn[DNSZ],
-       *organization,
+  int mapi;
+  FILE *fp;
+  char *b,
        pid[MAX_PATH],
-       buf[MAX_PATH],
-       fname[MAX_PATH];
+       path[MAX_PATH];
 
-  debug ("getpayload container...\n");
+  debug ("getting payload data...\n");
   if ((mapi = ebxml_pid (xml, r, pid)) < 0)
     return (NULL);
   ppathf (fname, cfg_map (xml, mapi, "Processed"), "%s",
     queue_field_get (r, "PAYLOADFILE"));
 
-  /* invoke the filter if given					*/
+  /* invoke the filter if given, reading it's output		*/
   b = cfg_map (xml, mapi, "Filter");
   if (*b)
   {
     char *emsg;
-    DBUF *rbuf = dbuf_alloc ();
 
-    debug ("filter read %s with %s\n", fname, b);
-    if (filter_run (b, fname, NULL, NULL, rbuf, &emsg, cfg_timeout (xml)))
+    ppathf (path, xml_get_text (xml, "Phineas.TempDirectory"),
+      "%s%d.filter", r->queue->name, r->rowid);
+    debug ("filter read %s with %s to %s\n", fname, b, path);
+    if (filter_run (b, fname, NULL, path, NULL, &emsg, cfg_timeout (xml)))
     {
       error ("Can't filter %s - %s\n", fname, strerror (errno));
-      dbuf_free (rbuf);
+      unlink (path);
       return (NULL);
     }
     if (*emsg)
       warn ("filter %s returned %s\n", b, emsg);
     free (emsg);
-    l = dbuf_size (rbuf);
-    b = dbuf_extract (rbuf);
+    fp = fopen (path, "rbD");	/* removed when closed		*/
   }
   else
   {
     debug ("reading data from %s\n", fname);
-    if ((b = readfile (fname, &l)) == NULL)
-    {
-      error ("Can't read %s - %s\n", fname, strerror (errno));
-      return (NULL);
-    }
+    fp = fopen (fname, "rb");
+  }
+  if (fp == NULL)
+  {
+    error ("Can't read %s - %s\n", fname, strerror (errno));
+    return (NULL);
   }
+  fseek (fp, 0L, SEEK_END);
+  *len = ftell (fp);
+  rewind (fp);
+  return (fp);
+}
 
+/*
+ * Build and return the mime payload container from it's data,
+ * encrypting it if the map calls for it.  The container owns fp,
+ * and the payload is read from it as the message is sent.
+ */
+MIME *ebxml_payload (XML *xml, QUEUEROW *r, FILE *fp, long len, 
+  char *fname)
+{
+  int mapi;
+  FILE *spool = NULL;
+  MIME *msg;
+  char *type,
+       *unc = NULL,		/* encryption info		*/
+       *pw = NULL,
+       dn[DNSZ],
+       *organization,
+       pid[MAX_PATH],
+       path[MAX_PATH];
+
+  debug ("getpayload container...\n");
+  if ((mapi = ebxml_pid (xml, r, pid)) < 0)
+  {
+    fclose (fp);
+    return (NULL);
+  }
   organization = cfg_org (xml);
   type = cfg_map (xml, mapi, "Encryption.Type");
   if ((type != NULL) && *type)	/* encrypted			*/
@@ -203,22 +223,67 @@ MIME *ebxml_getpayload (XML *xml, QUEUEROW *r)
     unc = cfg_map (xml, mapi, "Encryption.Unc");
     pw = cfg_map (xml, mapi, "Encryption.Password");
     strcpy (dn, cfg_map (xml, mapi, "Encryption.Id"));
+    /* the envelope is spooled, and removed when closed		*/
+    ppathf (path, xml_get_text (xml, "Phineas.TempDirectory"),
+      "%s%d.payload", r->queue->name, r->rowid);
+    if ((spool = fopen (path, "w+bD")) == NULL)
+      error ("Can't open %s - %s\n", path, strerror (errno));
   }
 
-  msg = payload_create (b, l, fname, organization, unc, dn, pw);
-
-  free (b);
+  msg = payload_create_fp (fp, len, spool, fname, organization, 
+    unc, dn, pw);
   if (msg == NULL)
     error ("Can't create payload container for %s\n", fname);
   return (msg);
 }
 
+/*
+ * Build and return the mime payload container.  The payload is read
+ * from it's file (or filter output) as the message is sent.
+ */
+MIME *ebxml_getpayload (XML *xml, QUEUEROW *r)
+{
+  long len;
+  FILE *fp;
+  char fname[MAX_PATH];
+
+  if ((fp = ebxml_getdata (xml, r, &len, fname)) == NULL)
+    return (NULL);
+  return (ebxml_payload (xml, r, fp, len, fname));
+}
+
+/*
+ * SOAP template fields we fill in, resolved once by the template
+ * cache, in the order they were originally set
+ */
+static char *SoapFields[] =
+{
+  SOAPFROMPARTY, SOAPTOPARTY, SOAPCPAID, SOAPCONVERSEID, SOAPSERVICE,
+  SOAPACTION, SOAPMESSAGEID, SOAPDATATIME, SOAPMREF, SOAPDBRECID,
+  SOAPDBMESSID, SOAPDBARGS, SOAPDBRECP
+};
+#define SF_FROMPARTY 0
+#define SF_TOPARTY 1
+#define SF_CPAID 2
+#define SF_CONVERSEID 3
+#define SF_SERVICE 4
+#define SF_ACTION 5
+#define SF_MESSAGEID 6
+#define SF_DATATIME 7
+#define SF_MREF 8
+#define SF_DBRECID 9
+#define SF_DBMESSID 10
+#define SF_DBARGS 11
+#define SF_DBRECP 12
+#define SF_NUM 13
+
 /*
  * Get the mime header (soap) container
  */
 MIME *ebxml_getsoap (XML *xml, QUEUEROW *r)
 {
   XML *soap;
+  void *f[SF_NUM];
   MIME *msg;
   char *ch,
        *pid,
@@ -243,23 +308,24 @@ MIME *ebxml_getsoap (XML *xml, QUEUEROW *r)
     < 0) return (NULL);
 
   debug ("getting soap template for pid=%s org=%s...\n", pid, organization);
-  if ((soap = ebxml_template (xml, XSOAP)) == NULL)
+  if ((soap = ebxml_template_fields (xml, XSOAP, SoapFields, SF_NUM, f)) 
+    == NULL)
   {
     error ("Can't get SOAP template\n");
     return (NULL);
   }
-  xml_set_text (soap, SOAPFROMPARTY, cfg_party (xml));
+  xml_node_set_text (f[SF_FROMPARTY], cfg_party (xml));
   partyid = "Someone_else";
-  xml_set_text (soap, SOAPTOPARTY, partyid);
+  xml_node_set_text (f[SF_TOPARTY], partyid);
   cpa = cfg_route (xml, route, "Cpa");
-  xml_set_text (soap, SOAPCPAID, cpa);
-  xml_set_text (soap, SOAPCONVERSEID, pid);
-  xml_set_text (soap, SOAPSERVICE, queue_field_get (r, "SERVICE"));
-  xml_set_text (soap, SOAPACTION, queue_field_get (r, "ACTION"));
+  xml_node_set_text (f[SF_CPAID], cpa);
+  xml_node_set_text (f[SF_CONVERSEID], pid);
+  xml_node_set_text (f[SF_SERVICE], queue_field_get (r, "SERVICE"));
+  xml_node_set_text (f[SF_ACTION], queue_field_get (r, "ACTION"));
   sprintf (buf, "%ld@%s", pid, organization);
-  xml_set_text (soap, SOAPMESSAGEID, buf);
+  xml_node_set_text (f[SF_MESSAGEID], buf);
   queue_field_set (r, "MESSAGECREATIONTIME", ptime (NULL, buf));
-  xml_set_text (soap, SOAPDATATIME, buf);
+  xml_node_set_text (f[SF_DATATIME], buf);
   if (!strcmp (queue_field_get (r, "ACTION"), "Ping"))
   {
     xml_delete (soap, SOAPBODY);
@@ -269,12 +335,12 @@ MIME *ebxml_getsoap (XML *xml, QUEUEROW *r)
     sprintf (buf, "cid:%s@%s", queue_field_get (r, "PAYLOADFILE"),
       organization);
     debug ("set %s xlink:href=\"%s\"\n", SOAPMREF, buf);
-    xml_set_attribute (soap, SOAPMREF, "xlink:href", buf);
+    xml_node_set_attribute (f[SF_MREF], "xlink:href", buf);
     sprintf (buf, "%s.%s", r->queue->name, queue_field_get (r, "RECORDID"));
-    xml_set_text (soap, SOAPDBRECID, buf);
-    xml_set_text (soap, SOAPDBMESSID, queue_field_get (r, "MESSAGEID"));
-    xml_set_text (soap, SOAPDBARGS, queue_field_get (r, "ARGUMENTS"));
-    xml_set_text (soap, SOAPDBRECP, 
+    xml_node_set_text (f[SF_DBRECID], buf);
+    xml_node_set_text (f[SF_DBMESSID], queue_field_get (r, "MESSAGEID"));
+    xml_node_set_text (f[SF_DBARGS], queue_field_get (r, "ARGUMENTS"));
+    xml_node_set_text (f[SF_DBRECP], 
 	queue_field_get (r, "MESSAGERECIPIENT"));
   }
   debug ("building soap mime container...\n");
@@ -293,39 +359,25 @@ MIME *ebxml_getsoap (XML *xml, QUEUEROW *r)
 }
 
 /*
- * Get the mime ebXML message
+ * Put the soap and payload (if any) containers in a mime ebXML
+ * message.  The message owns both, and they are freed if it fails.
  */
-MIME *ebxml_getmessage (XML *xml, QUEUEROW *r)
+MIME *ebxml_message (XML *xml, QUEUEROW *r, MIME *soap, MIME *payload)
 {
-  MIME *msg, *payload, *soap;
+  MIME *msg;
   char *pid,
        *organization,
        buf[MAX_PATH];
   int route;
 
   if ((route = cfg_route_index (xml, queue_field_get (r, "ROUTEINFO"))) 
-    < 0) return (NULL);
-  organization = cfg_org (xml);
-  pid = queue_field_get (r, "MESSAGEID");
-  if (pid != NULL)
-    pid = strchr (pid, '-');
-  if (pid++ == NULL)
-  {
-    error ("Can't get PID from MESSAGEID\n");
-    return (NULL);
-  }
-  if (strcmp (queue_field_get (r, "ACTION"), "Ping"))
-  {
-    if ((payload = ebxml_getpayload (xml, r)) == NULL)
-      return (NULL);
-  }
-  else
-    payload = NULL;
-  if ((soap = ebxml_getsoap (xml, r)) == NULL)
+    < 0)
   {
+    mime_free (soap);
     mime_free (payload);
     return (NULL);
   }
+  organization = cfg_org (xml);
   debug ("building multipart mime message\n");
   msg = mime_alloc ();
   sprintf (buf, "type=\"text/xml\"; start=\"ebxml-envelope@%s\";",
@@ -335,7 +387,8 @@ MIME *ebxml_getmessage (XML *xml, QUEUEROW *r)
     cfg_route (xml, route, "Host"),
     cfg_route (xml, route, "Port"));
   mime_setHeader (msg, "Host", buf, 99);
-  mime_setHeader (msg, "Connection", "Close", 99);
+  mime_setHeader (msg, "Connection", 
+    cfg_maxidle (xml) > 0 ? "Keep-Alive" : "Close", 99);
   if (strcmp ("basic", 
     cfg_route (xml, route, "Authentication.Type")) == 0)
   {
@@ -355,6 +408,39 @@ MIME *ebxml_getmessage (XML *xml, QUEUEROW *r)
   return (msg);
 }
 
+/*
+ * Get the mime ebXML message
+ */
+MIME *ebxml_getmessage (XML *xml, QUEUEROW *r)
+{
+  MIME *payload, *soap;
+  char *pid;
+
+  if (cfg_route_index (xml, queue_field_get (r, "ROUTEINFO")) < 0)
+    return (NULL);
+  pid = queue_field_get (r, "MESSAGEID");
+  if (pid != NULL)
+    pid = strchr (pid, '-');
+  if (pid++ == NULL)
+  {
+    error ("Can't get PID from MESSAGEID\n");
+    return (NULL);
+  }
+  if (strcmp (queue_field_get (r, "ACTION"), "Ping"))
+  {
+    if ((payload = ebxml_getpayload (xml, r)) == NULL)
+      return (NULL);
+  }
+  else
+    payload = NULL;
+  if ((soap = ebxml_getsoap (xml, r)) == NULL)
+  {
+    mime_free (payload);
+    return (NULL);
+  }
+  return (ebxml_message (xml, r, soap, payload));
+}
+
 /*
  * queue a Ping request for this route
  */
@@ -415,23 +501,22 @@ int ebxml_qping (XML *xml, int route)
 
 
 /*
- * A folder polling processor for ebxml queues - register this with
- * the fpoller.
+ * A folder polling row builder for ebxml queues - register this with
+ * the fpoller to queue a scan's files in batches.
  *
- * This initializes and pushes a queue row.  Once queued it moves
- * the file to a processed point.
+ * This initializes a queue row, and moves the file to a processed
+ * point.  The caller pushes and frees the row.
  *
  * xml - sender's configuration
  * prefix - xml path to this folder map
  * fname - file to be queued
  */
-int ebxml_fprocessor (XML *xml, char *prefix, char *fname)
+QUEUEROW *ebxml_frow (XML *xml, char *prefix, char *fname)
 {
   struct stat st;
   QUEUE *q;
   QUEUEROW *r;
   char *ch;
-  int pl;
   char qname[MAX_PATH],
        pid[PTIMESZ],
        buf[MAX_PATH];
@@ -439,16 +524,15 @@ int ebxml_fprocessor (XML *xml, char *prefix, char *fname)
   if (stat (fname, &st))
   {
     warn ("Can't access %s\n", fname);
-    return (-1);
+    return (NULL);
   }
   if (st.st_size == 0)
   {
     warn ("File %s empty... discarding\n", fname);
     unlink (fname);
-    return (-1);
+    return (NULL);
   }
   info ("Queuing ebXML folder %s for %s\n", fname, prefix);
-  pl = strlen (prefix);
   /*
    * prep a file name
    */
@@ -462,17 +546,17 @@ int ebxml_fprocessor (XML *xml, char *prefix, char *fname)
   if (rename (fname, buf))
   {
     error ("Couldn't move %s to %s - %s\n", fname, buf, strerror (errno));
-    return (-1);
+    return (NULL);
   }
 
   /*
-   * queue it up
+   * set up the queue row
    */
   ch = xml_getf (xml, "%sQueue", prefix);
   if ((q = queue_find (ch)) == NULL)
   {
     error ("Can't find queue for %s\n", ch);
-    return (-1);
+    return (NULL);
   }
   r = queue_row_alloc (q);
   sprintf (buf, "%s-%s", xml_getf (xml, "%sName", prefix), pid);
@@ -496,7 +580,28 @@ int ebxml_fprocessor (XML *xml, char *prefix, char *fname)
   queue_field_set (r, "PROCESSINGSTATUS", "queued");
   queue_field_set (r, "TRANSPORTSTATUS", "");
   queue_field_set (r, "PRIORITY", "0");
-  if (pl = queue_push (r) < 1)
+  return (r);
+}
+
+/*
+ * A folder polling processor for ebxml queues - register this with
+ * the fpoller.
+ *
+ * This initializes and pushes a queue row.  Once queued it moves
+ * the file to a processed point.
+ *
+ * xml - sender's configuration
+ * prefix - xml path to this folder map
+ * fname - file to be queued
+ */
+int ebxml_fprocessor (XML *xml, char *prefix, char *fname)
+{
+  QUEUEROW *r;
+  int pl;
+
+  if ((r = ebxml_frow (xml, prefix, fname)) == NULL)
+    return (-1);
+  if ((pl = queue_push (r)) < 1)
   {
     error ("Failed queueing %s\n", fname);
     pl = -1;
@@ -507,11 +612,12 @@ int ebxml_fprocessor (XML *xml, char *prefix, char *fname)
 }
 
 /*
- * get an SSL context for this route
+ * get a (cached) SSL context for this route
  */
 SSL_CTX *ebxml_route_ctx (XML *xml, int route)
 {
   char *id, *passwd, *unc, *ca,
+       name[MAX_PATH],
        pathbuf[MAX_PATH * 2];
 
   debug ("getting SSL context for route %d\n", route);
@@ -542,7 +648,8 @@ SSL_CTX *ebxml_route_ctx (XML *xml, int route)
   if (*(ca = cfg_senderca (xml)))
     ca = pathf (pathbuf + MAX_PATH, "%s", ca);
   debug ("ca path=%s\n", ca);
-  return (net_ctx (unc, unc, passwd, ca, 0));
+  sprintf (name, "route %s", cfg_route (xml, route, "Name"));
+  return (net_ctx_get (name, unc, unc, passwd, ca, 0, 0, 0));
 }
 
 /*
@@ -716,32 +823,107 @@ int ebxml_redirect (char *reply, char *host, int *port, char *path)
   return (1);
 }
 
+/*
+ * return true if the reply allows us to keep the connection open
+ */
+int ebxml_keepalive (DBUF *b)
+{
+  char *ch, *e;
+
+  e = strnstr (dbuf_getbuf (b), "\r\n\r\n", dbuf_size (b));
+  if (e == NULL)
+    return (0);
+  for (ch = dbuf_getbuf (b); ch < e; ch++)
+  {
+    if ((*ch == '\n') && (strnicmp (ch + 1, "Connection:", 11) == 0))
+    {
+      for (ch += 12; isspace (*ch); ch++);
+      return (strnicmp (ch, "close", 5) != 0);
+    }
+  }
+  return (1);
+}
+
+/*
+ * A send waiting on a retry is left "queued" with a TRANSPORTSTATUS
+ * of "retry" and a TRANSPORTERRORCODE of "retry <n> at <time>", so
+ * the schedule survives a restart.  Return the number of retries
+ * so far and when the next is due.
+ */
+int ebxml_retries (QUEUEROW *r, time_t *next)
+{
+  struct tm tm;
+  int n;
+  char *ch;
+
+  *next = 0;
+  ch = queue_field_get (r, "TRANSPORTSTATUS");
+  if ((ch == NULL) || strcmp (ch, "retry"))
+    return (0);
+  memset (&tm, 0, sizeof (tm));
+  if (sscanf (queue_field_get (r, "TRANSPORTERRORCODE"), 
+    "retry %d at %d-%d-%dT%d:%d:%d", &n, &tm.tm_year, &tm.tm_mon,
+    &tm.tm_mday, &tm.tm_hour, &tm.tm_min, &tm.tm_sec) != 7)
+    return (0);
+  tm.tm_year -= 1900;
+  tm.tm_mon--;
+  tm.tm_isdst = -1;
+  *next = mktime (&tm);
+  return (n);
+}
+
+/*
+ * schedule retry n of a send in delay seconds
+ */
+int ebxml_retry (QUEUEROW *r, int n, int delay)
+{
+  time_t t;
+  char buf[MAX_PATH];
+
+  time (&t);
+  t += delay;
+  ptime (&t, buf + sprintf (buf, "retry %d at ", n));
+  queue_field_set (r, "PROCESSINGSTATUS", "queued");
+  queue_field_set (r, "TRANSPORTSTATUS", "retry");
+  queue_field_set (r, "TRANSPORTERRORCODE", buf);
+  return (1);
+}
+
+/*
+ * mime_write() function to send part of a message
+ */
+static int ebxml_write (void *conn, char *buf, int len)
+{
+  return (net_write ((NETCON *) conn, buf, len));
+}
+
 /*
  * send a message
  * return non-zero if message not sent successful with completed
- * queue info for status and transport
+ * queue info for status and transport.  Attempts is the number
+ * of retries already made.  Rather than wait out a retry delay,
+ * the row is rescheduled and we return a positive value.
  */
-int ebxml_send (XML*xml, QUEUEROW *r, MIME *msg)
+int ebxml_send (XML*xml, QUEUEROW *r, MIME *msg, int attempts)
 {
   DBUF *b;
   NETCON *conn;
   char host[MAX_PATH];	/* need buffers for redirect		*/
   char path[MAX_PATH];
-  int port, route, timeout, delay, retry;
+  int port, route, timeout, delay, retry, pooled;
   SSL_CTX *ctx;
   char *rname, 		/* route name				*/
-       *content, 	/* message content			*/
+       key[MAX_PATH],	/* connection pool key			*/
        buf[MAX_PATH];
 
-  /* format up the message					*/
-  if ((content = mime_format (msg)) == NULL)
+  /* size up the message, setting it's Content-Length		*/
+  if (mime_size (msg) < 1)
   {
     queue_field_set (r, "PROCESSINGSTATUS", "done");
     queue_field_set (r, "TRANSPORTSTATUS", "failed");
     queue_field_set (r, "TRANSPORTERRORCODE", "failed formatting message");
     return (-1);
   }
-  debug ("Send content:\n%s\n", content);
 
   /*
    * get connection info from the record route
@@ -760,14 +942,24 @@ int ebxml_send (XML*xml, QUEUEROW *r, MIME *msg)
   port = atoi (cfg_route (xml, route, "Port"));
   if ((retry = atoi (cfg_route (xml, route, "Retry"))) == 0)
     retry = cfg_retries (xml);
+  retry -= attempts;
   timeout = atoi (cfg_route (xml, route, "Timeout"));
-  delay = cfg_delay (xml);
+  				/* back off from earlier tries	*/
+  delay = cfg_delay (xml) << (attempts < 10 ? attempts : 10);
   strcpy (path, cfg_route (xml, route, "Path"));
 
 sendmsg:
 
   info ("Sending ebXML %s:%d to %s\n", 
     r->queue->name, r->rowid, rname);
+  sprintf (key, "%s://%s:%d", ctx == NULL ? "http" : "https", host, port);
+  pooled = 1;
+  if ((conn = net_pool_get (key, cfg_idletimeout (xml))) != NULL)
+    goto sendconn;
+
+reconnect:
+
+  pooled = 0;
   debug ("opening connection socket on port=%d retrys=%d timeout=%d\n", 
     port, retry, timeout);
   if ((conn = net_open (host, port, 0, ctx)) == NULL)
@@ -775,6 +967,8 @@ sendmsg:
     error ("failed opening connection to %s:%d\n", host, port);
     goto retrysend;
   }
+
+sendconn:
   				/* set read timeout if given	*/
   if (timeout)
   {
@@ -784,37 +978,54 @@ sendmsg:
   delay = 0;			/* connection OK, don't delay	*/
   queue_field_set (r, "MESSAGESENTTIME", ptime (NULL, buf));
   sprintf (buf, "POST %s HTTP/1.1\r\n", path);
-  // ch = ebxml_beautify (ch);
   				/* all set... send the message	*/
   debug ("sending message...\n");
-  net_write (conn, buf, strlen (buf));
-  net_write (conn, content, strlen (content));
-  debug ("reading response...\n");
-  b = ebxml_receive (conn);
-  debug ("closing socket...\n");
-  net_close (conn);
+  if (mime_write (msg, buf, ebxml_write, conn) > 0)
+  {
+    debug ("reading response...\n");
+    b = ebxml_receive (conn);
+  }
+  else
+    b = NULL;
+  				/* pooled one went stale	*/
+  if ((b == NULL) && pooled)
+  {
+    info ("Pooled connection to %s closed, reconnecting\n", rname);
+    net_close (conn);
+    goto reconnect;
+  }
+  if ((b != NULL) && ebxml_keepalive (b))
+  {
+    debug ("pooling connection...\n");
+    net_pool_put (conn, key, cfg_maxidle (xml));
+  }
+  else
+  {
+    debug ("closing socket...\n");
+    net_close (conn);
+  }
   				/* no reply?			*/
   if (b == NULL)
   {
     warn ("Send response timed out or closed for %s\n", rname);
 
-retrysend:			/* retry with a wait, or..	*/	
+retrysend:			/* retry later, or..		*/	
 			
-    if (retry-- && phineas_running ())
+    if (retry-- > 0)
     {
-      if (delay)
+      attempts++;
+      if (delay || !phineas_running ())
       {
 	info ("Retrying send to %s in %d seconds\n", rname, delay);
-        sleep (delay * 1000);
-	delay <<= 1;
+	if (ctx != NULL)
+	  SSL_CTX_free (ctx);
+	return (ebxml_retry (r, attempts, delay));
       }
-      else			/* reset connection delay	*/
-        delay = cfg_delay (xml);
+      delay = cfg_delay (xml);	/* reset connection delay	*/
       goto sendmsg;
     }
     if (ctx != NULL)		/* give up!			*/
       SSL_CTX_free (ctx);
-    free (content);
     queue_field_set (r, "PROCESSINGSTATUS", "done");
     queue_field_set (r, "TRANSPORTSTATUS", "failed");
     queue_field_set (r, "TRANSPORTERRORCODE", "retries exhausted");
@@ -843,7 +1054,6 @@ retrysend:			/* retry with a wait, or..	*/
   }
   debug ("send completed\n");
   dbuf_free (b);
-  free (content);
   return (0);
 }
 
@@ -898,30 +1108,112 @@ int ebxml_file_ack (XML *xml, QUEUEROW *r)
 }
 
 /*
- * A queue polling processor for ebxml queues - register this with
- * the qpoller.
- *
- * This builds an ebXML MIME message, opens a connection to a
- * receiver, sends the request, processes the response, and
- * finally updates the queue status.
+ * A message making it's way through the sender's stages
  */
-int ebxml_qprocessor (XML *xml, QUEUEROW *r)
+typedef struct ebxmlsend
 {
-  MIME *m;
+  int attempts;			/* retries already made		*/
+  FILE *fp;			/* payload data			*/
+  long len;
+  MIME *soap;			/* header container		*/
+  MIME *msg;			/* the message to send		*/
+  char fname[MAX_PATH];		/* payload file			*/
+} EBXMLSEND;
+
+/*
+ * free a message in the sender's stages
+ */
+void ebxml_send_free (void *data)
+{
+  EBXMLSEND *s = (EBXMLSEND *) data;
+
+  if (s == NULL)
+    return;
+  if (s->fp != NULL)
+    fclose (s->fp);
+  mime_free (s->soap);
+  mime_free (s->msg);
+  free (s);
+}
+
+/*
+ * mark a row we can't build a message for
+ */
+int ebxml_badmessage (QUEUEROW *r, void **data)
+{
+  char buf[24];
+
+  ebxml_send_free (*data);
+  *data = NULL;
+  queue_field_set (r, "MESSAGECREATIONTIME", ptime (NULL, buf));
+  queue_field_set (r, "PROCESSINGSTATUS", "done");
+  queue_field_set (r, "TRANSPORTSTATUS", "failed");
+  queue_field_set (r, "TRANSPORTERRORCODE", "bad message");
+  queue_push (r);
+  return (-1);
+}
+
+/*
+ * Build stage - hold rows waiting on a retry, then read (or filter)
+ * the payload data and fill in the SOAP header.
+ */
+int ebxml_build (XML *xml, QUEUEROW *r, void **data)
+{
+  EBXMLSEND *s;
+  time_t next;
+  int attempts;
 
   /*
-   * build an ebXML MIME message
+   * if waiting on a retry, have the poller hold it until due
    */
-  if ((m = ebxml_getmessage (xml, r)) == NULL)
+  attempts = ebxml_retries (r, &next);
+  if ((next -= time (NULL)) > 0)
+    return ((int) next);
+  s = (EBXMLSEND *) malloc (sizeof (EBXMLSEND));
+  memset (s, 0, sizeof (EBXMLSEND));
+  s->attempts = attempts;
+  *data = s;
+  if (strcmp (queue_field_get (r, "ACTION"), "Ping") &&
+    ((s->fp = ebxml_getdata (xml, r, &s->len, s->fname)) == NULL))
+    return (ebxml_badmessage (r, data));
+  if ((s->soap = ebxml_getsoap (xml, r)) == NULL)
+    return (ebxml_badmessage (r, data));
+  return (0);
+}
+
+/*
+ * Encrypt stage - build the payload container, encrypting it if
+ * needed, and the MIME message.
+ */
+int ebxml_encrypt (XML *xml, QUEUEROW *r, void **data)
+{
+  EBXMLSEND *s = (EBXMLSEND *) *data;
+  MIME *payload = NULL;
+
+  if (s->fp != NULL)
   {
-    char buf[24];
-    queue_field_set (r, "MESSAGECREATIONTIME", ptime (NULL, buf));
-    queue_field_set (r, "PROCESSINGSTATUS", "done");
-    queue_field_set (r, "TRANSPORTSTATUS", "failed");
-    queue_field_set (r, "TRANSPORTERRORCODE", "bad message");
-    queue_push (r);
-    return (-1);
+    payload = ebxml_payload (xml, r, s->fp, s->len, s->fname);
+    s->fp = NULL;
+    if (payload == NULL)
+      return (ebxml_badmessage (r, data));
   }
+  s->msg = ebxml_message (xml, r, s->soap, payload);
+  s->soap = NULL;
+  if (s->msg == NULL)
+    return (ebxml_badmessage (r, data));
+  return (0);
+}
+
+/*
+ * Send stage - send it to the destination and update the queue
+ * with status from the reply.  Rows are only marked attempted here,
+ * so those still waiting to send at shutdown are sent on restart.
+ */
+int ebxml_transmit (XML *xml, QUEUEROW *r, void **data)
+{
+  EBXMLSEND *s = (EBXMLSEND *) *data;
+  int sent;
+
   /*
    * update the queue with message status
    */
@@ -930,23 +1222,49 @@ int ebxml_qprocessor (XML *xml, QUEUEROW *r)
   queue_field_set (r, "TRANSPORTSTATUS", "attempted");
   queue_field_set (r, "TRANSPORTERRORCODE", "");
   queue_push (r);
-  /*
-   * send it to the destination
-   */
   debug ("sending to destination\n");
-  if (ebxml_send (xml, r, m) == 0)
+  if ((sent = ebxml_send (xml, r, s->msg, s->attempts)) == 0)
     ebxml_file_ack (xml, r);
-  /*
-   * update the queue with status from the reply
-   */
   debug ("updating reply\n");
   queue_push (r);
-  /*
-   * release all memory
-   */
-  mime_free (m);
-  info ("ebXML %s:%d send completed\n", 
-    r->queue->name, r->rowid);
+  ebxml_send_free (s);
+  *data = NULL;
+  info ("ebXML %s:%d send %s\n", r->queue->name, r->rowid,
+    sent > 0 ? "rescheduled" : "completed");
+  return (0);
+}
+
+/*
+ * The sender's stages, so encrypting one message can overlap
+ * waiting on another's reply - register these with the qpoller.
+ */
+QPSTAGE EbxmlStages[EBXMLSTAGES] =
+{
+  { "Build", ebxml_build },
+  { "Encrypt", ebxml_encrypt },
+  { "Send", ebxml_transmit }
+};
+
+/*
+ * A queue polling processor for ebxml queues - register this with
+ * the qpoller.
+ *
+ * This builds an ebXML MIME message, opens a connection to a
+ * receiver, sends the request, processes the response, and
+ * finally updates the queue status.  A row with a retry not yet
+ * due returns the seconds left for the qpoller to hold it.  These
+ * are the sender's stages, run one after the other.
+ */
+int ebxml_qprocessor (XML *xml, QUEUEROW *r)
+{
+  void *data = NULL;
+  int i, n;
+
+  for (i = 0; i < EBXMLSTAGES; i++)
+  {
+    if ((n = EbxmlStages[i].proc (xml, r, &data)) != 0)
+      return (n);
+  }
   return (0);
 }
 
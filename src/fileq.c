@@ -25,6 +25,8 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <io.h>
+#include <sys/stat.h>
 #include "log.h"
 #include "util.h"
 #include "dbuf.h"
@@ -37,39 +39,141 @@
 /* file based record are tab delimited */
 #define Q_SEP '\t'
 
-/* size of our index (for now)		*/
-#define FILEQXSZ 500
+/* initial size of our index		*/
+#define FILEQXSZ 1024
+/* identifies an index file		*/
+#define FILEQXID "FQX2"
+/* fewest dead rows worth compacting	*/
+#define FILEQMINDEAD 1000
+/* growth worth remapping a file for	*/
+#define FILEQMAPGROW 0x10000
 
+/* compaction states			*/
+#define FILEQ_IDLE 0			/* not compacting		*/
+#define FILEQ_COPYING 1			/* copying live rows		*/
+#define FILEQ_COPIED 2			/* ready to swap in		*/
+#define FILEQ_FAILED 3			/* copy didn't work		*/
+
+/*
+ * A queued row ready to pop, with the offset of the version that
+ * was queued.  If the row changes, the offset won't match the index
+ * and we just drop it when it comes up.
+ */
+typedef struct fileqr
+{
+  int rowid;				/* the row			*/
+  int priority;				/* higher pops first		*/
+  long offset;				/* version queued		*/
+} FILEQR;
+
+/*
+ * Commit state for a queue.  Pushers count the rows they write, and
+ * whoever commits first flushes everything written so far while the
+ * rest wait on ready, so concurrent pushes share one sync.  Pushes
+ * that have written but not yet come to commit, and threads let go
+ * by the last commit, are expected to join, and signal the leader
+ * as they do.
+ */
+typedef struct fileqjoin
+{
+  READY ready;				/* set as each push joins	*/
+} FILEQJOIN;
+
+typedef struct fileqsync
+{
+  MUTEX mutex;				/* covers the counts		*/
+  READY ready;				/* set after each commit	*/
+  FILEQJOIN join;
+  int mode;				/* QSYNC_NONE, _ROW, or _GROUP	*/
+  long written,				/* rows written			*/
+       synced,				/* rows on disk			*/
+       pushes,				/* pushes written		*/
+       joined;				/* and come to commit		*/
+  int syncing,				/* a thread is committing	*/
+      waiting,				/* threads waiting on it	*/
+      expect,				/* threads the last let go	*/
+      back;				/* threads come to commit since	*/
+} FILEQSYNC;
+
+/*
+ * Each row is indexed by it's rowid to the offset of it's latest
+ * version in the file, or zero if deleted.  Rows popped for
+ * transport are negated so they aren't popped again.  Transport
+ * queues also keep a heap of queued rows, by PRIORITY and then
+ * rowid.
+ */
 typedef struct fileq
 {
   struct fileq *next;			/* next queue			*/
   int rowid, 				/* max row number		*/
-      offset,				/* offset to first row		*/
       sz; 				/* size of row index		*/
   FILE *fp;				/* data file			*/
   char *name;				/* queue name			*/
-  long transport;			/* next transport row to pop	*/
-  long row[];				/* row index			*/
+  char *path;				/* data file path		*/
+  long *row;				/* row index			*/
+  int status,				/* PROCESSINGSTATUS or -1	*/
+      priority;				/* PRIORITY or -1		*/
+  FILEQR *ready;			/* heap of queued rows		*/
+  int readys,				/* rows in the heap		*/
+      readysz;				/* heap size			*/
+  int live,				/* rows with a current version	*/
+      dead,				/* superseded and deleted rows	*/
+      ratio;				/* dead to live to compact	*/
+  volatile int compact;			/* compaction state		*/
+  long *xrow;				/* compacted row index		*/
+  int xrowid;				/* rows compacted		*/
+  long xsize;				/* data size compacted		*/
+  int append;				/* positioned to append		*/
+  int batch;				/* flush after a batch		*/
+  FILEQSYNC sync;			/* commit state			*/
+  HANDLE map;				/* read only file mapping	*/
+  char *view;				/* mapped data			*/
+  long mapsz;				/* size mapped			*/
 } FILEQ;
 
+/*
+ * The header for a saved index, kept in a ".idx" file beside the
+ * data.  It is good for the data file as long as that has only been
+ * appended to, so we only need to read the rows added since.
+ */
+typedef struct fileqx
+{
+  char id[4];				/* FILEQXID			*/
+  long size;				/* data file size indexed	*/
+  time_t mtime;				/* data file modified time	*/
+  int rowid;				/* max row number		*/
+  int dead;				/* superseded and deleted rows	*/
+  int ready;				/* queued rows			*/
+} FILEQX;
+
 FILEQ *FileQ = NULL;
 
+int fileq_reindex (QUEUE *q, FILEQ *c);
+int fileq_swap (FILEQ *c);
+char *fileq_getrow (FILEQ *c, int row, char *buf);
+QUEUEROW *fileq_parse (QUEUE *q, char *buf);
+QUEUEROW *fileq_read (QUEUE *q, FILEQ *c, int row);
+int fileq_unmap (FILEQ *c);
+
 /*
  * allocate a cache
  */
-FILEQ *fileq_alloc (char *name, FILE *fp, int sz)
+FILEQ *fileq_alloc (char *name, char *path, FILE *fp)
 {
   int tsz;
   FILEQ *c;
 
-  tsz = sizeof (FILEQ) + strlen (name) + 1 + sz * sizeof (long *);
+  tsz = sizeof (FILEQ) + strlen (name) + strlen (path) + 2;
   c = (FILEQ *) malloc (tsz);
   memset (c, 0, tsz); 
-  c->name = (char *) (c->row + sz);
+  c->name = (char *) (c + 1);
   strcpy (c->name, name);
-  c->sz = sz;
-  c->offset = 0;
+  c->path = c->name + strlen (name) + 1;
+  strcpy (c->path, path);
   c->fp = fp;
+  init_mutex ((&c->sync));
+  init_ready ((&c->sync), TRUE);
+  init_ready ((&c->sync.join), FALSE);
   return (c);
 }
 
@@ -80,8 +184,16 @@ FILEQ *fileq_free (FILEQ *c)
 {
   int i;
 
+  fileq_unmap (c);
   if (c->fp != NULL)
     fclose (c->fp);
+  if (c->row != NULL)
+    free (c->row);
+  if (c->ready != NULL)
+    free (c->ready);
+  destroy_mutex ((&c->sync));
+  destroy_ready ((&c->sync));
+  destroy_ready ((&c->sync.join));
   free (c);
   return (NULL);
 }
@@ -99,7 +211,11 @@ FILEQ *fileq_find (QUEUE *q)
   for (c = FileQ; c != NULL; c = c->next)
   {
     if (strcmp (q->name, c->name) == 0)
+    {
+      if (c->compact > FILEQ_COPYING)
+	fileq_swap (c);
       return (c);
+    }
   }
   ppathf (path, q->conn->conn, "%s.txt", q->table);
   if ((fp = fopen (path, "a+")) == NULL)
@@ -108,7 +224,12 @@ FILEQ *fileq_find (QUEUE *q)
     return (NULL);
   }
   debug ("opened file %s\n", path);
-  c = fileq_alloc (q->name, fp, FILEQXSZ);
+  c = fileq_alloc (q->name, path, fp);
+  c->ratio = q->conn->compact;
+  c->sync.mode = q->conn->syncmode;
+  c->status = istransportQ (q) ? 
+    queue_field_find (q, "PROCESSINGSTATUS") : -1;
+  c->priority = queue_field_find (q, "PRIORITY");
   if (fileq_reindex (q, c) < 0)
     return (fileq_free (c));
   c->next = FileQ;
@@ -117,32 +238,304 @@ FILEQ *fileq_find (QUEUE *q)
 }
 
 /*
- * add/update an index entry
+ * make room in the index for row r
+ */
+int fileq_grow (FILEQ *c, int r)
+{
+  int sz;
+
+  if (r < c->sz)
+    return (0);
+  sz = c->sz ? c->sz : FILEQXSZ;
+  while (sz <= r)
+    sz <<= 1;
+  debug ("growing index to %d\n", sz);
+  c->row = (long *) realloc (c->row, sz * sizeof (long));
+  memset (c->row + c->sz, 0, (sz - c->sz) * sizeof (long));
+  c->sz = sz;
+  return (0);
+}
+
+/*
+ * add/update an index entry, keeping count of live and dead rows
  */
 int fileq_index (FILEQ *c, int r, long p)
 {
-  if (r - c->offset < 0)
+  if (r < 1)
     return (0);
-  if (r - c->offset >= c->sz)
+  fileq_grow (c, r);
+  if (c->row[r])			/* replaces a version	*/
+    c->dead++;
+  else if (p)
+    c->live++;
+  if (p == 0)				/* deleted		*/
   {
-    debug ("full index, moving...\n");
-    int need = r - c->offset - c->sz + 1;
-    memmove (c->row, c->row + need, (c->sz - need) * sizeof (long));
-    memset (c->row + c->sz - need, 0, need * sizeof (long));
-    c->offset += need;
+    c->dead++;
+    if (c->row[r])
+      c->live--;
   }
-  c->row[r - c->offset] = p;
+  c->row[r] = p;
   if (r > c->rowid)
     c->rowid = r;
   return (r);
 }
 
+/*
+ * find field f in a formatted row
+ */
+char *fileq_field (char *buf, int f)
+{
+  while (f-- > 0)
+  {
+    if ((buf = strchr (buf, Q_SEP)) == NULL)
+      return (NULL);
+    buf++;
+  }
+  return (buf);
+}
+
+/*
+ * The ready heap...  higher priority first, then oldest row
+ */
+#define fileq_first(a,b) (((a).priority > (b).priority) || \
+  (((a).priority == (b).priority) && ((a).rowid < (b).rowid)))
+
+void fileq_ready_down (FILEQ *c, int i)
+{
+  FILEQR t;
+  int n;
+
+  t = c->ready[i];
+  while ((n = i * 2 + 1) < c->readys)
+  {
+    if ((n + 1 < c->readys) && fileq_first (c->ready[n + 1], c->ready[n]))
+      n++;
+    if (!fileq_first (c->ready[n], t))
+      break;
+    c->ready[i] = c->ready[n];
+    i = n;
+  }
+  c->ready[i] = t;
+}
+
+/*
+ * add a queued row to the heap
+ */
+int fileq_ready (FILEQ *c, int r, int priority, long p)
+{
+  FILEQR t;
+  int i, n;
+
+  if (c->readys == c->readysz)
+  {
+    c->readysz = c->readysz ? c->readysz << 1 : FILEQXSZ;
+    c->ready = (FILEQR *) realloc (c->ready, 
+      c->readysz * sizeof (FILEQR));
+  }
+  t.rowid = r;
+  t.priority = priority;
+  t.offset = p;
+  i = c->readys++;
+  while (i && fileq_first (t, c->ready[n = (i - 1) / 2]))
+  {
+    c->ready[i] = c->ready[n];
+    i = n;
+  }
+  c->ready[i] = t;
+  return (c->readys);
+}
+
+/*
+ * add this row version to the heap if it is queued
+ */
+int fileq_queued (FILEQ *c, char *buf, long p)
+{
+  char *ch;
+  int priority = 0;
+
+  if ((c->status < 0) || (p == 0) ||
+    ((ch = fileq_field (buf, c->status)) == NULL) ||
+    !strstarts (ch, "queued"))
+    return (0);
+  if ((c->priority >= 0) && 
+    ((ch = fileq_field (buf, c->priority)) != NULL))
+    priority = atoi (ch);
+  return (fileq_ready (c, atoi (buf), priority, p));
+}
+
+/*
+ * Drop rows from the heap that changed since they were queued, 
+ * moving offsets for those that didn't to the new index if given.
+ * Then put it back in order.
+ */
+int fileq_ready_rebuild (FILEQ *c, long *row)
+{
+  FILEQR *t;
+  int i, n = 0;
+
+  for (i = 0; i < c->readys; i++)
+  {
+    t = c->ready + i;
+    if ((t->rowid < 1) || (t->rowid > c->rowid) ||
+      (t->offset != c->row[t->rowid]))
+      continue;
+    if (row != NULL)
+      t->offset = row[t->rowid];
+    c->ready[n++] = *t;
+  }
+  c->readys = n;
+  for (i = n / 2 - 1; i >= 0; i--)
+    fileq_ready_down (c, i);
+  return (n);
+}
+
+/*
+ * pop the next queued row from the heap
+ */
+QUEUEROW *fileq_transport (QUEUE *q, FILEQ *c)
+{
+  FILEQR t;
+
+  while (c->readys)
+  {
+    t = c->ready[0];
+    if (--c->readys)
+    {
+      c->ready[0] = c->ready[c->readys];
+      fileq_ready_down (c, 0);
+    }
+    if ((t.rowid <= c->rowid) && (t.offset == c->row[t.rowid]))
+      return (fileq_read (q, c, t.rowid));
+  }
+  return (NULL);
+}
+
+/*
+ * get the path to a file beside the data with this extension
+ */
+char *fileq_xpath (FILEQ *c, char *path, char *ext)
+{
+  char *ch;
+
+  strcpy (path, c->path);
+  if ((ch = strrchr (path, '.')) == NULL)
+    ch = path + strlen (path);
+  strcpy (ch, ext);
+  return (path);
+}
+
+/*
+ * Save the index and queued rows.  Popped rows are saved as 
+ * unpopped and queued, so a restart pops any we didn't finish.
+ */
+int fileq_save (FILEQ *c)
+{
+  FILE *fp;
+  FILEQX x;
+  struct stat st;
+  int i;
+  long *row;
+  char *ch, path[MAX_PATH], buf[QBUFSZ];
+
+  fileq_ready_rebuild (c, NULL);
+  for (i = 1; (c->status >= 0) && (i <= c->rowid); i++)
+  {
+    if ((c->row[i] < 0) && (fileq_getrow (c, i, buf) != NULL))
+    {
+      ch = c->priority < 0 ? NULL : fileq_field (buf, c->priority);
+      fileq_ready (c, i, ch == NULL ? 0 : atoi (ch), -c->row[i]);
+    }
+  }
+  fflush (c->fp);
+  if (stat (c->path, &st))
+    return (-1);
+  memcpy (x.id, FILEQXID, 4);
+  x.size = st.st_size;
+  x.mtime = st.st_mtime;
+  x.rowid = c->rowid;
+  x.dead = c->dead;
+  x.ready = c->readys;
+  row = (long *) malloc ((c->rowid + 1) * sizeof (long));
+  for (i = 0; i <= c->rowid; i++)
+    row[i] = labs (c->row[i]);
+  fileq_xpath (c, path, ".idx");
+  if ((fp = fopen (path, "wb")) == NULL)
+  {
+    free (row);
+    return (-1);
+  }
+  i = (fwrite (&x, sizeof (x), 1, fp) != 1) ||
+    (fwrite (row, sizeof (long), c->rowid + 1, fp) != c->rowid + 1) ||
+    (fwrite (c->ready, sizeof (FILEQR), x.ready, fp) != x.ready);
+  fclose (fp);
+  free (row);
+  if (i)
+    unlink (path);
+  debug ("saved index %s to %d\n", path, c->rowid);
+  return (-i);
+}
+
+/*
+ * Load a saved index if it is still good for our data file,
+ * returning the offset in the data file it covers, or 0 if we
+ * need to index the whole thing.  We don't trust it if the data 
+ * changed without growing, or the data doesn't end with a full 
+ * row where it left off.
+ */
+long fileq_load (FILEQ *c, long first)
+{
+  FILE *fp;
+  FILEQX x;
+  struct stat st;
+  int i;
+  char path[MAX_PATH];
+
+  if (stat (c->path, &st))
+    return (0);
+  if ((fp = fopen (fileq_xpath (c, path, ".idx"), "rb")) == NULL)
+    return (0);
+  if ((fread (&x, sizeof (x), 1, fp) != 1) || 
+    memcmp (x.id, FILEQXID, 4) || (x.size < first) || (x.rowid < 0) ||
+    (x.size > st.st_size) || 
+    ((x.size == st.st_size) && (x.mtime != st.st_mtime)) ||
+    fseek (c->fp, x.size - 1, SEEK_SET) || (fgetc (c->fp) != '\n'))
+  {
+    fclose (fp);
+    return (0);
+  }
+  fileq_grow (c, x.rowid);
+  if (x.ready > c->readysz)
+  {
+    c->readysz = x.ready;
+    c->ready = (FILEQR *) realloc (c->ready, x.ready * sizeof (FILEQR));
+  }
+  if ((fread (c->row, sizeof (long), x.rowid + 1, fp) != x.rowid + 1) ||
+    (fread (c->ready, sizeof (FILEQR), x.ready, fp) != x.ready))
+  {
+    fclose (fp);
+    memset (c->row, 0, c->sz * sizeof (long));
+    return (0);
+  }
+  fclose (fp);
+  c->rowid = x.rowid;
+  c->readys = c->status < 0 ? 0 : x.ready;
+  fileq_ready_rebuild (c, NULL);
+  for (i = 1; i <= c->rowid; i++)
+  {
+    if (c->row[i])
+      c->live++;
+  }
+  c->dead = x.dead;
+  debug ("loaded index %s to %d\n", path, c->rowid);
+  return (x.size);
+}
+
 /*
  * (re)index a queue
  */
 int fileq_reindex (QUEUE *q, FILEQ *c)
 {
-  long p;
+  long p, s;
   int i, r;
   char *ch, *bp, buf[QBUFSZ];
 
@@ -150,9 +543,10 @@ int fileq_reindex (QUEUE *q, FILEQ *c)
   if (c->fp == NULL)
     return (-1);
   rewind (c->fp);
-  c->transport = 0L;
-  c->rowid = 0;
-  c->offset = 1;
+  c->append = 0;
+  c->rowid = c->live = c->dead = c->readys = 0;
+  fileq_grow (c, 0);
+  memset (c->row, 0, c->sz * sizeof (long));
   /*
    * If this is a new queue, initialize by inserting column names.
    * Otherwise, check to make sure column names match and reindex!
@@ -164,8 +558,6 @@ int fileq_reindex (QUEUE *q, FILEQ *c)
     for (i = 1; i < q->type->numfields; i++)
       fprintf (c->fp, "%c%s", Q_SEP, q->type->field[i]);
     fputc ('\n', c->fp);
-    if (istransportQ (q))
-      c->transport = ftell (c->fp);
   }
   else
   {
@@ -194,22 +586,220 @@ int fileq_reindex (QUEUE *q, FILEQ *c)
       bp = ch + 1;
     }
     p = ftell (c->fp);
-    if (istransportQ (q))
-      c->transport = p;
+    /*
+     * start from the saved index if we can, and only read the
+     * rows added since
+     */
+    if ((s = fileq_load (c, p)) > 0)
+      p = s;
+    if (fseek (c->fp, p, SEEK_SET))
+      return (-1);
     while (fgets (buf, QBUFSZ, c->fp) != NULL)
     {
       r = atoi (buf);
       if (!strchr (buf, Q_SEP))		/* deleted record	*/
 	fileq_index (c, r, 0L);
       else
+      {
         fileq_index (c, r, p);
+	fileq_queued (c, buf, p);
+      }
       p = ftell (c->fp);
     }
+    if (p > s)
+      fileq_save (c);
   }
-  debug ("index %s created to %d from %d\n", c->name, c->rowid, c->offset);
+  debug ("index %s created to %d\n", c->name, c->rowid);
   return (c->rowid);
 }
 
+/*
+ * Compaction...
+ * Updates and deletes are appended, leaving the earlier versions of
+ * a row dead in the file.  Once there are enough of those we copy
+ * just the live rows to a new file in the background, while the
+ * queue stays in use.  The next time the queue is used we add any
+ * rows appended in the mean time, and swap the new file in.
+ */
+
+/*
+ * the copy thread, writing the live rows as of xsize in row order
+ */
+void fileq_copy (FILEQ *c)
+{
+  FILE *in, *out;
+  int r;
+  char path[MAX_PATH], buf[QBUFSZ];
+
+  debug ("compacting %s to %d rows...\n", c->name, c->xrowid);
+  fileq_xpath (c, path, ".new");
+  in = fopen (c->path, "rb");
+  out = fopen (path, "wb");
+  if ((in == NULL) || (out == NULL) || 
+    (fgets (buf, QBUFSZ, in) == NULL) || (fputs (buf, out) < 0))
+    r = -1;
+  else
+  {
+    for (r = 1; r <= c->xrowid; r++)
+    {
+      if (c->xrow[r] == 0)
+	continue;
+      if (fseek (in, c->xrow[r], SEEK_SET) || 
+	(fgets (buf, QBUFSZ, in) == NULL) || (atoi (buf) != r))
+	break;
+      c->xrow[r] = ftell (out);
+      if (fputs (buf, out) < 0)
+	break;
+    }
+    if (r <= c->xrowid)
+      r = -1;
+  }
+  if (in != NULL)
+    fclose (in);
+  if ((out != NULL) && c->sync.mode && 
+    (fflush (out) || _commit (_fileno (out))))
+    r = -1;
+  if ((out != NULL) && fclose (out))
+    r = -1;
+  if (r < 0)
+  {
+    error ("Failed compacting %s\n", c->name);
+    unlink (path);
+  }
+  c->compact = r < 0 ? FILEQ_FAILED : FILEQ_COPIED;
+  t_exit ();
+}
+
+/*
+ * start compacting if there are enough dead rows
+ */
+int fileq_compact (FILEQ *c)
+{
+  int r;
+
+  if ((c->ratio < 1) || (c->compact != FILEQ_IDLE) || 
+    (c->dead < FILEQMINDEAD) || (c->dead / c->ratio < c->live))
+    return (0);
+  info ("Compacting queue %s, %d live and %d dead rows\n", 
+    c->name, c->live, c->dead);
+  fflush (c->fp);
+  if (fseek (c->fp, 0, SEEK_END))
+    return (-1);
+  c->xsize = ftell (c->fp);
+  c->xrowid = c->rowid;
+  c->xrow = (long *) malloc ((c->xrowid + 1) * sizeof (long));
+  for (r = 0; r <= c->xrowid; r++)
+    c->xrow[r] = labs (c->row[r]);
+  c->compact = FILEQ_COPYING;
+  t_start (fileq_copy, c);
+  return (0);
+}
+
+/*
+ * Finish a compaction by adding rows appended since the copy,
+ * and swap in the new file and index.  Rows popped in the old
+ * index stay popped in the new one.
+ */
+int fileq_swap (FILEQ *c)
+{
+  FILE *fp;
+  int r, dead;
+  long p;
+  struct stat st;
+  char path[MAX_PATH], buf[QBUFSZ];
+
+  if (c->compact == FILEQ_IDLE)
+    return (0);
+  fileq_xpath (c, path, ".new");
+  if (c->compact != FILEQ_COPIED)
+    r = -1;
+  else if ((fp = fopen (path, "a")) == NULL)
+    r = -1;
+  else
+  {
+    dead = r = 0;
+    if (c->sz > c->xrowid + 1)	/* room for rows added since	*/
+    {
+      c->xrow = (long *) realloc (c->xrow, c->sz * sizeof (long));
+      memset (c->xrow + c->xrowid + 1, 0, 
+	(c->sz - c->xrowid - 1) * sizeof (long));
+    }
+    fflush (c->fp);
+    c->append = 0;
+    if (fseek (c->fp, c->xsize, SEEK_SET))
+      r = -1;
+    else while (fgets (buf, QBUFSZ, c->fp) != NULL)
+    {
+      r = atoi (buf);
+      p = ftell (fp);
+      if (fputs (buf, fp) < 0)
+      {
+	r = -1;
+	break;
+      }
+      if ((r < 1) || (r >= c->sz))
+	continue;
+      if (c->xrow[r])
+	dead++;
+      if (strchr (buf, Q_SEP) == NULL)
+      {
+	dead++;
+	p = 0;
+      }
+      c->xrow[r] = p;
+    }
+    if (c->sync.mode && (fflush (fp) || _commit (_fileno (fp))))
+      r = -1;
+    if (fclose (fp))
+      r = -1;
+    /*
+     * the saved index is for the old file, and may well pass as one
+     * for the new if we crash before saving again, so drop it first
+     */
+    if ((r >= 0) && unlink (fileq_xpath (c, buf, ".idx")) && 
+      !stat (buf, &st))
+    {
+      error ("Can't remove stale index %s\n", buf);
+      r = -1;
+    }
+    if (r >= 0)
+    {
+      fileq_unmap (c);
+      fclose (c->fp);
+      if (!MoveFileEx (path, c->path, 
+	MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH))
+	r = -1;
+      if ((c->fp = fopen (c->path, "a+")) == NULL)
+	fatal ("Can't reopen fileq %s\n", c->path);
+    }
+  }
+  if (r < 0)
+  {
+    if (c->compact == FILEQ_COPIED)
+      error ("Failed swapping compacted %s\n", c->name);
+    unlink (path);
+    free (c->xrow);
+    c->xrow = NULL;
+    c->dead = 0;			/* wait for more to try again	*/
+    c->compact = FILEQ_IDLE;
+    return (-1);
+  }
+  fileq_ready_rebuild (c, c->xrow);
+  for (r = 1; r <= c->rowid; r++)
+  {
+    if ((c->row[r] < 0) && (c->xrow[r] > 0))
+      c->xrow[r] = -c->xrow[r];
+  }
+  free (c->row);
+  c->row = c->xrow;
+  c->xrow = NULL;
+  c->dead = dead;
+  c->compact = FILEQ_IDLE;
+  fileq_save (c);
+  info ("Compacted queue %s to %d live rows\n", c->name, c->live);
+  return (0);
+}
+
 /*
  * convert a string into a row
  */
@@ -219,7 +809,7 @@ QUEUEROW *fileq_parse (QUEUE *q, char *buf)
   int i;
   QUEUEROW *r;
 
-  if ((i = atoi (buf)) < 1)
+  if ((buf == NULL) || ((i = atoi (buf)) < 1))
     return (NULL);
   if (strchr (p = buf, Q_SEP) == NULL)	/* delete record	*/
     return (NULL);
@@ -265,14 +855,12 @@ char *fileq_format (QUEUEROW *row, char *buf)
 char *fileq_getrow (FILEQ *c, int row, char *buf)
 {
   long p;
-  int r;
   char *nl;
 
-  r = row;
-  if ((r < c->offset) || 		/* off front end	*/
-      ((r -= c->offset) >= c->sz) || 	/* off back end		*/
-      ((p = c->row[r]) == 0))		/* deleted		*/
+  if ((row < 1) || (row > c->rowid) || 	/* not indexed		*/
+      ((p = labs (c->row[row])) == 0))	/* deleted		*/
     return (NULL);
+  c->append = 0;
   if (fseek (c->fp, p, SEEK_SET))
     return (NULL);
   if (fgets (buf, QBUFSZ, c->fp) == NULL)
@@ -285,59 +873,163 @@ char *fileq_getrow (FILEQ *c, int row, char *buf)
 }
 
 /*
- * add a row to the file
+ * Mapped reads...
+ * Rows are parsed straight from a read only mapping of the file.
+ * Appends don't show up in the mapping, so rows past the end are
+ * read from the file until it has grown enough to be worth mapping
+ * again.  Small files are never mapped.
  */
-int fileq_putrow (FILEQ *c, char *buf)
+
+/*
+ * drop the mapping
+ */
+int fileq_unmap (FILEQ *c)
 {
-  int r;
-  long p;
+  if (c->view != NULL)
+    UnmapViewOfFile (c->view);
+  if (c->map != NULL)
+    CloseHandle (c->map);
+  c->view = NULL;
+  c->map = NULL;
+  c->mapsz = 0;
+  return (0);
+}
 
-  r = atoi (buf);
-  if (fseek (c->fp, 0, SEEK_END))
-    return (0);
-  p = ftell (c->fp);
-  fputs (buf, c->fp);
-  fputc ('\n', c->fp);
-  fileq_index (c, r, p);
-  return (r);
+/*
+ * (re)map the whole file
+ */
+int fileq_map (FILEQ *c)
+{
+  long sz;
+  HANDLE h;
+
+  fileq_unmap (c);
+  fflush (c->fp);
+  h = (HANDLE) _get_osfhandle (_fileno (c->fp));
+  if ((sz = _filelength (_fileno (c->fp))) < 1)
+    return (-1);
+  if ((c->map = CreateFileMapping (h, NULL, PAGE_READONLY, 0, 0, NULL)) 
+    == NULL)
+    return (-1);
+  if ((c->view = (char *) MapViewOfFile (c->map, FILE_MAP_READ, 0, 0, 0))
+    == NULL)
+  {
+    fileq_unmap (c);
+    return (-1);
+  }
+  c->mapsz = sz;
+  debug ("mapped %ld bytes of %s\n", sz, c->name);
+  return (0);
 }
 
 /*
- * read to the next transport record to pop
+ * Find a row in the mapping, setting it's length without the line
+ * ending.  Return NULL if it isn't mapped.
  */
-QUEUEROW *fileq_transport (QUEUE *q, FILEQ *c)
+char *fileq_maprow (FILEQ *c, int row, int *len)
 {
-  int i, f, r;
   long p;
-  char *ch, buf[QBUFSZ];
+  char *b, *e;
 
-  debug ("getting next transport row at %ld\n", c->transport);
-  if (fseek (c->fp, c->transport, SEEK_SET))
+  if ((row < 1) || (row > c->rowid) ||
+      ((p = labs (c->row[row])) == 0))
     return (NULL);
-  if ((f = queue_field_find (q, "PROCESSINGSTATUS")) < 0)
+  if (p >= c->mapsz)
+  {
+    fflush (c->fp);
+    if ((_filelength (_fileno (c->fp)) - c->mapsz < FILEQMAPGROW) ||
+      fileq_map (c) || (p >= c->mapsz))
+      return (NULL);
+  }
+  b = c->view + p;
+  if ((e = memchr (b, '\n', c->mapsz - p)) == NULL)
+    return (NULL);			/* only partly written	*/
+  if ((e > b) && (e[-1] == '\r'))
+    e--;
+  *len = e - b;
+  return (b);
+}
+
+/*
+ * convert len characters of a mapped row, leaving it unchanged
+ */
+QUEUEROW *fileq_parse_map (QUEUE *q, char *p, int len)
+{
+  char *e, *t;
+  int i, n;
+  QUEUEROW *r;
+
+  e = p + len;
+  if ((i = atoi (p)) < 1)
     return (NULL);
-  while (fgets (buf, QBUFSZ, c->fp) != NULL)
+  if (memchr (p, Q_SEP, len) == NULL)	/* delete record	*/
+    return (NULL);
+  r = queue_row_alloc (q);
+  r->rowid = i;
+  for (i = 0; i < q->type->numfields; i++)
   {
-    p = c->transport;
-    c->transport = ftell (c->fp);
-    ch = buf;
-    for (i = 0; i < f; i++)
-    {
-      if ((ch = strchr (ch, Q_SEP)) == NULL)
-	break;
-      ch++;
-    }
-    debug ("i=%d/%d ch=%.8s\n", i, f, ch == NULL ? "NULL" : ch);
-    if ((ch != NULL) && strstarts (ch, "queued"))
-    {
-      r = atoi (buf);			/* check if current	*/
-      if ((r < c->offset) || 		/* off front end	*/
-        ((r -= c->offset) > c->sz) || 	/* off back end		*/
-        (p == c->row[r]))		/* this row!		*/
-        return (fileq_parse (q, buf));
-    }
+    if ((t = memchr (p, Q_SEP, e - p)) == NULL)
+      t = e;
+    n = t - p;
+    r->field[i] = (char *) malloc (n + 1);
+    memcpy (r->field[i], p, n);
+    r->field[i][n] = 0;
+    if (t == e)
+      break;
+    p = t + 1;
   }
-  return (NULL);
+  return (r);
+}
+
+/*
+ * read a row, from the mapping if we can
+ */
+QUEUEROW *fileq_read (QUEUE *q, FILEQ *c, int row)
+{
+  int len;
+  char *p, buf[QBUFSZ];
+
+  if ((p = fileq_maprow (c, row, &len)) == NULL)
+    return (fileq_parse (q, fileq_getrow (c, row, buf)));
+  if (row != atoi (p))
+    error ("RowID %d does not match %.5s\n", row, p);
+  return (fileq_parse_map (q, p, len));
+}
+
+/*
+ * Add a row to the file.  We only seek to the end after reading, so
+ * rows written back to back share the buffer.  Without a sync policy
+ * each row (or batch) is flushed to the OS as before, otherwise
+ * fileq_commit() flushes them.
+ */
+int fileq_putrow (FILEQ *c, char *buf)
+{
+  int r;
+  long p;
+
+  r = atoi (buf);
+  if (!c->append)
+  {
+    if (fseek (c->fp, 0, SEEK_END))
+      return (0);
+    c->append = 1;
+  }
+  p = ftell (c->fp);
+  if (fprintf (c->fp, "%s\n", buf) < 0)
+    return (0);
+  if ((c->sync.mode == QSYNC_NONE) && !c->batch)
+    fflush (c->fp);
+  wait_mutex ((&c->sync));
+  c->sync.written++;
+  if (!c->batch)
+    c->sync.pushes++;
+  end_mutex ((&c->sync));
+  if (strchr (buf, Q_SEP) == NULL)
+    p = 0;
+  fileq_index (c, r, p);
+  fileq_queued (c, buf, p);
+  fileq_compact (c);
+  return (r);
 }
 
 /********************* advertized functions ***********************/
@@ -354,6 +1046,13 @@ int fileq_close (void *conn)
   {
     c = FileQ;
     FileQ = c->next;
+    while (c->compact == FILEQ_COPYING)
+      sleep (100);
+    fileq_swap (c);
+    fflush (c->fp);
+    if (c->sync.mode)
+      _commit (_fileno (c->fp));
+    fileq_save (c);
     fileq_free (c);
   }
   return (0);
@@ -374,6 +1073,36 @@ int fileq_push (QUEUEROW *r)
   return (fileq_putrow (c, fileq_format (r, buf)));
 }
 
+/*
+ * Add n rows to the queue as one append, returning the number added.
+ */
+int fileq_pushbatch (QUEUE *q, QUEUEROW **rows, int n)
+{
+  FILEQ *c;
+  int i;
+  char buf[QBUFSZ];
+
+  if ((c = fileq_find (q)) == NULL)
+    return (0);
+  c->batch = 1;
+  for (i = 0; i < n; i++)
+  {
+    if (rows[i]->rowid == 0)
+      rows[i]->rowid = ++c->rowid;
+    if (fileq_putrow (c, fileq_format (rows[i], buf)) == 0)
+      break;
+  }
+  c->batch = 0;
+  if (c->sync.mode == QSYNC_NONE)
+    fflush (c->fp);
+  if (i)
+  {
+    wait_mutex ((&c->sync));
+    c->sync.pushes++;
+    end_mutex ((&c->sync));
+  }
+  return (i);
+}
 
 /*
  * delete a row
@@ -388,7 +1117,6 @@ int fileq_del (QUEUE *q, int rowid)
   sprintf (buf, "%d", rowid);
   if (fileq_putrow (c, buf) == 0)
     return (-1);
-  fileq_index (c, rowid, 0L);
   return (0);
 }
 
@@ -398,11 +1126,10 @@ int fileq_del (QUEUE *q, int rowid)
 QUEUEROW *fileq_get (QUEUE *q, int rowid)
 {
   FILEQ *c;
-  char buf[QBUFSZ];
 
   if ((c = fileq_find (q)) == NULL)
     return (NULL);
-  return (fileq_parse (q, fileq_getrow (c, rowid, buf)));
+  return (fileq_read (q, c, rowid));
 }
 
 /*
@@ -411,26 +1138,19 @@ QUEUEROW *fileq_get (QUEUE *q, int rowid)
 QUEUEROW *fileq_next (QUEUE *q, int rowid)
 {
   FILEQ *c;
-  char buf[QBUFSZ];
 
   if ((c = fileq_find (q)) == NULL)
     return (NULL);
   /*
    * call with 0 to get the first row
    */
-  if (rowid == 0)
-  {
-    rowid = c->offset;
-  }
-  else if (rowid < c->offset)
-  {
+  if (rowid < 0)
     return (NULL);
-  }
   while (++rowid <= c->rowid)
   {
-    if (c->row[rowid - c->offset])
+    if (c->row[rowid])
     {
-      return (fileq_parse (q, fileq_getrow (c, rowid, buf)));
+      return (fileq_read (q, c, rowid));
     }
   }
   return (NULL);
@@ -442,7 +1162,6 @@ QUEUEROW *fileq_next (QUEUE *q, int rowid)
 QUEUEROW *fileq_prev (QUEUE *q, int rowid)
 {
   FILEQ *c;
-  char buf[QBUFSZ];
 
   if ((c = fileq_find (q)) == NULL)
     return (NULL);
@@ -458,17 +1177,43 @@ QUEUEROW *fileq_prev (QUEUE *q, int rowid)
     return (NULL);
   }
   debug ("getting prev to %d\n", rowid);
-  while (--rowid >= c->offset)
+  while (--rowid > 0)
   {
-    if (c->row[rowid - c->offset])
+    if (c->row[rowid])
     {
       debug ("found at %d\n", rowid);
-      return (fileq_parse (q, fileq_getrow (c, rowid, buf)));
+      return (fileq_read (q, c, rowid));
     }
   }
   return (NULL);
 }
 
+/*
+ * get up to n rows before this one, last first
+ */
+int fileq_page (QUEUE *q, int rowid, int n, QUEUEROW **rows)
+{
+  FILEQ *c;
+  int i;
+
+  if ((c = fileq_find (q)) == NULL)
+    return (0);
+  /*
+   * call with 0 to start from the last row
+   */
+  if (rowid == 0)
+    rowid = c->rowid + 1;
+  else if (rowid > c->rowid + 1)
+    return (0);
+  i = 0;
+  while ((i < n) && (--rowid > 0))
+  {
+    if (c->row[rowid] && ((rows[i] = fileq_read (q, c, rowid)) != NULL))
+      i++;
+  }
+  return (i);
+}
+
 /*
  * return the top row, removing it from our index
  */
@@ -476,20 +1221,111 @@ QUEUEROW *fileq_pop (QUEUE *q)
 {
   FILEQ *c;
   QUEUEROW *r;
+  int i;
 
   if ((c = fileq_find (q)) == NULL)
     return (NULL);
-  if (c->transport)
+  if (c->status >= 0)
     r = fileq_transport (q, c);
-  else 
-    r = fileq_prev (q, c->rowid + 1);
+  else 				/* highest not yet popped	*/
+  {
+    for (i = c->rowid; (i > 0) && (c->row[i] <= 0); i--);
+    r = fileq_read (q, c, i);
+  }
   if (r == NULL)
     return (NULL);
-  if (r->rowid >= c->offset)
-    c->row[r->rowid - c->offset] = 0;
+  if (c->row[r->rowid] > 0)		/* mark it popped	*/
+    c->row[r->rowid] = -c->row[r->rowid];
   return (r);
 }
 
+/*
+ * Wait for rows we've written to get to disk.  For a row commit each
+ * push does it's own sync.  For a group commit the first thread in
+ * leads.  If other pushes have written rows but not yet joined, or
+ * threads let go by the last commit haven't come back, it waits for
+ * them (each signals as it joins) for up to SyncDelay ms or until 
+ * SyncRows rows are waiting, then syncs everything written so far.
+ * A lone push syncs right away.  Threads arriving meanwhile wait for
+ * a commit that covers their rows, so concurrent pushes share one 
+ * sync.
+ */
+int fileq_commit (QUEUE *q)
+{
+  FILEQ *c;
+  FILEQSYNC *s;
+  DWORD t, e;
+  long n, mine;
+  int covered;
+
+  for (c = FileQ; c != NULL; c = c->next)
+  {
+    if (strcmp (q->name, c->name) == 0)
+      break;
+  }
+  if (c == NULL)
+    return (0);
+  s = &c->sync;
+  wait_mutex (s);
+  s->joined++;
+  s->back++;
+  if (s->syncing)
+    set_ready ((&s->join));
+  end_mutex (s);
+  if (s->mode == QSYNC_NONE)
+    return (0);
+  if (s->mode == QSYNC_ROW)
+  {
+    wait_mutex (q);
+    if (fflush (c->fp) || _commit (_fileno (c->fp)))
+      error ("Failed committing %s\n", c->name);
+    end_mutex (q);
+    return (0);
+  }
+  wait_mutex (s);
+  mine = s->written;			/* covers the row we pushed	*/
+  while (s->synced < mine)
+  {
+    if (s->syncing)			/* someone else is leading	*/
+    {
+      s->waiting++;
+      end_mutex (s);
+      wait_ready_for (s, 1000);
+      wait_mutex (s);
+      s->waiting--;
+      continue;
+    }
+    s->syncing = 1;
+    reset_ready (s);
+    t = GetTickCount ();
+    while (((s->joined < s->pushes) || (s->back < s->expect)) &&
+      (s->written - s->synced < q->conn->syncrows) &&
+      ((e = GetTickCount () - t) < (DWORD) q->conn->syncdelay))
+    {
+      end_mutex (s);
+      wait_ready_for ((&s->join), q->conn->syncdelay - e);
+      wait_mutex (s);
+    }
+    end_mutex (s);
+    wait_mutex (q);
+    wait_mutex (s);
+    n = s->written;
+    covered = s->waiting;		/* their rows are written	*/
+    end_mutex (s);
+    if (fflush (c->fp) || _commit (_fileno (c->fp)))
+      error ("Failed committing %s\n", c->name);
+    end_mutex (q);
+    wait_mutex (s);
+    s->synced = n;
+    s->syncing = 0;
+    s->expect = covered + 1;		/* we'll let them and us go	*/
+    s->back = 0;
+    set_ready (s);
+  }
+  end_mutex (s);
+  return (0);
+}
+
 /*
  * Making a connection...
  * note our private connection object is the unc path (prefix) to the folder
@@ -500,11 +1336,14 @@ int fileq_connect (QUEUECONN *conn)
   conn->conn = conn->unc;
   conn->close = fileq_close;
   conn->push = fileq_push;
+  conn->pushbatch = fileq_pushbatch;
+  conn->commit = fileq_commit;
   conn->pop = fileq_pop;
   conn->get = fileq_get;
   conn->del = fileq_del;
   conn->nextrow = fileq_next;
   conn->prevrow = fileq_prev;
+  conn->page = fileq_page;
   debug ("Connection to %s completed\n", conn->name);
   return (0);
 }
@@ -516,7 +1355,6 @@ int fileq_connect (QUEUECONN *conn)
 #include "xml.c"
 #include "dbuf.c"
 #include "queue.c"
-#include "xml.c"
 #include "xmln.c"
 
 char TestRow[] =
@@ -639,13 +1477,77 @@ int dump_row (QUEUEROW *r)
   free (r);
 }
 
-int main (int argc, char **argv)
+/*
+ * Time concurrent pushes under each sync policy, as receivers would
+ * push to an audit queue.  Run with "bench".
+ */
+#define BENCHTHREADS 4
+#define BENCHROWS 250
+
+int BenchDone[BENCHTHREADS];
+
+void bench_push (int t)
 {
   int i;
+  QUEUE *q;
+  QUEUEROW *r;
+  char buf[QBUFSZ];
+
+  q = queue_find ("MemReceiveQ");
+  for (i = 0; i < BENCHROWS; i++)
+  {
+    if ((r = fileq_parse (q, rand_rcv (1, buf))) == NULL)
+      break;
+    r->rowid = 0;
+    if (queue_push (r) < 1)
+      error ("Bench push failed\n");
+    queue_row_free (r);
+  }
+  BenchDone[t] = 1;
+  t_exit ();
+}
+
+int bench (void)
+{
+  char *policy[] = { "none", "row", "group" };
+  int i, mode;
+  DWORD t;
+  QUEUE *q;
+
+  q = queue_find ("MemReceiveQ");
+  if (q->conn->syncdelay < 1)
+    q->conn->syncdelay = 10;
+  if (q->conn->syncrows < 1)
+    q->conn->syncrows = 100;
+  for (mode = QSYNC_NONE; mode <= QSYNC_GROUP; mode++)
+  {
+    fileq_find (q)->sync.mode = q->conn->syncmode = mode;
+    t = GetTickCount ();
+    for (i = 0; i < BENCHTHREADS; i++)
+    {
+      BenchDone[i] = 0;
+      t_start (bench_push, (void *) i);
+    }
+    for (i = 0; i < BENCHTHREADS; i++)
+    {
+      while (!BenchDone[i])
+	sleep (1);
+    }
+    t = GetTickCount () - t;
+    info ("sync %-5s %d threads %d rows %d ms %d rows/sec\n", 
+      policy[mode], BENCHTHREADS, BENCHTHREADS * BENCHROWS, t,
+      BENCHTHREADS * BENCHROWS * 1000 / (t ? t : 1));
+  }
+  return (0);
+}
+
+int main (int argc, char **argv)
+{
+  int i, f, n;
   XML *xml;
   QUEUE *q;
   QUEUETYPE *t;
-  QUEUEROW *r = NULL;
+  QUEUEROW *r = NULL, *rows[10];
   char *ch = NULL;
   char buf[4096];
 
@@ -659,6 +1561,12 @@ int main (int argc, char **argv)
     fatal ("Couldn't initialize\n"); 
   if (argc > 1)
     build_queues (buf);
+  if ((argc > 1) && (strcmp (argv[1], "bench") == 0))
+  {
+    bench ();
+    queue_shutdown ();
+    exit (Errors);
+  }
   debug ("MemReceiveQ tests...\n");
   q = queue_find ("MemReceiveQ");
   if (q == NULL)
@@ -702,6 +1610,35 @@ int main (int argc, char **argv)
     error ("Couldn't get default prev queue %s\n", q->name);
   else
     dump_row (r);
+  debug ("Paging...\n");
+  if ((n = queue_page (q, 0, 10, rows)) != 10)
+    error ("Got %d rows paging queue %s\n", n, q->name);
+  for (i = f = 0; f < n; f++)
+  {
+    if ((r = queue_prev (q, i)) == NULL)
+      error ("Couldn't get prev row %d queue %s\n", i, q->name);
+    else if (r->rowid != rows[f]->rowid)
+      error ("Paged row %d didn't match prev row %d\n", 
+	rows[f]->rowid, r->rowid);
+    i = rows[f]->rowid;
+    queue_row_free (r);
+    queue_row_free (rows[f]);
+  }
+  debug ("Mapping...\n");
+  if (fileq_map (fileq_find (q)))
+    error ("Couldn't map queue %s\n", q->name);
+  for (i = 1; i <= fileq_find (q)->rowid; i++)
+  {
+    r = fileq_read (q, fileq_find (q), i);
+    rows[0] = fileq_parse (q, fileq_getrow (fileq_find (q), i, buf));
+    if ((r == NULL) != (rows[0] == NULL))
+      error ("Mapped row %d didn't match\n", i);
+    else if ((r != NULL) && strcmp (fileq_format (r, buf), 
+      fileq_format (rows[0], buf + QBUFSZ / 2)))
+      error ("Mapped row %d didn't match\n%s\n", i, buf);
+    queue_row_free (r);
+    queue_row_free (rows[0]);
+  }
 
   debug ("MemSendQ tests...\n");
   q = queue_find ("MemSendQ");
@@ -711,9 +1648,18 @@ int main (int argc, char **argv)
   if ((r = queue_pop (q)) == NULL)
     error ("Couldn't pop queue %s\n", q->name);
   else
+  {
+    i = r->rowid;
+    f = atoi (queue_field_get (r, "PRIORITY"));
     dump_row (r);
+  }
   while ((r = queue_pop (q)) != NULL)
   {
+    n = atoi (queue_field_get (r, "PRIORITY"));
+    if ((n > f) || ((n == f) && (r->rowid < i)))
+      error ("Row %d priority %d popped after row %d priority %d\n",
+	r->rowid, n, i, f);
+    f = n;
     i = r->rowid;
     dump_row (r);
   }
@@ -731,6 +1677,69 @@ int main (int argc, char **argv)
     error ("Couldn't get default next row from queue %s\n", q->name);
   else
     dump_row (r);
+  debug ("Compacting...\n");
+  fileq_find (q)->ratio = 2;
+  for (i = 0; i < 1200; i++)
+  {
+    if ((r = queue_get (q, i % 100 + 1)) == NULL)
+      continue;
+    queue_push (r);
+    queue_row_free (r);
+  }
+  while (fileq_find (q)->compact == FILEQ_COPYING)
+    sleep (10);
+  for (i = 1; i <= 100; i++)
+  {
+    if ((r = queue_get (q, i)) == NULL)
+      error ("Couldn't get row %d after compacting\n", i);
+    else
+      queue_row_free (r);
+  }
+  if (fileq_find (q)->dead >= FILEQMINDEAD)
+    error ("Queue %s wasn't compacted\n", q->name);
+  debug ("Restarting from saved index...\n");
+  *buf = 0;
+  if ((r = queue_get (q, 1)) != NULL)
+  {
+    fileq_format (r, buf);
+    queue_row_free (r);
+  }
+  queue_shutdown ();
+  if (queue_init (xml))
+    fatal ("Couldn't initialize\n"); 
+  q = queue_find ("MemSendQ");
+  if ((r = queue_get (q, 1)) == NULL)
+    error ("Couldn't get row 1 after restart\n");
+  else
+  {
+    if (strcmp (buf, fileq_format (r, buf + QBUFSZ / 2)))
+      error ("Row 1 changed after restart\n");
+    queue_row_free (r);
+  }
+  if ((r = queue_pop (q)) == NULL)
+    error ("Unfinished rows not popped after restart\n");
+  else
+    dump_row (r);
+  debug ("Batch pushing...\n");
+  for (n = 0; n < 10; n++)
+  {
+    if ((rows[n] = queue_get (q, n + 1)) == NULL)
+      break;
+    rows[n]->rowid = 0;
+  }
+  f = fileq_find (q)->rowid;
+  if ((i = queue_push_batch (q, rows, n)) != 10)
+    error ("Batch pushed %d of 10 rows\n", i);
+  for (i = 0; i < n; i++)
+  {
+    if (rows[i]->rowid != f + i + 1)
+      error ("Batch row %d got rowid %d\n", i, rows[i]->rowid);
+    else if ((r = queue_get (q, rows[i]->rowid)) == NULL)
+      error ("Couldn't get batch row %d\n", rows[i]->rowid);
+    else
+      queue_row_free (r);
+    queue_row_free (rows[i]);
+  }
   debug ("Closing...\n");
   queue_shutdown ();
   info ("%s %s\n", argv[0], Errors?"failed":"passed");
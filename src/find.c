@@ -161,6 +161,7 @@ FINDNAME *find (char *pat, int recurse)
       find_pathname (dirpath, pat, file.name);
       debug ("adding %s\n", file.name);
       *new = (FINDNAME *) malloc (sizeof (FINDNAME) + strlen (dirpath));
+      (*new)->mtime = file.time_write;
       strcpy ((*new)->name, dirpath);
       new = &(*new)->next;
     }
@@ -174,6 +175,41 @@ FINDNAME *find (char *pat, int recurse)
   return (fnames);
 }
 
+/*
+ * Sort a list of files oldest first, and by name when written at
+ * the same time (a merge sort, so it stays stable).
+ */
+FINDNAME *find_sort (FINDNAME *fnames)
+{
+  FINDNAME *a, *b, **p;
+
+  if ((fnames == NULL) || (fnames->next == NULL))
+    return (fnames);
+  b = fnames;				/* split at the middle		*/
+  for (a = fnames->next; (a != NULL) && (a->next != NULL); a = a->next->next)
+    b = b->next;
+  a = b->next;
+  b->next = NULL;
+  b = find_sort (a);
+  a = find_sort (fnames);
+  for (p = &fnames; (a != NULL) && (b != NULL); p = &(*p)->next)
+  {
+    if ((b->mtime < a->mtime) ||
+      ((b->mtime == a->mtime) && (strcmp (b->name, a->name) < 0)))
+    {
+      *p = b;
+      b = b->next;
+    }
+    else
+    {
+      *p = a;
+      a = a->next;
+    }
+  }
+  *p = a == NULL ? b : a;
+  return (fnames);
+}
+
 /*
  * Copy and dispose of next file in the list
  */
@@ -209,14 +245,20 @@ FINDNAME *find_free (FINDNAME *fnames)
 
 int main (int argc, char **argv)
 {
-  FINDNAME *f;
+  FINDNAME *f, *p;
   char fname[MAX_PATH];
   int n = 0;
 
   if (argc > 1)
-    f = find (argv[1], 1);
+    f = find_sort (find (argv[1], 1));
   else
-    f = find ("", 1);
+    f = find_sort (find ("", 1));
+  for (p = f; (p != NULL) && (p->next != NULL); p = p->next)
+  {
+    if ((p->next->mtime < p->mtime) || ((p->next->mtime == p->mtime) &&
+      (strcmp (p->next->name, p->name) < 0)))
+      error ("%s sorted after %s\n", p->next->name, p->name);
+  }
   while (find_next (&f, fname) != NULL)
   {
     debug ("%s\n", fname);
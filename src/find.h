@@ -18,9 +18,12 @@
 #ifndef __FIND__
 #define __FIND__
 
+#include <time.h>
+
 typedef struct findname
 {
   struct findname *next;
+  time_t mtime;			/* when last written		*/
   char name[1];
 } FINDNAME;
 
@@ -29,6 +32,7 @@ char *find_subpath (char *path, char *pat, char *subdir);
 char *find_pathname (char *path, char *pat, char *name);
 char *find_folder (char *path, char *pat);
 FINDNAME *find (char *pat, int recurse);
+FINDNAME *find_sort (FINDNAME *fnames);
 char *find_next (FINDNAME **fnames, char *name);
 FINDNAME *find_free (FINDNAME *fnames);
 
@@ -29,6 +29,7 @@
 #include "log.h"
 #include "find.h"
 #include "task.h"
+#include "queue.h"
 #include "fpoller.h"
 
 #ifndef debug
@@ -36,41 +37,150 @@
 #endif
 
 #define MAP "Phineas.Sender.MapInfo.Map"
+/* most rows queued together */
+#define FPOLLERBATCH 100
+/* most folders watched for changes */
+#define FPOLLERWATCH MAXIMUM_WAIT_OBJECTS
+/* least ms between full scans of watched folders */
+#define FPOLLERSCAN 60000
+/* ms before looking again for files still being written */
+#define FPOLLERBUSY 1000
+/* default threads polling folders */
+#define FPOLLERTHREADS 4
 
 /* the processor list */
 typedef struct fpoller
 {
   struct fpoller *next;
   int (*proc) (XML *xml, char *prefix, char *fname);
+  QUEUEROW *(*row) (XML *xml, char *prefix, char *fname);
   char name[1];
 } FPOLLER;
 
 FPOLLER *Fpoller = NULL;
 
 /*
- * register a folder processor with a folder name
+ * A map's folder, polled by one task at a time so it's files are
+ * queued in order.
  */
-int fpoller_register (char *name, int (*proc)(XML *, char *, char *))
+typedef struct fpollermap
+{
+  MUTEX mutex;
+  XML *xml;
+  TASKQ *q;				/* where we poll it		*/
+  int mapid;
+  int state;				/* FPOLLER_IDLE etc		*/
+} FPOLLERMAP;
+
+#define FPOLLER_IDLE 0			/* not being polled		*/
+#define FPOLLER_QUEUED 1		/* waiting for a thread		*/
+#define FPOLLER_RUNNING 2		/* being polled			*/
+#define FPOLLER_AGAIN 3			/* poll again when done		*/
+
+/*
+ * add a processor to the list
+ */
+FPOLLER *fpoller_add (char *name)
 {
   FPOLLER *n, **p;
 
   n = (FPOLLER *) malloc (sizeof (FPOLLER) + strlen (name));
   n->next = NULL;
-  n->proc = proc;
+  n->proc = NULL;
+  n->row = NULL;
   strcpy (n->name, name);
   for (p = &Fpoller; *p != NULL; p = &(*p)->next);
   *p = n;
+  return (n);
+}
+
+/*
+ * register a folder processor with a folder name
+ */
+int fpoller_register (char *name, int (*proc)(XML *, char *, char *))
+{
+  fpoller_add (name)->proc = proc;
+  return (0);
+}
+
+/*
+ * register a folder row builder with a folder name
+ */
+int fpoller_register_rows (char *name, 
+  QUEUEROW *(*row)(XML *, char *, char *))
+{
+  fpoller_add (name)->row = row;
+  return (0);
+}
+
+/*
+ * Push and free rows built for a folder, together for each run of
+ * rows going to the same queue.  Their files have already been
+ * moved to processed, so if a batch falls short (or is rolled back
+ * entirely) we push the rest one at a time, and only lose those
+ * that still fail.  Returns the number of rows not queued.
+ */
+int fpoller_push (QUEUEROW **rows, int n)
+{
+  int i, j, k, failed = 0;
+
+  for (i = 0; i < n; i = j)
+  {
+    for (j = i + 1; j < n; j++)
+    {
+      if (rows[j]->queue != rows[i]->queue)
+	break;
+    }
+    if ((k = queue_push_batch (rows[i]->queue, rows + i, j - i)) < j - i)
+    {
+      warn ("Batch queued %d of %d rows to %s, pushing the rest singly\n",
+	k, j - i, rows[i]->queue->name);
+      for (k += i; k < j; k++)
+      {
+	if (queue_push (rows[k]) < 1)
+	{
+	  error ("Failed queueing row %d of %d to %s\n", k - i + 1, j - i,
+	    rows[k]->queue->name);
+	  failed++;
+	}
+      }
+    }
+    else
+      debug ("queued %d rows to %s\n", k, rows[i]->queue->name);
+  }
+  for (i = 0; i < n; i++)
+    queue_row_free (rows[i]);
+  return (failed);
 }
 
 /*
- * Poll and process one folder
+ * Return non-zero if someone still has this file open for writing
+ */
+int fpoller_busy (char *fname)
+{
+  HANDLE h;
+
+  h = CreateFile (fname, GENERIC_READ, FILE_SHARE_READ, NULL,
+    OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+  if (h != INVALID_HANDLE_VALUE)
+  {
+    CloseHandle (h);
+    return (0);
+  }
+  return (GetLastError () == ERROR_SHARING_VIOLATION);
+}
+
+/*
+ * Poll and process one folder, returning the number of files
+ * skipped because they were still being written.
  */
 int fpoller_poll (XML *xml, int mapid)
 {
-  int mpos;
+  int mpos, n, busy;
   char *ch;
   FPOLLER *p;
   FINDNAME *f;
+  QUEUEROW *rows[FPOLLERBATCH];
   char mpath[80];
   char fpath[MAX_PATH];
 
@@ -91,27 +201,145 @@ int fpoller_poll (XML *xml, int mapid)
   ppathf (fpath, xml_get_text (xml, mpath), "");
   debug ("Folder is %s\n", fpath);
   /*
-   * get a directory listing
+   * get a directory listing, and queue rows in batches if we can
    */
-  f = find (fpath, 0);
+  f = find_sort (find (fpath, 0));
+  n = busy = 0;
   while (find_next (&f, fpath) != NULL)
   {
     mpath[mpos] = 0;
-    p->proc (xml, mpath, fpath);
+    if (fpoller_busy (fpath))
+    {
+      debug ("%s still being written\n", fpath);
+      busy++;
+    }
+    else if (p->row == NULL)
+      p->proc (xml, mpath, fpath);
+    else if (((rows[n] = p->row (xml, mpath, fpath)) != NULL) &&
+      (++n == FPOLLERBATCH))
+    {
+      fpoller_push (rows, n);
+      n = 0;
+    }
   }
+  fpoller_push (rows, n);
+  return (busy);
+}
+
+/*
+ * A task polling a map's folder, and again if it changed meanwhile.
+ * If any files were still being written, look again a bit later.
+ */
+int fpoller_run (void *parm)
+{
+  FPOLLERMAP *m = (FPOLLERMAP *) parm;
+  int busy;
+
+  wait_mutex (m);
+  do
+  {
+    m->state = FPOLLER_RUNNING;
+    end_mutex (m);
+    busy = fpoller_poll (m->xml, m->mapid);
+    wait_mutex (m);
+  } while (m->state == FPOLLER_AGAIN);
+  if (busy > 0)
+  {
+    m->state = FPOLLER_QUEUED;
+    end_mutex (m);
+    return (task_delay (m->q, FPOLLERBUSY, fpoller_run, parm));
+  }
+  m->state = FPOLLER_IDLE;
+  end_mutex (m);
+  return (0);
+}
+
+/*
+ * Have a map's folder polled, unless that's already pending
+ */
+int fpoller_queue (FPOLLERMAP *m)
+{
+  wait_mutex (m);
+  switch (m->state)
+  {
+    case FPOLLER_IDLE :
+      m->state = FPOLLER_QUEUED;
+      end_mutex (m);
+      return (task_add (m->q, fpoller_run, (void *) m));
+    case FPOLLER_RUNNING :
+      m->state = FPOLLER_AGAIN;
+      break;
+  }
+  end_mutex (m);
+  return (0);
+}
+
+/*
+ * Start watching map folders for added or changed files, filling
+ * in change handles and their map ids.  Returns the number of
+ * folders watched.  If any can't be watched, full scans stay at
+ * the poll interval.
+ */
+int fpoller_watch (XML *xml, int num_maps, HANDLE *watch, int *mapid)
+{
+  int i, n;
+  char mpath[80];
+  char fpath[MAX_PATH];
+
+  for (i = n = 0; i < num_maps; i++)
+  {
+    if (n == FPOLLERWATCH)
+    {
+      warn ("Only watching the first %d of %d folders\n", n, num_maps);
+      break;
+    }
+    sprintf (mpath, "%s[%d].Folder", MAP, i);
+    ppathf (fpath, xml_get_text (xml, mpath), "");
+    watch[n] = FindFirstChangeNotification (fpath, FALSE,
+      FILE_NOTIFY_CHANGE_FILE_NAME | FILE_NOTIFY_CHANGE_LAST_WRITE);
+    if (watch[n] == INVALID_HANDLE_VALUE)
+      warn ("Can't watch folder %s\n", fpath);
+    else
+      mapid[n++] = i;
+  }
+  debug ("watching %d folders\n", n);
+  return (n);
+}
+
+/*
+ * Stop watching folders
+ */
+int fpoller_unwatch (HANDLE *watch, int n)
+{
+  while (n--)
+    FindCloseChangeNotification (watch[n]);
+  return (0);
 }
 
 /*
  * Poll all folder maps...
  * a thread, expected to be started from the TASKQ.  Note you must
  * re-register processors after this task exits.
+ *
+ * Unless Sender.WatchFolders is "no", folders are watched and
+ * polled as soon as something changes in them.  When all are watched
+ * full scans only serve as a once a minute safety net.  Folders are
+ * polled by up to Sender.FolderThreads threads, so a busy folder
+ * doesn't hold up the rest.
  */
 int fpoller_task (void *parm)
 {
-  int i,
+  int i, j,
       poll_interval,
-      num_maps;
+      scan_interval,
+      num_maps,
+      num_watch,
+      mapid[FPOLLERWATCH];
+  DWORD due, ms;
+  HANDLE watch[FPOLLERWATCH];
   FPOLLER *p;
+  FPOLLERMAP *m;
+  TASKQ *q;
   XML *xml = (XML *) parm;
 
   info ("Folder Poller starting\n");
@@ -120,14 +348,74 @@ int fpoller_task (void *parm)
     poll_interval = 5;
   debug ("%d maps %d interval\n", num_maps, poll_interval);
   poll_interval *= 1000;
+  if ((i = xml_get_int (xml, "Phineas.Sender.FolderThreads")) < 1)
+    i = FPOLLERTHREADS;
+  if (i > num_maps)
+    i = num_maps;
+  q = task_allocq (i, poll_interval);
+  m = (FPOLLERMAP *) malloc ((num_maps + 1) * sizeof (FPOLLERMAP));
+  for (i = 0; i < num_maps; i++)
+  {
+    init_mutex ((m + i));
+    m[i].xml = xml;
+    m[i].q = q;
+    m[i].mapid = i;
+    m[i].state = FPOLLER_IDLE;
+  }
+  scan_interval = poll_interval;
+  num_watch = 0;
+  if (strcmp (xml_get_text (xml, "Phineas.Sender.WatchFolders"), "no") &&
+    ((num_watch = fpoller_watch (xml, num_maps, watch, mapid)) == num_maps)
+    && (scan_interval < FPOLLERSCAN))
+    scan_interval = FPOLLERSCAN;
+  due = GetTickCount ();
   while (phineas_running ())
   {
-    for (i = 0; i < num_maps; i++)
+    if ((int) (due - GetTickCount ()) <= 0)
+    {
+      for (i = 0; i < num_maps; i++)
+        fpoller_queue (m + i);
+      due = GetTickCount () + scan_interval;
+    }
+    if ((int) (ms = due - GetTickCount ()) < 0)
+      ms = 0;
+    if (num_watch == 0)
+    {
+      sleep (ms);
+      continue;
+    }
+    /*
+     * wait for changes, but check now and then if we should stop
+     */
+    if (ms > poll_interval)
+      ms = poll_interval;
+    i = WaitForMultipleObjects (num_watch, watch, FALSE, ms);
+    if (i == WAIT_FAILED)
+    {
+      error ("Failed waiting for folder changes, scanning instead\n");
+      fpoller_unwatch (watch, num_watch);
+      num_watch = 0;
+      due = GetTickCount () + (scan_interval = poll_interval);
+      continue;
+    }
+    /*
+     * the wait only reports the first, so poll any other changes too
+     */
+    for (j = i -= WAIT_OBJECT_0; (j >= 0) && (j < num_watch); j++)
     {
-      fpoller_poll (xml, i);
+      if ((j > i) && (WaitForSingleObject (watch[j], 0) != WAIT_OBJECT_0))
+	continue;
+      FindNextChangeNotification (watch[j]);
+      fpoller_queue (m + mapid[j]);
     }
-    sleep (poll_interval);
   }
+  debug ("Folder Poller shutting down...\n");
+  fpoller_unwatch (watch, num_watch);
+  task_stop (q);
+  task_freeq (q);
+  for (i = 0; i < num_maps; i++)
+    destroy_mutex ((m + i));
+  free (m);
   while ((p = Fpoller) != NULL)
   {
     Fpoller = p->next;
@@ -146,15 +434,16 @@ int fpoller_task (void *parm)
 #include "dbuf.c"
 #include "xmln.c"
 #include "xml.c"
+#include "task.c"
 #include "queue.c"
 #include "fileq.c"
 #include "find.c"
 
-int ran = 0;
+int ran = 0, running = 0, stopped = 0;
 
 int phineas_running  ()
 {
-  return (ran++ < 3);
+  return (running || (ran++ < 3));
 }
 
 int test_processor (XML *xml, char *prefix, char *fname)
@@ -163,14 +452,132 @@ int test_processor (XML *xml, char *prefix, char *fname)
   return (0);
 }
 
+/*
+ * queue a row naming the file, and remove it
+ */
+QUEUEROW *test_row (XML *xml, char *prefix, char *fname)
+{
+  QUEUEROW *r;
+
+  r = queue_row_alloc (queue_find (xml_getf (xml, "%sQueue", prefix)));
+  queue_field_set (r, "PAYLOADFILE", basename (fname));
+  queue_field_set (r, "PROCESSINGSTATUS", "queued");
+  unlink (fname);
+  return (r);
+}
+
+#define TESTFILES 250
+
+/*
+ * drop test files in the first map's folder
+ */
+int test_files (XML *xml)
+{
+  int i;
+  FILE *fp;
+  char path[MAX_PATH];
+
+  for (i = 0; i < TESTFILES; i++)
+  {
+    ppathf (path, xml_get_text (xml, MAP "[0].Folder"), "fpoller%03d.test",
+      i);
+    if ((fp = fopen (path, "w")) == NULL)
+      fatal ("Can't create %s\n", path);
+    fprintf (fp, "test file %d\n", i);
+    fclose (fp);
+  }
+  return (0);
+}
+
+/*
+ * count test rows queued after rowid, checking they were queued
+ * in the order written
+ */
+int test_rows (QUEUE *q, int rowid)
+{
+  int n;
+  QUEUEROW *r;
+  char *ch, last[MAX_PATH];
+
+  *last = 0;
+  for (n = 0; (r = queue_next (q, rowid)) != NULL; n++)
+  {
+    ch = queue_field_get (r, "PAYLOADFILE");
+    if (strncmp (ch, "fpoller", 7))
+      error ("Unexpected row %d queued\n", r->rowid);
+    else if (strcmp (ch, last) <= 0)
+      error ("Row %d %s queued after %s\n", r->rowid, ch, last);
+    strcpy (last, ch);
+    rowid = r->rowid;
+    queue_row_free (r);
+  }
+  return (n);
+}
+
+/*
+ * the last rowid in a queue
+ */
+int test_last (QUEUE *q)
+{
+  int rowid;
+  QUEUEROW *r;
+
+  r = queue_prev (q, 0);
+  rowid = r == NULL ? 0 : r->rowid;
+  queue_row_free (r);
+  return (rowid);
+}
+
+void test_task (void *xml)
+{
+  fpoller_task ((XML *) xml);
+  stopped = 1;
+}
+
 int main (int argc, char **argv)
 {
+  int i, n;
   XML *xml;
+  QUEUE *q;
 
   xml = xml_parse (PhineasConfig);
+  loadpath (xml_get_text (xml, "Phineas.InstallDirectory"));
   queue_init (xml);
   fpoller_register ("ebxml", test_processor);
   fpoller_task (xml);
+  /*
+   * rows from a scan are queued in batches
+   */
+  debug ("batch queueing %d files...\n", TESTFILES);
+  test_files (xml);
+  q = queue_find (xml_get_text (xml, MAP "[0].Queue"));
+  i = test_last (q);
+  fpoller_register_rows ("ebxml", test_row);
+  fpoller_poll (xml, 0);
+  if ((n = test_rows (q, i)) != TESTFILES)
+    error ("Queued %d of %d files\n", n, TESTFILES);
+  /*
+   * a watched folder is polled well before the next full scan
+   */
+  debug ("watching for %d files...\n", TESTFILES);
+  xml_set_text (xml, "Phineas.Sender.PollInterval", "5");
+  running = 1;
+  t_start (test_task, xml);
+  sleep (500);
+  i = test_last (q);
+  test_files (xml);
+  for (n = 0; n < 20; n++)
+  {
+    if (test_rows (q, i) == TESTFILES)
+      break;
+    sleep (100);
+  }
+  if ((n = test_rows (q, i)) != TESTFILES)
+    error ("Watcher queued %d of %d files\n", n, TESTFILES);
+  running = 0;
+  while (!stopped)
+    sleep (100);
+  queue_shutdown ();
   xml_free (xml);
   info ("%s %s\n", argv[0], Errors ? "failed" : "passed");
   exit (Errors);
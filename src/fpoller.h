@@ -19,12 +19,20 @@
 #define __FPOLLER__
 
 #include "xml.h"
+#include "queue.h"
 
 /*
  * register a folder processor with a folder name
  */
 int fpoller_register (char *name, int (*proc)(XML *, char *, char *));
 
+/*
+ * register a folder row builder with a folder name, so each scan's
+ * rows are pushed together
+ */
+int fpoller_register_rows (char *name, 
+  QUEUEROW *(*row)(XML *, char *, char *));
+
 /*
  * Poll all folder maps...
  * a thread, expected to be started from the TASKQ.  Note you must
@@ -215,6 +215,7 @@ int phineas_start (int argc, char **argv)
   info ("%s is starting\n", Software);
   debug ("%d args - initializing network\n", argc);
   net_startup ();
+  ebxml_template_init ();
   debug ("loading queue configuration\n");
   debug ("initializing queues\n");
   if (queue_init (Config))
@@ -227,10 +228,11 @@ int phineas_start (int argc, char **argv)
 #endif
 #ifdef __SENDER__
   debug ("initializing sender\n");
-  fpoller_register ("ebxml", ebxml_fprocessor);
+  fpoller_register_rows ("ebxml", ebxml_frow);
   task_add (Taskq, fpoller_task, Config);
   sleep (1);
-  qpoller_register ("EbXmlSndQ", ebxml_qprocessor);
+  qpoller_register_stages ("EbXmlSndQ", EbxmlStages, EBXMLSTAGES,
+    ebxml_send_free);
   task_add (Taskq, qpoller_task, Config);
   sleep (1);
 #endif 
@@ -255,6 +257,7 @@ int phineas_stop ()
   debug ("shutting down queuing...\n");
   queue_shutdown ();
   debug ("freeing up configuration...\n");
+  ebxml_template_free ();
   cfg_free ();
   debug ("shutting down networking...\n");
   net_shutdown ();
@@ -825,6 +828,7 @@ w_logMessage ()
 w_statusMessage ()
 {
   char *ch;
+  long resumed, full;
   DBUF *b = dbuf_alloc ();
   /*
     if (ShellExecute (NULL, "open", "http://www.microsoft.com", 
@@ -846,6 +850,9 @@ w_statusMessage ()
   if (Taskq != NULL)
     dbuf_printf (b, "  %d running threads\n  %d waiting threads\n",
       task_running (Taskq), task_waiting (Taskq));
+  net_sslstats (&resumed, &full);
+  dbuf_printf (b, "  %ld resumed SSL handshakes\n  %ld full SSL handshakes\n",
+    resumed, full);
   MessageBox (NULL, dbuf_getbuf (b), Software, MB_OK);
   dbuf_free (b);
 }
@@ -32,13 +32,12 @@
 #include "log.h"
 #include "mime.h"
 #include "dbuf.h"
+#include "b64.h"
 
 #ifndef debug
 #define debug(fmt...)
 #endif
 
-int mime_format_part (MIME *mime, DBUF *b);
-
 /*
  * allocate a mime structure
  */
@@ -61,6 +60,8 @@ MIME *mime_free (MIME *m)
     free (m->headers);
   if (m->body != NULL)
     free (m->body);
+  if (m->fp != NULL)
+    fclose (m->fp);
   free (m);
   return (NULL);
 }
@@ -183,6 +184,26 @@ int mime_setBody (MIME *m, unsigned char *b, int len)
   return (len);
 }
 
+/*
+ * Use len bytes of a file from the current position as the body,
+ * base64 encoded if encode is set.  The body is read when the message
+ * is written, and the file is closed when the MIME is freed.  Sets
+ * Content-Length and returns the (encoded) body len.
+ */
+int mime_setFile (MIME *m, FILE *fp, long len, int encode)
+{
+  if (m->fp != NULL)
+    fclose (m->fp);
+  m->fp = fp;
+  m->offset = ftell (fp);
+  m->flen = len;
+  m->encode = encode;
+  if (encode)
+    len = b64_size (len, 76);
+  mime_setLength (m, m->len = len);
+  return (m->len);
+}
+
 /*
  * add a multipart chunk - multipart must be set
  */
@@ -394,40 +415,163 @@ int mime_size (MIME *m)
   return (sz + strlen (m->headers));
 }
 
+/*
+ * Formatted messages are written through a buffer to a caller's
+ * function, so bodies kept in files never need to be in memory
+ */
+#define MIMEOUTSZ 16384		/* output buffer, a full SSL record	*/
+#define MIMECHUNK (57 * 128)	/* file read size, whole b64 lines	*/
+
+typedef struct mimeout
+{
+  int (*write) (void *parm, char *buf, int len);
+  void *parm;
+  long sz;			/* bytes written so far			*/
+  int n;			/* bytes buffered			*/
+  char buf[MIMEOUTSZ];
+} MIMEOUT;
+
+/*
+ * write out anything buffered, return non-zero if it fails
+ */
+static int mime_flush (MIMEOUT *o)
+{
+  if (o->n && (o->write (o->parm, o->buf, o->n) != o->n))
+  {
+    debug ("failed writing %d bytes at %ld\n", o->n, o->sz);
+    return (-1);
+  }
+  o->sz += o->n;
+  o->n = 0;
+  return (0);
+}
+
+/*
+ * buffer len bytes for output, return non-zero if it fails
+ */
+static int mime_put (MIMEOUT *o, char *b, int len)
+{
+  int n;
+
+  while (len > 0)
+  {
+    if ((o->n == MIMEOUTSZ) && mime_flush (o))
+      return (-1);
+    if ((n = MIMEOUTSZ - o->n) > len)
+      n = len;
+    memcpy (o->buf + o->n, b, n);
+    o->n += n;
+    b += n;
+    len -= n;
+  }
+  return (0);
+}
+
+/*
+ * output a body kept in a file, encoding it if needed.  Since we
+ * always seek to the start of the body this may be repeated.
+ */
+static int mime_put_file (MIMEOUT *o, MIME *m)
+{
+  unsigned char buf[MIMECHUNK];
+  char enc[MIMECHUNK / 57 * 78 + 4];
+  long len;
+  int n;
+
+  if (fseek (m->fp, m->offset, SEEK_SET))
+    return (-1);
+  for (len = m->flen; len > 0; len -= n)
+  {
+    n = len < MIMECHUNK ? len : MIMECHUNK;
+    if (fread (buf, 1, n, m->fp) != n)
+    {
+      error ("MIME body file is short by %ld bytes\n", len);
+      return (-1);
+    }
+    if (m->encode)
+    {
+      if (mime_put (o, enc, b64_encode (enc, buf, n, 76)))
+	return (-1);
+    }
+    else if (mime_put (o, buf, n))
+      return (-1);
+  }
+  return (0);
+}
+
 /*
  * format a mime message - this is the recursive one, not intended
  * for external use.
  */
-int mime_format_part (MIME *m, DBUF *b)
+static int mime_put_part (MIMEOUT *o, MIME *m)
 {
   MIME *n;
   char boundary[100];
   int bl;
 
   mime_size (m);
-  dbuf_printf (b, "%s", m->headers);
-  dbuf_write (b, m->body, m->len);
+  if ((m->headers != NULL) && mime_put (o, m->headers, strlen (m->headers)))
+    return (-1);
+  if (m->fp != NULL)
+  {
+    if (mime_put_file (o, m))
+      return (-1);
+  }
+  else if (mime_put (o, m->body, m->len))
+    return (-1);
   // prefix boundary with CR
   boundary[0] = '\r';
   boundary[1] = '\n';
   if ((bl = mime_getBoundary (m, boundary + 2, 98) + 2) < 3)
-    return (dbuf_size (b));
+    return (0);
   boundary[bl++] = '\r';
   boundary[bl++] = '\n';
   for (n = m->next; n != NULL; n = n->next)
   {
-    debug ("adding next part at %d\n", dbuf_size (b));
-    dbuf_write (b, boundary, bl);
-    mime_format_part (n, b);
+    debug ("adding next part at %ld\n", o->sz + o->n);
+    if (mime_put (o, boundary, bl) || mime_put_part (o, n))
+      return (-1);
   }
-  debug ("adding final boundary at %d\n", dbuf_size (b));
-  dbuf_write (b, boundary, bl - 2);
-  dbuf_write (b, "--\r\n", 4);
-  debug ("final size is %d\n", dbuf_size (b));
-  debug ("actual size is %d (%d/%d)\n",
-      strlen (dbuf_getbuf(b)), strlen (m->headers), 
-      strlen (dbuf_getbuf(b)) - strlen (m->headers));
-  return (dbuf_size (b));
+  debug ("adding final boundary at %ld\n", o->sz + o->n);
+  if (mime_put (o, boundary, bl - 2) || mime_put (o, "--\r\n", 4))
+    return (-1);
+  return (0);
+}
+
+/*
+ * Write a formatted MIME message using fn, which is passed parm and
+ * should return the number of bytes written.  The optional preamble 
+ * (e.g. an HTTP request line) is written first.  Returns the total 
+ * size written or -1 if fn fails.
+ */
+long mime_write (MIME *m, char *preamble,
+  int (*fn) (void *parm, char *buf, int len), void *parm)
+{
+  MIMEOUT *o;
+  long sz;
+
+  o = (MIMEOUT *) malloc (sizeof (MIMEOUT));
+  o->write = fn;
+  o->parm = parm;
+  o->sz = 0;
+  o->n = 0;
+  if (((preamble != NULL) && mime_put (o, preamble, strlen (preamble)))
+    || mime_put_part (o, m) || mime_flush (o))
+    sz = -1;
+  else
+    sz = o->sz;
+  debug ("final size is %ld\n", sz);
+  free (o);
+  return (sz);
+}
+
+/*
+ * mime_write() function for formatting to a DBUF
+ */
+static int mime_dbuf (void *b, char *buf, int len)
+{
+  dbuf_write ((DBUF *) b, buf, len);
+  return (len);
 }
 
 /*
@@ -439,15 +583,157 @@ char *mime_format (MIME *m)
   DBUF *b;
 
   b = dbuf_alloc ();
-  mime_format_part (m, b);
+  mime_write (m, NULL, mime_dbuf, b);
   return (dbuf_extract (b));
 }
 
+/*
+ * Spooled messages...
+ *
+ * Large multipart bodies may be kept in a file instead of memory.
+ * These find the parts in that file using a bounded buffer, and
+ * let us load just the headers, or the whole of a (small) part.
+ */
+#define MIMEBUFSZ 8192
+
+/*
+ * Find the parts of a multipart body in a file, starting at the
+ * current file position.  The boundary is as returned by 
+ * mime_getBoundary().  Fills in the file offset where each part
+ * starts (after it's boundary line) and ends (before the line break
+ * ahead of the next boundary) for up to max parts.  Returns the 
+ * number of parts found, or -1 if the closing boundary is missing.
+ */
+int mime_findParts (FILE *fp, char *boundary, long *start, long *end,
+  int max)
+{
+  char *ch, 
+       buf[MIMEBUFSZ], 
+       pat[100];
+  long base;
+  int i, j, l, n, parts;
+
+  *pat = '\n';
+  strncpy (pat + 1, boundary, 98);
+  pat[99] = 0;
+  l = strlen (pat);
+  /*
+   * the body may start with a boundary, so prime the buffer with
+   * the line break that ended the headers
+   */
+  base = ftell (fp) - 1;
+  *buf = '\n';
+  n = 1;
+  i = parts = 0;
+  while (1)
+  {
+    n += fread (buf + n, 1, MIMEBUFSZ - n, fp);
+    while (i + l + 2 <= n)
+    {
+      if ((ch = memchr (buf + i, '\n', n - i - l - 1)) == NULL)
+      {
+	i = n - l - 1;
+	break;
+      }
+      i = ch - buf;
+      if (memcmp (buf + i, pat, l))
+      {
+	i++;
+	continue;
+      }
+      if (parts && (parts <= max))
+	end[parts - 1] = base + i - ((i && (buf[i - 1] == '\r')) ? 1 : 0);
+      if ((buf[i + l] == '-') && (buf[i + l + 1] == '-'))
+      {
+	debug ("found %d parts\n", parts);
+	return (parts);
+      }
+      if ((ch = memchr (buf + i + l, '\n', n - i - l)) == NULL)
+	break;
+      if (parts < max)
+	start[parts] = base + (ch - buf) + 1;
+      parts++;
+      i = ch - buf + 1;
+    }
+    if (feof (fp) || ferror (fp))
+      break;
+    /*
+     * keep what we haven't checked yet, plus the character before
+     * it for the CR check
+     */
+    if ((j = i - 1) < 1)
+    {
+      if (n == MIMEBUFSZ)		/* boundary line too long	*/
+	break;
+      continue;
+    }
+    memmove (buf, buf + j, n - j);
+    n -= j;
+    base += j;
+    i -= j;
+  }
+  debug ("closing boundary not found\n");
+  return (-1);
+}
+
+/*
+ * Read just the headers of a part in a file at offset.  Returns
+ * a MIME with the headers set and sets body to the offset where 
+ * the part's body starts, or NULL if the headers aren't found.
+ */
+MIME *mime_readHeaders (FILE *fp, long offset, long *body)
+{
+  char *ch, buf[MIMEBUFSZ];
+  int n;
+  MIME *m;
+
+  if (fseek (fp, offset, SEEK_SET))
+    return (NULL);
+  n = fread (buf, 1, MIMEBUFSZ - 1, fp);
+  buf[n] = 0;
+  if ((ch = strstr (buf, "\n\r\n")) != NULL)
+    ch += 3;
+  else if ((ch = strstr (buf, "\n\n")) != NULL)
+    ch += 2;
+  else
+  {
+    debug ("headers not found\n");
+    return (NULL);
+  }
+  *body = offset + (ch - buf);
+  *ch = 0;
+  m = mime_alloc ();
+  m->headers = (char *) malloc (ch - buf + 1);
+  strcpy (m->headers, buf);
+  return (m);
+}
+
+/*
+ * Read and parse a part of a file from start up to end. Intended
+ * for parts small enough to keep in memory.
+ */
+MIME *mime_readPart (FILE *fp, long start, long end)
+{
+  char *buf;
+  int n;
+  MIME *m;
+
+  if ((end <= start) || fseek (fp, start, SEEK_SET))
+    return (NULL);
+  buf = (char *) malloc (end - start + 1);
+  n = fread (buf, 1, end - start, fp);
+  buf[n] = 0;
+  m = mime_parse (buf);
+  free (buf);
+  return (m);
+}
 
 #ifdef UNITTEST
 #undef UNITTEST
 #undef debug
 #include "dbuf.c"
+#include "util.c"
+#include "b64.c"
 
 #define MNAME "../examples/request.txt"
 char *SimpleTest =
@@ -530,9 +816,133 @@ void test_multipart ()
   free (buf);
 }
 
+/*
+ * check we find the same parts in a spooled file that we parse
+ */
+void test_spool ()
+{
+  FILE *fp;
+  MIME *m, *h, *part;
+  char *buf, *body, boundary[100];
+  long start[4], end[4], offset;
+  int i, n, len;
+
+  if ((buf = readfile (MNAME, &len)) == NULL)
+  {
+    error ("Can't read %s\n", MNAME);
+    return;
+  }
+  if ((m = mime_parse (buf)) == NULL)
+  {
+    error ("Failed parsing %s\n", MNAME);
+    free (buf);
+    return;
+  }
+  if ((body = strstr (buf, "\n\r\n")) != NULL)
+    body += 3;
+  else
+    body = strstr (buf, "\n\n") + 2;
+  fp = tmpfile ();
+  fwrite (body, 1, len - (body - buf), fp);
+  rewind (fp);
+  mime_getBoundary (m, boundary, 100);
+  if ((n = mime_findParts (fp, boundary, start, end, 4)) != 2)
+    error ("Found %d spooled parts, expected 2\n", n);
+  for (i = 0; i < n; i++)
+  {
+    part = mime_getMultiPart (m, i + 1);
+    if ((h = mime_readHeaders (fp, start[i], &offset)) == NULL)
+    {
+      error ("Can't read headers for spooled part %d\n", i + 1);
+      continue;
+    }
+    if (strncmp (mime_getHeader (h, MIME_CONTENTID),
+      mime_getHeader (part, MIME_CONTENTID), 20))
+      error ("Spooled part %d headers don't match\n", i + 1);
+    if (memcmp (mime_getBody (part), body + offset, end[i] - offset))
+      error ("Spooled part %d body doesn't match\n", i + 1);
+    mime_free (h);
+    if ((h = mime_readPart (fp, start[i], end[i])) == NULL)
+      error ("Can't read spooled part %d\n", i + 1);
+    mime_free (h);
+  }
+  fclose (fp);
+  mime_free (m);
+  free (buf);
+}
+
+/*
+ * mime_write() function that fails after a few writes
+ */
+int test_writer (void *parm, char *buf, int len)
+{
+  if (--*(int *) parm < 0)
+    return (-1);
+  return (len);
+}
+
+/*
+ * check a body kept in a file writes the same as one in memory
+ */
+void test_file ()
+{
+  FILE *fp;
+  MIME *m, *f;
+  char *data, *enc, *buf, *fbuf;
+  int i, len, n;
+
+  len = 100000;
+  data = (char *) malloc (len);
+  for (i = 0; i < len; i++)
+    data[i] = i * 7 + i / 251;
+  enc = (char *) malloc (b64_size (len, 76) + 1);
+  n = b64_encode (enc, data, len, 76);
+  fp = tmpfile ();
+  fwrite ("prefix", 1, 6, fp);
+  fwrite (data, 1, len, fp);
+  fseek (fp, 6, SEEK_SET);
+
+  m = mime_alloc ();
+  mime_setBoundary (m, "type=\"text/xml\";");
+  f = mime_alloc ();
+  mime_setHeader (f, MIME_CONTENT, MIME_OCTET, 99);
+  mime_setHeader (f, MIME_ENCODING, MIME_BASE64, 99);
+  mime_setBody (f, enc, n);
+  mime_setMultiPart (m, f);
+  buf = mime_format (m);
+
+  mime_free (m->next);
+  m->next = NULL;
+  f = mime_alloc ();
+  mime_setHeader (f, MIME_CONTENT, MIME_OCTET, 99);
+  mime_setHeader (f, MIME_ENCODING, MIME_BASE64, 99);
+  if (mime_setFile (f, fp, len, 1) != n)
+    error ("file body length %d expected %d\n", f->len, n);
+  mime_setMultiPart (m, f);
+  i = mime_size (m);
+  fbuf = mime_format (m);
+  if ((strlen (fbuf) != i) || strcmp (buf, fbuf))
+    error ("file body formatted differently\n");
+  free (fbuf);
+  /* again, since a retry must send the same thing		*/
+  fbuf = mime_format (m);
+  if (strcmp (buf, fbuf))
+    error ("file body formatted differently the second time\n");
+  free (fbuf);
+  n = 3;
+  if (mime_write (m, "POST / HTTP/1.1\r\n", test_writer, &n) >= 0)
+    error ("write failure not returned\n");
+  free (buf);
+  free (enc);
+  free (data);
+  mime_free (m);
+}
+
 int main (int argc, char **argv)
 {
   test_multipart ();
+  test_spool ();
+  test_file ();
   info ("%s %s\n", argv[0], Errors?"failed":"passed");
   exit (Errors);
 }
@@ -40,6 +40,10 @@ typedef struct mime
   int len;
   char *headers;
   unsigned char *body;
+  FILE *fp;			/* or the body is kept in this file	*/
+  long offset;			/* starting here			*/
+  long flen;			/* for this many bytes			*/
+  int encode;			/* base64 encoded when written		*/
 } MIME;
 
 /*
@@ -99,6 +103,13 @@ unsigned char *mime_getBody (MIME *mime);
  * if incoming len < 1, use the buffer string length
  */
 int mime_setBody (MIME *mime, unsigned char *body, int len);
+/*
+ * Use len bytes of a file from the current position as the body,
+ * base64 encoded if encode is set.  The body is read when the message
+ * is written, and the file is closed when the MIME is freed.  Sets
+ * Content-Length and returns the (encoded) body len.
+ */
+int mime_setFile (MIME *mime, FILE *fp, long len, int encode);
 /*
  * Get the size of the formatted mime message.
  * Sets the Content-Length in the header...
@@ -109,5 +120,30 @@ int mime_size (MIME *m);
  * is responsible for freeing this buffer.
  */
 char *mime_format (MIME *mime);
+/*
+ * Write a formatted MIME message using fn, which is passed parm and
+ * should return the number of bytes written.  The optional preamble 
+ * (e.g. an HTTP request line) is written first.  Returns the total 
+ * size written or -1 if fn fails.
+ */
+long mime_write (MIME *mime, char *preamble,
+  int (*fn) (void *parm, char *buf, int len), void *parm);
+/*
+ * Find the parts of a multipart body in a file, starting at the
+ * current file position, filling in the start and end offsets for
+ * up to max parts.  Returns the number of parts or -1 if the closing
+ * boundary is missing.
+ */
+int mime_findParts (FILE *fp, char *boundary, long *start, long *end,
+  int max);
+/*
+ * Read just the headers of a part in a file at offset and set body
+ * to the offset where that part's body starts.
+ */
+MIME *mime_readHeaders (FILE *fp, long offset, long *body);
+/*
+ * Read and parse a (small) part of a file from start up to end.
+ */
+MIME *mime_readPart (FILE *fp, long start, long end);
 
 #endif /* __MIME__ */
@@ -20,7 +20,9 @@
 #include "unittest.h"
 #endif
 
+#include <sys/stat.h>
 #include "log.h"
+#include "task.h"
 #include "net.h"
 #include "openssl/err.h"
 #include "crypt.h"
@@ -33,6 +35,44 @@
 #define REASON ERR_error_string (ERR_get_error (), NULL)
 #define SSLREASON(e) ssl_error (conn->ssl,e)
 
+/*
+ * SSL contexts cached by name, along with what they were built from
+ */
+typedef struct netctx
+{
+  struct netctx *next;
+  SSL_CTX *ctx;
+  char *name;			/* cache key (route, server...)		*/
+  char *args;			/* cert, key, password, and authority	*/
+  time_t mtime[3];		/* cert, key, and authority file times	*/
+} NETCTX;
+
+/*
+ * the last SSL session for a cached context (e.g. a route) and a
+ * client connection's address:port
+ */
+typedef struct netsess
+{
+  struct netsess *next;
+  SSL_CTX *ctx;			/* context it was negotiated with	*/
+  SSL_SESSION *sess;
+  char *key;			/* context name and address:port	*/
+} NETSESS;
+
+/*
+ * idle client connections, SSL contexts, and sessions kept for reuse
+ */
+typedef struct netpool
+{
+  MUTEX mutex;
+  NETCON *idle;			/* most recently pooled first		*/
+  NETCTX *ctx;			/* cached SSL contexts			*/
+  NETSESS *sess;		/* client SSL sessions			*/
+  long resumed, full;		/* SSL handshake counts			*/
+} NETPOOL;
+
+NETPOOL *NetPool = NULL;
+
 /*
  * get ssl error message
  */
@@ -61,6 +101,12 @@ int net_startup (void)
 {
   WSADATA wsadata;
 
+  if (NetPool == NULL)
+  {
+    NetPool = (NETPOOL *) malloc (sizeof (NETPOOL));
+    memset (NetPool, 0, sizeof (NETPOOL));
+    init_mutex (NetPool);
+  }
   if ((gethostbyname ("localhost") != NULL) ||
       (WSAGetLastError () != WSANOTINITIALISED))
   {
@@ -84,10 +130,185 @@ int net_startup (void)
  */
 int net_shutdown (void)
 {
+  NETCON *conn;
+  NETSESS *s;
+
+  if (NetPool != NULL)
+  {
+    while ((conn = NetPool->idle) != NULL)
+    {
+      NetPool->idle = conn->next;
+      net_close (conn);
+    }
+    net_ctx_flush ();
+    info ("%ld resumed and %ld full SSL handshakes\n", 
+      NetPool->resumed, NetPool->full);
+    destroy_mutex (NetPool);
+    free (NetPool);
+    NetPool = NULL;
+  }
   WSACleanup ();
   return (0);
 }
 
+/*
+ * Format the session key for a client connection using a cached
+ * context, or return NULL if the context isn't (or is no longer)
+ * cached.  The pool must be locked.
+ */
+static char *net_sess_key (NETCON *conn, SSL_CTX *ctx, char *key)
+{
+  NETCTX *c;
+
+  for (c = NetPool->ctx; c != NULL; c = c->next)
+  {
+    if (c->ctx == ctx)
+      break;
+  }
+  if (c == NULL)
+    return (NULL);
+  snprintf (key, MAX_PATH, "%s|%s:%d", c->name, 
+    inet_ntoa (conn->sin.sin_addr), ntohs (conn->sin.sin_port));
+  return (key);
+}
+
+/*
+ * Drop the sessions negotiated with a context, when it is replaced
+ * or flushed from the cache.  The pool must be locked.
+ */
+static void net_sess_drop (SSL_CTX *ctx)
+{
+  NETSESS *s, **prev;
+
+  prev = &NetPool->sess;
+  while ((s = *prev) != NULL)
+  {
+    if (s->ctx != ctx)
+    {
+      prev = &s->next;
+      continue;
+    }
+    *prev = s->next;
+    SSL_SESSION_free (s->sess);
+    free (s->key);
+    free (s);
+  }
+}
+
+/*
+ * Save a newly negotiated client session for reuse.  Called by
+ * OpenSSL, which may be after the handshake (e.g. TLS 1.3 tickets).
+ * Sessions are only kept for cached contexts, so they are dropped
+ * with the context.
+ */
+static int net_sess_new (SSL *ssl, SSL_SESSION *sess)
+{
+  NETCON *conn;
+  NETSESS *s;
+  char key[MAX_PATH];
+
+  if ((NetPool == NULL) || 
+    ((conn = (NETCON *) SSL_get_app_data (ssl)) == NULL))
+    return (0);
+  wait_mutex (NetPool);
+  if (net_sess_key (conn, SSL_get_SSL_CTX (ssl), key) == NULL)
+  {
+    end_mutex (NetPool);
+    return (0);
+  }
+  for (s = NetPool->sess; s != NULL; s = s->next)
+  {
+    if (strcmp (s->key, key) == 0)
+      break;
+  }
+  if (s == NULL)
+  {
+    s = (NETSESS *) malloc (sizeof (NETSESS));
+    s->key = strdup (key);
+    s->next = NetPool->sess;
+    NetPool->sess = s;
+  }
+  else
+    SSL_SESSION_free (s->sess);
+  s->ctx = SSL_get_SSL_CTX (ssl);
+  s->sess = sess;
+  end_mutex (NetPool);
+  debug ("saved SSL session for %s\n", key);
+  return (1);
+}
+
+/*
+ * offer the last session for this connection's context and peer
+ */
+static void net_sess_set (NETCON *conn, SSL_CTX *ctx)
+{
+  NETSESS *s;
+  char key[MAX_PATH];
+
+  SSL_set_app_data (conn->ssl, conn);
+  if (NetPool == NULL)
+    return;
+  wait_mutex (NetPool);
+  if (net_sess_key (conn, ctx, key) != NULL)
+  {
+    for (s = NetPool->sess; s != NULL; s = s->next)
+    {
+      if ((strcmp (s->key, key) == 0) && (s->ctx == ctx))
+      {
+	SSL_set_session (conn->ssl, s->sess);
+	break;
+      }
+    }
+  }
+  end_mutex (NetPool);
+}
+
+/*
+ * count a completed handshake
+ */
+static void net_sess_count (NETCON *conn)
+{
+  if (NetPool == NULL)
+    return;
+  wait_mutex (NetPool);
+  if (SSL_session_reused (conn->ssl))
+    NetPool->resumed++;
+  else
+    NetPool->full++;
+  end_mutex (NetPool);
+}
+
+/*
+ * get counts of resumed and full SSL handshakes
+ */
+void net_sslstats (long *resumed, long *full)
+{
+  *resumed = *full = 0;
+  if (NetPool == NULL)
+    return;
+  wait_mutex (NetPool);
+  *resumed = NetPool->resumed;
+  *full = NetPool->full;
+  end_mutex (NetPool);
+}
+
+/*
+ * set up a server's SSL session cache - size and timeout (seconds)
+ * of 0 leave the defaults
+ */
+void net_sess_cache (SSL_CTX *ctx, long size, long timeout)
+{
+  SSL_CTX_set_session_cache_mode (ctx, SSL_SESS_CACHE_SERVER);
+  SSL_CTX_set_session_id_context (ctx, (unsigned char *) "Phineas", 7);
+  if (size > 0)
+    SSL_CTX_sess_set_cache_size (ctx, size);
+  if (timeout > 0)
+    SSL_CTX_set_timeout (ctx, timeout);
+#ifdef SSL_OP_NO_TICKET
+  SSL_CTX_clear_options (ctx, SSL_OP_NO_TICKET);
+#endif
+}
+
 /*
  * Get an ssl context.  Note that if an auth file is provided,
  * peer verification is turned on automatically.
@@ -165,6 +386,16 @@ SSL_CTX *net_ctx (char *cert, char *key, char *passwd,
    * don't bother us about re-negotiations!
    */
   SSL_CTX_set_mode (ctx, SSL_MODE_AUTO_RETRY);
+  /*
+   * clients keep their sessions in our pool by peer, to resume them
+   * on the next connection
+   */
+  if (!is_server)
+  {
+    SSL_CTX_set_session_cache_mode (ctx, 
+      SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+    SSL_CTX_sess_set_new_cb (ctx, net_sess_new);
+  }
   return (ctx);
 
 fail:
@@ -172,6 +403,133 @@ fail:
   return (NULL);
 }
 
+/*
+ * add a reference to an SSL context, so both the cache and those
+ * using it may free it
+ */
+SSL_CTX *net_ctx_ref (SSL_CTX *ctx)
+{
+  if (ctx != NULL)
+#if (OPENSSL_VERSION_NUMBER >= 0x10100000L)
+    SSL_CTX_up_ref (ctx);
+#else
+    CRYPTO_add (&ctx->references, 1, CRYPTO_LOCK_SSL_CTX);
+#endif
+  return (ctx);
+}
+
+/*
+ * get the modification time of a context file, or 0 if none
+ */
+static time_t net_ctx_mtime (char *path)
+{
+  struct stat st;
+
+  if ((path == NULL) || (*path == 0) || stat (path, &st))
+    return (0);
+  return (st.st_mtime);
+}
+
+/*
+ * Build a context for net_ctx_get(), with it's session cache set up
+ * if it's for a server.
+ */
+static SSL_CTX *net_ctx_build (char *cert, char *key, char *passwd,
+    char *auth, int is_server, long cachesize, long timeout)
+{
+  SSL_CTX *ctx;
+
+  if (((ctx = net_ctx (cert, key, passwd, auth, is_server)) != NULL) &&
+    is_server)
+    net_sess_cache (ctx, cachesize, timeout);
+  return (ctx);
+}
+
+/*
+ * Get a cached SSL context by name, building it with net_ctx() if 
+ * needed or if the arguments or their files have changed since it
+ * was built.  A server's session cache is set up as it is built, 
+ * so those sharing it needn't.  The caller should SSL_CTX_free() it
+ * when done.
+ */
+SSL_CTX *net_ctx_get (char *name, char *cert, char *key, char *passwd,
+    char *auth, int is_server, long cachesize, long timeout)
+{
+  NETCTX *c, **prev;
+  SSL_CTX *ctx;
+  time_t mtime[3];
+  char args[MAX_PATH * 4];
+
+  if (NetPool == NULL)
+    return (net_ctx_build (cert, key, passwd, auth, is_server,
+      cachesize, timeout));
+  snprintf (args, sizeof (args), "%d|%ld|%ld|%s|%s|%s|%s", is_server,
+    cachesize, timeout, cert == NULL ? "" : cert, key == NULL ? "" : key,
+    passwd == NULL ? "" : passwd, auth == NULL ? "" : auth);
+  mtime[0] = net_ctx_mtime (cert);
+  mtime[1] = net_ctx_mtime (key);
+  mtime[2] = net_ctx_mtime (auth);
+  wait_mutex (NetPool);
+  for (prev = &NetPool->ctx; (c = *prev) != NULL; prev = &c->next)
+  {
+    if (strcmp (c->name, name) == 0)
+      break;
+  }
+  if (c != NULL)
+  {
+    if ((strcmp (c->args, args) == 0) && 
+      (memcmp (c->mtime, mtime, sizeof (mtime)) == 0))
+    {
+      ctx = net_ctx_ref (c->ctx);
+      end_mutex (NetPool);
+      return (ctx);
+    }
+    debug ("SSL context for %s changed\n", name);
+    *prev = c->next;
+    net_sess_drop (c->ctx);
+    SSL_CTX_free (c->ctx);
+    free (c->name);
+    free (c->args);
+    free (c);
+  }
+  info ("Initializing SSL context for %s\n", name);
+  if ((ctx = net_ctx_build (cert, key, passwd, auth, is_server,
+    cachesize, timeout)) != NULL)
+  {
+    c = (NETCTX *) malloc (sizeof (NETCTX));
+    c->ctx = net_ctx_ref (ctx);
+    c->name = strdup (name);
+    c->args = strdup (args);
+    memcpy (c->mtime, mtime, sizeof (mtime));
+    c->next = NetPool->ctx;
+    NetPool->ctx = c;
+  }
+  end_mutex (NetPool);
+  return (ctx);
+}
+
+/*
+ * drop all cached SSL contexts and their sessions
+ */
+void net_ctx_flush (void)
+{
+  NETCTX *c;
+
+  if (NetPool == NULL)
+    return;
+  wait_mutex (NetPool);
+  while ((c = NetPool->ctx) != NULL)
+  {
+    NetPool->ctx = c->next;
+    net_sess_drop (c->ctx);
+    SSL_CTX_free (c->ctx);
+    free (c->name);
+    free (c->args);
+    free (c);
+  }
+  end_mutex (NetPool);
+}
+
 /*
  * open a network connection - if we are a server, set it to listen,
  * otherwise go ahead and connect and complete SSL negotiations
@@ -298,6 +656,7 @@ NETCON *net_ssl (NETCON *conn, SSL_CTX *ctx, int is_server)
   }
   else
   {
+    net_sess_set (conn, ctx);
     if ((e = SSL_connect (conn->ssl)) != 1)
     {
       error ("Can't complete SSL connection - %s\n", SSLREASON (e));
@@ -314,6 +673,7 @@ NETCON *net_ssl (NETCON *conn, SSL_CTX *ctx, int is_server)
      */
     debug ("Completed SSL client negotiations\n");
   }
+  net_sess_count (conn);
   return (conn);
 }
 
@@ -366,24 +726,84 @@ int net_timeout (NETCON *conn, int timeout)
 }
 
 /*
- * read amount of data still available on this socket
+ * read amount of data still available on this socket, including
+ * whatever is left in our read buffer
  */
 unsigned long net_available (NETCON *conn)
 {
   unsigned long n;
 
   if (ioctlsocket (conn->sock, FIONREAD, &n))
-    return (0);
-  return n;
+    n = 0;
+  if (conn->ssl != NULL)
+    n += SSL_pending (conn->ssl);
+  return (n + conn->rlen - conn->rpos);
 }
 
 /*
- * read from a socket
+ * do a single read from a socket, returning the number of bytes
+ * read, 0 if closed or failed, or -1 if it would block
  *
  * note that the other end may have closed the connection or we
  * may have timed out or when we get here, so we don't complain about
  * IO errors (SSL_ERROR_SYSCALL).
  */
+static int net_recv (NETCON *conn, char *buf, int sz)
+{
+  int n;
+
+  if (conn->ssl != NULL)
+  {
+    if ((n = SSL_read (conn->ssl, buf, sz)) <= 0)
+    {
+      int e = SSL_get_error (conn->ssl, n);
+      if ((e == SSL_ERROR_WANT_READ) || (e == SSL_ERROR_WANT_WRITE))
+	return (-1);
+      if (e != SSL_ERROR_ZERO_RETURN)
+      {
+	if (e != SSL_ERROR_SYSCALL) 
+	  error ("read error %d - %s\n", e, SSLREASON (n));
+	else
+	  debug ("read EOF\n");
+      }
+      n = 0;
+    }
+  }
+  else
+  {
+    if ((n = recv (conn->sock, buf, sz, 0)) < 0)
+    {
+      if (h_errno == WSAEWOULDBLOCK)
+	return (-1);
+      if (h_errno && (h_errno != WSAETIMEDOUT))
+        error ("read error %d - %s\n", h_errno, strerror (h_errno));
+      n = 0;
+    }
+  }
+  return (n);
+}
+
+/*
+ * refill an empty read buffer, returning the number of bytes now
+ * buffered or 0 on EOF, timeout, or error
+ */
+static int net_fill (NETCON *conn)
+{
+  int n;
+
+  conn->rpos = conn->rlen = 0;
+  if ((n = net_recv (conn, conn->rbuf, NETBUFSZ)) <= 0)
+    return (0);
+  return (conn->rlen = n);
+}
+
+/*
+ * read from a socket
+ *
+ * Anything already buffered is returned first.  Small reads go
+ * through the connection read buffer, large ones directly into
+ * the caller's buffer.
+ */
 int net_read (NETCON *conn, char *buf, int sz)
 {
   int n, rsz;
@@ -391,35 +811,157 @@ int net_read (NETCON *conn, char *buf, int sz)
   rsz = 0;
   while (n = sz - rsz)
   {
-    if (conn->ssl != NULL)
+    if (conn->rpos < conn->rlen)
     {
-      if ((n = SSL_read (conn->ssl, buf + rsz, n)) <= 0)
-      {
-	int e = SSL_get_error (conn->ssl, n);
-	if (e != SSL_ERROR_ZERO_RETURN)
-	{
-	  if (e != SSL_ERROR_SYSCALL) 
-	    error ("read error %d - %s\n", e, SSLREASON (n));
-	  else
-	    debug ("read EOF\n");
-	}
-	break;
-      }
+      if (n > conn->rlen - conn->rpos)
+	n = conn->rlen - conn->rpos;
+      memcpy (buf + rsz, conn->rbuf + conn->rpos, n);
+      conn->rpos += n;
     }
-    else
+    else if (n < NETBUFSZ)
     {
-      if ((n = recv (conn->sock, buf + rsz, n, 0)) <= 0)
-      {
-        if (h_errno && (h_errno != WSAETIMEDOUT))
-          error ("read error %d - %s\n", h_errno, strerror (h_errno));
-        break;
-      }
+      if (net_fill (conn) == 0)
+	break;
+      continue;
     }
+    else if ((n = net_recv (conn, buf + rsz, n)) <= 0)
+      break;
+    rsz += n;
+  }
+  return (rsz);
+}
+
+/*
+ * read a line from a socket into buf, including the newline if
+ * it fits, and NUL terminate it.  Return the length read or 0
+ * on EOF, timeout, or error.
+ */
+int net_gets (NETCON *conn, char *buf, int sz)
+{
+  int n, rsz;
+  char *ch;
+
+  rsz = 0;
+  sz--;
+  while (rsz < sz)
+  {
+    if ((conn->rpos >= conn->rlen) && (net_fill (conn) == 0))
+      break;
+    n = conn->rlen - conn->rpos;
+    if (n > sz - rsz)
+      n = sz - rsz;
+    ch = conn->rbuf + conn->rpos;
+    if ((ch = memchr (ch, '\n', n)) != NULL)
+      n = ch - conn->rbuf - conn->rpos + 1;
+    memcpy (buf + rsz, conn->rbuf + conn->rpos, n);
+    conn->rpos += n;
     rsz += n;
+    if (ch != NULL)
+      break;
   }
+  buf[rsz] = 0;
   return (rsz);
 }
 
+/*
+ * Read whatever is available into the connection read buffer 
+ * without consuming it.  Intended for non-blocking connections.
+ * Return the number of bytes added, 0 if closed, or -1 if there was
+ * nothing to read (or no room for it).
+ */
+int net_buffer (NETCON *conn)
+{
+  int n;
+
+  if (conn->rpos)
+  {
+    memmove (conn->rbuf, conn->rbuf + conn->rpos, conn->rlen - conn->rpos);
+    conn->rlen -= conn->rpos;
+    conn->rpos = 0;
+  }
+  if (conn->rlen == NETBUFSZ)
+    return (-1);
+  if ((n = net_recv (conn, conn->rbuf + conn->rlen, 
+    NETBUFSZ - conn->rlen)) > 0)
+    conn->rlen += n;
+  return (n);
+}
+
+/*
+ * Point buf at the unread data in the connection read buffer and
+ * return it's length.
+ */
+int net_peek (NETCON *conn, char **buf)
+{
+  *buf = conn->rbuf + conn->rpos;
+  return (conn->rlen - conn->rpos);
+}
+
+/*
+ * set a connection blocking or not
+ */
+int net_nonblock (NETCON *conn, int on)
+{
+  unsigned long arg = on;
+
+  if (ioctlsocket (conn->sock, FIONBIO, &arg))
+  {
+    error ("Can't set blocking mode on socket!\n");
+    return (-1);
+  }
+  return (0);
+}
+
+/*
+ * Take the next step of SSL negotiations on a non-blocking 
+ * connection.  Return 0 when completed, NETWANTREAD or NETWANTWRITE
+ * if waiting on the socket, or -1 if it failed.
+ */
+int net_handshake (NETCON *conn, SSL_CTX *ctx, int is_server)
+{
+  int e;
+
+  if (conn->ssl == NULL)
+  {
+    debug ("starting SSL negotiations\n");
+    if ((conn->ssl = (SSL *) SSL_new (ctx)) == NULL)
+    {
+      error ("Can't establish SSL context - %s\n", REASON);
+      return (-1);
+    }
+    if (SSL_set_fd (conn->ssl, conn->sock) == 0)
+    {
+      error ("Can't set SSL sockets\n");
+      return (-1);
+    }
+    if (is_server)
+      SSL_set_accept_state (conn->ssl);
+    else
+    {
+      net_sess_set (conn, ctx);
+      SSL_set_connect_state (conn->ssl);
+    }
+  }
+  if ((e = SSL_do_handshake (conn->ssl)) == 1)
+  {
+    debug ("Completed SSL negotiations\n");
+    net_sess_count (conn);
+    return (0);
+  }
+  switch (SSL_get_error (conn->ssl, e))
+  {
+    case SSL_ERROR_WANT_READ : return (NETWANTREAD);
+    case SSL_ERROR_WANT_WRITE : return (NETWANTWRITE);
+    default : break;
+  }
+  if (e)
+    error ("Can't complete SSL %s - %s\n", 
+      is_server ? "accept" : "connection", SSLREASON (e));
+  else
+    debug ("EOF on SSL handshake\n");
+  return (-1);
+}
+
 /*
  * write to a socket
  */
@@ -432,6 +974,72 @@ int net_write (NETCON *conn, char *buf, int sz)
   return (sz);
 }
 
+/*
+ * Gather and write a list of buffers.  Plain sockets hand the list
+ * to WSASend().  SSL has no gather write, so pieces are coalesced
+ * in a buffer of NETBUFSZ (the largest SSL record) that is written
+ * as it fills, and a large piece that is left is written straight
+ * from the caller's buffer.
+ */
+#define NETVECMAX 16		/* buffers per WSASend()		*/
+
+int net_writev (NETCON *conn, NETVEC *v, int n)
+{
+  int i, l, sz, total;
+  char *p;
+  DWORD sent;
+  WSABUF w[NETVECMAX];
+  char buf[NETBUFSZ];
+
+  if (n == 1)
+    return (net_write (conn, v->buf, v->len));
+  total = 0;
+  if (conn->ssl == NULL)
+  {
+    for (i = 0; i < n; i += l)
+    {
+      for (l = 0; (l < NETVECMAX) && (i + l < n); l++)
+      {
+	w[l].buf = v[i + l].buf;
+	w[l].len = v[i + l].len;
+      }
+      if (WSASend (conn->sock, w, l, &sent, 0, NULL, NULL))
+	return (-1);
+      total += sent;
+    }
+    return (total);
+  }
+  for (i = l = 0; i < n; i++)
+  {
+    p = v[i].buf;
+    sz = v[i].len;
+    if (l && (sz > NETBUFSZ - l))	/* top off and send the buffer	*/
+    {
+      memcpy (buf + l, p, NETBUFSZ - l);
+      p += NETBUFSZ - l;
+      sz -= NETBUFSZ - l;
+      if (net_write (conn, buf, NETBUFSZ) != NETBUFSZ)
+	return (-1);
+      total += NETBUFSZ;
+      l = 0;
+    }
+    if (sz >= NETBUFSZ)			/* too big to bother copying	*/
+    {
+      if (net_write (conn, p, sz) != sz)
+	return (-1);
+      total += sz;
+    }
+    else
+    {
+      memcpy (buf + l, p, sz);
+      l += sz;
+    }
+  }
+  if (l && (net_write (conn, buf, l) != l))
+    return (-1);
+  return (total + l);
+}
+
 /*
  * close a socket
  */
@@ -442,6 +1050,8 @@ NETCON *net_close (NETCON *conn)
 {
   if (conn->sock == INVALID_SOCKET)
     return (NULL);
+  if (conn->key != NULL)
+    free (conn->key);
   if (conn->ssl != NULL)
   {
     debug ("shutdown SSL\n");
@@ -459,6 +1069,108 @@ NETCON *net_close (NETCON *conn)
   return (NULL);
 }
 
+/*
+ * return true if an idle connection has been closed by the peer, or
+ * has data we never asked for
+ */
+static int net_stale (NETCON *conn)
+{
+  fd_set fds;
+  struct timeval tv;
+
+  if (conn->rpos < conn->rlen)
+    return (1);
+  if ((conn->ssl != NULL) && SSL_pending (conn->ssl))
+    return (1);
+  FD_ZERO (&fds);
+  FD_SET (conn->sock, &fds);
+  tv.tv_sec = tv.tv_usec = 0;
+  return (select (conn->sock + 1, &fds, NULL, NULL, &tv) != 0);
+}
+
+/*
+ * get a pooled connection for this key
+ */
+NETCON *net_pool_get (char *key, int timeout)
+{
+  NETCON *conn, **prev, *found, *expired;
+  time_t now;
+
+  if (NetPool == NULL)
+    return (NULL);
+  found = expired = NULL;
+  time (&now);
+  wait_mutex (NetPool);
+  prev = &NetPool->idle;
+  while ((conn = *prev) != NULL)
+  {
+    if (now - conn->idle > timeout)
+    {
+      *prev = conn->next;
+      conn->next = expired;
+      expired = conn;
+    }
+    else if ((found == NULL) && (strcmp (conn->key, key) == 0))
+    {
+      *prev = conn->next;
+      found = conn;
+    }
+    else
+      prev = &conn->next;
+  }
+  end_mutex (NetPool);
+  while ((conn = expired) != NULL)
+  {
+    expired = conn->next;
+    debug ("closing expired connection to %s\n", conn->key);
+    net_close (conn);
+  }
+  if (found == NULL)
+    return (NULL);
+  if (net_stale (found))
+  {
+    debug ("discarding stale connection to %s\n", key);
+    net_close (found);
+    return (NULL);
+  }
+  free (found->key);
+  found->key = NULL;
+  found->next = NULL;
+  debug ("reusing connection to %s\n", key);
+  return (found);
+}
+
+/*
+ * pool a connection for this key
+ */
+int net_pool_put (NETCON *conn, char *key, int maxidle)
+{
+  NETCON *c;
+  int n = 0;
+
+  if (NetPool != NULL)
+  {
+    wait_mutex (NetPool);
+    for (c = NetPool->idle; c != NULL; c = c->next)
+    {
+      if (strcmp (c->key, key) == 0)
+	n++;
+    }
+    if (n < maxidle)
+    {
+      conn->key = strdup (key);
+      time (&conn->idle);
+      conn->next = NetPool->idle;
+      NetPool->idle = conn;
+    }
+    end_mutex (NetPool);
+    if (n < maxidle)
+      return (0);
+  }
+  net_close (conn);
+  return (-1);
+}
+
 #ifdef IPV6
 /*
  * TODO IPV6 support...
@@ -20,20 +20,35 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <winsock2.h>
 #include <windows.h>
-#include <winsock.h>
+#include <time.h>
 #include <openssl/ssl.h>
 
 #define WSA_VERSION 0x202	/* missing in winsock?			*/
 #define DFLTTIMEOUT 5000 	/* 5 second default receive timeout	*/
+#define NETBUFSZ 16384		/* connection read buffer size		*/
+#define NETWANTREAD 1		/* non-blocking handshake states	*/
+#define NETWANTWRITE 2
 
 typedef struct netcon
 {
   SOCKET sock;
   struct sockaddr_in sin;
   SSL *ssl;
+  int rpos, rlen;		/* read buffer position and length	*/
+  char rbuf[NETBUFSZ];		/* read buffer				*/
+  struct netcon *next;		/* idle client connection pool list	*/
+  char *key;			/* pooled destination			*/
+  time_t idle;			/* when it was pooled			*/
 } NETCON;
 
+typedef struct netvec		/* a buffer for gathered writes		*/
+{
+  char *buf;
+  int len;
+} NETVEC;
+
 /*
  * call me first!
  */
@@ -52,6 +67,31 @@ int net_shutdown (void);
  */
 SSL_CTX *net_ctx (char *cert, char *key, char *passwd, char *auth, 
   int is_server);
+/*
+ * Get a shared SSL context cached by name (e.g. a route), rebuilt
+ * when the arguments or certificate file times change.  A server's
+ * session cache is set up once with cachesize and timeout when the
+ * context is built.  Free it with SSL_CTX_free() when done.
+ */
+SSL_CTX *net_ctx_get (char *name, char *cert, char *key, char *passwd,
+  char *auth, int is_server, long cachesize, long timeout);
+/*
+ * add a reference to an SSL context
+ */
+SSL_CTX *net_ctx_ref (SSL_CTX *ctx);
+/*
+ * drop all cached SSL contexts, e.g. when the configuration changes
+ */
+void net_ctx_flush (void);
+/*
+ * Set up a server context's SSL session cache and tickets.  A size
+ * or timeout (seconds) of 0 leaves the OpenSSL default.
+ */
+void net_sess_cache (SSL_CTX *ctx, long size, long timeout);
+/*
+ * get counts of resumed and full SSL handshakes
+ */
+void net_sslstats (long *resumed, long *full);
 /*
  * open a network connection...
  * host/port - our hostname/port if server, or host we want to connect to
@@ -81,20 +121,60 @@ int net_localhost (NETCON *conn);
  */
 int net_timeout (NETCON *conn, int timeout);
 /*
- * read amount of data still available on this socket
+ * read amount of data still available on this socket, including
+ * anything already buffered
  */
 unsigned long net_available (NETCON *conn);
 /*
  * read from a connection
  */
 int net_read (NETCON *conn, char *buf, int sz);
+/*
+ * read a line (including the newline) from a connection
+ */
+int net_gets (NETCON *conn, char *buf, int sz);
+/*
+ * read whatever is available into the read buffer without consuming
+ * it, returning bytes added, 0 if closed, or -1 if none
+ */
+int net_buffer (NETCON *conn);
+/*
+ * point buf at unread buffered data and return it's length
+ */
+int net_peek (NETCON *conn, char **buf);
+/*
+ * set a connection blocking (on=0) or non-blocking (on=1)
+ */
+int net_nonblock (NETCON *conn, int on);
+/*
+ * Take the next step of SSL negotiations on a non-blocking connection.
+ * Returns 0 when done, NETWANTREAD or NETWANTWRITE when waiting, or
+ * -1 if it failed.
+ */
+int net_handshake (NETCON *conn, SSL_CTX *ctx, int is_server);
 /*
  * write to a connection
  */
 int net_write (NETCON *conn, char *buf, int sz);
+/*
+ * Write a list of n buffers, gathering small ones into a single send
+ * (or SSL record).  Returns bytes written or -1 on failure.
+ */
+int net_writev (NETCON *conn, NETVEC *v, int n);
 /*
  * close a connection
  */
 NETCON *net_close (NETCON *conn);
+/*
+ * Get an idle client connection for this key (e.g. protocol://host:port)
+ * from the pool, discarding any idle longer than timeout seconds or
+ * found closed.  Returns NULL if none available.
+ */
+NETCON *net_pool_get (char *key, int timeout);
+/*
+ * Return a client connection to the pool for reuse, or close it if 
+ * maxidle connections are already pooled for this key.
+ */
+int net_pool_put (NETCON *conn, char *key, int maxidle);
 
 #endif /* __NET__ */
@@ -43,6 +43,7 @@
 #include <sqlext.h>
 #include "log.h"
 #include "util.h"
+#include "dbuf.h"
 #include "queue.h"
 
 #ifndef debug
@@ -50,34 +51,77 @@
 #endif
 
 /*
- * ODBC connection information
- */
-typedef struct odbcq_conn
-{
-  SQLHENV env;
-  SQLHDBC dbc;
-  SQLHSTMT stmt;
-} ODBCQCONN;
-
-/*
- * Internal meta data
+ * Internal meta data for a queue, shared by every pooled connection
+ * and changed only under the queue's lock.
  */
 typedef struct odbcq
 {
   struct odbcq *next;
-  ODBCQCONN *conn;			/* the connection 		*/
+  struct odbcq_conn *conn;		/* the connection 		*/
   int rowid;				/* max row number		*/
   int transport;			/* next transport row to pop	*/
+  int bad;				/* columns failed to map	*/
   char *name;				/* queue name			*/
   signed char cmap[];			/* maps queue to table columns	*/
 } ODBCQ;
 
-ODBCQ *Odbcq = NULL;
+/*
+ * Statements prepared on one pooled connection for the mapped 
+ * columns of a queue.  Those taking a rowid are bound to key.
+ */
+typedef struct odbcq_stmts
+{
+  struct odbcq_stmts *next;
+  ODBCQ *queue;				/* queue these are for		*/
+  SQLINTEGER key;			/* rowid parameter		*/
+  SQLHSTMT insert,			/* add a row			*/
+	   update,			/* change a row			*/
+	   get,				/* read a row			*/
+	   del,				/* delete a row			*/
+	   after,			/* rows after key		*/
+	   before,			/* rows before key, descending	*/
+	   queued;			/* next queued row after key	*/
+} ODBCQSTMTS;
+
+/*
+ * a pooled dB connection
+ */
+typedef struct odbcq_db
+{
+  struct odbcq_db *next;		/* next free connection		*/
+  SQLHDBC dbc;
+  SQLHSTMT stmt;			/* for ad hoc statements	*/
+  ODBCQSTMTS *stmts;			/* prepared for our queues	*/
+} ODBCQDB;
+
+/*
+ * ODBC connection information.  Worker threads check out a pooled
+ * connection for each queue operation, and we open them as needed
+ * up to the pool size.  The mutex covers the pool and queue list.
+ */
+typedef struct odbcq_conn
+{
+  MUTEX mutex;
+  READY ready;				/* set when one is checked in	*/
+  SQLHENV env;
+  char *dsn;				/* connection string		*/
+  int size,				/* pool size			*/
+      open;				/* connections opened		*/
+  ODBCQDB **db,				/* slots for those opened	*/
+	  *free;			/* those not checked out	*/
+  ODBCQ *queues;			/* meta data for our queues	*/
+} ODBCQCONN;
+
+/* marks a pool slot held while it's connection is opened */
+#define ODBCQOPENING ((ODBCQDB *) 1)
 
 #ifndef COLUMN_NAME
 #define COLUMN_NAME 4
 #endif
 
+/* rowid past any row, for reading back from the last */
+#define ODBCQ_LAST 0x7fffffff
+
 /*
  * get error information for a handle
  */
@@ -130,49 +174,369 @@ char *odbcq_error (char *dst, int sz, SQLHANDLE handle, SQLSMALLINT type)
 }
 
 /*
- * return a dB integer value
+ * return an integer from an executed statement, or null if NULL
  */
-int odbcq_getint (ODBCQCONN *c, char *fmt, ...)
+int odbcq_fetchint (SQLHSTMT stmt, SQLRETURN ret, int null)
 {
   SQLINTEGER ind;
-  SQLRETURN ret;
   int n = -1;
-  va_list ap;
   char buf[80];
 
-  va_start (ap, fmt);
-  vsprintf (buf, fmt, ap);
-  va_end (ap);
-  debug ("executing %s\n", buf);
-  ret = SQLExecDirect (c->stmt, buf, SQL_NTS);
   if (SQL_SUCCEEDED (ret))
   {
-    ret = SQLFetch (c->stmt);
+    ret = SQLFetch (stmt);
     if (SQL_SUCCEEDED (ret))
     {
-      ret = SQLGetData (c->stmt, 1, SQL_C_CHAR, buf, sizeof (buf), &ind);
+      ret = SQLGetData (stmt, 1, SQL_C_CHAR, buf, sizeof (buf), &ind);
       if (SQL_SUCCEEDED (ret))
-      {
-	if (ind != SQL_NULL_DATA)
-          n = atoi (buf);
-      }
+        n = ind == SQL_NULL_DATA ? null : atoi (buf);
     }
   }
   if (!SQL_SUCCEEDED (ret))
   {
     char ebuf[1024];
 
-    error ("Failed getting integer for statment: %s\n%s",
-      buf, odbcq_error (ebuf, sizeof (ebuf), c->stmt, SQL_HANDLE_STMT));
+    error ("Failed getting integer\n%s",
+      odbcq_error (ebuf, sizeof (ebuf), stmt, SQL_HANDLE_STMT));
   }
-  SQLFreeStmt (c->stmt, SQL_CLOSE);
+  SQLFreeStmt (stmt, SQL_CLOSE);
   return (n);
 }
 
 /*
- * Return our meta data for a queue
+ * return a dB integer value
+ */
+int odbcq_getint (ODBCQDB *d, char *fmt, ...)
+{
+  va_list ap;
+  char buf[256];
+
+  va_start (ap, fmt);
+  vsnprintf (buf, sizeof (buf), fmt, ap);
+  va_end (ap);
+  debug ("executing %s\n", buf);
+  return (odbcq_fetchint (d->stmt, SQLExecDirect (d->stmt, buf, SQL_NTS),
+    -1));
+}
+
+/*
+ * get a column as text, however long, or NULL if we can't
+ */
+char *odbcq_getdata (SQLHSTMT stmt, int col)
+{
+  SQLINTEGER ind;
+  SQLRETURN ret;
+  char *v = NULL;
+  int len = 0, n;
+  char buf[256];
+
+  while (1)
+  {
+    ret = SQLGetData (stmt, col, SQL_C_CHAR, buf, sizeof (buf), &ind);
+    if (!SQL_SUCCEEDED (ret))		/* SQL_NO_DATA when done	*/
+      break;
+    if (ind == SQL_NULL_DATA)
+      *buf = 0;
+    n = strlen (buf);
+    v = (char *) realloc (v, len + n + 1);
+    memcpy (v + len, buf, n + 1);
+    len += n;
+    if (ret == SQL_SUCCESS)
+      break;
+  }
+  return (v);
+}
+
+/*
+ * Write insert or update SQL for the mapped columns of a queue, 
+ * or just those set if given a row.  Parameters are in the order 
+ * bound by odbcq_bind().
+ */
+char *odbcq_sql (DBUF *b, QUEUE *q, ODBCQ *o, QUEUEROW *r, int update)
+{
+  int i, n = 0;
+  char **field;
+
+  field = q->type->field;
+  if (update)
+    dbuf_printf (b, "update %s set ", q->table);
+  else
+    dbuf_printf (b, "insert into %s (%s", q->table, field[0]);
+  for (i = 1; i < q->type->numfields; i++)
+  {
+    if ((o->cmap[i] < 1) || ((r != NULL) && (r->field[i] == NULL)))
+      continue;
+    if (update)
+      dbuf_printf (b, "%s%s=?", n++ ? ", " : "", field[i]);
+    else
+    {
+      dbuf_printf (b, ", %s", field[i]);
+      n++;
+    }
+  }
+  if (update)
+    dbuf_printf (b, " where %s=?", field[0]);
+  else
+  {
+    dbuf_printf (b, ") values (?");
+    while (n--)
+      dbuf_printf (b, ", ?");
+    dbuf_printf (b, ")");
+  }
+  dbuf_putc (b, 0);
+  return (dbuf_getbuf (b));
+}
+
+/*
+ * Bind the set and mapped fields of a row to statement parameters,
+ * with the rowid first for an insert or last for an update.
+ * Return the number of fields bound.
+ */
+int odbcq_bind (SQLHSTMT stmt, ODBCQSTMTS *s, QUEUEROW *r, int update)
+{
+  int i, n, len;
+
+  SQLFreeStmt (stmt, SQL_RESET_PARAMS);
+  n = 1;
+  s->key = r->rowid;
+  if (!update)
+    SQLBindParameter (stmt, n++, SQL_PARAM_INPUT, SQL_C_LONG, SQL_INTEGER,
+      0, 0, &s->key, 0, NULL);
+  for (i = 1; i < r->queue->type->numfields; i++)
+  {
+    if ((s->queue->cmap[i] < 1) || (r->field[i] == NULL))
+      continue;
+    len = strlen (r->field[i]);
+    SQLBindParameter (stmt, n++, SQL_PARAM_INPUT, SQL_C_CHAR, 
+      len > 255 ? SQL_LONGVARCHAR : SQL_VARCHAR, len ? len : 1, 0, 
+      r->field[i], len + 1, NULL);
+  }
+  if (update)
+    SQLBindParameter (stmt, n++, SQL_PARAM_INPUT, SQL_C_LONG, SQL_INTEGER,
+      0, 0, &s->key, 0, NULL);
+  return (n - 2);
+}
+
+/*
+ * prepare a statement, optionally bound to our key
+ */
+SQLHSTMT odbcq_prepare (ODBCQDB *d, ODBCQSTMTS *s, char *sql, int key)
+{
+  SQLHSTMT stmt;
+  SQLRETURN ret;
+  char buf[1024];
+
+  debug ("preparing %s\n", sql);
+  ret = SQLAllocHandle (SQL_HANDLE_STMT, d->dbc, &stmt);
+  if (!SQL_SUCCEEDED (ret))
+    return (NULL);
+  ret = SQLPrepare (stmt, sql, SQL_NTS);
+  if (!SQL_SUCCEEDED (ret))
+  {
+    error ("Failed preparing %s\n%s", sql,
+      odbcq_error (buf, sizeof (buf), stmt, SQL_HANDLE_STMT));
+    SQLFreeHandle (SQL_HANDLE_STMT, stmt);
+    return (NULL);
+  }
+  if (key)
+    SQLBindParameter (stmt, 1, SQL_PARAM_INPUT, SQL_C_LONG, SQL_INTEGER,
+      0, 0, &s->key, 0, NULL);
+  return (stmt);
+}
+
+/*
+ * free prepared statements
+ */
+int odbcq_unprepare (ODBCQSTMTS *s)
+{
+  if (s->insert != NULL)
+    SQLFreeHandle (SQL_HANDLE_STMT, s->insert);
+  if (s->update != NULL)
+    SQLFreeHandle (SQL_HANDLE_STMT, s->update);
+  if (s->get != NULL)
+    SQLFreeHandle (SQL_HANDLE_STMT, s->get);
+  if (s->del != NULL)
+    SQLFreeHandle (SQL_HANDLE_STMT, s->del);
+  if (s->after != NULL)
+    SQLFreeHandle (SQL_HANDLE_STMT, s->after);
+  if (s->before != NULL)
+    SQLFreeHandle (SQL_HANDLE_STMT, s->before);
+  if (s->queued != NULL)
+    SQLFreeHandle (SQL_HANDLE_STMT, s->queued);
+  free (s);
+  return (0);
+}
+
+/*
+ * Prepare the statements for a queue on a pooled connection once
+ * it's columns are mapped.  Inserts and updates with every mapped 
+ * column set use these.  Reading next, previous, and queued rows are
+ * range scans on the key, limited with SQL_ATTR_MAX_ROWS, so gaps
+ * left by deleted rows cost nothing.
+ */
+ODBCQSTMTS *odbcq_statements (QUEUE *q, ODBCQ *o, ODBCQDB *d)
+{
+  ODBCQSTMTS *s;
+  DBUF *b;
+  char *id, buf[256];
+
+  s = (ODBCQSTMTS *) malloc (sizeof (ODBCQSTMTS));
+  memset (s, 0, sizeof (ODBCQSTMTS));
+  s->queue = o;
+  id = q->type->field[0];
+  b = dbuf_alloc ();
+  s->insert = odbcq_prepare (d, s, odbcq_sql (b, q, o, NULL, 0), 0);
+  dbuf_clear (b);
+  s->update = odbcq_prepare (d, s, odbcq_sql (b, q, o, NULL, 1), 0);
+  dbuf_free (b);
+  snprintf (buf, sizeof (buf), "select * from %s where %s=?", 
+    q->table, id);
+  if ((s->get = odbcq_prepare (d, s, buf, 1)) != NULL)
+    SQLSetStmtAttr (s->get, SQL_ATTR_MAX_ROWS, (SQLPOINTER) 1, 0);
+  snprintf (buf, sizeof (buf), "delete from %s where %s=?", 
+    q->table, id);
+  s->del = odbcq_prepare (d, s, buf, 1);
+  snprintf (buf, sizeof (buf), "select * from %s where %s>? order by %s",
+    q->table, id, id);
+  if ((s->after = odbcq_prepare (d, s, buf, 1)) != NULL)
+    SQLSetStmtAttr (s->after, SQL_ATTR_MAX_ROWS, (SQLPOINTER) 1, 0);
+  snprintf (buf, sizeof (buf), 
+    "select * from %s where %s<? order by %s desc", q->table, id, id);
+  s->before = odbcq_prepare (d, s, buf, 1);
+  if (o->transport >= 0)
+  {
+    snprintf (buf, sizeof (buf), "select * from %s where "
+      "PROCESSINGSTATUS='queued' and %s>? order by %s", q->table, id, id);
+    if ((s->queued = odbcq_prepare (d, s, buf, 1)) != NULL)
+      SQLSetStmtAttr (s->queued, SQL_ATTR_MAX_ROWS, (SQLPOINTER) 1, 0);
+  }
+  if ((s->insert == NULL) || (s->update == NULL) || (s->get == NULL) ||
+    (s->del == NULL) || (s->after == NULL) || (s->before == NULL) ||
+    ((o->transport >= 0) && (s->queued == NULL)))
+  {
+    odbcq_unprepare (s);
+    return (NULL);
+  }
+  s->next = d->stmts;
+  d->stmts = s;
+  return (s);
+}
+
+/*
+ * open a connection for the pool
  */
-ODBCQ *odbcq_find (QUEUE *q)
+ODBCQDB *odbcq_open (ODBCQCONN *c)
+{
+  ODBCQDB *d;
+  SQLRETURN ret;
+  char buf[1024];
+
+  d = (ODBCQDB *) malloc (sizeof (ODBCQDB));
+  memset (d, 0, sizeof (ODBCQDB));
+  /* Allocate a connection handle */
+  SQLAllocHandle (SQL_HANDLE_DBC, c->env, &d->dbc);
+  ret = SQLDriverConnect (d->dbc, NULL, c->dsn, SQL_NTS, NULL, 0, NULL,
+    SQL_DRIVER_NOPROMPT);
+  if (!SQL_SUCCEEDED (ret))
+  {
+    error ("SQLDriverConnect to %s:\n%s", 
+      c->dsn, odbcq_error (buf, sizeof (buf), d->dbc, SQL_HANDLE_DBC));
+    SQLFreeHandle (SQL_HANDLE_DBC, d->dbc);
+    free (d);
+    return (NULL);
+  }
+  /* Allocate a statement handle */
+  SQLAllocHandle (SQL_HANDLE_STMT, d->dbc, &d->stmt);
+  return (d);
+}
+
+/*
+ * close a pooled connection
+ */
+int odbcq_shut (ODBCQDB *d)
+{
+  ODBCQSTMTS *s;
+
+  while ((s = d->stmts) != NULL)
+  {
+    d->stmts = s->next;
+    odbcq_unprepare (s);
+  }
+  SQLFreeHandle (SQL_HANDLE_STMT, d->stmt);
+  SQLDisconnect (d->dbc);		/* disconnect from driver */
+  SQLFreeHandle (SQL_HANDLE_DBC, d->dbc);
+  free (d);
+  return (0);
+}
+
+/*
+ * Check out a pooled connection, opening another if none are free
+ * and the pool has an empty slot, or waiting for one to be checked 
+ * in.  If an open fails we wait for one in use, and only fail when
+ * there are none.
+ */
+ODBCQDB *odbcq_checkout (ODBCQCONN *c)
+{
+  ODBCQDB *d;
+  int i, failed = 0;
+
+  wait_mutex (c);
+  while ((d = c->free) == NULL)
+  {
+    for (i = 0; (i < c->size) && (c->db[i] != NULL); i++);
+    if ((i < c->size) && !failed)
+    {
+      c->db[i] = ODBCQOPENING;		/* hold our place		*/
+      end_mutex (c);
+      d = odbcq_open (c);
+      wait_mutex (c);
+      if ((c->db[i] = d) == NULL)
+      {
+	failed = 1;
+	set_ready (c);			/* let waiters look again	*/
+	continue;
+      }
+      c->open++;
+      debug ("opened pooled connection %d of %d\n", i + 1, c->open);
+      d->next = c->free;
+      c->free = d;
+      continue;
+    }
+    if (failed)				/* any in use or opening?	*/
+    {
+      for (i = 0; (i < c->size) && (c->db[i] == NULL); i++);
+      if (i == c->size)
+	break;
+    }
+    reset_ready (c);
+    end_mutex (c);
+    wait_ready_for (c, INFINITE);
+    wait_mutex (c);
+  }
+  if (d != NULL)
+    c->free = d->next;
+  end_mutex (c);
+  return (d);
+}
+
+/*
+ * return a connection to the pool
+ */
+void odbcq_checkin (ODBCQCONN *c, ODBCQDB *d)
+{
+  wait_mutex (c);
+  d->next = c->free;
+  c->free = d;
+  set_ready (c);
+  end_mutex (c);
+}
+
+/*
+ * Return our meta data for a queue, reading it with this connection
+ * the first time.  Only the thread holding the queue's lock adds 
+ * it's meta data, so we only need the lock for the list itself.
+ */
+ODBCQ *odbcq_find (QUEUE *q, ODBCQDB *d)
 {
   ODBCQ *o;
   ODBCQCONN *c;
@@ -182,11 +546,16 @@ ODBCQ *odbcq_find (QUEUE *q)
   char *id, buf[1024];
 
   // debug ("looking for %s\n", q->name);
-  for (o = Odbcq; o != NULL; o = o->next)
+  c = (ODBCQCONN *) q->conn->conn;
+  wait_mutex (c);
+  for (o = c->queues; o != NULL; o = o->next)
   {
     if (strcmp (q->name, o->name) == 0)
-      return (o);
+      break;
   }
+  end_mutex (c);
+  if (o != NULL)
+    return (o);
   /*
    * none found... start by allocating some
    */
@@ -196,16 +565,12 @@ ODBCQ *odbcq_find (QUEUE *q)
   memset (o, 0, i);
   o->name = o->cmap + q->type->numfields;
   strcpy (o->name, q->name);
-  /*
-   * set up connection and statement
-   */
-  c = (ODBCQCONN *) q->conn->conn;
   o->conn = c;
   /*
    * set next row to pop and top row
    */
   id = q->type->field[0];
-  o->rowid = odbcq_getint (c, "select max(%s) from %s", id, q->table);
+  o->rowid = odbcq_getint (d, "select max(%s) from %s", id, q->table);
   if (istransportQ (q))
     o->transport = 0;
   else
@@ -213,16 +578,16 @@ ODBCQ *odbcq_find (QUEUE *q)
   /*
    * map queue columns to the table columns
    */
-  SQLSetStmtAttr (c->stmt, SQL_ATTR_MAX_ROWS , 0, 0);
-  ret = SQLColumns (c->stmt, NULL, 0, NULL, 0, q->table, 
+  SQLSetStmtAttr (d->stmt, SQL_ATTR_MAX_ROWS , 0, 0);
+  ret = SQLColumns (d->stmt, NULL, 0, NULL, 0, q->table, 
     strlen (q->table), NULL, 0);
   col = 1;
   while (SQL_SUCCEEDED (ret))
   {
-    ret = SQLFetch (c->stmt);
+    ret = SQLFetch (d->stmt);
     if (SQL_SUCCEEDED (ret))
     {
-      ret = SQLGetData (c->stmt, COLUMN_NAME, SQL_C_CHAR,
+      ret = SQLGetData (d->stmt, COLUMN_NAME, SQL_C_CHAR,
         buf, sizeof (buf), &indicator);
       if (SQL_SUCCEEDED (ret) && (indicator != SQL_NULL_DATA))
       {
@@ -234,8 +599,9 @@ ODBCQ *odbcq_find (QUEUE *q)
       else
       {
         error ("Failed mapping at column %d\n%s", col,
-	  odbcq_error (buf, 1024, c->stmt, SQL_HANDLE_STMT));
+	  odbcq_error (buf, 1024, d->stmt, SQL_HANDLE_STMT));
         o->rowid = o->transport = -1;	/* BAD queue!		*/
+	o->bad = 1;
         break;
       }
       col++;
@@ -245,44 +611,41 @@ ODBCQ *odbcq_find (QUEUE *q)
   /*
    * clean up and return
    */
-  SQLFreeStmt (c->stmt, SQL_CLOSE);
-  o->next = Odbcq;
-  Odbcq = o;
+  SQLFreeStmt (d->stmt, SQL_CLOSE);
+  wait_mutex (c);
+  o->next = c->queues;
+  c->queues = o;
+  end_mutex (c);
   return (o);
 }
 
 /*
- * return last row for a queue
+ * Check out a connection for a queue operation, with the queue's meta
+ * data and statements prepared on that connection.  Check it back in
+ * with odbcq_checkin() when done.
  */
-int odbcq_lastrow (QUEUE *q)
+ODBCQDB *odbcq_handle (QUEUE *q, ODBCQ **m, ODBCQSTMTS **s)
 {
-  ODBCQ *m;
-
-  if ((m = odbcq_find (q)) == NULL)
-    return (-1);
-  return (m->rowid);
-}
-
-/*
- * return next row to pop
- */
-int odbcq_transport (QUEUE *q)
-{
-  ODBCQ *m;
-  char *k;
-  int rowid;
+  ODBCQCONN *c;
+  ODBCQDB *d;
 
-  if ((m = odbcq_find (q)) == NULL)
-    return (-1);
-  if (m->transport < 0)
-    return (-1);
-  k = q->type->field[0];
-  rowid = odbcq_getint ((ODBCQCONN *) q->conn->conn,
-    "select min(%s) from %s where PROCESSINGSTATUS='queued' and "
-    "%s>%d", k, q->table, k, m->transport);
-  if (rowid > 0)
-    return (m->transport = rowid);
-  return (0);
+  c = (ODBCQCONN *) q->conn->conn;
+  if ((d = odbcq_checkout (c)) == NULL)
+    return (NULL);
+  if ((*m = odbcq_find (q, d)) != NULL)
+  {
+    for (*s = d->stmts; *s != NULL; *s = (*s)->next)
+    {
+      if ((*s)->queue == *m)
+        return (d);
+    }
+    if (!(*m)->bad && ((*s = odbcq_statements (q, *m, d)) != NULL))
+      return (d);
+    (*m)->rowid = (*m)->transport = -1;	/* BAD queue!		*/
+    (*m)->bad = 1;
+  }
+  odbcq_checkin (c, d);
+  return (NULL);
 }
 
 /*
@@ -291,30 +654,31 @@ int odbcq_transport (QUEUE *q)
 int odbcq_close (void *conn)
 {
   ODBCQCONN *c;
-  ODBCQ **o, *f;
+  ODBCQ *o;
+  int i;
 
   c = (ODBCQCONN *) conn;
   /*
    * remove any meta data associated with this connection
    */
-  o = &Odbcq;
-  while ((f = *o) != NULL)
+  while ((o = c->queues) != NULL)
   {
-    if (f->conn == c)
-    {
-      *o = f->next;
-      free (f);
-    }
-    else
-      o = &(f->next);
+    c->queues = o->next;
+    free (o);
   }
   /*
-   * shut down the connection
+   * shut down the pooled connections
    */
-  SQLFreeHandle (SQL_HANDLE_STMT, c->stmt);
-  SQLDisconnect (c->dbc);		/* disconnect from driver */
-  SQLFreeHandle (SQL_HANDLE_DBC, c->dbc);
+  for (i = 0; i < c->size; i++)
+  {
+    if ((c->db[i] != NULL) && (c->db[i] != ODBCQOPENING))
+      odbcq_shut (c->db[i]);
+  }
   SQLFreeHandle (SQL_HANDLE_ENV, c->env);
+  destroy_ready (c);
+  destroy_mutex (c);
+  free (c->db);
+  free (c->dsn);
   free (c);
   return (0);
 }
@@ -322,24 +686,24 @@ int odbcq_close (void *conn)
 /*
  * execute an arbitrary statement
  */
-int odbcq_exec (ODBCQCONN *c, char *s)
+int odbcq_exec (ODBCQDB *d, char *s)
 {
   SQLRETURN ret;
   SQLSMALLINT col;
   char buf[256];
   int row = 0;
 
-  SQLSetStmtAttr (c->stmt, SQL_ATTR_MAX_ROWS , (SQLPOINTER) 1, 0);
+  SQLSetStmtAttr (d->stmt, SQL_ATTR_MAX_ROWS , (SQLPOINTER) 1, 0);
   /* exec the statement */
-  ret = SQLExecDirect (c->stmt, s, SQL_NTS);
-  SQLNumResultCols (c->stmt, &col);
+  ret = SQLExecDirect (d->stmt, s, SQL_NTS);
+  SQLNumResultCols (d->stmt, &col);
   while (SQL_SUCCEEDED (ret))
   {
     SQLINTEGER ind;
-    ret = SQLFetch (c->stmt);
+    ret = SQLFetch (d->stmt);
     if (SQL_SUCCEEDED (ret))
     {
-      ret = SQLGetData (c->stmt, col, SQL_C_CHAR, buf, sizeof (buf), &ind);
+      ret = SQLGetData (d->stmt, col, SQL_C_CHAR, buf, sizeof (buf), &ind);
       if (SQL_SUCCEEDED (ret))
       {
         if (ind == SQL_NULL_DATA)
@@ -348,113 +712,216 @@ int odbcq_exec (ODBCQCONN *c, char *s)
       row++;
     }
   }
-  SQLFreeStmt (c->stmt, SQL_CLOSE);
+  SQLFreeStmt (d->stmt, SQL_CLOSE);
   return (row);
 }
 
 /*
- * quote strings with escapes returning length of output
+ * Add or update a row on a checked out connection and return the
+ * rowid.  Rows with every mapped field set use the prepared 
+ * statements.  Otherwise we only write those set, as the rest may 
+ * have defaults or values to keep.
  */
-int odbcq_quote (char *dst, char *src)
+int odbcq_write (QUEUEROW *r, ODBCQ *o, ODBCQSTMTS *s, ODBCQDB *d)
 {
-  char *ch;
+  SQLHSTMT stmt;
+  SQLRETURN ret;
+  DBUF *b = NULL;
+  int i, update;
+  char buf[1024];
 
-  ch = dst;
-  *ch++ = '\'';
-  while (*ch = *src++)
+  if (update = r->rowid)
+  {
+    stmt = s->update;
+    if ((r->rowid <= o->transport) && 
+      !strcmp ("queued", queue_field_get (r, "PROCESSINGSTATUS")))
+	o->transport = r->rowid -1;
+  }
+  else
+  {
+    stmt = s->insert;
+    if ((r->rowid = o->rowid + 1) < 1)
+      r->rowid = 1;
+  }
+  for (i = 1; i < r->queue->type->numfields; i++)
+  {
+    if ((o->cmap[i] > 0) && (r->field[i] == NULL))
+      break;
+  }
+  if (i < r->queue->type->numfields)	/* some fields not set	*/
+  {
+    stmt = d->stmt;
+    b = dbuf_alloc ();
+    ret = SQLPrepare (stmt, odbcq_sql (b, r->queue, o, r, update), SQL_NTS);
+    if (!SQL_SUCCEEDED (ret))
+      stmt = NULL;
+  }
+  if (stmt == NULL)
+  {
+    error ("push failed preparing %s\n", r->queue->name);
+    dbuf_free (b);
+    return (-1);
+  }
+  if ((odbcq_bind (stmt, s, r, update) == 0) && update)
+  {
+    dbuf_free (b);			/* nothing to change	*/
+    return (r->rowid);
+  }
+  ret = SQLExecute (stmt);
+  SQLFreeStmt (stmt, SQL_CLOSE);
+  if (!SQL_SUCCEEDED (ret))
   {
-    if (*ch++ == '\'')
-      *ch++ = '\'';
+    if (b != NULL)
+      debug ("stmt: %s\n", dbuf_getbuf (b));
+    error ("push failed: %s", 
+      odbcq_error (buf, sizeof (buf), stmt, SQL_HANDLE_STMT));
+    dbuf_free (b);
+    return (-1);
   }
-  *ch++ = '\'';
-  *ch = 0;
-  return (ch - dst);
+  dbuf_free (b);
+  if (r->rowid > o->rowid)
+    o->rowid = r->rowid;
+  return (r->rowid);
 }
 
 /*
- * add or update a row and return the rowid
+ * Add or update a row and return the rowid.
  */
 int odbcq_push (QUEUEROW *r)
 {
   ODBCQ *o;
-  ODBCQCONN *c;
-  SQLRETURN ret;
-  char **field;
-  char *s, buf[4096];
-  int i, l, sz;
+  ODBCQSTMTS *s;
+  ODBCQDB *d;
+  int rowid;
 
   /*
-   * get the meta data
+   * get the meta data and a connection
    */
-  if ((o = odbcq_find (r->queue)) == NULL)
+  if ((d = odbcq_handle (r->queue, &o, &s)) == NULL)
   {
     warn ("no meta data for %s\n", r->queue->name);
     return (-1);
   }
-
-  l = 4096;
-  sz = 0;
   debug ("pushing row %d for %s\n", r->rowid, r->queue->name);
-  field = r->queue->type->field;
-  if (r->rowid)				/* update		*/
-  {
-    for (i = 1; i < r->queue->type->numfields; i++)
-      if (o->cmap[i] > 0) break;
-    sz = sprintf (buf, "update %s set %s=", 
-      r->queue->table, field[i]);
-    sz += odbcq_quote (buf + sz, r->field[i]);
-    while (++i < r->queue->type->numfields)
-    {
-      if ((o->cmap[i] > 0) && (r->field[i] != NULL))
-      {
-	sz += sprintf (buf + sz, ", %s=", field[i]);
-	sz += odbcq_quote (buf + sz, r->field[i]);
-      }
-    }
-    sz += sprintf (buf + sz, " where %s=%d", field[0], r->rowid);
-    if ((r->rowid <= o->transport) && 
-      !strcmp ("queued", queue_field_get (r, "PROCESSINGSTATUS")))
-	o->transport = r->rowid -1;
+  rowid = odbcq_write (r, o, s, d);
+  odbcq_checkin (o->conn, d);
+  return (rowid);
+}
+
+/*
+ * Add or update n rows as one transaction, returning n, or 0 if it
+ * was rolled back.
+ */
+int odbcq_pushbatch (QUEUE *q, QUEUEROW **rows, int n)
+{
+  ODBCQ *o;
+  ODBCQSTMTS *s;
+  ODBCQDB *d;
+  SQLRETURN ret;
+  int i, rowid, transport;
+
+  if ((d = odbcq_handle (q, &o, &s)) == NULL)
+  {
+    warn ("no meta data for %s\n", q->name);
+    return (0);
   }
-  else					/* insert		*/
+  debug ("pushing %d rows for %s\n", n, q->name);
+  rowid = o->rowid;
+  transport = o->transport;
+  SQLSetConnectAttr (d->dbc, SQL_ATTR_AUTOCOMMIT,
+    (SQLPOINTER) SQL_AUTOCOMMIT_OFF, 0);
+  for (i = 0; i < n; i++)
   {
-    if ((r->rowid = o->rowid + 1) < 1)
-      r->rowid = 1;
-    sz = sprintf (buf, "insert into %s (%s", r->queue->table, field[0]);
-    for (i = 1; i < r->queue->type->numfields; i++)
+    if (odbcq_write (rows[i], o, s, d) < 1)
+      break;
+  }
+  ret = SQLEndTran (SQL_HANDLE_DBC, d->dbc, 
+    i < n ? SQL_ROLLBACK : SQL_COMMIT);
+  if ((i < n) || !SQL_SUCCEEDED (ret))
+  {
+    error ("push of %d rows to %s rolled back\n", n, q->name);
+    for (i = 0; i < n; i++)		/* rows we inserted are gone	*/
     {
-      if ((o->cmap[i] > 0) && (r->field[i] != NULL))
-	sz += sprintf (buf + sz, ", %s", field[i]);
+      if (rows[i]->rowid > rowid)
+        rows[i]->rowid = 0;
     }
-    sz += sprintf (buf + sz, ") values (%d", r->rowid);
-    for (i = 1; i < r->queue->type->numfields; i++)
+    o->rowid = rowid;
+    o->transport = transport;
+    n = 0;
+  }
+  SQLSetConnectAttr (d->dbc, SQL_ATTR_AUTOCOMMIT,
+    (SQLPOINTER) SQL_AUTOCOMMIT_ON, 0);
+  odbcq_checkin (o->conn, d);
+  return (n);
+}
+
+/*
+ * fetch the next row from an executed statement
+ */
+QUEUEROW *odbcq_fetch (QUEUE *q, ODBCQ *m, SQLHSTMT stmt)
+{
+  SQLRETURN ret;
+  SQLSMALLINT col, i;
+  QUEUEROW *row;
+
+  ret = SQLFetch (stmt);
+  if (!SQL_SUCCEEDED (ret))
+    return (NULL);
+  row = queue_row_alloc (q);
+  for (i = 0; i < q->type->numfields; i++)
+  {
+    if ((col = m->cmap[i]) < 1)		/* column not mapped		*/
     {
-      if ((o->cmap[i] > 0) && (r->field[i] != NULL))
-      {
-	sz += sprintf (buf + sz, ", ");
-        sz += odbcq_quote (buf + sz, r->field[i]);
-      }
+      debug ("%s not mapped\n", q->type->field[i]);
+      continue;
     }
-    sz += sprintf (buf + sz, ")");
+    row->field[i] = odbcq_getdata (stmt, col);
   }
+  if (row->field[0] != NULL)
+    row->rowid = atoi (row->field[0]);
+  return (row);
+}
 
-  c = r->queue->conn->conn;
-  SQLSetStmtAttr (c->stmt, SQL_ATTR_MAX_ROWS, (SQLPOINTER) 1, 0);
-  /* exec the statement */
-  ret = SQLExecDirect (c->stmt, buf, SQL_NTS);
-  SQLFreeStmt (c->stmt, SQL_CLOSE);
-  if (!SQL_SUCCEEDED (ret))
+/*
+ * Execute a statement for rows from key, and fetch up to n of them.
+ * Return the number fetched.
+ */
+int odbcq_read (QUEUE *q, ODBCQSTMTS *s, SQLHSTMT stmt, int key, 
+  int n, QUEUEROW **rows)
+{
+  SQLRETURN ret;
+  int i = 0;
+  char buf[256];
+
+  s->key = key;
+  ret = SQLExecute (stmt);
+  if (SQL_SUCCEEDED (ret))
   {
-    debug ("stmt: %s\n", buf);
-    error ("push failed: %s", 
-      odbcq_error (buf, sizeof (buf), c->stmt, SQL_HANDLE_STMT));
-    return (-1);
+    while ((i < n) && 
+      ((rows[i] = odbcq_fetch (q, s->queue, stmt)) != NULL))
+      i++;
   }
-  if (r->rowid > o->rowid)
-    o->rowid = r->rowid;
-  return (r->rowid);
+  else
+  {
+    error ("failed reading %s from row %d: %s", q->name, key,
+      odbcq_error (buf, sizeof (buf), stmt, SQL_HANDLE_STMT));
+  }
+  SQLFreeStmt (stmt, SQL_CLOSE);
+  return (i);
 }
 
+/*
+ * read up to n rows before this one on a checked out connection
+ */
+int odbcq_before (QUEUE *q, ODBCQSTMTS *s, int rowid, int n, 
+  QUEUEROW **rows)
+{
+  if (rowid == 0)
+    rowid = ODBCQ_LAST;
+  debug ("%d rows before %d\n", n, rowid);
+  SQLSetStmtAttr (s->before, SQL_ATTR_MAX_ROWS, (SQLPOINTER) n, 0);
+  return (odbcq_read (q, s, s->before, rowid, n, rows));
+}
 
 /*
  * get a specific row with optional warning
@@ -462,60 +929,34 @@ int odbcq_push (QUEUEROW *r)
 QUEUEROW *odbcq_wget (QUEUE *q, int rowid, int warn)
 {
   ODBCQ *m;
-  ODBCQCONN *c;
+  ODBCQSTMTS *s;
+  ODBCQDB *d;
   SQLRETURN ret;
-  SQLSMALLINT col, i;
-  SQLINTEGER ind;
   QUEUEROW *row = NULL;
   char buf[256];
 
   /*
-   * get the meta data
+   * get the meta data and a connection
    */
-  if ((m = odbcq_find (q)) == NULL)
+  if ((d = odbcq_handle (q, &m, &s)) == NULL)
     return (NULL);
 
   /*
    * select the row
    */
-  c = q->conn->conn;
-  SQLSetStmtAttr (c->stmt, SQL_ATTR_MAX_ROWS, (SQLPOINTER) 1, 0);
-  /* exec the statement */
-  sprintf (buf, "select * from %s where %s = %d",
-    q->table, q->type->field[0], rowid);
-  ret = SQLExecDirect (c->stmt, buf, SQL_NTS);
+  s->key = rowid;
+  ret = SQLExecute (s->get);
   if (SQL_SUCCEEDED (ret))
-  {
-    ret = SQLFetch (c->stmt);
-    if (SQL_SUCCEEDED (ret))
-    {
-      row = queue_row_alloc (q);
-      row->rowid = rowid;
-      for (i = 0; i < q->type->numfields; i++)
-      {
-	if ((col = m->cmap[i]) < 1)	/* column not mapped		*/
-	{
-	  debug ("%s not mapped\n", q->type->field[i]);
-	  continue;
-	}
-        ret = SQLGetData (c->stmt, col, SQL_C_CHAR, buf, 
-	  sizeof (buf), &ind);
-        if (SQL_SUCCEEDED (ret))
-        {
-          if (ind == SQL_NULL_DATA)
-	    *buf = 0;
-	  row->field[i] = stralloc (row->field[i], buf);
-	  // debug ("set %s=%s\n", q->type->field[i], buf);
-        }
-      }
-    }
-  }
+    row = odbcq_fetch (q, m, s->get);
   if ((row == NULL) && warn)
   {
     warn ("failed reading %s row %d: %s", q->name, rowid,
-      odbcq_error (buf, sizeof (buf), c->stmt, SQL_HANDLE_STMT));
+      odbcq_error (buf, sizeof (buf), s->get, SQL_HANDLE_STMT));
   }
-  SQLFreeStmt (c->stmt, SQL_CLOSE);
+  SQLFreeStmt (s->get, SQL_CLOSE);
+  odbcq_checkin (m->conn, d);
+  if (row != NULL)
+    row->rowid = rowid;
   return (row);
 }
 
@@ -533,52 +974,62 @@ QUEUEROW *odbcq_get (QUEUE *q, int rowid)
 int odbcq_del (QUEUE *q, int rowid)
 {
   ODBCQ *m;
-  ODBCQCONN *c;
+  ODBCQSTMTS *s;
+  ODBCQDB *d;
   SQLRETURN ret;
-  SQLSMALLINT col, i;
-  SQLINTEGER ind;
-  QUEUEROW *row = NULL;
   char buf[256];
 
   /*
-   * get the meta data
+   * get the meta data and a connection
    */
-  if ((m = odbcq_find (q)) == NULL)
+  if ((d = odbcq_handle (q, &m, &s)) == NULL)
     return (-1);
 
   /*
    * delete the row
    */
-  c = q->conn->conn;
-  SQLSetStmtAttr (c->stmt, SQL_ATTR_MAX_ROWS, (SQLPOINTER) 1, 0);
-  /* exec the statement */
-  sprintf (buf, "delete from %s where %s = %d",
-    q->table, q->type->field[0], rowid);
-  ret = SQLExecDirect (c->stmt, buf, SQL_NTS);
-  SQLFreeStmt (c->stmt, SQL_CLOSE);
+  s->key = rowid;
+  ret = SQLExecute (s->del);
+  SQLFreeStmt (s->del, SQL_CLOSE);
   if (!SQL_SUCCEEDED (ret))
   {
-     debug ("stmt: %s\n", buf);
-     error ("delete failed: %s", 
-       odbcq_error (buf, sizeof (buf), c->stmt, SQL_HANDLE_STMT));
-     return (-1);
-   } 
-  return (0);
+     error ("delete of row %d failed: %s", rowid,
+       odbcq_error (buf, sizeof (buf), s->del, SQL_HANDLE_STMT));
+     rowid = -1;
+  } 
+  else
+    rowid = 0;
+  odbcq_checkin (m->conn, d);
+  return (rowid);
 }
 
 /*
- * get the next transport row, or last row if transport < 0
+ * get up to n rows before this one, last first, call with rowid=0
+ * to start from the last row
  */
-QUEUEROW *odbcq_pop (QUEUE *q)
+int odbcq_page (QUEUE *q, int rowid, int n, QUEUEROW **rows)
 {
-  int rowid;
+  ODBCQ *m;
+  ODBCQSTMTS *s;
+  ODBCQDB *d;
 
-  if ((rowid = odbcq_transport (q)) < 0)
-    rowid = odbcq_lastrow (q);
-  debug ("popping row %d\n", rowid);
-  if (rowid == 0)
+  if ((n < 1) || ((d = odbcq_handle (q, &m, &s)) == NULL))
+    return (0);
+  n = odbcq_before (q, s, rowid, n, rows);
+  odbcq_checkin (m->conn, d);
+  return (n);
+}
+
+/*
+ * get the previous row, call with rowid=0 to get the last row
+ */
+QUEUEROW *odbcq_prev (QUEUE *q, int rowid)
+{
+  QUEUEROW *r;
+
+  if (odbcq_page (q, rowid, 1, &r) < 1)
     return (NULL);
-  return (odbcq_get (q, rowid));
+  return (r);
 }
 
 /*
@@ -586,58 +1037,76 @@ QUEUEROW *odbcq_pop (QUEUE *q)
  */
 QUEUEROW *odbcq_next (QUEUE *q, int rowid)
 {
-  int lastrow;
+  ODBCQ *m;
+  ODBCQSTMTS *s;
+  ODBCQDB *d;
   QUEUEROW *r;
+  int n;
 
-  lastrow = odbcq_lastrow (q);
-  debug ("next row after %d up to %d\n", rowid, lastrow);
-  while (rowid++ < lastrow)
-  {
-    if ((r = odbcq_wget (q, rowid, 0)) != NULL)
-      return (r);
-  }
-  return (NULL);
+  if ((d = odbcq_handle (q, &m, &s)) == NULL)
+    return (NULL);
+  debug ("next row after %d\n", rowid);
+  n = odbcq_read (q, s, s->after, rowid, 1, &r);
+  odbcq_checkin (m->conn, d);
+  if (n < 1)
+    return (NULL);
+  return (r);
 }
 
 /*
- * get the previous row, call with rowid=0 to get the last row
+ * get the next transport row, or last row if not a transport queue
  */
-QUEUEROW *odbcq_prev (QUEUE *q, int rowid)
+QUEUEROW *odbcq_pop (QUEUE *q)
 {
+  ODBCQ *m;
+  ODBCQSTMTS *s;
+  ODBCQDB *d;
   QUEUEROW *r;
+  int n;
 
-  if (rowid == 0)
-    rowid = odbcq_lastrow (q) + 1;
-  debug ("prev row to %d\n", rowid);
-  while (--rowid > 0)
-  {
-    if ((r = odbcq_wget (q, rowid, 0)) != NULL)
-      return (r);
-  }
-  return (NULL);
+  if ((d = odbcq_handle (q, &m, &s)) == NULL)
+    return (NULL);
+  if (m->transport < 0)
+    n = odbcq_before (q, s, 0, 1, &r);
+  else if ((n = odbcq_read (q, s, s->queued, m->transport, 1, &r)) > 0)
+    m->transport = r->rowid;
+  odbcq_checkin (m->conn, d);
+  if (n < 1)
+    return (NULL);
+  debug ("popped row %d\n", r->rowid);
+  return (r);
 }
 
 /*
  * Makes a connection to a PHINMS Access dB using ODBC.
  * Connect unc expected to be of form "DSN=the_odbc_name".  Look it up
  * in your Administrators ODBC connection lists.  User and pass are
- * typically NULL and ignored here.
+ * typically NULL and ignored here.  We open the first pooled
+ * connection now, and up to PoolSize as threads need them.
  */
 int odbcq_connect (QUEUECONN *conn)
 {
   ODBCQCONN *c;
+  ODBCQDB *d;
   SQLCHAR inbuf[1024];
   SQLCHAR buf[1024];
   SQLSMALLINT len;
 
   c = (ODBCQCONN *) malloc (sizeof (ODBCQCONN));
   memset (c, 0, sizeof (ODBCQCONN));
+  init_mutex (c);
+  init_ready (c, TRUE);
+  if ((c->size = conn->poolsize) < 1)
+    c->size = 1;
+  c->db = (ODBCQDB **) calloc (c->size, sizeof (ODBCQDB *));
   /* Allocate an environment handle */
   SQLAllocHandle (SQL_HANDLE_ENV, SQL_NULL_HANDLE, &c->env);
   /* We want ODBC 3 support */
   SQLSetEnvAttr (c->env, SQL_ATTR_ODBC_VERSION, (void *) SQL_OV_ODBC3, 0);
   /* Allocate a connection handle */
-  SQLAllocHandle (SQL_HANDLE_DBC, c->env, &c->dbc);
+  d = (ODBCQDB *) malloc (sizeof (ODBCQDB));
+  memset (d, 0, sizeof (ODBCQDB));
+  SQLAllocHandle (SQL_HANDLE_DBC, c->env, &d->dbc);
   /* 
    * build a connection string 
    */
@@ -667,27 +1136,34 @@ int odbcq_connect (QUEUECONN *conn)
   if (*conn->driver)
     len += sprintf (inbuf + len, "DRIVER={%s};", conn->driver);
   /* Connect to the DSN mydsn */
-  if (!SQL_SUCCEEDED (SQLDriverConnect (c->dbc, NULL, inbuf, SQL_NTS,
+  if (!SQL_SUCCEEDED (SQLDriverConnect (d->dbc, NULL, inbuf, SQL_NTS,
     buf, sizeof (buf), &len, SQL_DRIVER_COMPLETE)))
   {
     error ("SQLDriverConnect to %s:\n%s", 
-      inbuf, odbcq_error (buf, sizeof (buf), c->dbc, SQL_HANDLE_DBC));
+      inbuf, odbcq_error (buf, sizeof (buf), d->dbc, SQL_HANDLE_DBC));
+    SQLFreeHandle (SQL_HANDLE_DBC, d->dbc);
+    free (d);
     odbcq_close (c);
     return (-1);
   }
   /* Allocate a statement handle */
-  SQLAllocHandle (SQL_HANDLE_STMT, c->dbc, &c->stmt);
-
-  debug ("conn=%x c=%x handle=%x\n", conn, c, c->dbc);
+  SQLAllocHandle (SQL_HANDLE_STMT, d->dbc, &d->stmt);
+  /* pool it, and keep the completed string for the rest */
   buf[len] = 0;
+  c->dsn = strdup (buf);
+  c->db[c->open++] = c->free = d;
+
+  debug ("conn=%x c=%x handle=%x\n", conn, c, d->dbc);
   conn->conn = c;
   conn->close = odbcq_close;
   conn->push = odbcq_push;
+  conn->pushbatch = odbcq_pushbatch;
   conn->pop = odbcq_pop;
   conn->get = odbcq_get;
   conn->del = odbcq_del;
   conn->nextrow = odbcq_next;
   conn->prevrow = odbcq_prev;
+  conn->page = odbcq_page;
   info ("ODBC connected %s\n", buf);
   return (0);
 }
@@ -845,6 +1321,159 @@ int build_queues ()
   return (0);
 }
 
+/*
+ * time pushing and getting rows, run with "bench"
+ */
+#define BENCHROWS 2000
+
+int bench (QUEUE *q, QUEUEROW *(*fn)(QUEUEROW *r))
+{
+  int i, first;
+  DWORD t;
+  QUEUEROW *r, *rows[100];
+
+  r = queue_row_alloc (q);
+  t = GetTickCount ();
+  for (i = 0; i < BENCHROWS; i++)
+  {
+    fn (r);
+    if (queue_push (r) < 1)
+      error ("Bench push failed\n");
+    if (i == 0)
+      first = r->rowid;
+  }
+  t = GetTickCount () - t;
+  info ("%s push %d rows %d ms %d rows/sec\n", q->name, BENCHROWS, t,
+    BENCHROWS * 1000 / (t ? t : 1));
+  queue_row_free (r);
+  t = GetTickCount ();
+  for (i = 0; i < BENCHROWS; i++)
+  {
+    if ((r = queue_get (q, first + i)) == NULL)
+      error ("Bench get %d failed\n", first + i);
+    queue_row_free (r);
+  }
+  t = GetTickCount () - t;
+  info ("%s get %d rows %d ms %d rows/sec\n", q->name, BENCHROWS, t,
+    BENCHROWS * 1000 / (t ? t : 1));
+  t = GetTickCount ();
+  for (i = 0, r = queue_next (q, first - 1); r != NULL; i++)
+  {
+    first = r->rowid;
+    queue_row_free (r);
+    r = queue_next (q, first);
+  }
+  t = GetTickCount () - t;
+  info ("%s next %d rows %d ms %d rows/sec\n", q->name, i, t,
+    i * 1000 / (t ? t : 1));
+  for (i = 0; i < 100; i++)
+    rows[i] = queue_row_alloc (q);
+  t = GetTickCount ();
+  for (first = 0; first < BENCHROWS; first += 100)
+  {
+    for (i = 0; i < 100; i++)
+      fn (rows[i]);
+    if (queue_push_batch (q, rows, 100) != 100)
+      error ("Bench batch push failed\n");
+  }
+  t = GetTickCount () - t;
+  info ("%s batch push %d rows %d ms %d rows/sec\n", q->name, BENCHROWS,
+    t, BENCHROWS * 1000 / (t ? t : 1));
+  for (i = 0; i < 100; i++)
+  {
+    if ((r = queue_get (q, rows[i]->rowid)) == NULL)
+      error ("Bench get batch row %d failed\n", rows[i]->rowid);
+    queue_row_free (r);
+    queue_row_free (rows[i]);
+  }
+  return (0);
+}
+
+/*
+ * Time both queues pushing at once from their own threads, first 
+ * sharing one connection and then with the configured pool.
+ */
+int BenchDone[2];
+
+void bench_push (int t)
+{
+  int i;
+  QUEUE *q;
+  QUEUEROW *r;
+
+  q = queue_find (t ? "AccessSendQ" : "AccessReceiveQ");
+  r = queue_row_alloc (q);
+  for (i = 0; i < BENCHROWS; i++)
+  {
+    if (t)
+      rand_trans (r);
+    else
+      rand_rcv (r);
+    r->rowid = 0;
+    if (queue_push (r) < 1)
+      error ("Bench push failed\n");
+  }
+  queue_row_free (r);
+  BenchDone[t] = 1;
+  t_exit ();
+}
+
+int bench_pool (QUEUE *q)
+{
+  ODBCQCONN *c;
+  int i, k, size[2];
+  DWORD t;
+
+  c = (ODBCQCONN *) q->conn->conn;
+  size[0] = 1;
+  size[1] = q->conn->poolsize;
+  for (k = 0; k < 2; k++)
+  {
+    c->size = size[k];
+    t = GetTickCount ();
+    for (i = 0; i < 2; i++)
+    {
+      BenchDone[i] = 0;
+      t_start (bench_push, (void *) i);
+    }
+    for (i = 0; i < 2; i++)
+    {
+      while (!BenchDone[i])
+	sleep (1);
+    }
+    t = GetTickCount () - t;
+    info ("pool %d push %d rows %d ms %d rows/sec\n", size[k], 
+      2 * BENCHROWS, t, 2 * BENCHROWS * 1000 / (t ? t : 1));
+  }
+  return (0);
+}
+
+/*
+ * check a page of rows against walking back with prev
+ */
+int check_page (QUEUE *q)
+{
+  int i, n;
+  QUEUEROW *r, *rows[10];
+
+  n = queue_page (q, 0, 10, rows);
+  r = queue_prev (q, 0);
+  for (i = 0; i < n; i++)
+  {
+    if ((r == NULL) || (r->rowid != rows[i]->rowid))
+      error ("page row %d doesn't match prev\n", rows[i]->rowid);
+    if (r != NULL)
+    {
+      queue_row_free (r);
+      r = queue_prev (q, rows[i]->rowid);
+    }
+    queue_row_free (rows[i]);
+  }
+  if (r != NULL)
+    queue_row_free (r);
+  return (n);
+}
+
 int dump_row (QUEUEROW *r)
 {
   char *ch;
@@ -875,6 +1504,14 @@ int main (int argc, char **argv)
   debug ("Configuring...\n");
   if (queue_init (xml))
     fatal ("Couldn't initialize from config/Queues.xml!\n");
+  if ((argc > 1) && (strcmp (argv[1], "bench") == 0))
+  {
+    bench (queue_find ("AccessReceiveQ"), rand_rcv);
+    bench (queue_find ("AccessSendQ"), rand_trans);
+    bench_pool (queue_find ("AccessSendQ"));
+    queue_shutdown ();
+    exit (Errors);
+  }
   if (argc > 1)
     build_queues ();
   q = queue_find ("AccessReceiveQ");
@@ -887,8 +1524,10 @@ int main (int argc, char **argv)
   if ((r = queue_pop (q)) == NULL)
     error ("Couldn't pop queue %s\n", q->name);
   else
+  {
+    i = r->rowid - 10;
     dump_row (r);
-  i = r->rowid - 10;
+  }
   if ((r = queue_prev (q, i)) == NULL)
     error ("Couldn't get prev row %d queue %s\n", i, q->name);
   else
@@ -898,6 +1537,8 @@ int main (int argc, char **argv)
     i = r->rowid;
     dump_row (r);
   }
+  if (check_page (q) < 1)
+    error ("Couldn't page queue %s\n", q->name);
   q = queue_find ("AccessSendQ");
   if (q == NULL)
     fatal ("Couldn't find AccessSendQ\n");
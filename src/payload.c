@@ -21,6 +21,7 @@
 #endif
 
 #include <stdio.h>
+#include <io.h>
 #include "util.h"
 #include "log.h"
 #include "b64.h"
@@ -33,6 +34,29 @@
 #define debug(fmt...)
 #endif
 
+/*
+ * Get the payload file name from the disposition
+ *
+ * part has our MIME envelope
+ * filename get copy of payload name 
+ * return filename or NULL if not found
+ */
+char *payload_name (MIME *part, char *filename)
+{
+  char *ch;
+
+  *filename = 0;
+  if ((ch = mime_getHeader (part, MIME_DISPOSITION)) != NULL)
+    ch = strchr (ch, '"');
+  if (ch == NULL)
+    return (NULL);
+  strcpy (filename, ch + 1);
+  if ((ch = strchr (filename, '"')) != NULL)
+    *ch = 0;
+  debug ("filename=%s\n", filename);
+  return (filename);
+}
+
 /*
  * Process a payload envelope
  *
@@ -61,17 +85,12 @@ int payload_process (MIME *part, unsigned char **data, char *filename,
   /*
    * first get the file name from the disposition...
    */
-  if ((ch = mime_getHeader (part, MIME_DISPOSITION)) != NULL)
-    ch = strchr (ch, '"');
-  if (ch == NULL)
+  if (payload_name (part, filename) == NULL)
   {
     *data ="Missing Payload DISPOSITION";
     error ("%s\n", *data);
     return (0);
   }
-  strcpy (filename, ch + 1);
-  *strchr (filename, '"') = 0;
-  debug ("filename=%s\n", filename);
   /*
    * next decrypt the data... assume it is not
    */
@@ -133,6 +152,121 @@ int payload_process (MIME *part, unsigned char **data, char *filename,
   return (0);
 }
 
+/*
+ * Copy len bytes of a file to another, base64 decoding if needed
+ * returns the length written
+ */
+#define PBUFSZ 8192
+
+static long payload_copy (FILE *in, long len, FILE *out, int decode)
+{
+  char buf[PBUFSZ + 1], carry[5];
+  unsigned char dec[PBUFSZ];
+  long sz;
+  int n;
+
+  *carry = 0;
+  for (sz = 0; len > 0; len -= n)
+  {
+    n = len < PBUFSZ ? len : PBUFSZ;
+    if ((n = fread (buf, 1, n, in)) < 1)
+      break;
+    if (decode)
+      sz += fwrite (dec, 1, b64_decode_part (dec, buf, n, carry), out);
+    else
+      sz += fwrite (buf, 1, n, out);
+  }
+  if (decode)
+    sz += fwrite (dec, 1, b64_decode (dec, carry), out);
+  return (sz);
+}
+
+/*
+ * Process a payload envelope kept in a file, decoding or decrypting
+ * it straight into another file so it is never held in memory
+ *
+ * part has our MIME envelope headers
+ * in is positioned at the payload body of len bytes
+ * out gets the payload
+ * unc and pw used for decryption
+ * dn gets DN found if empty, otherwise must match
+ * emsg gets the error message if fails
+ * return len or 0 for failure
+ */
+long payload_stream (MIME *part, FILE *in, long len, FILE *out,
+    char *unc, char *dn, char *pw, char **emsg)
+{
+  char *ch;
+  long offset, sz;
+
+  *emsg = "";
+  if ((ch = mime_getHeader (part, MIME_CONTENT)) == NULL)
+  {
+    /*
+     * use payload as is (assume text)
+     */
+    return (payload_copy (in, len, out, 0));
+  }
+  if (strstr (ch, MIME_XML) != NULL)
+  {
+    /*
+     * encryption envelope attached
+     */
+    offset = ftell (in);
+    if ((sz = xcrypt_decrypt_fp (in, len, out, unc, dn, pw)) > 0)
+    {
+      info ("payload decryption successful\n");
+      return (sz);
+    }
+    /* PHINMS simply stores the XML envelope	*/
+    warn ("failed to decrypt payload\n");
+    fflush (out);
+    chsize (fileno (out), 0);
+    rewind (out);
+    fseek (in, offset, SEEK_SET);
+    return (payload_copy (in, len, out, 0));
+  }
+  if (strstr (ch, MIME_OCTET) != NULL)
+  {
+    if (((ch = mime_getHeader (part, MIME_ENCODING)) != NULL)
+      && (strstarts (ch, "base64\r\n")))
+    {
+      return (payload_copy (in, len, out, 1));
+    }
+    *emsg = "Unknown payload encoding";
+    error ("%s '%s'\n", *emsg, ch);
+    return (0);
+  }
+  *emsg = "Unsupported payload Content-Type";
+  error ("%s: %s\n", *emsg, ch);
+  return (0);
+}
+
+/*
+ * Allocate a payload envelope with it's MIME headers set
+ */
+static MIME *payload_alloc (char *fname, char *org, int encrypted)
+{
+  MIME *msg;
+  char buf[MAX_PATH];
+
+  debug ("getpayload container...\n");
+  msg = mime_alloc ();
+  sprintf (buf, "<%s@%s>", basename (fname), org);
+  debug ("content ID: %s\n", buf);
+  mime_setHeader (msg, MIME_CONTENTID, buf, 0);
+  if (encrypted)
+    mime_setHeader (msg, MIME_CONTENT, MIME_XML, 99);
+  else
+  {
+    mime_setHeader (msg, MIME_CONTENT, MIME_OCTET, 99);
+    mime_setHeader (msg, MIME_ENCODING, MIME_BASE64, 99);
+  }
+  sprintf (buf, "attachment; name=\"%s\"", basename (fname));
+  mime_setHeader (msg, MIME_DISPOSITION, buf, 99);
+  return (msg);
+}
+
 /*
  * Create a payload envelope
  *
@@ -148,37 +282,27 @@ MIME *payload_create (unsigned char *data, int len,
 {
   MIME *msg;
   char *ch;
-  char buf[MAX_PATH];
 
   if ((data == NULL) || (len < 1) || (fname == NULL) || (org == NULL))
     return (NULL);
-  debug ("getpayload container...\n");
-  msg = mime_alloc ();
-  sprintf (buf, "<%s@%s>", basename (fname), org);
-  debug ("content ID: %s\n", buf);
-  mime_setHeader (msg, MIME_CONTENTID, buf, 0);
   if ((unc == NULL) || (*unc == 0))	/* not encrypted		*/
   {
     debug ("no encryption... plain payload\n");
-    mime_setHeader (msg, MIME_CONTENT, MIME_OCTET, 99);
-    mime_setHeader (msg, MIME_ENCODING, MIME_BASE64, 99);
+    msg = payload_alloc (fname, org, 0);
     /*
      * base64 encode the payload
      */
-    ch = (char *) malloc ((int) (1.4 * len));
+    ch = (char *) malloc (b64_size (len, 76) + 1);
     len = b64_encode (ch, data, len ,76);
   }
   else					/* encrypted			*/
   {
     XML *xml;
 
-    mime_setHeader (msg, MIME_CONTENT, MIME_XML, 99);
     debug ("creating payload encryption xml using %s\n", unc);
     if ((xml = xcrypt_encrypt (data, len, unc, dn, pw, TRIPLEDES)) == NULL)
-    {
-      mime_free (msg);
       return (NULL);
-    }
+    msg = payload_alloc (fname, org, 1);
 #ifdef UNITTEST
     xml_beautify (xml, 2);
 #endif
@@ -186,13 +310,60 @@ MIME *payload_create (unsigned char *data, int len,
     len = strlen (ch);
     xml_free (xml);
   }
-  sprintf (buf, "attachment; name=\"%s\"", basename (fname));
-  mime_setHeader (msg, MIME_DISPOSITION, buf, 99);
   mime_setBody (msg, ch, len);
   free (ch);
   return (msg);
 }
 
+/*
+ * Create a payload envelope from a file, which is read as the
+ * envelope gets written, so the payload is never held in memory
+ *
+ * fp is positioned at the payload
+ * len of payload
+ * spool gets the envelope when encrypted
+ * fname and org for the organization for MIME headers
+ * unc and pw for encryption
+ * dn gets DN of certificate used and inserted into envelope
+ * return the MIME envelope or NULL if fails
+ *
+ * The envelope owns fp and spool, and both are closed if it fails.
+ */
+MIME *payload_create_fp (FILE *fp, long len, FILE *spool,
+    char *fname, char *org, char *unc, char *dn, char *pw)
+{
+  MIME *msg = NULL;
+
+  if ((fp == NULL) || (len < 1) || (fname == NULL) || (org == NULL))
+    debug ("missing payload file, name, or organization\n");
+  else if ((unc == NULL) || (*unc == 0))	/* not encrypted	*/
+  {
+    debug ("no encryption... plain payload\n");
+    msg = payload_alloc (fname, org, 0);
+    mime_setFile (msg, fp, len, 1);
+    fp = NULL;
+  }
+  else if (spool == NULL)
+    error ("No spool file for %s encryption\n", fname);
+  else					/* encrypted			*/
+  {
+    debug ("streaming payload encryption xml using %s\n", unc);
+    if ((len = xcrypt_encrypt_fp (fp, len, spool, unc, dn, pw, 
+      TRIPLEDES)) > 0)
+    {
+      msg = payload_alloc (fname, org, 1);
+      rewind (spool);
+      mime_setFile (msg, spool, len, 0);
+      spool = NULL;
+    }
+  }
+  if (fp != NULL)
+    fclose (fp);
+  if (spool != NULL)
+    fclose (spool);
+  return (msg);
+}
+
 #ifdef UNITTEST
 #undef UNITTEST
 #undef debug
@@ -206,6 +377,53 @@ MIME *payload_create (unsigned char *data, int len,
 #include "crypt.c"
 #include "xcrypt.c"
 
+/*
+ * create an envelope from a file, and check it formats to something
+ * we can stream back to the original
+ */
+void test_create_fp (char *msg, char *unc, char *dn, char *pw)
+{
+  MIME *env;
+  FILE *in, *out;
+  char *data, *body, *emsg, buf[MAX_PATH];
+  long len;
+
+  if ((in = tmpfile ()) == NULL || (out = tmpfile ()) == NULL)
+    fatal ("can't open temporary files\n");
+  fwrite (msg, 1, strlen (msg) + 1, in);
+  rewind (in);
+  env = payload_create_fp (in, strlen (msg) + 1, out, "foobar", 
+    "some org", unc, dn, pw);
+  if (env == NULL)
+  {
+    error ("failed to create envelope from a file\n");
+    return;
+  }
+  data = mime_format (env);
+  debug ("MIME: %s\n", data);
+  if ((body = strstr (data, "\r\n\r\n")) == NULL)
+    error ("envelope from a file has no body\n");
+  else if (strlen (body += 4) != mime_getLength (env))
+    error ("envelope body is %d bytes but Content-Length %d\n",
+      strlen (body), mime_getLength (env));
+  else
+  {
+    in = tmpfile ();
+    out = tmpfile ();
+    fwrite (body, 1, strlen (body), in);
+    rewind (in);
+    len = payload_stream (env, in, strlen (body), out, unc, dn, pw, &emsg);
+    rewind (out);
+    fread (buf, 1, len, out);
+    if ((len != strlen (msg) + 1) || strcmp (buf, msg))
+      error ("envelope from a file decoded wrong:%.*s\n", len, buf);
+    fclose (in);
+    fclose (out);
+  }
+  free (data);
+  mime_free (env);
+}
+
 int main (int argc, char **argv)
 {
   MIME *env;
@@ -215,6 +433,8 @@ int main (int argc, char **argv)
   char dn[MAX_PATH];
   char fname[MAX_PATH];
   char *pw = "changeit";
+  FILE *in, *out;
+  char *emsg;
   int len;
 
   debug ("initializing...\n");
@@ -240,7 +460,28 @@ int main (int argc, char **argv)
   if (strcmp (data, msg))
     fatal ("message decrypted wrong:%.*s\n", len, data);
   free (data);
+  /*
+   * again, but from a file
+   */
+  if ((in = tmpfile ()) == NULL || (out = tmpfile ()) == NULL)
+    fatal ("can't open temporary files\n");
+  fwrite (mime_getBody (env), 1, env->len, in);
+  rewind (in);
+  len = payload_stream (env, in, env->len, out, unc, dn, pw, &emsg);
+  if (len != strlen (msg) + 1)
+    error ("wrong streamed len: %d vs %d\n", len, strlen (msg) + 1);
+  rewind (out);
+  fread (fname, 1, len, out);
+  if (strcmp (fname, msg))
+    error ("streamed message decrypted wrong:%.*s\n", len, fname);
+  fclose (in);
+  fclose (out);
   mime_free (env);
+  /*
+   * and created from a file, both plain and encrypted
+   */
+  test_create_fp (msg, NULL, dn, pw);
+  test_create_fp (msg, unc, dn, pw);
   info ("%s %s\n", argv[0], Errors ? "failed" : "passed");
   exit (Errors);
 }
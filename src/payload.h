@@ -19,6 +19,15 @@
 #define __PAYLOAD__
 #include "mime.h"
 
+/*
+ * Get the payload file name from the disposition
+ *
+ * part has our MIME envelope
+ * filename get copy of payload name 
+ * return filename or NULL if not found
+ */
+char *payload_name (MIME *part, char *filename);
+
 /*
  * Process a payload envelope
  *
@@ -32,6 +41,21 @@
 int payload_process (MIME *part, unsigned char **data, char *filename,
     char *unc, char *dn, char *pw); 
 
+/*
+ * Process a payload envelope kept in a file, decoding or decrypting
+ * it straight into another file
+ *
+ * part has our MIME envelope headers
+ * in is positioned at the payload body of len bytes
+ * out gets the payload
+ * unc and pw used for decryption
+ * dn gets DN found if empty, otherwise must match
+ * emsg gets the error message if fails
+ * return len or 0 for failure
+ */
+long payload_stream (MIME *part, FILE *in, long len, FILE *out,
+    char *unc, char *dn, char *pw, char **emsg);
+
 /*
  * Create a payload envelope
  *
@@ -45,4 +69,21 @@ int payload_process (MIME *part, unsigned char **data, char *filename,
 MIME *payload_create (unsigned char *data, int len, 
     char *fname, char *org, char *unc, char *dn, char *pw);
 
+/*
+ * Create a payload envelope from a file, which is read as the
+ * envelope gets written, so the payload is never held in memory
+ *
+ * fp is positioned at the payload
+ * len of payload
+ * spool gets the envelope when encrypted
+ * fname and org for the organization for MIME headers
+ * unc and pw for encryption
+ * dn gets DN of certificate used and inserted into envelope
+ * return the MIME envelope or NULL if fails
+ *
+ * The envelope owns fp and spool, and both are closed if it fails.
+ */
+MIME *payload_create_fp (FILE *fp, long len, FILE *spool,
+    char *fname, char *org, char *unc, char *dn, char *pw);
+
 #endif
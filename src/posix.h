@@ -0,0 +1,207 @@
+/*
+ * posix.h
+ *
+ * Copyright 2011-2012 Thomas L Dunnick
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+/*
+ * Stand-ins for the few Windows calls the task, queue, and utility
+ * layers make, so queues (e.g. SQLite queues and their bench) build
+ * on a plain POSIX box with pthreads.  Only what those layers use is
+ * here - the rest of Phineas still needs Windows.
+ */
+#ifndef __POSIX__
+#define __POSIX__
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <limits.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+typedef unsigned long DWORD;
+typedef long LONG;
+typedef int BOOL;
+
+#ifndef TRUE
+#define TRUE 1
+#define FALSE 0
+#endif
+#ifndef MAX_PATH
+#define MAX_PATH PATH_MAX
+#endif
+#define INFINITE 0xFFFFFFFF
+#define WAIT_OBJECT_0 0
+#define WAIT_TIMEOUT 258
+
+#define stricmp strcasecmp
+#define strnicmp strncasecmp
+#define _fullpath(d,s,n) realpath (s, d)
+
+/*
+ * milliseconds since some time in the past
+ */
+static DWORD GetTickCount (void)
+{
+  struct timespec t;
+
+  clock_gettime (CLOCK_MONOTONIC, &t);
+  return ((DWORD) (t.tv_sec * 1000 + t.tv_nsec / 1000000));
+}
+
+static void Sleep (DWORD ms)
+{
+  usleep (ms * 1000);
+}
+
+#define InterlockedExchange(p,v) __sync_lock_test_and_set (p, v)
+#define InterlockedIncrement(p) __sync_add_and_fetch (p, 1)
+#define InterlockedDecrement(p) __sync_sub_and_fetch (p, 1)
+
+/*
+ * critical sections are recursive mutexes
+ */
+typedef pthread_mutex_t CRITICAL_SECTION;
+
+static void InitializeCriticalSection (CRITICAL_SECTION *m)
+{
+  pthread_mutexattr_t a;
+
+  pthread_mutexattr_init (&a);
+  pthread_mutexattr_settype (&a, PTHREAD_MUTEX_RECURSIVE);
+  pthread_mutex_init (m, &a);
+  pthread_mutexattr_destroy (&a);
+}
+
+#define DeleteCriticalSection(m) pthread_mutex_destroy (m)
+#define EnterCriticalSection(m) pthread_mutex_lock (m)
+#define LeaveCriticalSection(m) pthread_mutex_unlock (m)
+
+/*
+ * events, and the only handles we need
+ */
+typedef struct posixevent
+{
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  int manual;			/* stays set until reset		*/
+  int set;
+  long sets;			/* times set, to release all waiting	*/
+} *HANDLE;
+
+static HANDLE CreateEvent (void *attr, BOOL manual, BOOL set, char *name)
+{
+  HANDLE e;
+
+  e = (HANDLE) malloc (sizeof (*e));
+  pthread_mutex_init (&e->mutex, NULL);
+  pthread_cond_init (&e->cond, NULL);
+  e->manual = manual;
+  e->set = set;
+  e->sets = 0;
+  return (e);
+}
+
+static BOOL CloseHandle (HANDLE e)
+{
+  pthread_cond_destroy (&e->cond);
+  pthread_mutex_destroy (&e->mutex);
+  free (e);
+  return (TRUE);
+}
+
+static BOOL SetEvent (HANDLE e)
+{
+  pthread_mutex_lock (&e->mutex);
+  e->set = 1;
+  e->sets++;
+  if (e->manual)
+    pthread_cond_broadcast (&e->cond);
+  else
+    pthread_cond_signal (&e->cond);
+  pthread_mutex_unlock (&e->mutex);
+  return (TRUE);
+}
+
+static BOOL ResetEvent (HANDLE e)
+{
+  pthread_mutex_lock (&e->mutex);
+  e->set = 0;
+  pthread_mutex_unlock (&e->mutex);
+  return (TRUE);
+}
+
+/*
+ * Like Windows, setting a manual event releases everyone waiting on
+ * it, even if it is reset before they get to run.
+ */
+static DWORD WaitForSingleObject (HANDLE e, DWORD ms)
+{
+  struct timespec t;
+  int r = 0;
+  long sets;
+
+  clock_gettime (CLOCK_REALTIME, &t);
+  t.tv_sec += ms / 1000;
+  if ((t.tv_nsec += (ms % 1000) * 1000000) >= 1000000000)
+  {
+    t.tv_sec++;
+    t.tv_nsec -= 1000000000;
+  }
+  pthread_mutex_lock (&e->mutex);
+  sets = e->sets;
+  while (!e->set && !(e->manual && (e->sets != sets)) && (r != ETIMEDOUT))
+  {
+    if (ms == INFINITE)
+      pthread_cond_wait (&e->cond, &e->mutex);
+    else
+      r = pthread_cond_timedwait (&e->cond, &e->mutex, &t);
+  }
+  if (e->set || (e->manual && (e->sets != sets)))
+  {
+    r = WAIT_OBJECT_0;
+    if (!e->manual)
+      e->set = 0;
+  }
+  else
+    r = WAIT_TIMEOUT;
+  pthread_mutex_unlock (&e->mutex);
+  return (r);
+}
+
+/*
+ * detached threads
+ */
+static unsigned long _beginthread (void (*fn)(void *), unsigned stack,
+  void *parm)
+{
+  pthread_t t;
+  pthread_attr_t a;
+
+  pthread_attr_init (&a);
+  pthread_attr_setdetachstate (&a, PTHREAD_CREATE_DETACHED);
+  if (pthread_create (&t, &a, (void *(*)(void *)) fn, parm))
+    t = (pthread_t) -1;
+  pthread_attr_destroy (&a);
+  return ((unsigned long) t);
+}
+
+#define _endthread() pthread_exit (NULL)
+
+#endif /* __POSIX__ */
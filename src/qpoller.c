@@ -38,11 +38,30 @@
 
 #define QP_INFO "Phineas.QueueInfo"
 #define QP_QUEUE QP_INFO".Queue"
+/* default rows waiting for each stage, beyond those running */
+#define QP_STAGEQUEUE 2
+
+/*
+ * The threads for a stage of a pipeline, and a bound on the rows
+ * handed to it so faster stages can't run ahead of slower ones.
+ */
+typedef struct qpollerstage
+{
+  MUTEX mutex;
+  READY ready;			/* set when a row leaves the stage	*/
+  TASKQ *q;			/* threads running the stage		*/
+  int jobs;			/* rows queued or running		*/
+  int depth;			/* most rows allowed			*/
+} QPOLLERSTAGE;
 
 typedef struct qpoller
 {
   struct qpoller *next;
   int (*proc) (XML *, QUEUEROW *);
+  QPSTAGE *stage;		/* or a pipeline of stages		*/
+  int stages;
+  void (*cleanup) (void *);	/* for rows dropped at shutdown		*/
+  QPOLLERSTAGE *pipe;		/* running each stage			*/
   char type[1];
 } QPOLLER;
 
@@ -51,36 +70,154 @@ QPOLLER *Qpoller = NULL;
 typedef struct qpollerjob
 {
   struct qpollerjob *next;
-  int (*proc) (XML *, QUEUEROW *);
+  QPOLLER *poller;		/* NULL when the job is done		*/
   XML *xml;
   QUEUEROW *row;
+  TASKQ *q;
+  int stage;			/* pipeline stage running		*/
+  int held;			/* held out of the stage's count	*/
+  void *data;			/* passed from stage to stage		*/
 } QPOLLERJOB;
 
 QPOLLERJOB *QpollerJobs = NULL;
 
+/*
+ * Wait for room in a pipeline stage and count a row into it.  Once
+ * the stage is stopping, let the row in anyway - it gets dropped.
+ */
+void qpoller_enter (QPOLLERSTAGE *s)
+{
+  wait_mutex (s);
+  while ((s->jobs >= s->depth) && !task_stopping (s->q))
+  {
+    end_mutex (s);
+    wait_ready_for (s, 1000);
+    wait_mutex (s);
+  }
+  s->jobs++;
+  end_mutex (s);
+}
+
+/*
+ * count a row out of a pipeline stage, waking anyone waiting for
+ * room.  The first stage is filled by the poller.
+ */
+void qpoller_leave (QPOLLERSTAGE *s, int first)
+{
+  int full;
+
+  wait_mutex (s);
+  full = s->jobs-- >= s->depth;
+  end_mutex (s);
+  set_ready (s);
+  if (full && first)
+    queue_notify ();
+}
+
+/*
+ * Check for room in the first stage of a pipeline
+ */
+int qpoller_room (QPOLLER *poller)
+{
+  if (poller->pipe == NULL)
+    return (1);
+  return (poller->pipe->jobs < poller->pipe->depth);
+}
+
 /*
  * run a poller
+ * A processor returning a positive number of seconds isn't ready
+ * to handle the row yet (e.g. a retry isn't due), so hold the job
+ * and run it again then.  In a pipeline, a stage returning zero
+ * passes the row to the next stage, once it has room.  Held rows
+ * don't count against a stage's room.
  */
 int qpoller_run (void *p)
 {
   QPOLLERJOB *job;
+  QPOLLERSTAGE *s;
+  int delay;
 
   job = (QPOLLERJOB *) p;
-  job->proc (job->xml, job->row);
-  job->proc = NULL;
+  if (job->held)
+  {
+    s = job->poller->pipe + job->stage;
+    wait_mutex (s);
+    s->jobs++;
+    end_mutex (s);
+    job->held = 0;
+  }
+  if (job->poller->stage == NULL)
+    delay = job->poller->proc (job->xml, job->row);
+  else
+    delay = job->poller->stage[job->stage].proc (job->xml, job->row,
+      &job->data);
+  if (delay > 0)
+  {
+    debug ("holding %s row %d for %d seconds\n", 
+      job->row->queue->name, job->row->rowid, delay);
+    if (job->poller->pipe != NULL)
+    {
+      s = job->poller->pipe + job->stage;
+      qpoller_leave (s, s == job->poller->pipe);
+      job->held = 1;
+    }
+    return (task_delay (job->q, delay * 1000, qpoller_run, p));
+  }
+  if (job->poller->pipe != NULL)
+  {
+    s = job->poller->pipe + job->stage;
+    if ((delay == 0) && (++job->stage < job->poller->stages))
+    {
+      debug ("passing %s row %d to stage %s\n", job->row->queue->name,
+	job->row->rowid, job->poller->stage[job->stage].name);
+      qpoller_enter (s + 1);
+      qpoller_leave (s, s == job->poller->pipe);
+      job->q = s[1].q;
+      return (task_add (job->q, qpoller_run, p));
+    }
+    qpoller_leave (s, s == job->poller->pipe);
+  }
+  job->poller = NULL;
+  return (0);
+}
+
+/*
+ * Check for a job already running (or holding) this row.  A row
+ * held for a retry is pushed back as queued, and a row waiting in
+ * a pipeline is still queued in the store, so a queue may pop it
+ * again before it's job is done.
+ */
+int qpoller_live (QUEUEROW *row)
+{
+  QPOLLERJOB *j;
+
+  for (j = QpollerJobs; j != NULL; j = j->next)
+  {
+    if ((j->poller != NULL) && (j->row->queue == row->queue) &&
+      (j->row->rowid == row->rowid))
+      return (1);
+  }
   return (0);
 }
 
 /*
  * start up a poller
+ * return non-zero if the row already has a job
  */
 int qpoller_start (QPOLLER *poller, XML *xml, QUEUEROW *row, TASKQ *q)
 {
   QPOLLERJOB **p;
 
+  if (qpoller_live (row))
+  {
+    debug ("%s row %d already has a job\n", row->queue->name, 
+      row->rowid);
+    return (-1);
+  }
   for (p = &QpollerJobs; *p != NULL; p = &(*p)->next)
   {
-    if ((*p)->proc == NULL)
+    if ((*p)->poller == NULL)
       break;
   }
   if (*p == NULL)
@@ -88,9 +225,18 @@ int qpoller_start (QPOLLER *poller, XML *xml, QUEUEROW *row, TASKQ *q)
     *p = (QPOLLERJOB *) malloc (sizeof (QPOLLERJOB));
     (*p)->next = NULL;
   }
-  (*p)->proc = poller->proc;
   (*p)->xml = xml;
   (*p)->row = row;
+  (*p)->stage = 0;
+  (*p)->held = 0;
+  (*p)->data = NULL;
+  if (poller->pipe != NULL)
+  {
+    q = poller->pipe->q;
+    qpoller_enter (poller->pipe);
+  }
+  (*p)->q = q;
+  (*p)->poller = poller;
   task_add (q, qpoller_run, (void *) *p);
   debug ("starting processor %s for %s row %d\n", poller->type,
     row->queue->name, row->rowid);
@@ -98,18 +244,102 @@ int qpoller_start (QPOLLER *poller, XML *xml, QUEUEROW *row, TASKQ *q)
 }
 
 /*
- * register a processor for a queue type
+ * add a processor to the list
  */
-void qpoller_register (char *type, int (*proc) (XML *, QUEUEROW *))
+QPOLLER *qpoller_add (char *type)
 {
   QPOLLER *n, **p;
 
   n = (QPOLLER *) malloc (sizeof (QPOLLER) + strlen (type));
-  n->next = NULL;
-  n->proc = proc;
+  memset (n, 0, sizeof (QPOLLER));
   strcpy (n->type, type);
   for (p = &Qpoller; *p != NULL; p = &(*p)->next);
   *p = n;
+  return (n);
+}
+
+/*
+ * register a processor for a queue type
+ */
+void qpoller_register (char *type, int (*proc) (XML *, QUEUEROW *))
+{
+  qpoller_add (type)->proc = proc;
+}
+
+/*
+ * register a pipeline of processor stages for a queue type
+ */
+void qpoller_register_stages (char *type, QPSTAGE *stage, int num,
+  void (*cleanup) (void *))
+{
+  QPOLLER *n;
+
+  n = qpoller_add (type);
+  n->stage = stage;
+  n->stages = num;
+  n->cleanup = cleanup;
+}
+
+/*
+ * Start the threads for each stage of a pipeline.  A stage gets
+ * QueueInfo.<name>Threads threads, or as many as the poller if
+ * not given.
+ */
+void qpoller_pipe (QPOLLER *poller, XML *xml, int threads, int timeout)
+{
+  int i, n, depth;
+  QPOLLERSTAGE *s;
+  char path[MAX_PATH];
+
+  if ((depth = xml_get_int (xml, QP_INFO".StageQueue")) < 1)
+    depth = QP_STAGEQUEUE;
+  poller->pipe = (QPOLLERSTAGE *) 
+    malloc (poller->stages * sizeof (QPOLLERSTAGE));
+  for (i = 0; i < poller->stages; i++)
+  {
+    s = poller->pipe + i;
+    sprintf (path, QP_INFO".%sThreads", poller->stage[i].name);
+    if ((n = xml_get_int (xml, path)) < 1)
+      n = threads;
+    debug ("%s stage %s has %d threads\n", poller->type,
+      poller->stage[i].name, n);
+    init_mutex (s);
+    init_ready (s, FALSE);
+    s->q = task_allocq (n, timeout);
+    s->jobs = 0;
+    s->depth = n + depth;
+  }
+}
+
+/*
+ * Stop a pipeline's threads, first stage first so rows in later
+ * stages can drain.
+ */
+void qpoller_pipe_stop (QPOLLER *poller)
+{
+  int i;
+
+  for (i = 0; i < poller->stages; i++)
+    task_stop (poller->pipe[i].q);
+}
+
+/*
+ * free a pipeline's threads
+ */
+void qpoller_pipe_free (QPOLLER *poller)
+{
+  int i;
+  QPOLLERSTAGE *s;
+
+  for (i = 0; i < poller->stages; i++)
+  {
+    s = poller->pipe + i;
+    task_freeq (s->q);
+    destroy_ready (s);
+    destroy_mutex (s);
+  }
+  free (poller->pipe);
+  poller->pipe = NULL;
 }
 
 /*
@@ -145,9 +375,11 @@ int qpoller_poll (XML *xml, int mapid, TASKQ *tq)
     debug ("Can't find queue %s\n", ch);
     return (-1);
   }
-  while ((r = queue_pop (q)) != NULL)
+  /* leave rows queued while a pipeline is full			*/
+  while (qpoller_room (p) && ((r = queue_pop (q)) != NULL))
   {
-    qpoller_start (p, xml, r, tq);
+    if (qpoller_start (p, xml, r, tq))
+      queue_row_free (r);
   }
   return (0);
 }
@@ -177,6 +409,11 @@ int qpoller_task (void *parm)
   if ((i = xml_get_int (xml, QP_INFO".MaxThreads")) < 1)
     i = 1;
   q = task_allocq (i, poll_interval);
+  for (p = Qpoller; p != NULL; p = p->next)
+  {
+    if (p->stage != NULL)
+      qpoller_pipe (p, xml, i, poll_interval);
+  }
   debug ("%d queues %d interval\n", num_queues, poll_interval);
   while (phineas_running ())
   {
@@ -184,19 +421,30 @@ int qpoller_task (void *parm)
     {
       qpoller_poll (xml, i, q);
     }
-    sleep (poll_interval);
+    queue_wait (poll_interval);	/* until something is queued	*/
   }
   debug ("Queue Poller shutting down...\n");
   task_stop (q);
+  for (p = Qpoller; p != NULL; p = p->next)
+  {
+    if (p->pipe != NULL)
+      qpoller_pipe_stop (p);
+  }
   task_freeq (q);
+  /* rows left in a pipeline are popped again at restart		*/
   while ((j = QpollerJobs) != NULL)
   {
     QpollerJobs = j->next;
+    if ((j->poller != NULL) && (j->poller->cleanup != NULL) &&
+      (j->data != NULL))
+      j->poller->cleanup (j->data);
     free (j);
   }
   while ((p = Qpoller) != NULL)
   {
     Qpoller = p->next;
+    if (p->pipe != NULL)
+      qpoller_pipe_free (p);
     free (p);
   }
   info ("Queue Poller exiting\n");
@@ -218,9 +466,19 @@ int qpoller_task (void *parm)
 #include "fileq.c"
 #include "odbcq.c"
 
+#define TESTROWS 20
+
 int ran = 0;
+int Pipelined = 0;		/* rows in the pipeline test		*/
+LONG Staged[3],			/* rows run by each stage		*/
+     Cleaned = 0,		/* rows dropped at shutdown		*/
+     InFlight = 0,		/* rows in the pipeline			*/
+     MaxFlight = 0;
+
 int phineas_running  ()
 {
+  if (Pipelined)
+    return ((Staged[2] < Pipelined) && (ran++ < 50));
   return (ran++ < 3);
 }
 
@@ -230,17 +488,157 @@ int test_qprocessor (XML *x, QUEUEROW *r)
   return (0);
 }
 
+int test_hold (XML *x, QUEUEROW *r)
+{
+  return (60);
+}
+
+/*
+ * a stage that keeps it's row in the pipeline until released
+ */
+int Released = 0;
+
+int test_wait (XML *x, QUEUEROW *r, void **data)
+{
+  while (!Released)
+    sleep (10);
+  return (0);
+}
+
+QPSTAGE WaitStages[] =
+{
+  { "Wait", test_wait }
+};
+
+/*
+ * pipeline stages, checking each row goes through them in order
+ */
+int test_build (XML *x, QUEUEROW *r, void **data)
+{
+  LONG n;
+
+  if (*data != NULL)
+    error ("Row %d already built\n", r->rowid);
+  if ((n = InterlockedIncrement (&InFlight)) > MaxFlight)
+    MaxFlight = n;
+  *data = malloc (sizeof (int));
+  *(int *) *data = 1;
+  InterlockedIncrement (Staged);
+  return (0);
+}
+
+int test_encrypt (XML *x, QUEUEROW *r, void **data)
+{
+  if ((*data == NULL) || (*(int *) *data != 1))
+    error ("Row %d encrypted out of order\n", r->rowid);
+  else
+    *(int *) *data = 2;
+  InterlockedIncrement (Staged + 1);
+  return (0);
+}
+
+int test_send (XML *x, QUEUEROW *r, void **data)
+{
+  if ((*data == NULL) || (*(int *) *data != 2))
+    error ("Row %d sent out of order\n", r->rowid);
+  free (*data);
+  *data = NULL;
+  queue_field_set (r, "PROCESSINGSTATUS", "done");
+  queue_field_set (r, "TRANSPORTSTATUS", "success");
+  queue_push (r);
+  InterlockedDecrement (&InFlight);
+  InterlockedIncrement (Staged + 2);
+  return (0);
+}
+
+void test_cleanup (void *data)
+{
+  InterlockedIncrement (&Cleaned);
+  InterlockedDecrement (&InFlight);
+  free (data);
+}
+
+QPSTAGE TestStages[] =
+{
+  { "Build", test_build },
+  { "Encrypt", test_encrypt },
+  { "Send", test_send }
+};
+
 int main (int argc, char **argv)
 {
   XML *xml;
   char *ch;
+  int i;
+  QUEUE *q;
+  QUEUEROW *r, *r2;
+  QPOLLER *p;
+  TASKQ *tq;
 
   xml = xml_parse (PhineasConfig);
   loadpath (xml_get_text (xml, "Phineas.InstallDirectory"));
   queue_init (xml);
+
+  debug ("held row test...\n");
+  if ((q = queue_find ("MemSendQ")) == NULL)
+    error ("Can't find MemSendQ\n");
+  else
+  {
+    tq = task_allocq (1, 1000);
+    qpoller_register ("HoldQ", test_hold);
+    r = queue_row_alloc (q);
+    r2 = queue_row_alloc (q);
+    r->rowid = r2->rowid = -1;
+    if (qpoller_start (Qpoller, xml, r, tq))
+      error ("Couldn't start held row\n");
+    if (qpoller_start (Qpoller, xml, r2, tq) == 0)
+      error ("Held row started twice\n");
+    task_freeq (tq);
+    queue_row_free (r2);
+
+    debug ("pipelined row test...\n");
+    qpoller_register_stages ("WaitQ", WaitStages, 1, NULL);
+    for (p = Qpoller; strcmp (p->type, "WaitQ"); p = p->next);
+    qpoller_pipe (p, xml, 1, 1000);
+    r = queue_row_alloc (q);
+    r2 = queue_row_alloc (q);
+    r->rowid = r2->rowid = -2;
+    if (qpoller_start (p, xml, r, NULL))
+      error ("Couldn't start pipelined row\n");
+    if (qpoller_start (p, xml, r2, NULL) == 0)
+      error ("Pipelined row started twice\n");
+    Released = 1;
+    qpoller_pipe_stop (p);
+    qpoller_pipe_free (p);
+    queue_row_free (r2);
+  }
+
   debug ("begin registration...\n");
   qpoller_register ("EbXmlSndQ", test_qprocessor);
   qpoller_task (xml);
+
+  debug ("pipeline test...\n");
+  if ((q = queue_find ("MemSendQ")) == NULL)
+    error ("Can't find MemSendQ\n");
+  for (i = 0; (q != NULL) && (i < TESTROWS); i++)
+  {
+    r = queue_row_alloc (q);
+    queue_field_set (r, "PROCESSINGSTATUS", "queued");
+    queue_field_set (r, "TRANSPORTSTATUS", "queued");
+    queue_push (r);
+    queue_row_free (r);
+  }
+  Pipelined = TESTROWS;
+  qpoller_register_stages ("EbXmlSndQ", TestStages, 3, test_cleanup);
+  qpoller_task (xml);
+  if (Staged[0] < TESTROWS)
+    error ("Only %d of %d rows built\n", Staged[0], TESTROWS);
+  if (Staged[2] + Cleaned != Staged[0])
+    error ("%d rows built but %d sent and %d dropped\n", Staged[0],
+      Staged[2], Cleaned);
+  /* each stage's threads plus StageQueue waiting			*/
+  if (MaxFlight > 6 + 3 * QP_STAGEQUEUE)
+    error ("%d rows in the pipeline at once\n", MaxFlight);
   xml_free (xml);
   info ("%s %s\n", argv[0], Errors ? "failed" : "passed");
   exit (Errors);
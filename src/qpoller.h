@@ -21,10 +21,32 @@
 #include "xml.h"
 #include "queue.h"
 
+/*
+ * A stage of a queue processor pipeline.  Each stage runs on it's
+ * own QueueInfo.<name>Threads threads, and only so many rows may
+ * wait for a stage, so a slow stage holds back the ones before it.
+ * A stage returns zero to pass the row on (or finish with it at
+ * the last stage), a positive number of seconds to hold and run it
+ * again, or negative when done with it.  Data is passed from stage
+ * to stage and should be freed (and cleared) once done.
+ */
+typedef struct qpstage
+{
+  char *name;
+  int (*proc) (XML *xml, QUEUEROW *r, void **data);
+} QPSTAGE;
+
 /*
  * register a processor for a queue type
  */
-void poller_register (char *type, int (*proc) (XML *, QUEUEROW *));
+void qpoller_register (char *type, int (*proc) (XML *, QUEUEROW *));
+
+/*
+ * register a pipeline of num processor stages for a queue type.
+ * Cleanup frees the data for rows left in the pipeline at shutdown.
+ */
+void qpoller_register_stages (char *type, QPSTAGE *stage, int num,
+  void (*cleanup) (void *));
 
 /*
  * Poll all queues...
@@ -41,6 +41,9 @@ extern int fileq_connect (QUEUECONN *);
 #ifdef __ODBCQ__
 extern int odbcq_connect (QUEUECONN *);
 #endif
+#ifdef __SQLITEQ__
+extern int sqliteq_connect (QUEUECONN *);
+#endif
 
 int no_connect (QUEUECONN *conn)
 {
@@ -63,6 +66,9 @@ QUEUEAPI QApi[] =
 #endif
 #ifdef __ODBCQ__
   { odbcq_connect, "odbc" },
+#endif
+#ifdef __SQLITEQ__
+  { sqliteq_connect, "sqlite" },
 #endif
   { no_connect, "none" }
 };
@@ -83,6 +89,18 @@ QUEUECONN *QConn = NULL;		/* the connections		*/
 QUEUETYPE *QType = NULL;		/* the queue types		*/
 QUEUE *Queue = NULL;			/* all the queues		*/
 
+/*
+ * Set when a row is pushed "queued", so a poller can wait on it
+ * instead of sleeping.  Rows added outside of Phineas (e.g. directly
+ * to an ODBC table) don't set it, so pollers should still time out.
+ */
+typedef struct queuenotice
+{
+  READY ready;
+} QUEUENOTICE;
+
+QUEUENOTICE QNotice = { NULL };
+
 /******************** private entry points ******************************/
 /*
  * allocate and open a connection from the XML configuration
@@ -95,7 +113,8 @@ QUEUECONN *queue_conn_alloc (XML *xml, int index)
        *unc,
        *user,
        *pass,
-       *driver;
+       *driver,
+       *sync;
   int i, sz;
 
   name = xml_getf (xml, "%s[%d].Name", QP_CONN, index);
@@ -126,6 +145,21 @@ QUEUECONN *queue_conn_alloc (XML *xml, int index)
   strcpy (conn->passwd, pass);
   conn->driver = conn->passwd + strlen (pass) + 1;
   strcpy (conn->driver, driver);
+  conn->compact = atoi (xml_getf (xml, "%s[%d].CompactRatio", 
+    QP_CONN, index));
+  sync = xml_getf (xml, "%s[%d].Sync", QP_CONN, index);
+  if (stricmp (sync, "row") == 0)
+    conn->syncmode = QSYNC_ROW;
+  else if (stricmp (sync, "group") == 0)
+    conn->syncmode = QSYNC_GROUP;
+  else
+    conn->syncmode = QSYNC_NONE;
+  conn->syncdelay = atoi (xml_getf (xml, "%s[%d].SyncDelay", 
+    QP_CONN, index));
+  conn->syncrows = atoi (xml_getf (xml, "%s[%d].SyncRows", 
+    QP_CONN, index));
+  conn->poolsize = atoi (xml_getf (xml, "%s[%d].PoolSize", 
+    QP_CONN, index));
   debug ("allocated connection=%x for %s\n", conn, name);
   return (conn);
 }
@@ -278,6 +312,8 @@ int queue_init (XML *xml)
 
   if (xml == NULL)
     return (-1);
+  if (QNotice.ready == NULL)
+    init_ready ((&QNotice), FALSE);
   n = xml_count (xml, QP_CONN);
   debug ("allocating %d connections\n", n);
   for (i = 0; i < n; i++)
@@ -341,6 +377,11 @@ void queue_shutdown (void)
       c->close (c->conn);
     free (c);
   }
+  if (QNotice.ready != NULL)
+  {
+    destroy_ready ((&QNotice));
+    QNotice.ready = NULL;
+  }
 }
 
 /*
@@ -372,7 +413,8 @@ QUEUE *queue_find (char *name)
 /*
  * The convensions for "pop" is to return either the 
  * highest record, or for queues with TRANSPORTSTATUS return
- * the oldest record where TRANSPORTSTATUS is "queued".
+ * the oldest record where TRANSPORTSTATUS is "queued".  File 
+ * queues return those with a higher PRIORITY first.
  */
 QUEUEROW *queue_pop (QUEUE *q)
 {
@@ -388,20 +430,90 @@ QUEUEROW *queue_pop (QUEUE *q)
 
 /*
  * A "push" will update records with rowid > 0, or assign the
- * next row to this record and insert it.
+ * next row to this record and insert it.  If the connection
+ * commits, we wait for that after letting go of the queue, so 
+ * other threads can push rows to share the commit.
  */
 int queue_push (QUEUEROW *r)
 {
   int id;
+  char *ch;
 
   if (r == NULL)
     return (-1);
   wait_mutex (r->queue);
   id = r->queue->conn->push (r);
   end_mutex (r->queue);
+  if ((id > 0) && (r->queue->conn->commit != NULL))
+    r->queue->conn->commit (r->queue);
+  if ((id > 0) && ((ch = queue_field_get (r, "PROCESSINGSTATUS")) != NULL)
+    && !strcmp (ch, "queued"))
+    queue_notify ();
   return (id);
 }
 
+/*
+ * Push n rows of a queue together, for one backend write where the
+ * connection supports it, or one row at a time where it doesn't.
+ * Returns the number of rows pushed, stopping at the first that 
+ * fails, so when short, the count indexes the row that failed.  A
+ * connection writing the rows as one transaction pushes all or none.
+ */
+int queue_push_batch (QUEUE *q, QUEUEROW **rows, int n)
+{
+  int i, queued;
+  char *ch;
+
+  if ((q == NULL) || (n < 1))
+    return (0);
+  wait_mutex (q);
+  if (q->conn->pushbatch != NULL)
+    n = q->conn->pushbatch (q, rows, n);
+  else
+  {
+    for (i = 0; i < n; i++)
+    {
+      if (q->conn->push (rows[i]) < 1)
+        break;
+    }
+    n = i;
+  }
+  end_mutex (q);
+  if ((n > 0) && (q->conn->commit != NULL))
+    q->conn->commit (q);
+  for (i = queued = 0; (i < n) && !queued; i++)
+  {
+    queued = ((ch = queue_field_get (rows[i], "PROCESSINGSTATUS")) != NULL)
+      && !strcmp (ch, "queued");
+  }
+  if (queued)
+    queue_notify ();
+  return (n);
+}
+
+/*
+ * Wake anyone waiting for queued rows
+ */
+void queue_notify (void)
+{
+  if (QNotice.ready != NULL)
+    set_ready ((&QNotice));
+}
+
+/*
+ * Wait up to ms milliseconds for a row to be queued.  Return zero
+ * if one was (since the last wait), non-zero if we timed out.
+ */
+int queue_wait (int ms)
+{
+  if (QNotice.ready == NULL)
+  {
+    sleep (ms);
+    return (-1);
+  }
+  return (wait_ready_for ((&QNotice), ms) != TASK_READY);
+}
+
 /*
  * delete a row
  */
@@ -412,6 +524,8 @@ int queue_delete (QUEUE *q, int rowid)
   wait_mutex (q);
   rowid = q->conn->del (q, rowid);
   end_mutex (q);
+  if ((rowid == 0) && (q->conn->commit != NULL))
+    q->conn->commit (q);
   return (rowid);
 }
 
@@ -460,6 +574,30 @@ QUEUEROW *queue_prev (QUEUE *q, int rowid)
   return (r);
 }
 
+/*
+ * Retrieve up to n rows before this one, last first, for paging
+ * through a queue.  Use 0 to start with the last row.  Connections
+ * without a page() get them one at a time, but all under one lock.
+ */
+int queue_page (QUEUE *q, int rowid, int n, QUEUEROW **rows)
+{
+  int i;
+
+  if (q == NULL)
+    return (0);
+  wait_mutex (q);
+  if (q->conn->page != NULL)
+    i = q->conn->page (q, rowid, n, rows);
+  else for (i = 0; i < n; i++)
+  {
+    if ((rows[i] = q->conn->prevrow (q, rowid)) == NULL)
+      break;
+    rowid = rows[i]->rowid;
+  }
+  end_mutex (q);
+  return (i);
+}
+
 /*
  * Allocate a row
  */
@@ -564,6 +702,11 @@ int main (int argc, char **argv)
   debug ("attempting initialization\n");
   if (queue_init (xml))
     fatal ("Couldn't initialize from config/Queues.xml!\n");
+  if (queue_wait (10) == 0)
+    error ("queue_wait didn't time out\n");
+  queue_notify ();
+  if (queue_wait (1000))
+    error ("queue_wait missed notification\n");
   debug ("attempting shutdown\n");
   if (queue_shutdown ())
     fatal ("Failed shutdown\n");
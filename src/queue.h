@@ -27,6 +27,11 @@
 #define EBXMLSENDQ "EbXmlSndQ"
 #define EBXMLRCVQ "EbXmlRcvQ"
 
+/* how hard to try to get writes to disk			*/
+#define QSYNC_NONE 0			/* leave it to the OS		*/
+#define QSYNC_ROW 1			/* sync before a push returns	*/
+#define QSYNC_GROUP 2			/* wait to sync rows together	*/
+
 /*
  * Describes the basic fields and data structure.  Each implemtation
  * needs
@@ -70,9 +75,12 @@ typedef struct queuerow
  * connect() parse the unc for host, port, db, etc
  * shutdown () closes the connecition
  * push() add a row
+ * pushbatch() optionally add or update n rows in one write
+ * commit() optionally wait for pushes to get to disk
  * pop() remove a row
  * next() read the next row
  * prev() read the previous row
+ * page() optionally read up to n rows before rowid in one call
  */
 typedef struct queueconn
 {
@@ -84,13 +92,21 @@ typedef struct queueconn
   char *passwd;			/* password for authentication	*/
   char *driver;			/* driver used			*/
   void *conn;			/* private data			*/
+  int compact;			/* dead to live rows to compact	*/
+  int syncmode,			/* QSYNC_NONE, _ROW, or _GROUP	*/
+      syncdelay,		/* ms to wait for a group	*/
+      syncrows;			/* rows to make a group		*/
+  int poolsize;			/* dB connections to pool	*/
   int (*close) (void *conn);
   int (*push) (QUEUEROW *row);
+  int (*pushbatch) (QUEUE *q, QUEUEROW **rows, int n);
+  int (*commit) (QUEUE *q);
   int (*del) (QUEUE *q, int rowid);
   QUEUEROW *(*pop) (QUEUE *q);
   QUEUEROW *(*get) (QUEUE *q, int rowid);
   QUEUEROW *(*nextrow) (QUEUE *q, int rowid);
   QUEUEROW *(*prevrow) (QUEUE *q, int rowid);
+  int (*page) (QUEUE *q, int rowid, int n, QUEUEROW **rows);
 } QUEUECONN;
 
 
@@ -105,14 +121,22 @@ QUEUE *queue_find (char *name);
 QUEUEROW *queue_pop (QUEUE *q);
 /* add or update row of a queue */
 int queue_push (QUEUEROW *r);
+/* add or update n rows of a queue together, returning the number pushed */
+int queue_push_batch (QUEUE *q, QUEUEROW **rows, int n);
 /* get a row of a queue */
 QUEUEROW *queue_get (QUEUE *q, int rowid);
 /* get the next row of a queue */
 QUEUEROW *queue_next (QUEUE *q, int rowid);
 /* get the previous row of a queue */
 QUEUEROW *queue_prev (QUEUE *q, int rowid);
+/* get up to n rows before rowid (0 for the last), returning the count */
+int queue_page (QUEUE *q, int rowid, int n, QUEUEROW **rows);
 /* delete a queue row */
 int queue_delete (QUEUE *q, int rowid);
+/* wake pollers waiting on queued rows */
+void queue_notify (void);
+/* wait for a row to be queued, return non-zero on timeout */
+int queue_wait (int ms);
 
 /************************ queue row function **************************/
 /* get a fresh queue row */
@@ -28,6 +28,8 @@
 
 #ifdef __SERVER__
 
+#define FD_SETSIZE 512		/* allow for lots of parked connections	*/
+
 #include <stdio.h>
 #include <stdarg.h>
 #include <ctype.h>
@@ -43,12 +45,32 @@
 #endif
 
 /*
- * a TASK parameter
+ * Between requests connections are parked in a poller, and only 
+ * handed to a worker TASK once a request header has arrived.  Workers
+ * hand connections back when they are done with a request.
  */
-typedef struct
+#define SERVERMAXCONN (FD_SETSIZE - 3)
+
+typedef struct serverpoll
 {
+  MUTEX mutex;
+  struct serverparm *parked;	/* connections workers are done with	*/
+  SOCKET wakeup;		/* datagram socket to wake the poller	*/
+  struct sockaddr_in sin;	/* and it's address			*/
+} SERVERPOLL;
+
+/*
+ * a TASK parameter, and a parked connection
+ */
+typedef struct serverparm
+{
+  struct serverparm *next;
   NETCON *conn;
   XML *xml;
+  SERVERPOLL *poll;
+  SSL_CTX *ctx;			/* set while negotiating SSL		*/
+  int want;			/* what negotiations are waiting on	*/
+  DWORD idle;			/* when this connection was last busy	*/
 } SERVERPARM;
 
 /*
@@ -63,7 +85,7 @@ SSL_CTX *server_ctx (XML *xml)
        key[MAX_PATH], 
        auth[MAX_PATH];
 
-  info ("Initializing SSL context\n");
+  debug ("getting SSL context\n");
   ch = xml_get_text (xml, "Phineas.Server.SSL.CertFile");
   if (*ch == 0)
     return (NULL);
@@ -81,18 +103,21 @@ SSL_CTX *server_ctx (XML *xml)
     ch = NULL;
   else
     ch = pathf (auth, "%s", ch);
-  if ((ctx = net_ctx (cert, key, passwd, ch, 1)) == NULL)
+  if ((ctx = net_ctx_get ("server", cert, key, passwd, ch, 1,
+    xml_get_int (xml, "Phineas.Server.SSL.SessionCacheSize"),
+    xml_get_int (xml, "Phineas.Server.SSL.SessionTimeout"))) == NULL)
     error ("Failed getting SSL context for server\n");
   return (ctx);
 }
 
 /*
- * Receive an incoming message
+ * Read an incoming message header up to the empty line, and set
+ * len to it's Content-Length.
  */
-DBUF *server_receive (NETCON *conn)
+DBUF *server_getheader (NETCON *conn, long *len)
 {
   long n, sz;
-  char c, *ch;
+  char *ch, line[DBUFSZ];
   DBUF *b;
 
   b = dbuf_alloc ();
@@ -100,16 +125,18 @@ DBUF *server_receive (NETCON *conn)
   /*
    * read to end of message request header - empty line
    */
-  while (net_read (conn, &c, 1) == 1)
+  while ((sz = net_gets (conn, line, DBUFSZ)) > 0)
   {
-    dbuf_putc (b, c);
-    if (c == '\n')
+    dbuf_write (b, line, sz);
+    if (line[sz - 1] != '\n')
+      n = 0;
+    else if ((n == 1) && ((sz == 1) || ((sz == 2) && (*line == '\r'))))
     {
-      if (n++ == 1)
-        break;
+      n = 2;
+      break;
     }
-    else if (c != '\r')
-      n = 0;
+    else
+      n = 1;
   }
   if (n != 2)
   {
@@ -131,29 +158,119 @@ DBUF *server_receive (NETCON *conn)
       n = atol (ch + 16);
   }
   debug ("expecting %d bytes\n", n);
+  *len = n;
+  return (b);
+}
+
+/*
+ * Read the content of an incoming message into our buffer.
+ */
+int server_getcontent (NETCON *conn, DBUF *b, long n)
+{
+  long sz;
+
+readbytes:
+
+  /*
+   * read the content straight into our (presized) buffer
+   */
+  if (n > 0)
+  {
+    dbuf_expand (b, n);
+    sz = net_read (conn, dbuf_getbuf (b) + dbuf_size (b), n);
+    dbuf_setsize (b, dbuf_size (b) + sz);
+    // note we'll take what we get and hope it's enough...
+    if (sz < n)
+      error ("Read failed or connection closed\n");
+  }
+  if (n = net_available (conn))
+  {
+    warn ("Found %d unread bytes...\n", n);
+    goto readbytes;
+  }
+  debug ("returning %d bytes\n", dbuf_size (b));
+  return (dbuf_size (b));
+}
+
+/*
+ * Receive an incoming message
+ */
+DBUF *server_receive (NETCON *conn)
+{
+  long n;
+  DBUF *b;
+
+  b = server_getheader (conn, &n);
+  server_getcontent (conn, b, n);
+  return (b);
+}
+
+/*
+ * Large ebXML requests get their content spooled to a temporary
+ * file instead of memory.  Return 1 and set path if we spooled it,
+ * or -1 if we couldn't write all of it, in which case the content
+ * is still read and discarded but the request should be rejected.
+ */
+int server_spool (XML *xml, NETCON *conn, char *req, long n, char *path)
+{
+  long sz;
+  int failed = 0;
+  FILE *fp;
+  char buf[NETBUFSZ];
+
+  *path = 0;
+#ifdef __RECEIVER__
+  sz = xml_get_int (xml, "Phineas.Server.SpoolSize");
+  if ((sz < 1) || (n <= sz) || !strstarts (req, "POST ") ||
+    !strstarts (req + 5, xml_get_text (xml, "Phineas.Receiver.Url")))
+    return (0);
+  ppathf (path, xml_get_text (xml, "Phineas.TempDirectory"),
+    "spool%ld", GetCurrentThreadId ());
+  if ((fp = fopen (path, "wb")) == NULL)
+  {
+    warn ("Can't spool request to %s\n", path);
+    *path = 0;
+    return (0);
+  }
+  debug ("spooling %d bytes to %s\n", n, path);
 
 readbytes:
 
-  while (n--)
+  while (n > 0)
   {
-    if ((sz = net_read (conn, &c, 1)) != 1)
+    if ((sz = net_read (conn, buf, n < NETBUFSZ ? n : NETBUFSZ)) < 1)
     {
-      if (sz  == 0)
-        error ("Read failed or connection closed\n");
-      else
-        error ("Read timed out\n");
       // note we'll take what we get and hope it's enough...
+      error ("Read failed or connection closed\n");
       break;
     }
-    dbuf_putc (b, c);
+    if (!failed && (fwrite (buf, 1, sz, fp) != sz))
+    {
+      error ("Failed writing request to %s\n", path);
+      failed = 1;
+    }
+    n -= sz;
   }
   if (n = net_available (conn))
   {
     warn ("Found %d unread bytes...\n", n);
     goto readbytes;
   }
-  debug ("returning %d bytes\n", dbuf_size (b));
-  return (b);
+  if (fclose (fp) && !failed)
+  {
+    error ("Failed closing spooled request %s\n", path);
+    failed = 1;
+  }
+  if (failed)
+  {
+    unlink (path);
+    *path = 0;
+    return (-1);
+  }
+  return (1);
+#else
+  return (0);
+#endif
 }
 
 /*
@@ -193,12 +310,14 @@ DBUF *server_respond (int code, char *fmt, ...)
 }
 
 /*
- * return response for a request
+ * return response for a request, which may have it's content
+ * spooled to a file.  Any header kept apart from the response
+ * content is added to hdr.
  */
-DBUF *server_response (XML *xml, char *req)
+DBUF *server_response (XML *xml, char *req, char *spool, DBUF *hdr)
 {
   char *url, *ch;
-  DBUF *console_response (XML *, char *);
+  DBUF *console_response (XML *, char *, DBUF *);
   extern char Software[];
 
   if (strstarts (req, "GET "))
@@ -214,7 +333,11 @@ DBUF *server_response (XML *xml, char *req)
     if (url == req + 5)		/* this a POST?			*/
     {
       debug ("getting ebXML response\n");
-      if ((ch = ebxml_process_req (xml, req)) != NULL)
+      if (*spool)
+        ch = ebxml_process_spool (xml, req, spool);
+      else
+        ch = ebxml_process_req (xml, req);
+      if (ch != NULL)
         return (dbuf_setbuf (NULL, ch, strlen (ch)));
     }
     return (server_respond (200, "<h3>%s</h3>Receiver", Software));
@@ -223,7 +346,7 @@ DBUF *server_response (XML *xml, char *req)
 #ifdef __CONSOLE__
   ch = xml_get_text (xml, "Phineas.Console.Url");
   if (strstarts (url, ch) || strstarts (url, "/favicon.ico"))
-    return (console_response (xml, req));
+    return (console_response (xml, req, hdr));
 #endif
   if ((ch = strchr (url, '\n')) == NULL)
     ch = url + strlen (url);
@@ -233,17 +356,19 @@ DBUF *server_response (XML *xml, char *req)
 }
 
 /*
- * set any needed header info
+ * Format the status line for a response into buf, returning it's
+ * length.  The response header is in hdr, or leads the content b.
  */
-int server_header (DBUF *b)
+int server_header (DBUF *hdr, DBUF *b, char *buf)
 {
   char *ch,
        *status;
   int l,
       code = 200;
-  char buf[120];
 
   /* find the end of the current header and get return code */
+  if (dbuf_size (hdr))
+    b = hdr;
   if (strstarts (ch = dbuf_getbuf (b), "Status:"))
     code = atoi (ch + 8);
   l = 0;
@@ -273,9 +398,8 @@ int server_header (DBUF *b)
     status = "SERVER ERROR";
   l = sprintf (buf, "HTTP/1.1 %d %s\r\n%s",
     code, status, l ? "" : "\r\n");
-  debug ("inserting header %s", buf);
-  dbuf_insert (b, 0, buf, l);
-  return (0);
+  debug ("status %s", buf);
+  return (l);
 }
 
 void server_logrequest (NETCON *conn, int sz, char *req)
@@ -291,89 +415,239 @@ void server_logrequest (NETCON *conn, int sz, char *req)
   info ("%s: %.*s\n", net_remotehost (conn, buf), i, req);
 }
 
+/*
+ * allocate a poller and it's wakeup socket
+ */
+SERVERPOLL *server_poll_alloc ()
+{
+  SERVERPOLL *p;
+  int l;
+  unsigned long arg = 1;
+
+  p = (SERVERPOLL *) malloc (sizeof (SERVERPOLL));
+  init_mutex (p);
+  p->parked = NULL;
+  memset (&p->sin, 0, sizeof (p->sin));
+  p->sin.sin_family = AF_INET;
+  p->sin.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+  l = sizeof (p->sin);
+  if (((p->wakeup = socket (AF_INET, SOCK_DGRAM, 0)) == INVALID_SOCKET) ||
+    bind (p->wakeup, (struct sockaddr *) &p->sin, sizeof (p->sin)) ||
+    getsockname (p->wakeup, (struct sockaddr *) &p->sin, &l) ||
+    ioctlsocket (p->wakeup, FIONBIO, &arg))
+  {
+    warn ("Can't open server wakeup socket\n");
+    if (p->wakeup != INVALID_SOCKET)
+      closesocket (p->wakeup);
+    p->wakeup = INVALID_SOCKET;
+  }
+  return (p);
+}
+
+/*
+ * close a connection and free it's parameter
+ */
+void server_close (SERVERPARM *s)
+{
+  if (s->conn != NULL)
+    net_close (s->conn);
+  if (s->ctx != NULL)
+    SSL_CTX_free (s->ctx);
+  free (s);
+}
+
+/*
+ * free a poller and anything still parked there
+ */
+void server_poll_free (SERVERPOLL *p)
+{
+  SERVERPARM *s;
+
+  while ((s = p->parked) != NULL)
+  {
+    p->parked = s->next;
+    server_close (s);
+  }
+  if (p->wakeup != INVALID_SOCKET)
+    closesocket (p->wakeup);
+  destroy_mutex (p);
+  free (p);
+}
+
+/*
+ * hand a connection back to the poller and wake it up
+ */
+void server_park (SERVERPARM *s)
+{
+  SERVERPOLL *p = s->poll;
+
+  wait_mutex (p);
+  s->next = p->parked;
+  p->parked = s;
+  end_mutex (p);
+  if (p->wakeup != INVALID_SOCKET)
+    sendto (p->wakeup, "", 1, 0, (struct sockaddr *) &p->sin, 
+      sizeof (p->sin));
+}
+
+/*
+ * Return true if a connection has buffered a complete request, or
+ * as much of one as it can.
+ */
+int server_ready (SERVERPARM *s)
+{
+  char *buf, *ch;
+  int len, h;
+
+  if ((len = net_peek (s->conn, &buf)) < 1)
+    return (0);
+  if (len == NETBUFSZ)
+    return (1);
+  if ((ch = strnstr (buf, "\n\r\n", len)) != NULL)
+    h = ch - buf + 3;
+  else if ((ch = strnstr (buf, "\n\n", len)) != NULL)
+    h = ch - buf + 2;
+  else
+    return (0);
+  if ((ch = strnstr (buf, "Content-Length: ", h)) == NULL)
+    return (1);
+  /*
+   * if it won't fit then the worker gets to read the rest
+   */
+  h += atol (ch + 16);
+  return ((len >= h) || (h >= NETBUFSZ));
+}
+
 /*
  * TASK to handle an incoming request
  */
 int server_request (void *parm)
 {
   SERVERPARM *s;
-  DBUF *req, *res;
-  char *curl;
+  DBUF *req, *res, *hdr;
+  NETVEC v[3];
+  long n;
+  int spooled;
+  char *curl,
+       status[120],
+       spool[MAX_PATH];
 
   s = (SERVERPARM *) parm;
   curl = xml_get_text (s->xml, "Phineas.Console.Url");
-  res = NULL;
-  while ((req = server_receive (s->conn)) != NULL)
+  req = server_getheader (s->conn, &n);
+  if (dbuf_size (req) == 0)
   {
-    debug ("received %d bytes\n", dbuf_size (req));
-    if (dbuf_size (req) == 0)
-    {
-      dbuf_free (req);
-      net_close (s->conn);
-      return (-1);
-    }
-    dbuf_putc (req, 0);
-    /*
-     * log the request, but filter out GET requests for the console... 
-     * noise
-     */
-    if (!(*curl && strstarts (dbuf_getbuf (req) + 4, curl)))
-      server_logrequest (s->conn, dbuf_size (req), dbuf_getbuf (req));
-    if ((res = server_response (s->xml, dbuf_getbuf (req))) == NULL)
-    {
-      res = server_respond (500,
-	    "<h3>Failure processing ebXML request</h3>");
-    }
-    server_header (res);
-    net_write (s->conn, dbuf_getbuf (res), dbuf_size (res));
-    dbuf_free (res);
     dbuf_free (req);
+    server_close (s);
+    return (-1);
+  }
+  if (!(spooled = server_spool (s->xml, s->conn, dbuf_getbuf (req), n, 
+    spool)))
+    server_getcontent (s->conn, req, n);
+  debug ("received %d bytes\n", dbuf_size (req));
+  dbuf_putc (req, 0);
+  /*
+   * log the request, but filter out GET requests for the console... 
+   * noise
+   */
+  if (!(*curl && strstarts (dbuf_getbuf (req) + 4, curl)))
+    server_logrequest (s->conn, dbuf_size (req), dbuf_getbuf (req));
+  hdr = dbuf_alloc ();
+  if ((spooled < 0) ||
+    ((res = server_response (s->xml, dbuf_getbuf (req), spool, hdr)) 
+    == NULL))
+  {
+    dbuf_clear (hdr);
+    res = server_respond (500,
+	  "<h3>Failure processing ebXML request</h3>");
   }
-  net_close (s->conn);
+  /*
+   * status line, header, and content all go out together
+   */
+  v[0].buf = status;
+  v[0].len = server_header (hdr, res, status);
+  v[1].buf = dbuf_getbuf (hdr);
+  v[1].len = dbuf_size (hdr);
+  v[2].buf = dbuf_getbuf (res);
+  v[2].len = dbuf_size (res);
+  net_writev (s->conn, v, 3);
+  dbuf_free (hdr);
+  dbuf_free (res);
+  dbuf_free (req);
+  if (*spool)
+    unlink (spool);
+  /*
+   * park the connection for it's next request unless we're stopping
+   */
+  if (phineas_running ())
+    server_park (s);
+  else
+    server_close (s);
   debug ("request completed\n");
   return (0);
 }
 
 /*
- * accept a connection and start a thread to manage it
+ * accept a connection and add it to our active list.  SSL
+ * negotiations are done by the poller as the socket is ready.
  */
-int server_accept (XML *xml, NETCON *conn, SSL_CTX *ctx, TASKQ *q)
+int server_accept (XML *xml, NETCON *conn, SSL_CTX *ctx, SERVERPOLL *p,
+  SERVERPARM **active)
 {
   SERVERPARM *s;
   NETCON *c;
 
   debug ("accepting connection\n");
-  if ((c = net_accept (conn, ctx)) == NULL)
+  if ((c = net_accept (conn, NULL)) == NULL)
   {
     debug ("failed to successfully accept socket\n");
+    if (ctx != NULL)
+      SSL_CTX_free (ctx);
     return (-1);
   }
   s = (SERVERPARM *) malloc (sizeof (SERVERPARM));
   s->conn = c;
   s->xml = xml;
-  if (!task_available (q))
-    warn ("No available server threads for request\n");
-  task_add (q, server_request, s);
+  s->poll = p;
+  s->ctx = ctx;
+  s->want = NETWANTREAD;
+  s->idle = GetTickCount ();
+  net_nonblock (c, 1);
+  s->next = *active;
+  *active = s;
   return (0);
 }
 
 /*
- * Listen for incoming connections until told to stop
+ * add a socket to a set, noting the largest
+ */
+#define server_fdset(sock,set,max) \
+  { FD_SET (sock, set); if ((int) (sock) > max) max = (int) (sock); }
+
+/*
+ * Listen for incoming connections until told to stop.  Idle and
+ * negotiating connections are kept here, and those with a request
+ * ready are handed to a worker.
  */
 int server_listen (XML *xml, NETCON *conn, NETCON *ssl, SSL_CTX *ctx,
   int threads)
 {
-  char *ch;
   TASKQ *t;
+  SERVERPOLL *p;
+  SERVERPARM *s, **sp, *active;
+  SSL_CTX *c;
   struct timeval timeout;
-  fd_set fds;
+  fd_set rfds, wfds;
+  DWORD now;
+  char buf[16];
+  int e, n, maxfd, ready;
 
   if ((conn == NULL) && (ssl == NULL))
     return (-1);
 
   t = task_allocq (threads, 2);
-  timeout.tv_sec = 2;
-  timeout.tv_usec = 0;
+  p = server_poll_alloc ();
+  active = NULL;
 
   /*
    * Keep servicing requests until they stop coming in AND we are
@@ -383,24 +657,135 @@ int server_listen (XML *xml, NETCON *conn, NETCON *ssl, SSL_CTX *ctx,
    */
   while (1)
   {
-    FD_ZERO (&fds);
-    if (conn != NULL)
-      FD_SET (conn->sock, &fds);
-    if (ssl != NULL)
-      FD_SET (ssl->sock, &fds);
-    if (select (2, &fds, NULL, NULL, &timeout) <= 0)
+    /*
+     * pick up connections the workers are done with
+     */
+    wait_mutex (p);
+    while ((s = p->parked) != NULL)
+    {
+      p->parked = s->next;
+      s->next = active;
+      active = s;
+      s->want = NETWANTREAD;
+      s->idle = GetTickCount ();
+      net_nonblock (s->conn, 1);
+    }
+    end_mutex (p);
+    /*
+     * build our socket sets
+     */
+    FD_ZERO (&rfds);
+    FD_ZERO (&wfds);
+    maxfd = n = ready = 0;
+    if (p->wakeup != INVALID_SOCKET)
+      server_fdset (p->wakeup, &rfds, maxfd);
+    for (s = active; s != NULL; s = s->next, n++)
     {
-      if (phineas_running ())
-        continue;
+      if ((s->ctx == NULL) && server_ready (s))
+	ready++;
+      if (s->want == NETWANTWRITE)
+	server_fdset (s->conn->sock, &wfds, maxfd)
+      else
+	server_fdset (s->conn->sock, &rfds, maxfd)
+    }
+    if (n < SERVERMAXCONN)
+    {
+      if (conn != NULL)
+	server_fdset (conn->sock, &rfds, maxfd);
+      if (ssl != NULL)
+	server_fdset (ssl->sock, &rfds, maxfd);
+    }
+    else
+      warn ("Too many connections (%d), accepts delayed\n", n);
+    timeout.tv_sec = ready ? 0 : 2;
+    timeout.tv_usec = 0;
+    if ((e = select (maxfd + 1, &rfds, &wfds, NULL, &timeout)) < 0)
+    {
+      error ("select failed - %d\n", h_errno);
+      FD_ZERO (&rfds);
+      FD_ZERO (&wfds);
+      e = 0;
+    }
+    if ((e == 0) && (ready == 0) && !phineas_running ())
       break;
+    if ((p->wakeup != INVALID_SOCKET) && FD_ISSET (p->wakeup, &rfds))
+      while (recv (p->wakeup, buf, sizeof (buf), 0) > 0);
+    if ((conn != NULL) && FD_ISSET (conn->sock, &rfds))
+      server_accept (xml, conn, NULL, p, &active);
+    if ((ssl != NULL) && FD_ISSET (ssl->sock, &rfds))
+    {
+      /* cached, but rebuilt when our certificates change	*/
+      if ((c = server_ctx (xml)) == NULL)
+	c = net_ctx_ref (ctx);
+      server_accept (xml, ssl, c, p, &active);
+    }
+    /*
+     * advance negotiations, buffer requests, and dispatch them
+     */
+    now = GetTickCount ();
+    for (sp = &active; (s = *sp) != NULL; )
+    {
+      e = FD_ISSET (s->conn->sock, &rfds) || FD_ISSET (s->conn->sock, &wfds);
+      if (e && (s->ctx != NULL))
+      {
+	s->idle = now;
+	if ((e = net_handshake (s->conn, s->ctx, 1)) == 0)
+	{
+	  SSL_CTX_free (s->ctx);
+	  s->ctx = NULL;
+	  s->want = NETWANTREAD;
+	  e = 1;		/* request may have come with it	*/
+	}
+	else if (e > 0)
+	{
+	  s->want = e;
+	  e = 0;
+	}
+	else
+	{
+	  *sp = s->next;
+	  server_close (s);
+	  continue;
+	}
+      }
+      if (e)
+      {
+	s->idle = now;
+	if (net_buffer (s->conn) == 0)
+	{
+	  debug ("connection closed by client\n");
+	  *sp = s->next;
+	  server_close (s);
+	  continue;
+	}
+      }
+      if ((s->ctx == NULL) && server_ready (s))
+      {
+	*sp = s->next;
+	net_nonblock (s->conn, 0);
+	if (!task_available (t))
+	  warn ("No available server threads for request\n");
+	task_add (t, server_request, s);
+	continue;
+      }
+      if (now - s->idle > DFLTTIMEOUT)
+      {
+	debug ("closing idle connection\n");
+	*sp = s->next;
+	server_close (s);
+	continue;
+      }
+      sp = &s->next;
     }
-    if ((conn != NULL) && FD_ISSET (conn->sock, &fds))
-      server_accept (xml, conn, NULL, t);
-    if ((ssl != NULL) && FD_ISSET (ssl->sock, &fds))
-      server_accept (xml, ssl, ctx, t);
+  }
+  while ((s = active) != NULL)
+  {
+    active = s->next;
+    server_close (s);
   }
   task_stop (t);
   task_freeq (t);
+  server_poll_free (p);
   return (0);
 }
 
@@ -411,16 +796,16 @@ int server_listen (XML *xml, NETCON *conn, NETCON *ssl, SSL_CTX *ctx,
  */
 server_task (XML *xml)
 {
-  SSL_CTX *ctx;
-  NETCON *conn, *ssl;
+  SSL_CTX *ctx = NULL;
+  NETCON *conn = NULL, 
+	 *ssl = NULL;
   int port, threads, e;
 
-
   if ((threads = xml_get_int (xml, "Phineas.Server.NumThreads")) == 0)
     threads = 2;
   if (port = xml_get_int (xml, "Phineas.Server.Port"))
   {
-    if ((conn = net_open ("ANY", port, threads, NULL)) == NULL)
+    if ((conn = net_open ("ANY", port, SOMAXCONN, NULL)) == NULL)
     {
       return (phineas_fatal ("Failed to open port %d\n", port));
     }
@@ -428,7 +813,7 @@ server_task (XML *xml)
   if (port = xml_get_int (xml, "Phineas.Server.SSL.Port"))
   {
     ctx = server_ctx (xml);
-    if ((ssl = net_open ("ANY", port, threads, ctx)) == NULL)
+    if ((ssl = net_open ("ANY", port, SOMAXCONN, ctx)) == NULL)
     {
       if (conn != NULL)
         net_close (conn);
@@ -0,0 +1,790 @@
+/*
+ * sqliteq.c
+ *
+ * Copyright 2011-2012 Thomas L Dunnick
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+/*
+ * Queues kept in an embedded SQLite database.  The connection Unc
+ * is the database file, and each queue is a table named for the
+ * queue table, created as needed with a column for each field.  The
+ * first field is the integer primary key, so it is SQLite's rowid.
+ * The database runs in WAL mode so readers don't block the writer,
+ * and the connection Sync sets how hard we push commits to disk.
+ *
+ * It is only built in with __SQLITEQ__, which the builds define when
+ * SQLITE is set to the SQLite install location.  Elsewhere the task
+ * layer falls back on posix.h, so the unit test and bench also build
+ * on a plain POSIX box (see "make sqlitebench").
+ */
+
+#ifdef UNITTEST
+#define __SQLITEQ__	/* needed for registration in queue.c	*/
+#include "unittest.h"
+#endif
+
+#ifdef __SQLITEQ__	/* only if we are using SQLite queues!	*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sqlite3.h>
+#include "log.h"
+#include "util.h"
+#include "dbuf.h"
+#include "queue.h"
+
+#ifndef debug
+#define debug(fmt...)
+#endif
+
+/* rowid past any row, for reading back from the last */
+#define SQLITEQ_LAST 0x7fffffff
+/* ms to wait on a locked database */
+#define SQLITEQ_BUSY 5000
+
+/*
+ * Internal meta data and prepared statements for a queue.  Those
+ * taking a rowid bind it as the first parameter, and those reading
+ * rows select the fields in queue type order.
+ */
+typedef struct sqliteq
+{
+  struct sqliteq *next;
+  int rowid;				/* max row number		*/
+  int transport;			/* next transport row to pop	*/
+  sqlite3_stmt *insert,			/* add a row			*/
+	       *update,			/* change the fields set	*/
+	       *get,			/* read a row			*/
+	       *del,			/* delete a row			*/
+	       *after,			/* n rows after rowid		*/
+	       *before,			/* n rows before, descending	*/
+	       *queued;			/* next queued row after rowid	*/
+  char name[1];				/* queue name			*/
+} SQLITEQ;
+
+/*
+ * A connection is one database.  SQLite serializes use of the
+ * handle, and the mutex covers our list of queues and keeps other
+ * queues' writes out of a batch's transaction.
+ */
+typedef struct sqliteq_conn
+{
+  MUTEX mutex;
+  sqlite3 *db;
+  SQLITEQ *queues;			/* meta data for our queues	*/
+} SQLITEQCONN;
+
+/*
+ * execute SQL with no results, returning non-zero on failure
+ */
+int sqliteq_exec (sqlite3 *db, char *sql)
+{
+  char *err = NULL;
+
+  debug ("executing %s\n", sql);
+  if (sqlite3_exec (db, sql, NULL, NULL, &err) == SQLITE_OK)
+    return (0);
+  error ("Failed %s: %s\n", sql, err);
+  sqlite3_free (err);
+  return (-1);
+}
+
+/*
+ * prepare a statement, or NULL if we can't
+ */
+sqlite3_stmt *sqliteq_prepare (sqlite3 *db, DBUF *b)
+{
+  sqlite3_stmt *stmt;
+
+  dbuf_putc (b, 0);
+  debug ("preparing %s\n", dbuf_getbuf (b));
+  if (sqlite3_prepare_v2 (db, dbuf_getbuf (b), -1, &stmt, NULL)
+    != SQLITE_OK)
+  {
+    error ("Failed preparing %s: %s\n", dbuf_getbuf (b),
+      sqlite3_errmsg (db));
+    stmt = NULL;
+  }
+  dbuf_clear (b);
+  return (stmt);
+}
+
+/*
+ * write a select for all of the fields of a queue
+ */
+DBUF *sqliteq_select (DBUF *b, QUEUE *q)
+{
+  int i;
+
+  dbuf_printf (b, "select %s", q->type->field[0]);
+  for (i = 1; i < q->type->numfields; i++)
+    dbuf_printf (b, ", %s", q->type->field[i]);
+  dbuf_printf (b, " from \"%s\" where ", q->table);
+  return (b);
+}
+
+/*
+ * Create the table and indexes for a queue as needed, and prepare
+ * it's statements.  Updates only change fields set in the row.
+ * Return non-zero on failure.
+ */
+int sqliteq_statements (sqlite3 *db, QUEUE *q, SQLITEQ *o)
+{
+  DBUF *b;
+  int i;
+  char **field;
+
+  field = q->type->field;
+  b = dbuf_alloc ();
+  dbuf_printf (b, "create table if not exists \"%s\" "
+    "(%s integer primary key", q->table, field[0]);
+  for (i = 1; i < q->type->numfields; i++)
+    dbuf_printf (b, ", %s text", field[i]);
+  dbuf_printf (b, ")");
+  dbuf_putc (b, 0);
+  i = sqliteq_exec (db, dbuf_getbuf (b));
+  dbuf_clear (b);
+  if ((i == 0) && (queue_field_find (q, "PROCESSINGSTATUS") > 0))
+  {
+    dbuf_printf (b, "create index if not exists \"%s_status\" "
+      "on \"%s\" (PROCESSINGSTATUS)", q->table, q->table);
+    dbuf_putc (b, 0);
+    i = sqliteq_exec (db, dbuf_getbuf (b));
+    dbuf_clear (b);
+  }
+  if (i)
+  {
+    dbuf_free (b);
+    return (-1);
+  }
+  dbuf_printf (b, "insert into \"%s\" (%s", q->table, field[0]);
+  for (i = 1; i < q->type->numfields; i++)
+    dbuf_printf (b, ", %s", field[i]);
+  dbuf_printf (b, ") values (?1");
+  for (i = 1; i < q->type->numfields; i++)
+    dbuf_printf (b, ", ?%d", i + 1);
+  dbuf_printf (b, ")");
+  o->insert = sqliteq_prepare (db, b);
+  dbuf_printf (b, "update \"%s\" set ", q->table);
+  for (i = 1; i < q->type->numfields; i++)
+    dbuf_printf (b, "%s%s=coalesce(?%d,%s)", i > 1 ? ", " : "",
+      field[i], i + 1, field[i]);
+  dbuf_printf (b, " where %s=?1", field[0]);
+  o->update = sqliteq_prepare (db, b);
+  dbuf_printf (sqliteq_select (b, q), "%s=?1", field[0]);
+  o->get = sqliteq_prepare (db, b);
+  dbuf_printf (b, "delete from \"%s\" where %s=?1", q->table, field[0]);
+  o->del = sqliteq_prepare (db, b);
+  dbuf_printf (sqliteq_select (b, q), "%s>?1 order by %s limit ?2",
+    field[0], field[0]);
+  o->after = sqliteq_prepare (db, b);
+  dbuf_printf (sqliteq_select (b, q), "%s<?1 order by %s desc limit ?2",
+    field[0], field[0]);
+  o->before = sqliteq_prepare (db, b);
+  if (o->transport >= 0)
+  {
+    dbuf_printf (sqliteq_select (b, q), "PROCESSINGSTATUS='queued' and "
+      "%s>?1 order by %s limit 1", field[0], field[0]);
+    o->queued = sqliteq_prepare (db, b);
+  }
+  dbuf_free (b);
+  if ((o->insert == NULL) || (o->update == NULL) || (o->get == NULL) ||
+    (o->del == NULL) || (o->after == NULL) || (o->before == NULL) ||
+    ((o->transport >= 0) && (o->queued == NULL)))
+    return (-1);
+  return (0);
+}
+
+/*
+ * free prepared statements (finalize ignores NULL)
+ */
+int sqliteq_unprepare (SQLITEQ *o)
+{
+  sqlite3_finalize (o->insert);
+  sqlite3_finalize (o->update);
+  sqlite3_finalize (o->get);
+  sqlite3_finalize (o->del);
+  sqlite3_finalize (o->after);
+  sqlite3_finalize (o->before);
+  sqlite3_finalize (o->queued);
+  return (0);
+}
+
+/*
+ * Return our meta data for a queue, setting up it's table the first
+ * time.  Returns NULL if the queue can't be used.
+ */
+SQLITEQ *sqliteq_find (QUEUE *q)
+{
+  SQLITEQ *o;
+  SQLITEQCONN *c;
+  sqlite3_stmt *stmt;
+  char buf[256];
+
+  c = (SQLITEQCONN *) q->conn->conn;
+  wait_mutex (c);
+  for (o = c->queues; o != NULL; o = o->next)
+  {
+    if (strcmp (q->name, o->name) == 0)
+      break;
+  }
+  if (o != NULL)
+  {
+    end_mutex (c);
+    return (o->rowid < 0 ? NULL : o);
+  }
+  /*
+   * none found... start by allocating some
+   */
+  debug ("%s meta data not found, allocating...\n", q->name);
+  o = (SQLITEQ *) malloc (sizeof (SQLITEQ) + strlen (q->name));
+  memset (o, 0, sizeof (SQLITEQ));
+  strcpy (o->name, q->name);
+  o->transport = istransportQ (q) ? 0 : -1;
+  if (sqliteq_statements (c->db, q, o))
+    o->rowid = o->transport = -1;	/* BAD queue!		*/
+  else
+  {
+    /*
+     * set the top row
+     */
+    snprintf (buf, sizeof (buf), "select max(%s) from \"%s\"",
+      q->type->field[0], q->table);
+    if (sqlite3_prepare_v2 (c->db, buf, -1, &stmt, NULL) == SQLITE_OK)
+    {
+      if (sqlite3_step (stmt) == SQLITE_ROW)
+        o->rowid = sqlite3_column_int (stmt, 0);
+      sqlite3_finalize (stmt);
+    }
+  }
+  debug ("rowid=%d transport=%d\n", o->rowid, o->transport);
+  o->next = c->queues;
+  c->queues = o;
+  end_mutex (c);
+  return (o->rowid < 0 ? NULL : o);
+}
+
+/*
+ * interface connection close
+ */
+int sqliteq_close (void *conn)
+{
+  SQLITEQCONN *c;
+  SQLITEQ *o;
+
+  c = (SQLITEQCONN *) conn;
+  while ((o = c->queues) != NULL)
+  {
+    c->queues = o->next;
+    sqliteq_unprepare (o);
+    free (o);
+  }
+  sqlite3_close (c->db);
+  destroy_mutex (c);
+  free (c);
+  return (0);
+}
+
+/*
+ * Add or update a row and return the rowid.  Updates only change
+ * the fields that are set.
+ */
+int sqliteq_write (QUEUEROW *r, SQLITEQ *o)
+{
+  sqlite3_stmt *stmt;
+  int i, ret;
+  char *ch;
+
+  debug ("pushing row %d for %s\n", r->rowid, r->queue->name);
+  if (r->rowid)
+  {
+    stmt = o->update;
+    if ((r->rowid <= o->transport) &&
+      ((ch = queue_field_get (r, "PROCESSINGSTATUS")) != NULL) &&
+      !strcmp ("queued", ch))
+	o->transport = r->rowid -1;
+  }
+  else
+  {
+    stmt = o->insert;
+    if ((r->rowid = o->rowid + 1) < 1)
+      r->rowid = 1;
+  }
+  sqlite3_bind_int (stmt, 1, r->rowid);
+  for (i = 1; i < r->queue->type->numfields; i++)
+  {
+    if (r->field[i] == NULL)
+      sqlite3_bind_null (stmt, i + 1);
+    else
+      sqlite3_bind_text (stmt, i + 1, r->field[i], -1, SQLITE_STATIC);
+  }
+  ret = sqlite3_step (stmt);
+  sqlite3_reset (stmt);
+  sqlite3_clear_bindings (stmt);
+  if (ret != SQLITE_DONE)
+  {
+    error ("push failed for %s: %s\n", r->queue->name,
+      sqlite3_errmsg (sqlite3_db_handle (stmt)));
+    return (-1);
+  }
+  if (r->rowid > o->rowid)
+    o->rowid = r->rowid;
+  return (r->rowid);
+}
+
+/*
+ * add or update a row
+ */
+int sqliteq_push (QUEUEROW *r)
+{
+  SQLITEQ *o;
+  SQLITEQCONN *c;
+  int rowid;
+
+  if ((o = sqliteq_find (r->queue)) == NULL)
+  {
+    warn ("no meta data for %s\n", r->queue->name);
+    return (-1);
+  }
+  c = (SQLITEQCONN *) r->queue->conn->conn;
+  wait_mutex (c);
+  rowid = sqliteq_write (r, o);
+  end_mutex (c);
+  return (rowid);
+}
+
+/*
+ * Add or update n rows as one transaction, returning n, or 0 if it
+ * was rolled back.
+ */
+int sqliteq_pushbatch (QUEUE *q, QUEUEROW **rows, int n)
+{
+  SQLITEQ *o;
+  SQLITEQCONN *c;
+  int i, rowid, transport;
+
+  if ((o = sqliteq_find (q)) == NULL)
+  {
+    warn ("no meta data for %s\n", q->name);
+    return (0);
+  }
+  c = (SQLITEQCONN *) q->conn->conn;
+  rowid = o->rowid;
+  transport = o->transport;
+  wait_mutex (c);
+  if (sqliteq_exec (c->db, "begin immediate"))
+    i = -1;
+  else
+  {
+    for (i = 0; i < n; i++)
+    {
+      if (sqliteq_write (rows[i], o) < 1)
+        break;
+    }
+    if ((i < n) || sqliteq_exec (c->db, "commit"))
+    {
+      sqliteq_exec (c->db, "rollback");
+      i = -1;
+    }
+  }
+  end_mutex (c);
+  if (i < 0)
+  {
+    error ("push of %d rows to %s rolled back\n", n, q->name);
+    for (i = 0; i < n; i++)		/* rows we inserted are gone	*/
+    {
+      if (rows[i]->rowid > rowid)
+        rows[i]->rowid = 0;
+    }
+    o->rowid = rowid;
+    o->transport = transport;
+    return (0);
+  }
+  return (n);
+}
+
+/*
+ * Read up to n rows from a statement bound to rowid, returning the
+ * number read.
+ */
+int sqliteq_read (QUEUE *q, sqlite3_stmt *stmt, int rowid,
+  int n, QUEUEROW **rows)
+{
+  int i, k = 0, ret;
+  const char *v;
+  QUEUEROW *r;
+
+  sqlite3_bind_int (stmt, 1, rowid);
+  if (sqlite3_bind_parameter_count (stmt) > 1)
+    sqlite3_bind_int (stmt, 2, n);
+  while ((k < n) && ((ret = sqlite3_step (stmt)) == SQLITE_ROW))
+  {
+    r = rows[k++] = queue_row_alloc (q);
+    r->rowid = sqlite3_column_int (stmt, 0);
+    for (i = 0; i < q->type->numfields; i++)
+    {
+      if ((v = (const char *) sqlite3_column_text (stmt, i)) == NULL)
+	v = "";
+      r->field[i] = strdup (v);
+    }
+  }
+  if ((k < n) && (ret != SQLITE_DONE))
+    error ("failed reading %s from row %d: %s\n", q->name, rowid,
+      sqlite3_errmsg (sqlite3_db_handle (stmt)));
+  sqlite3_reset (stmt);
+  return (k);
+}
+
+/*
+ * get a specific row
+ */
+QUEUEROW *sqliteq_get (QUEUE *q, int rowid)
+{
+  SQLITEQ *o;
+  QUEUEROW *r;
+
+  if (((o = sqliteq_find (q)) == NULL) ||
+    (sqliteq_read (q, o->get, rowid, 1, &r) < 1))
+    return (NULL);
+  return (r);
+}
+
+/*
+ * delete a row
+ */
+int sqliteq_del (QUEUE *q, int rowid)
+{
+  SQLITEQ *o;
+  SQLITEQCONN *c;
+  int ret;
+
+  if ((o = sqliteq_find (q)) == NULL)
+    return (-1);
+  c = (SQLITEQCONN *) q->conn->conn;
+  wait_mutex (c);
+  sqlite3_bind_int (o->del, 1, rowid);
+  ret = sqlite3_step (o->del);
+  sqlite3_reset (o->del);
+  end_mutex (c);
+  if (ret != SQLITE_DONE)
+  {
+    error ("delete of row %d failed: %s\n", rowid,
+      sqlite3_errmsg (sqlite3_db_handle (o->del)));
+    return (-1);
+  }
+  return (0);
+}
+
+/*
+ * get up to n rows before this one, last first, call with rowid=0
+ * to start from the last row
+ */
+int sqliteq_page (QUEUE *q, int rowid, int n, QUEUEROW **rows)
+{
+  SQLITEQ *o;
+
+  if ((n < 1) || ((o = sqliteq_find (q)) == NULL))
+    return (0);
+  if (rowid == 0)
+    rowid = SQLITEQ_LAST;
+  return (sqliteq_read (q, o->before, rowid, n, rows));
+}
+
+/*
+ * get the previous row, call with rowid=0 to get the last row
+ */
+QUEUEROW *sqliteq_prev (QUEUE *q, int rowid)
+{
+  QUEUEROW *r;
+
+  if (sqliteq_page (q, rowid, 1, &r) < 1)
+    return (NULL);
+  return (r);
+}
+
+/*
+ * get the next row, call with rowid=0 to get first row
+ */
+QUEUEROW *sqliteq_next (QUEUE *q, int rowid)
+{
+  SQLITEQ *o;
+  QUEUEROW *r;
+
+  if (((o = sqliteq_find (q)) == NULL) ||
+    (sqliteq_read (q, o->after, rowid, 1, &r) < 1))
+    return (NULL);
+  return (r);
+}
+
+/*
+ * get the next transport row, or last row if not a transport queue
+ */
+QUEUEROW *sqliteq_pop (QUEUE *q)
+{
+  SQLITEQ *o;
+  QUEUEROW *r;
+
+  if ((o = sqliteq_find (q)) == NULL)
+    return (NULL);
+  if (o->transport < 0)
+    return (sqliteq_prev (q, 0));
+  if (sqliteq_read (q, o->queued, o->transport, 1, &r) < 1)
+    return (NULL);
+  o->transport = r->rowid;
+  debug ("popped row %d\n", r->rowid);
+  return (r);
+}
+
+/*
+ * Open the database named by the connection Unc in WAL mode.  With
+ * WAL, a "normal" sync only reaches the disk at checkpoints, which
+ * serves for group syncs, while "full" syncs every commit.
+ */
+int sqliteq_connect (QUEUECONN *conn)
+{
+  SQLITEQCONN *c;
+  char *sync[] = { "off", "full", "normal" };
+  char path[MAX_PATH], buf[80];
+
+  if (pathf (path, "%s", conn->unc) == NULL)
+  {
+    error ("Bad SQLite path %s\n", conn->unc);
+    return (-1);
+  }
+  c = (SQLITEQCONN *) malloc (sizeof (SQLITEQCONN));
+  memset (c, 0, sizeof (SQLITEQCONN));
+  if (sqlite3_open_v2 (path, &c->db, SQLITE_OPEN_READWRITE |
+    SQLITE_OPEN_CREATE | SQLITE_OPEN_FULLMUTEX, NULL) != SQLITE_OK)
+  {
+    error ("Can't open %s: %s\n", path, sqlite3_errmsg (c->db));
+    sqlite3_close (c->db);
+    free (c);
+    return (-1);
+  }
+  sqlite3_busy_timeout (c->db, SQLITEQ_BUSY);
+  sprintf (buf, "pragma synchronous=%s", sync[conn->syncmode]);
+  if (sqliteq_exec (c->db, "pragma journal_mode=wal") ||
+    sqliteq_exec (c->db, buf))
+  {
+    sqlite3_close (c->db);
+    free (c);
+    return (-1);
+  }
+  init_mutex (c);
+  conn->conn = c;
+  conn->close = sqliteq_close;
+  conn->push = sqliteq_push;
+  conn->pushbatch = sqliteq_pushbatch;
+  conn->pop = sqliteq_pop;
+  conn->get = sqliteq_get;
+  conn->del = sqliteq_del;
+  conn->nextrow = sqliteq_next;
+  conn->prevrow = sqliteq_prev;
+  conn->page = sqliteq_page;
+  info ("SQLite connected %s\n", path);
+  return (0);
+}
+
+#ifdef UNITTEST
+#undef UNITTEST
+#undef debug
+#include "util.c"
+#include "xml.c"
+#include "xmln.c"
+#include "dbuf.c"
+#include "queue.c"
+
+/*
+ * random row for a queue, with a random status
+ */
+QUEUEROW *rand_row (QUEUEROW *r)
+{
+  char *status[] = { "done", "failed", "queued", "in process" };
+  char buf[80];
+  int i;
+
+  r->rowid = 0;
+  for (i = 1; i < r->queue->type->numfields; i++)
+  {
+    sprintf (buf, "%s_%d", r->queue->type->field[i], rand ());
+    queue_field_set (r, r->queue->type->field[i], buf);
+  }
+  queue_field_set (r, "PROCESSINGSTATUS", status[rand () % 4]);
+  return (r);
+}
+
+/*
+ * push n random rows, returning the first rowid
+ */
+int push_rows (QUEUE *q, int n)
+{
+  int i, first = 0;
+  QUEUEROW *r;
+
+  r = queue_row_alloc (q);
+  for (i = 0; i < n; i++)
+  {
+    if (queue_push (rand_row (r)) < 1)
+      error ("push to %s failed\n", q->name);
+    if (first == 0)
+      first = r->rowid;
+  }
+  queue_row_free (r);
+  return (first);
+}
+
+/*
+ * time pushing, getting, and reading through rows, run with "bench"
+ */
+#define BENCHROWS 10000
+
+int bench (QUEUE *q)
+{
+  int i, n, first;
+  DWORD t;
+  QUEUEROW *r, *rows[100];
+
+  t = GetTickCount ();
+  first = push_rows (q, BENCHROWS);
+  t = GetTickCount () - t;
+  info ("%s push %d rows %d ms %d rows/sec\n", q->name, BENCHROWS, t,
+    BENCHROWS * 1000 / (t ? t : 1));
+  t = GetTickCount ();
+  for (i = 0; i < BENCHROWS; i++)
+  {
+    if ((r = queue_get (q, first + i)) == NULL)
+      error ("Bench get %d failed\n", first + i);
+    queue_row_free (r);
+  }
+  t = GetTickCount () - t;
+  info ("%s get %d rows %d ms %d rows/sec\n", q->name, BENCHROWS, t,
+    BENCHROWS * 1000 / (t ? t : 1));
+  t = GetTickCount ();
+  for (i = 0; (r = queue_pop (q)) != NULL; i++)
+    queue_row_free (r);
+  t = GetTickCount () - t;
+  info ("%s pop %d rows %d ms %d rows/sec\n", q->name, i, t,
+    i * 1000 / (t ? t : 1));
+  for (i = 0; i < 100; i++)
+    rows[i] = queue_row_alloc (q);
+  t = GetTickCount ();
+  for (n = 0; n < BENCHROWS; n += 100)
+  {
+    for (i = 0; i < 100; i++)
+      rand_row (rows[i]);
+    if (queue_push_batch (q, rows, 100) != 100)
+      error ("Bench batch push failed\n");
+  }
+  t = GetTickCount () - t;
+  info ("%s batch push %d rows %d ms %d rows/sec\n", q->name, BENCHROWS, t,
+    BENCHROWS * 1000 / (t ? t : 1));
+  for (i = 0; i < 100; i++)
+    queue_row_free (rows[i]);
+  return (0);
+}
+
+int main (int argc, char **argv)
+{
+  int i, n, first;
+  XML *xml;
+  QUEUE *q;
+  QUEUEROW *r, *p, *rows[10];
+
+  if ((xml = xml_parse (PhineasConfig)) == NULL)
+    return (-1);
+  loadpath (xml_get_text (xml, "Phineas.InstallDirectory"));
+  xml_set_text (xml, "Phineas.QueueInfo.Connection[0].Type", "sqlite");
+  xml_set_text (xml, "Phineas.QueueInfo.Connection[0].Unc",
+    "queues/sqliteq.test");
+  if (queue_init (xml))
+    fatal ("Couldn't initialize\n");
+  if ((argc > 1) && (strcmp (argv[1], "bench") == 0))
+  {
+    bench (queue_find ("MemSendQ"));
+    queue_shutdown ();
+    exit (Errors);
+  }
+  /*
+   * write and read back some rows
+   */
+  q = queue_find ("MemReceiveQ");
+  first = push_rows (q, 100);
+  if ((r = queue_get (q, first)) == NULL)
+    error ("Couldn't get row %d\n", first);
+  else
+  {
+    /* an update only changes what is set */
+    p = queue_row_alloc (q);
+    p->rowid = r->rowid;
+    queue_field_set (p, "PROCESSINGSTATUS", "updated");
+    if (queue_push (p) != r->rowid)
+      error ("Couldn't update row %d\n", r->rowid);
+    queue_row_free (p);
+    if ((p = queue_get (q, first)) == NULL)
+      error ("Couldn't get updated row %d\n", first);
+    else if (strcmp (queue_field_get (p, "PROCESSINGSTATUS"), "updated") ||
+      strcmp (queue_field_get (p, "MESSAGEID"),
+      queue_field_get (r, "MESSAGEID")))
+      error ("Row %d not updated correctly\n", first);
+    queue_row_free (p);
+    queue_row_free (r);
+  }
+  /*
+   * walk forward, and page back against prev
+   */
+  for (i = first - 1, n = 0; (r = queue_next (q, i)) != NULL; n++)
+  {
+    i = r->rowid;
+    queue_row_free (r);
+  }
+  if ((n != 100) || (i != first + 99))
+    error ("Read %d rows to %d from %d\n", n, i, first);
+  n = queue_page (q, 0, 10, rows);
+  for (i = 0; i < n; i++)
+  {
+    if (rows[i]->rowid != first + 99 - i)
+      error ("Page row %d is %d\n", i, rows[i]->rowid);
+    queue_row_free (rows[i]);
+  }
+  if (n != 10)
+    error ("Paged %d rows\n", n);
+  if (queue_delete (q, first + 1) ||
+    ((r = queue_get (q, first + 1)) != NULL))
+    error ("Couldn't delete row %d\n", first + 1);
+  if (((r = queue_prev (q, first + 2)) == NULL) || (r->rowid != first))
+    error ("Prev didn't skip deleted row %d\n", first + 1);
+  queue_row_free (r);
+  /*
+   * transport pops only queued rows, in order
+   */
+  q = queue_find ("MemSendQ");
+  i = push_rows (q, 100);
+  n = 0;
+  while ((r = queue_pop (q)) != NULL)
+  {
+    if (strcmp (queue_field_get (r, "PROCESSINGSTATUS"), "queued") ||
+      (r->rowid <= n))
+      error ("Popped row %d out of order or not queued\n", r->rowid);
+    n = r->rowid;
+    queue_row_free (r);
+  }
+  queue_shutdown ();
+  info ("%s %s\n", argv[0], Errors?"failed":"passed");
+  exit (Errors);
+}
+
+#endif /* UNITTEST */
+#endif /* __SQLITEQ__ */
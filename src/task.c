@@ -31,23 +31,43 @@
 */
 
 /*
- * allocate a queue 
- * our event is auto-reset and initially reset
+ * allocate a queue and it's (idle) workers
+ * worker events are auto-reset and initially reset
  */
 TASKQ *task_allocq (int numthreads, int timeout)
 {
   TASKQ *q;
+  TASKW *w;
+  int i;
 
+  if (numthreads < 1)
+    numthreads = 1;
   q = (TASKQ *) malloc (sizeof (TASKQ));
   init_mutex (q);
-  init_ready (q, FALSE);
   q->timeout = timeout;
-  q->queue = NULL;
-  q->pool = NULL;
+  q->worker = (TASKW *) malloc (numthreads * sizeof (TASKW));
+  q->parked = NULL;
+  q->next = 0;
   q->maxthreads = numthreads;
   q->running = 0;
   q->waiting = 0;
   q->stop = 0;
+  init_ready (q, FALSE);
+  q->timer = NULL;
+  q->timers = q->timersz = 0;
+  q->ticking = 0;
+  for (i = 0; i < numthreads; i++)
+  {
+    w = q->worker + i;
+    init_mutex (w);
+    init_ready (w, FALSE);
+    w->timeout = timeout;
+    w->task = NULL;
+    w->head = w->count = w->size = 0;
+    w->state = TASK_IDLE;
+    w->q = q;
+    w->parked = NULL;
+  }
   return (q);
 }
 
@@ -57,28 +77,232 @@ TASKQ *task_allocq (int numthreads, int timeout)
 
 TASKQ *task_freeq (TASKQ *q)
 {
-  TASK *t;
+  TASKW *w;
+  int i;
 
   task_stop (q);
+  debug ("freeing workers\n");
+  for (i = 0; i < q->maxthreads; i++)
+  {
+    w = q->worker + i;
+    if (w->task != NULL)
+      free (w->task);
+    destroy_mutex (w);
+    destroy_ready (w);
+  }
+  free (q->worker);
+  if (q->timer != NULL)
+    free (q->timer);
+  destroy_ready (q);
+  debug ("closing critical section\n");
+  destroy_mutex (q);
+  free (q);
+  return (NULL);
+}
+
+/*
+ * add a task to the end of a worker's ring, growing it as needed.
+ * Fails if the worker has no thread, unless forced.
+ */
+static int task_push (TASKW *w, int (*fn)(void *), void *parm, int force)
+{
+  TASK *t;
+  int i, sz;
+
+  wait_mutex (w);
+  if ((w->state == TASK_IDLE) && !force)
+  {
+    end_mutex (w);
+    return (-1);
+  }
+  if (w->count == w->size)	/* full, double it		*/
+  {
+    sz = w->size ? w->size << 1 : 16;
+    t = (TASK *) malloc (sz * sizeof (TASK));
+    for (i = 0; i < w->count; i++)
+      t[i] = w->task[(w->head + i) % w->size];
+    if (w->task != NULL)
+      free (w->task);
+    w->task = t;
+    w->head = 0;
+    w->size = sz;
+  }
+  t = w->task + (w->head + w->count++) % w->size;
+  t->fn = fn;
+  t->parm = parm;
+  end_mutex (w);
+  return (0);
+}
+
+/*
+ * take the oldest task from our own ring
+ */
+static int task_pop (TASKW *w, TASK *t)
+{
+  if (w->count == 0)		/* quick look before we lock	*/
+    return (0);
+  wait_mutex (w);
+  if (w->count == 0)
+  {
+    end_mutex (w);
+    return (0);
+  }
+  *t = w->task[w->head];
+  w->head = (w->head + 1) % w->size;
+  w->count--;
+  end_mutex (w);
+  return (1);
+}
+
+/*
+ * take the newest task from some other worker's ring
+ */
+static int task_steal (TASKW *w, TASK *t)
+{
+  TASKQ *q = w->q;
+  TASKW *v;
+  int i, n;
+
+  n = w - q->worker;
+  for (i = 1; i < q->maxthreads; i++)
+  {
+    v = q->worker + (n + i) % q->maxthreads;
+    if (v->count == 0)
+      continue;
+    wait_mutex (v);
+    if (v->count > 0)
+    {
+      *t = v->task[(v->head + --v->count) % v->size];
+      end_mutex (v);
+      debug ("stole task from worker %d\n", (n + i) % q->maxthreads);
+      return (1);
+    }
+    end_mutex (v);
+  }
+  return (0);
+}
+
+/*
+ * take a worker off the parked list (we hold the queue lock), 
+ * returning non-zero if it wasn't there
+ */
+static int task_unpark (TASKQ *q, TASKW *w)
+{
+  TASKW **wp;
+
+  for (wp = &q->parked; *wp != NULL; wp = &(*wp)->parked)
+  {
+    if (*wp == w)
+    {
+      *wp = w->parked;
+      q->waiting--;
+      w->state = TASK_BUSY;
+      return (0);
+    }
+  }
+  return (-1);
+}
+
+/*
+ * wake up a parked worker, if there is one
+ */
+static void task_wake (TASKQ *q)
+{
+  TASKW *w;
+
   wait_mutex (q);
-  debug ("freeing queue\n");
-  while ((t = q->queue) != NULL)
+  if ((w = q->parked) != NULL)
+    task_unpark (q, w);
+  end_mutex (q);
+  if (w != NULL)
+    set_ready (w);
+}
+
+/*
+ * Delayed tasks are kept in a heap (soonest at the top) by tick
+ * count, compared by difference so wrap around is harmless.  All of
+ * these expect the queue lock to be held.
+ */
+#define task_due(a,b) ((int) ((a).due - (b).due) < 0)
+
+static int task_timer_up (TASKQ *q, int i)
+{
+  TASKT t;
+  int p;
+
+  t = q->timer[i];
+  while (i && task_due (t, q->timer[p = (i - 1) / 2]))
   {
-    q->queue = t->next;
-    free (t);
+    q->timer[i] = q->timer[p];
+    i = p;
   }
-  debug ("freeing pool\n");
-  while ((t = q->pool) != NULL)
+  q->timer[i] = t;
+  return (i);
+}
+
+static void task_timer_down (TASKQ *q, int i)
+{
+  TASKT t;
+  int c;
+
+  t = q->timer[i];
+  while ((c = i * 2 + 1) < q->timers)
   {
-    q->pool = t->next;
-    free (t);
+    if ((c + 1 < q->timers) && task_due (q->timer[c + 1], q->timer[c]))
+      c++;
+    if (!task_due (q->timer[c], t))
+      break;
+    q->timer[i] = q->timer[c];
+    i = c;
   }
-  debug ("closing event and critical section\n");
+  q->timer[i] = t;
+}
+
+/*
+ * The timer thread.  It sleeps until the soonest delayed task is due
+ * (or a sooner one is added), and hands it off to a worker.  It exits
+ * when the heap is empty or the queue is stopped.
+ */
+static void task_timer (TASKQ *q)
+{
+  TASKT t;
+  int ms;
+
+  debug ("timer thread started\n");
+  wait_mutex (q);
+  while (q->timers && !q->stop)
+  {
+    if ((ms = (int) (q->timer->due - GetTickCount ())) > 0)
+    {
+      end_mutex (q);
+      wait_ready_for (q, ms);
+      wait_mutex (q);
+      continue;
+    }
+    t = *q->timer;
+    if (--q->timers)
+    {
+      *q->timer = q->timer[q->timers];
+      task_timer_down (q, 0);
+    }
+    end_mutex (q);
+    task_add (q, t.task.fn, t.task.parm);
+    wait_mutex (q);
+  }
+  q->ticking = 0;
   end_mutex (q);
-  destroy_mutex (q);
-  destroy_ready (q);
-  free (q);
-  return (NULL);
+  debug ("timer thread exiting\n");
+}
+
+/*
+ * start the timer thread if it isn't running (we hold the queue lock)
+ */
+static void task_tick (TASKQ *q)
+{
+  if (q->ticking || !q->timers || q->stop)
+    return;
+  q->ticking = 1;
+  t_start (task_timer, q);
 }
 
 /*
@@ -95,10 +319,12 @@ int task_stop (TASKQ *q)
   }
   q->stop = 1;
   debug ("waiting on tasks to exit...\n");
-  while (q->waiting || q->running)
+  while (q->running || q->ticking)
   {
-    set_ready (q);
     end_mutex (q);
+    set_ready (q);
+    while (q->parked != NULL)
+      task_wake (q);
     sleep (100);
     wait_mutex (q);
   }
@@ -112,126 +338,455 @@ int task_stop (TASKQ *q)
  */
 int task_reset (TASKQ *q)
 {
-  TASK *t;
+  TASKW *w;
+  int i;
 
-  wait_mutex (q);
-  while ((t = q->queue) != NULL)
+  for (i = 0; i < q->maxthreads; i++)
   {
-    q->queue = t->next;
-    t->next = q->pool;
-    q->pool = t;
+    w = q->worker + i;
+    wait_mutex (w);
+    w->head = w->count = 0;
+    end_mutex (w);
   }
+  wait_mutex (q);
+  q->timers = 0;
   end_mutex (q);
   return (0);
 }
 
 /*
- * start as many threads as might be needed for the current queue
+ * start threads for workers that have tasks queued but no thread,
+ * and the timer if tasks are delayed
  */
 int task_start (TASKQ *q)
 {
-  int num_tasks = 0;
-  TASK *t;
+  TASKW *w;
+  int i;
 
   wait_mutex (q);
   q->stop = 0;
-  for (t = q->queue; t != NULL; t = t->next)
-    num_tasks++;
-  num_tasks -= q->waiting;
-  set_ready (q);
-  while ((num_tasks-- > 0) && (q->running < q->maxthreads))
+  for (i = 0; i < q->maxthreads; i++)
   {
-    debug ("starting new task\n");
-    q->running++;
-    t_start (task_run, q);
+    w = q->worker + i;
+    wait_mutex (w);
+    if ((w->state == TASK_IDLE) && w->count)
+    {
+      debug ("starting new task\n");
+      w->state = TASK_BUSY;
+      q->running++;
+      t_start (task_run, w);
+    }
+    end_mutex (w);
   }
+  task_tick (q);
   end_mutex (q);
   return (0);
 }
 
 /*
- * add a task to run, and start a thread for it if needed and not stopped
+ * Add a task to run, handing it to a parked thread, starting a new
+ * thread, or queueing it for a busy one.
  * return non-zero if something bad happens
  */
 int task_add (TASKQ *q, int (*fn)(void *), void *parm)
 {
-  TASK *new, **tp;
+  TASKW *w;
 
+  /*
+   * When every thread is busy (e.g. a burst of requests) just queue
+   * it round robin, and only bother the queue if a worker parked
+   * in the mean time.
+   */
+  if ((q->parked == NULL) && (q->running == q->maxthreads) && !q->stop)
+  {
+    w = q->worker + 
+      (InterlockedIncrement (&q->next) & 0x7fffffff) % q->maxthreads;
+    if (task_push (w, fn, parm, 0) == 0)
+    {
+      if (q->parked != NULL)
+	task_wake (q);
+      return (0);
+    }
+  }
   wait_mutex (q);
-  debug ("getting new task\n");
-  if ((new = q->pool) != NULL)
-    q->pool = new->next;
-  else
-    new = (TASK *) malloc (sizeof (TASK));
-  new->next = NULL;
-  new->fn = fn;
-  new->parm = parm;
-  debug ("adding task to queue list\n");
-  for (tp = &q->queue; *tp != NULL; tp = &(*tp)->next);
-  *tp = new;
+  if (q->stop)			/* hold it for task_start()	*/
+  {
+    task_push (q->worker, fn, parm, 1);
+    end_mutex (q);
+    return (0);
+  }
+  if ((w = q->parked) != NULL)	/* wake a waiting thread	*/
+  {
+    task_unpark (q, w);
+    task_push (w, fn, parm, 1);
+    end_mutex (q);
+    set_ready (w);
+    return (0);
+  }
+  if (q->running < q->maxthreads)
+  {
+    for (w = q->worker; w->state != TASK_IDLE; w++);
+    debug ("starting new task\n");
+    wait_mutex (w);
+    w->state = TASK_BUSY;
+    end_mutex (w);
+    task_push (w, fn, parm, 1);
+    q->running++;
+    end_mutex (q);
+    t_start (task_run, w);
+    return (0);
+  }
+  w = q->worker + (++q->next & 0x7fffffff) % q->maxthreads;
+  task_push (w, fn, parm, 1);
   end_mutex (q);
-  if (q->stop == 0)
-    task_start (q);
   return (0);
 }
 
 /*
- * This is our actual thread.  It gets tasks off the queue and 
- * runs them until it either times out waiting for a new task,
- * or is told to exit.
+ * Add a task to run after ms milliseconds.  The task is held in the
+ * queue's heap until due, so no thread is tied up waiting on it.
+ * Delayed tasks not yet due when the queue is freed are dropped.
  */
-void task_run (TASKQ *q)
+int task_delay (TASKQ *q, int ms, int (*fn)(void *), void *parm)
 {
+  TASKT *t;
+
+  if (ms <= 0)
+    return (task_add (q, fn, parm));
+  wait_mutex (q);
+  if (q->timers == q->timersz)	/* full, double it		*/
+  {
+    q->timersz = q->timersz ? q->timersz << 1 : 16;
+    t = (TASKT *) malloc (q->timersz * sizeof (TASKT));
+    if (q->timers)
+      memcpy (t, q->timer, q->timers * sizeof (TASKT));
+    if (q->timer != NULL)
+      free (q->timer);
+    q->timer = t;
+  }
+  t = q->timer + q->timers;
+  t->due = GetTickCount () + ms;
+  t->task.fn = fn;
+  t->task.parm = parm;
+  if (task_timer_up (q, q->timers++) == 0)
+    set_ready (q);		/* new soonest, re-arm the timer	*/
+  task_tick (q);
+  end_mutex (q);
+  return (0);
+}
+
+/*
+ * This is our actual thread.  It runs tasks from it's own worker
+ * ring or stolen from others until it either times out waiting for
+ * a new task, or is told to exit.
+ */
+void task_run (TASKW *w)
+{
+  TASKQ *q = w->q;
+  TASK t;
+  int v;
+
+  debug ("new thread started\n");
+  while (1)
+  { 
+    if (q->stop)
+    {
+      wait_mutex (q);
+      task_unpark (q, w);
+      wait_mutex (w);
+      break;
+    }
+    debug ("checking next task\n");
+    if (task_pop (w, &t) || task_steal (w, &t))
+    {
+      debug ("completing task\n");
+      (*t.fn) (t.parm);		/* complete the task		*/
+      continue;
+    }
+    /*
+     * Nothing to do, so park.  Look again once parked since a task
+     * may have been queued before we could be woken for it.
+     */
+    wait_mutex (q);
+    w->state = TASK_PARKED;
+    w->parked = q->parked;
+    q->parked = w;
+    q->waiting++;
+    end_mutex (q);
+    if (task_pop (w, &t) || task_steal (w, &t))
+    {
+      wait_mutex (q);
+      task_unpark (q, w);
+      end_mutex (q);
+      (*t.fn) (t.parm);
+      continue;
+    }
+    debug ("waiting for ready\n");
+    v = wait_ready (w);
+    /*
+     * If we are still parked, either we timed out or the event was
+     * left over from an earlier wake up.
+     */
+    wait_mutex (q);
+    if (task_unpark (q, w) || (v == TASK_READY))
+    {
+      end_mutex (q);
+      continue;
+    }
+    end_mutex (q);
+    debug ("timed out or lost event\n");
+    if (task_steal (w, &t))
+    {
+      (*t.fn) (t.parm);
+      continue;
+    }
+    wait_mutex (q);		/* exit unless a task came our way */
+    wait_mutex (w);
+    if (w->count == 0)
+      break;
+    end_mutex (w);
+    end_mutex (q);
+  }
+  /* exit here, note no longer running, regardless		*/
+  w->state = TASK_IDLE;
+  q->running--;			/* note we no longer run	*/
+  end_mutex (w);
+  end_mutex (q);
+  debug ("exiting\n");
+  t_exit ();
+}
+
+#ifdef UNITTEST
+#undef UNITTEST
+
+/*
+ * The original single lock, linked list task queue, kept here to
+ * benchmark against.
+ */
+typedef struct listt
+{
+  struct listt *next;
+  int (*fn) (void *p);
+  void *parm;
+} LISTT;
+
+typedef struct listq
+{
+  MUTEX mutex;
+  READY ready;
+  int timeout;
+  LISTT *queue;
+  LISTT *pool;
+  int maxthreads;
+  int running;
+  int waiting;
+  int stop;
+} LISTQ;
+
+void list_run (LISTQ *q)
+{
+  LISTT *t;
   int v;
-  TASK *t;
   int (*fn)(void *p);
   void *parm;
 
-  debug ("new thread started\n");
   wait_mutex (q);
-  while (q->stop == 0)		/* get next task from the queue	*/
+  while (q->stop == 0)
   { 
-    debug ("checking next task\n");
-    if ((t = q->queue) != NULL)	/* found something to do	*/
+    if ((t = q->queue) != NULL)
     {
       if ((q->queue = t->next) != NULL)
-        set_ready (q);		/* notify others task is ready	*/
-      fn = t->fn;		/* note our task		*/
+        set_ready (q);
+      fn = t->fn;
       parm = t->parm;
-      t->next = q->pool;	/* add it back to the pool	*/
+      t->next = q->pool;
       q->pool = t;
-      debug ("completing task\n");
       end_mutex (q);
-      (*fn) (parm);		/* complete the task		*/
+      (*fn) (parm);
       wait_mutex (q);
     }
-    else			/* no tasks, go idle		*/
+    else
     {
-      q->waiting++;		/* note we are waiting		*/
+      q->waiting++;
       end_mutex (q);
-      debug ("waiting for ready\n");
       v = wait_ready (q);
       wait_mutex (q);
       q->waiting--;
       if (v != TASK_READY)
-      {
-        debug ("timed out or lost event\n");
         break;	
-      }
     }
   }
-  /* exit here, note no longer running, regardless		*/
-  q->running--;			/* note we no longer run	*/
+  q->running--;
   end_mutex (q);
-  debug ("exiting\n");
   t_exit ();
 }
 
-#ifdef UNITTEST
-#undef UNITTEST
+int list_add (LISTQ *q, int (*fn)(void *), void *parm)
+{
+  LISTT *new, **tp;
+  int n = 0;
+
+  wait_mutex (q);
+  if ((new = q->pool) != NULL)
+    q->pool = new->next;
+  else
+    new = (LISTT *) malloc (sizeof (LISTT));
+  new->next = NULL;
+  new->fn = fn;
+  new->parm = parm;
+  for (tp = &q->queue; *tp != NULL; tp = &(*tp)->next);
+  *tp = new;
+  for (new = q->queue; new != NULL; new = new->next)
+    n++;
+  n -= q->waiting;
+  set_ready (q);
+  while ((n-- > 0) && (q->running < q->maxthreads))
+  {
+    q->running++;
+    t_start (list_run, q);
+  }
+  end_mutex (q);
+  return (0);
+}
+
+/*
+ * benchmark tasks and producers
+ */
+#define BENCHTASKS 200000
+#define BENCHPRODUCERS 4
+
+LONG Done = 0;
+int Ran[BENCHTASKS];
+
+int bench_task (void *p)
+{
+  Ran[(int) p]++;
+  InterlockedIncrement (&Done);
+  return (0);
+}
+
+typedef struct bench
+{
+  void *q;
+  int list;
+  int first;
+} BENCH;
+
+void bench_producer (BENCH *b)
+{
+  int i;
+
+  for (i = b->first; i < BENCHTASKS; i += BENCHPRODUCERS)
+  {
+    if (b->list)
+      list_add ((LISTQ *) b->q, bench_task, (void *) i);
+    else
+      task_add ((TASKQ *) b->q, bench_task, (void *) i);
+  }
+}
+
+/*
+ * Add BENCHTASKS from BENCHPRODUCERS threads and time how long
+ * it takes for them all to run.
+ */
+DWORD bench (void *q, int list)
+{
+  BENCH b[BENCHPRODUCERS];
+  DWORD t;
+  int i;
+
+  Done = 0;
+  memset (Ran, 0, sizeof (Ran));
+  t = GetTickCount ();
+  for (i = 0; i < BENCHPRODUCERS; i++)
+  {
+    b[i].q = q;
+    b[i].list = list;
+    b[i].first = i;
+    t_start (bench_producer, b + i);
+  }
+  while (Done < BENCHTASKS)
+    sleep (1);
+  t = GetTickCount () - t;
+  for (i = 0; i < BENCHTASKS; i++)
+  {
+    if (Ran[i] != 1)
+    {
+      error ("task %d ran %d times\n", i, Ran[i]);
+      break;
+    }
+  }
+  return (t);
+}
+
+/*
+ * delayed tasks record when they ran, so we can check none ran early
+ */
+#define DELAYTASKS 50
+
+DWORD Due[DELAYTASKS], Fired[DELAYTASKS];
+
+int delay_task (void *p)
+{
+  Fired[(int) p] = GetTickCount ();
+  InterlockedIncrement (&Done);
+  return (0);
+}
 
 int main (int argc, char **argv)
 {
+  TASKQ *q;
+  LISTQ *l;
+  DWORD t;
+  int threads = 8;
+
+  if (argc > 1)
+    threads = atoi (argv[1]);
+  q = task_allocq (threads, 1000);
+  t = bench (q, 0);
+  info ("work stealing: %d tasks on %d threads in %d ms\n", 
+    BENCHTASKS, threads, t);
+
+  Done = 0;
+  for (t = 0; t < DELAYTASKS; t++)
+  {
+    Due[t] = GetTickCount () + (t * 37) % 500;
+    task_delay (q, (t * 37) % 500, delay_task, (void *) t);
+  }
+  while (Done < DELAYTASKS)
+    sleep (10);
+  for (t = 0; t < DELAYTASKS; t++)
+  {
+    if ((int) (Fired[t] - Due[t]) < 0)
+      error ("delayed task %d ran %d ms early\n", t, Due[t] - Fired[t]);
+  }
+  if (task_delayed (q))
+    error ("%d delayed tasks left\n", task_delayed (q));
+  task_delay (q, 60000, delay_task, (void *) 0);
+  if (task_stop (q) || task_running (q))
+    error ("task_stop failed\n");
+  task_freeq (q);
+
+  l = (LISTQ *) malloc (sizeof (LISTQ));
+  memset (l, 0, sizeof (LISTQ));
+  init_mutex (l);
+  init_ready (l, FALSE);
+  l->timeout = 1000;
+  l->maxthreads = threads;
+  t = bench (l, 1);
+  info ("single list: %d tasks on %d threads in %d ms\n", 
+    BENCHTASKS, threads, t);
+  wait_mutex (l);
+  l->stop = 1;
+  while (l->running)
+  {
+    set_ready (l);
+    end_mutex (l);
+    sleep (100);
+    wait_mutex (l);
+  }
+  end_mutex (l);
+
   info ("%s %s\n", argv[0], Errors?"failed":"passed");
   exit (Errors);
 }
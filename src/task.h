@@ -17,7 +17,11 @@
  */
 #ifndef __TASK__
 #define __TASK__
+#ifdef _WIN32
 #include <windows.h>
+#else
+#include "posix.h"
+#endif
 
 #define sleep Sleep
 
@@ -40,6 +44,7 @@
 #define init_ready(o,m) o->ready = CreateEvent (NULL,m,FALSE,NULL)
 #define destroy_ready(o) CloseHandle (o->ready)
 #define wait_ready(o) WaitForSingleObject (o->ready,o->timeout)
+#define wait_ready_for(o,ms) WaitForSingleObject (o->ready,ms)
 #define set_ready(o) SetEvent (o->ready)
 #define reset_ready(o) ResetEvent (o->ready)
 #define t_start(fn,p) _beginthread (fn,STACKSIZE,p)
@@ -50,26 +55,68 @@
  */
 typedef struct task
 {
-  struct task *next;		/* kept in a list			*/
   int (*fn) (void *p);		/* function to call			*/
   void *parm;			/* paramter to pass			*/
 } TASK;
 
 /*
- * a queue for tasks - the semaphore indicates the number of tasks that
- * are ready and waiting to run.
+ * a task delayed until the tick count reaches due
+ */
+typedef struct taskt
+{
+  DWORD due;			/* GetTickCount() to run it		*/
+  TASK task;			/* what to run				*/
+} TASKT;
+
+/*
+ * worker states
+ */
+#define TASK_IDLE 0		/* no thread for this worker		*/
+#define TASK_BUSY 1		/* thread running or looking for tasks	*/
+#define TASK_PARKED 2		/* thread waiting for a task		*/
+
+/*
+ * A worker thread slot with it's own queue (a ring) of tasks.  The
+ * worker takes the oldest of it's own tasks, and when it runs out
+ * steals the newest from other workers.
+ */
+typedef struct taskw
+{
+  MUTEX mutex;
+  READY ready;			/* set to wake a parked worker		*/
+  int timeout;			/* idle time before the thread exits	*/
+  TASK *task;			/* ring of queued tasks			*/
+  int head;			/* oldest task in the ring		*/
+  int count;			/* tasks in the ring			*/
+  int size;			/* ring size				*/
+  int state;			/* TASK_IDLE, TASK_BUSY, or TASK_PARKED	*/
+  struct taskq *q;		/* the queue we belong to		*/
+  struct taskw *parked;		/* next parked worker			*/
+} TASKW;
+
+/*
+ * A queue for tasks, spread across maxthreads workers.  The mutex
+ * covers starting, parking, and stopping worker threads.  Adding a
+ * task while all workers are busy only takes one worker's lock.
+ * It also covers the heap of delayed tasks, which a timer thread
+ * hands to task_add() as they come due.
  */
 typedef struct taskq
 {
   MUTEX mutex;
-  READY ready;			/* set when a task is ready		*/
   int timeout;			/* for breaking ready wait		*/
-  TASK *queue;			/* tasks queued to run			*/
-  TASK *pool;			/* a pool of available tasks		*/
+  TASKW *worker;		/* maxthreads workers			*/
+  TASKW *parked;		/* workers waiting for a task		*/
+  LONG next;			/* round robin worker for adds		*/
   int maxthreads;		/* most threads allowed			*/
   int running;			/* threads running a task		*/
   int waiting;			/* threads waiting for a task		*/
   int stop;			/* exit threads if set			*/
+  READY ready;			/* wakes the timer thread		*/
+  TASKT *timer;			/* heap of delayed tasks, soonest first	*/
+  int timers;			/* delayed tasks in the heap		*/
+  int timersz;			/* heap size				*/
+  int ticking;			/* timer thread is running		*/
 } TASKQ;
 
 /*
@@ -81,10 +128,12 @@ int task_stop (TASKQ *q);
 int task_start (TASKQ *q);
 int task_reset (TASKQ *q);
 int task_add (TASKQ *q, int (*fn)(void *), void *p);
-void task_run (TASKQ *q);
+int task_delay (TASKQ *q, int ms, int (*fn)(void *), void *p);
+void task_run (TASKW *w);
 #define task_running(q) ((q)->running)
 #define task_waiting(q) ((q)->waiting)
 #define task_available(q) ((q)->maxthreads-(q)->running)
 #define task_stopping(q) ((q)->stop)
+#define task_delayed(q) ((q)->timers)
 
 #endif /* __TASK__*/
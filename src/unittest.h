@@ -18,6 +18,8 @@
 #ifndef __UNITTEST__
 #define __UNITTEST__
 
+#include <stdio.h>
+
 /*
  * some shared globals usually in main.c
  */
@@ -116,6 +118,8 @@ char PhineasConfig[] =
 "  <PollInterval>1</PollInterval>\n"
 "  <!-- maximum number of sender threads -->\n"
 "  <MaxThreads>3</MaxThreads>\n"
+"  <!-- threads polling map folders -->\n"
+"  <FolderThreads>2</FolderThreads>\n"
 "  <!-- certificate authority -->\n"
 "  <CertificateAuthority></CertificateAuthority>\n"
 "  <!-- maximum number of reties -->\n"
@@ -212,6 +216,10 @@ char PhineasConfig[] =
 "<QueueInfo>\n"
 "  <!-- frequency that queues should be polled in seconds -->"
 "  <PollInterval>2</PollInterval>"
+"  <!-- threads for each stage of the sender -->\n"
+"  <BuildThreads>1</BuildThreads>\n"
+"  <EncryptThreads>2</EncryptThreads>\n"
+"  <SendThreads>3</SendThreads>\n"
 "  <!-- \n"
 "    for queue types, the field id is used internally, and the field\n"
 "    value should match the field label in the data row\n"
@@ -288,6 +296,7 @@ char PhineasConfig[] =
 */
 "    <Unc>tmp\\phineas.dsn</Unc>\n"
 "    <Driver></Driver>\n"
+"    <PoolSize>4</PoolSize>\n"
 "  </Connection>\n"
 "  <Queue>\n"
 "    <Name>MemSendQ</Name>\n"
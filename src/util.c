@@ -21,7 +21,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
-#include <windows.h>
+#include "task.h"
 #include "util.h"
 
 #ifndef debug
@@ -103,12 +103,13 @@ char *ptime (time_t *t, char *buf)
 
 /*
  * PHINMS process ID's
- * TODO thread safety for previous PID
  * Psuedo millisecond granular by using the MS tick counter...
+ * Each is later than the last, even from another thread.
  */
 
 time_t util_tv = 0;
 int util_ms = 0;
+LONG util_lock = 0;
 
 char *ppid (char *buf)
 {
@@ -117,10 +118,20 @@ char *ppid (char *buf)
 
   time (&tv);
   ms = GetTickCount () % 1000;
-  if ((tv == util_tv) && (ms == util_ms))
-    ms++;
+  while (InterlockedExchange (&util_lock, 1))
+    Sleep (0);
+  if ((tv < util_tv) || ((tv == util_tv) && (ms <= util_ms)))
+  {
+    tv = util_tv;
+    if ((ms = util_ms + 1) > 999)
+    {
+      tv++;
+      ms = 0;
+    }
+  }
   util_tv = tv;
   util_ms = ms;
+  InterlockedExchange (&util_lock, 0);
   sprintf (buf, "%ld%03d", tv, ms);
   return (buf);
 }
@@ -254,6 +265,10 @@ int fixpath (char *p)
     return (lp);
   if (p[1] == ':')			/* could be relative	*/
     return (lp);			/* but punt anyway	*/
+#ifndef _WIN32
+  if (p[0] == DIRSEP)			/* no drives here	*/
+    return (lp);
+#endif
   if (p[0] == DIRSEP)
   {
     if (p[1] == DIRSEP) 		/* a UNC path 		*/
@@ -22,7 +22,11 @@
 #include <time.h>
 
 #define PTIMESZ 22
+#ifdef _WIN32
 #define DIRSEP '\\'
+#else
+#define DIRSEP '/'
+#endif
 
 char *stralloc (char *old, char *new);
 char *strnstr (char *haystack, char *needle, int len);
@@ -94,6 +94,72 @@ char *xcrypt_Template =
 "  </CipherData>"
 "</EncryptedData>";
 
+/*
+ * Set the symetric key used to encrypt a payload.  Password based
+ * and file keys clear unc, since no certificate is needed.  Otherwise
+ * a random key is used and path gets the certificate's path.
+ */
+static void xcrypt_symkey (unsigned char *key, char **unc, char *path,
+  char *passwd, int how)
+{
+  if (*unc == NULL)
+  {
+    debug ("password based encryption\n");
+    crypt_pbkey (key, passwd, NULL, how);
+    strcpy (path, "Password Based");
+  }
+  else if (crypt_fkey (key, pathf (path, *unc)) == crypt_keylen (how))
+  {
+    debug ("encrypting using file key %s\n", path);
+    *unc = NULL;
+  }
+  else
+  {
+    debug ("certificate based encryption\n");
+    crypt_key (key, how);
+  }
+}
+
+/*
+ * Fill in the envelope's key information.  Use the certificate to 
+ * encrypt the symetric key or simply skip keyinfo if we don't have 
+ * a certificate.  Return non-zero if it fails.
+ */
+static int xcrypt_keyinfo (XML *xml, unsigned char *key, char *unc,
+  char *path, char *dn, char *passwd, int how)
+{
+  int len;
+  unsigned char
+    ekey[PKEYSZ],		/* big enough for a 4096 bit RSA key	*/
+    bkey[PKEYSZ+PKEYSZ/2];	/* +50% for b64 encoding		*/
+  char dnbuf[DNSZ];		/* subject in the cert			*/
+
+  if (unc == NULL)
+  {
+    debug ("no certificate, setting raw key name\n");
+    xml_delete (xml, EncryptedKey);
+    xml_set_text (xml, KeyInfoName, path);
+  }
+  else
+  {
+    debug ("unc=%s\n", unc);
+    if (dn == NULL)
+      dn = dnbuf;
+    debug ("encrypting key for %s\n", path);
+    if ((len = crypt_pk_encrypt (path, passwd, dn, ekey, key, 
+        crypt_keylen (how))) < 1)
+    {
+      error ("Public key encoding failed\n");
+      return (-1);
+    }
+    len = b64_encode (bkey, ekey, len, 76);
+    xml_set_text (xml, KeyValue, bkey);
+    xml_set_text (xml, KeyName, dn);
+  }
+  xml_set_attribute (xml, Method, "Algorithm", xcrypt_Algorithm[how]);
+  return (0);
+}
+
 /*
  * Fill in an ebxml encryption envelope.
  *
@@ -112,11 +178,8 @@ XML *xcrypt_encrypt (unsigned char *data, int len,
 {
   XML *xml;
   unsigned char *enc,
-    key[SKEYSZ],
-    ekey[PKEYSZ],		/* big enough for a 4096 bit RSA key	*/
-    bkey[PKEYSZ+PKEYSZ/2];	/* +50% for b64 encoding		*/
-  char dnbuf[DNSZ],		/* subject in the cert			*/
-    path[MAX_PATH];
+    key[SKEYSZ];
+  char path[MAX_PATH];
 
 
   if (((unc == NULL) && (passwd == NULL)) || (data == NULL) || (len < 1))
@@ -131,98 +194,47 @@ XML *xcrypt_encrypt (unsigned char *data, int len,
    * first symetric encrypt the payload and convert it to base64
    */
   debug ("encrypting %d bytes data...\n", len);
+  xcrypt_symkey (key, &unc, path, passwd, how);
   enc = (unsigned char *) malloc (len + crypt_blocksz (how) * 2);
-  if (unc == NULL)
-  {
-    debug ("password based encryption\n");
-    crypt_pbkey (key, passwd, NULL, how);
-    len = crypt_copy (enc, data, key, len, how, 1);
-    strcpy (path, "Password Based");
-  }
-  else if (crypt_fkey (key, pathf (path, unc)) == crypt_keylen (how))
-  {
-    debug ("encrypting using file key %s\n", path);
-    len = crypt_copy (enc, data, key, len, how, 1);
-    unc = NULL;
-  }
-  else
-  {
-    debug ("certificate based encryption\n");
-    len = crypt_encrypt (enc, data, key, len, how);
-  }
-  if (len < 1)
+  if ((len = crypt_copy (enc, data, key, len, how, 1)) < 1)
   {
     error ("Encryption failed\n");
     free (enc);
     return (NULL);
   }
-  data = (unsigned char *) malloc ((int) (1.40 * len));
+  data = (unsigned char *) malloc (b64_size (len, 76) + 1);
   len = b64_encode (data, enc, len, 76);
   xml = xml_parse (xcrypt_Template);
   xml_set_text (xml, DataValue, data);
   free (data);
+  free (enc);
   /*
-   * now use the certificate to encrypt the symetric key or
-   * simply skip keyinfo if only password is supplied
-   */
-  if (unc == NULL)
-  {
-    debug ("no certificate, setting raw key name\n");
-    xml_delete (xml, EncryptedKey);
-    xml_set_text (xml, KeyInfoName, path);
-  }
-  else
-  {
-    debug ("unc=%s\n", unc);
-    if (dn == NULL)
-      dn = dnbuf;
-    debug ("encrypting key for %s\n", path);
-    if ((len = crypt_pk_encrypt (path, passwd, dn, ekey, key, 
-        crypt_keylen (how))) < 1)
-    {
-      error ("Public key encoding failed\n");
-      free (enc);
-      return (NULL);
-    }
-    len = b64_encode (bkey, ekey, len, 76);
-    xml_set_text (xml, KeyValue, bkey);
-    xml_set_text (xml, KeyName, dn);
-  }
-  xml_set_attribute (xml, Method, "Algorithm", xcrypt_Algorithm[how]);
-  /*
-   * clean up
+   * now the key information
    */
-  free (enc);
+  if (xcrypt_keyinfo (xml, key, unc, path, dn, passwd, how))
+    return (xml_free (xml));
   debug ("encryption completed\n");
   return (xml);
 }
 
 /*
- * decrypt the payload and save it to data, returning it's len
+ * get the symetric key used to encrypt a payload, returning the 
+ * algorithm used (or 0 if it fails) and the key in symkey
  * payload has the XML payload envelope
- * data gets allocated the resulting decrypted payload
  * unc and passwd used to get the decryption key
  * dn checked against payload if given, otherwise gets filled in with 
  * payload's DN or ignored if NULL.
- * returns data length or 0 if fails
  */
-
-int xcrypt_decrypt (XML *payload, unsigned char **data,
+int xcrypt_key (XML *payload, unsigned char *symkey,
     char *unc, char *dn, char *passwd)
 {
   int how, len;
   unsigned char *ch, 
-    *enc, 
-    *keyfile,
-    key[PKEYSZ],
-    symkey[SKEYSZ];
-  FILE *pfp;
+    key[PKEYSZ];
   char path[MAX_PATH];
 
   if (((unc == NULL) && (passwd == NULL)) || (payload == NULL))
     return (0);
-  debug ("beginning decryption...\n");
-  *data = NULL;
   /*
    * determine how this got encrypted
    */
@@ -298,6 +310,33 @@ int xcrypt_decrypt (XML *payload, unsigned char **data,
       }
     }
   }
+  return (how);
+}
+
+/*
+ * decrypt the payload and save it to data, returning it's len
+ * payload has the XML payload envelope
+ * data gets allocated the resulting decrypted payload
+ * unc and passwd used to get the decryption key
+ * dn checked against payload if given, otherwise gets filled in with 
+ * payload's DN or ignored if NULL.
+ * returns data length or 0 if fails
+ */
+
+int xcrypt_decrypt (XML *payload, unsigned char **data,
+    char *unc, char *dn, char *passwd)
+{
+  int how, len;
+  unsigned char *ch, 
+    *enc, 
+    symkey[SKEYSZ];
+
+  if (((unc == NULL) && (passwd == NULL)) || (payload == NULL))
+    return (0);
+  debug ("beginning decryption...\n");
+  *data = NULL;
+  if ((how = xcrypt_key (payload, symkey, unc, dn, passwd)) == 0)
+    return (0);
   /*
    * get and decrypt the payload
    */
@@ -318,6 +357,310 @@ int xcrypt_decrypt (XML *payload, unsigned char **data,
   return (len);
 }
 
+/*
+ * Streamed decryption...
+ *
+ * Large envelopes are kept in a file.  Only the envelope without
+ * it's cipher data gets parsed, and the cipher data is decoded and 
+ * decrypted a block at a time.
+ */
+#define XBUFSZ 8192		/* stream buffer size			*/
+#define XHEADSZ 65536		/* largest envelope sans cipher data	*/
+
+/*
+ * Find the cipher data in an envelope in a file of len bytes at the
+ * current position.  This is the content of the last CipherValue
+ * tag.  Set first and last to offsets from the start of the 
+ * envelope.  Return 0 if found.
+ */
+static int xcrypt_find (FILE *in, long len, long *first, long *last)
+{
+  char *ch, *p, buf[XBUFSZ];
+  long base;
+  int i, j, n, l;
+
+  base = 0;
+  *first = *last = -1;
+  l = strlen ("CipherValue>");
+  i = n = 0;
+  while (base + n < len)
+  {
+    j = len - base - n;
+    if (j > XBUFSZ - n)
+      j = XBUFSZ - n;
+    if ((j = fread (buf + n, 1, j, in)) < 1)
+      break;
+    n += j;
+    while (1)
+    {
+      if ((ch = memchr (buf + i, 'C', n - i)) == NULL)
+      {
+	i = n;
+	break;
+      }
+      i = ch - buf;
+      if (i + l > n)
+	break;
+      i++;
+      if (strncmp (ch, "CipherValue>", l))
+	continue;
+      /*
+       * back up to the start of the tag to see if it opens or closes
+       */
+      for (p = ch; (p > buf) && (p > ch - 32) && (*p != '<'); p--);
+      if (*p != '<')
+	continue;
+      if (p[1] != '/')
+      {
+	*first = base + i - 1 + l;
+	*last = -1;
+      }
+      else if (*last < 0)
+	*last = base + (p - buf);
+    }
+    /*
+     * keep enough to back up over a tag prefix
+     */
+    if ((j = i - 48) > 0)
+    {
+      memmove (buf, buf + j, n - j);
+      n -= j;
+      i -= j;
+      base += j;
+    }
+  }
+  return ((*first < 0) || (*last < *first));
+}
+
+/*
+ * Read and parse the envelope, skipping the cipher data from first
+ * up to last.
+ */
+static XML *xcrypt_envelope (FILE *in, long offset, long len,
+  long first, long last)
+{
+  char *buf;
+  int n;
+  XML *xml;
+
+  if (first + len - last > XHEADSZ)
+  {
+    error ("Encryption envelope too large\n");
+    return (NULL);
+  }
+  buf = (char *) malloc (first + len - last + 1);
+  fseek (in, offset, SEEK_SET);
+  n = fread (buf, 1, first, in);
+  fseek (in, offset + last, SEEK_SET);
+  n += fread (buf + n, 1, len - last, in);
+  buf[n] = 0;
+  xml = xml_parse (buf);
+  free (buf);
+  return (xml);
+}
+
+/*
+ * write decrypted data, skipping the leading IV block
+ */
+static int xcrypt_write (FILE *out, unsigned char *plain, int len, 
+  int *skip)
+{
+  int n;
+
+  if ((n = *skip) > len)
+    n = len;
+  *skip -= n;
+  if (len -= n)
+    fwrite (plain + n, 1, len, out);
+  return (len);
+}
+
+/*
+ * decrypt a payload envelope kept in a file, writing it to another
+ * in is positioned at the start of an envelope len bytes long
+ * out gets the decrypted payload
+ * unc, dn, and passwd as for xcrypt_decrypt()
+ * returns decrypted length or 0 if fails
+ */
+long xcrypt_decrypt_fp (FILE *in, long len, FILE *out,
+    char *unc, char *dn, char *passwd)
+{
+  EVP_CIPHER_CTX ctx;
+  XML *payload;
+  long offset, first, last, sz;
+  int how, n, l, skip;
+  char buf[XBUFSZ + 1], carry[5];
+  unsigned char iv[16],
+    dec[XBUFSZ],
+    plain[XBUFSZ + 32],
+    symkey[SKEYSZ];
+
+  debug ("beginning streamed decryption...\n");
+  offset = ftell (in);
+  if (xcrypt_find (in, len, &first, &last))
+  {
+    error ("Couldn't get cypher payload\n");
+    return (0);
+  }
+  if ((payload = xcrypt_envelope (in, offset, len, first, last)) == NULL)
+    return (0);
+  how = xcrypt_key (payload, symkey, unc, dn, passwd);
+  xml_free (payload);
+  if (how == 0)
+    return (0);
+  /*
+   * decode and decrypt the cipher data, dropping the IV
+   */
+  debug ("decrypting %ld bytes of cypher data\n", last - first);
+  fseek (in, offset + first, SEEK_SET);
+  memset (iv, 0, sizeof (iv));
+  skip = crypt_blocksz (how);
+  EVP_CIPHER_CTX_init (&ctx);
+  EVP_CipherInit (&ctx, crypt_cipher (how), symkey, iv, 0);
+  *carry = 0;
+  sz = 0;
+  for (len = last - first; len > 0; len -= n)
+  {
+    n = len < XBUFSZ ? len : XBUFSZ;
+    if ((n = fread (buf, 1, n, in)) < 1)
+      break;
+    l = b64_decode_part (dec, buf, n, carry);
+    EVP_CipherUpdate (&ctx, plain, &l, dec, l);
+    sz += xcrypt_write (out, plain, l, &skip);
+  }
+  l = b64_decode (dec, carry);
+  EVP_CipherUpdate (&ctx, plain, &l, dec, l);
+  sz += xcrypt_write (out, plain, l, &skip);
+  if (!EVP_CipherFinal (&ctx, plain, &l))
+  {
+    error ("Couldn't decrypt payload\n");
+    sz = 0;
+  }
+  else
+    sz += xcrypt_write (out, plain, l, &skip);
+  EVP_CIPHER_CTX_cleanup (&ctx);
+  debug ("final decoding to %ld bytes\n", sz);
+  return (sz);
+}
+
+/*
+ * Streamed encryption...
+ *
+ * The envelope is formatted with a marker where the cipher data goes,
+ * and the data is encrypted and encoded a block at a time in it's
+ * place.  Whole lines are encoded until the last so the result
+ * matches encoding it all at once.
+ */
+#define XMARKER "CIPHERDATA"
+#define XENCSZ (((XBUFSZ + 90) / 57 + 1) * 78 + 4)
+
+/*
+ * write whole lines of base64 encoded cipher data of len, or all of 
+ * it if last, keeping any remainder for the next call.  Return the
+ * encoded length written or -1 if it fails.
+ */
+static int xcrypt_encode (FILE *out, unsigned char *cipher, int *len,
+  int last)
+{
+  char enc[XENCSZ];
+  int n, l;
+
+  n = last ? *len : *len / 57 * 57;
+  l = b64_encode (enc, cipher, n, 76);
+  if (fwrite (enc, 1, l, out) != l)
+    return (-1);
+  *len -= n;
+  memmove (cipher, cipher + n, *len);
+  return (l);
+}
+
+/*
+ * encrypt a payload kept in a file, writing the envelope to another
+ * in is positioned at the start of the payload which is len long
+ * out gets the envelope
+ * unc, dn, passwd, and how as for xcrypt_encrypt()
+ * returns envelope length or 0 if fails
+ */
+long xcrypt_encrypt_fp (FILE *in, long len, FILE *out,
+    char *unc, char *dn, char *passwd, int how)
+{
+  EVP_CIPHER_CTX ctx;
+  XML *xml;
+  long sz;
+  int n, l, p;
+  char *env, *ch,
+    path[MAX_PATH];
+  unsigned char iv[16],
+    key[SKEYSZ],
+    buf[XBUFSZ],
+    cipher[XBUFSZ + 90];
+
+  if (((unc == NULL) && (passwd == NULL)) || (len < 1))
+  {
+    debug ("missing unc/passwd or data for len=%ld\n", len);
+    return (0);
+  }
+  if ((how < FIRSTCIPHER) || (how > LASTCIPHER))
+    how = TRIPLEDES;
+  debug ("beginning streamed encryption...\n");
+  xcrypt_symkey (key, &unc, path, passwd, how);
+  xml = xml_parse (xcrypt_Template);
+  xml_set_text (xml, DataValue, XMARKER);
+  if (xcrypt_keyinfo (xml, key, unc, path, dn, passwd, how))
+  {
+    xml_free (xml);
+    return (0);
+  }
+  env = xml_format (xml);
+  xml_free (xml);
+  if ((ch = strstr (env, XMARKER)) == NULL)
+  {
+    error ("Can't find cipher data in envelope\n");
+    free (env);
+    return (0);
+  }
+  sz = fwrite (env, 1, ch - env, out);
+  /*
+   * encrypt the IV followed by the payload, as crypt_copy() does
+   */
+  debug ("encrypting %ld bytes of data\n", len);
+  crypt_iv (iv, how);
+  EVP_CIPHER_CTX_init (&ctx);
+  EVP_CipherInit (&ctx, crypt_cipher (how), key, iv, 1);
+  EVP_CipherUpdate (&ctx, cipher, &p, iv, crypt_blocksz (how));
+  for (; len > 0; len -= n)
+  {
+    n = len < XBUFSZ ? len : XBUFSZ;
+    if ((n = fread (buf, 1, n, in)) < 1)
+      break;
+    EVP_CipherUpdate (&ctx, cipher + p, &l, buf, n);
+    p += l;
+    if ((l = xcrypt_encode (out, cipher, &p, 0)) < 0)
+      break;
+    sz += l;
+  }
+  if (len == 0)
+  {
+    EVP_CipherFinal (&ctx, cipher + p, &l);
+    p += l;
+    if ((l = xcrypt_encode (out, cipher, &p, 1)) < 0)
+      len = -1;
+    sz += l;
+  }
+  EVP_CIPHER_CTX_cleanup (&ctx);
+  ch += strlen (XMARKER);
+  if ((len != 0) || (fwrite (ch, 1, strlen (ch), out) != strlen (ch)))
+  {
+    error ("Failed streaming encryption envelope\n");
+    sz = 0;
+  }
+  else
+    sz += strlen (ch);
+  free (env);
+  debug ("encrypted envelope is %ld bytes\n", sz);
+  return (sz);
+}
+
 #ifdef CMDLINE
 #undef debug
 #include "applink.c"
@@ -352,9 +695,11 @@ int dbuftest ()
 int runtest (char *keyfile, char *password, int how)
 {
   XML *xml;
+  FILE *in, *env, *out;
   int len;
   char 
     *method = "certificate",
+    buf[DNSZ],
     dn[DNSZ];
   unsigned char
     *payload,
@@ -376,9 +721,35 @@ int runtest (char *keyfile, char *password, int how)
       fatal ("length %d doesn't match expected %d\n", len, strlen (p) + 1);
     if (strcmp (payload, p))
       fatal ("payload differs: %s", payload);
-    debug ("passed testing using %s\n", method);
     free (payload);
     xml = xml_free (xml);
+    /*
+     * again, streamed through files
+     */
+    in = tmpfile ();
+    env = tmpfile ();
+    out = tmpfile ();
+    fwrite (p, 1, strlen (p) + 1, in);
+    rewind (in);
+    *dn = 0;
+    if ((len = xcrypt_encrypt_fp (in, strlen (p) + 1, env, keyfile, dn,
+      password, how)) < 1)
+      fatal ("failed streamed encryption\n");
+    if (ftell (env) != len)
+      error ("streamed envelope size %d but wrote %ld\n", len, ftell (env));
+    rewind (env);
+    if ((len = xcrypt_decrypt_fp (env, len, out, keyfile, dn, 
+      password)) != strlen (p) + 1)
+      fatal ("streamed length %d doesn't match expected %d\n", 
+        len, strlen (p) + 1);
+    rewind (out);
+    fread (buf, 1, len, out);
+    if (strcmp (buf, p))
+      fatal ("streamed payload differs: %s", buf);
+    fclose (in);
+    fclose (env);
+    fclose (out);
+    debug ("passed testing using %s\n", method);
     if (strcmp (method, "certificate") == 0)
     {
       method = "key file";
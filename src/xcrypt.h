@@ -45,5 +45,25 @@ XML *xcrypt_encrypt (unsigned char *data, int len,
  */
 int xcrypt_decrypt (XML *payload, unsigned char **data,
     char *unc, char *dn, char *passwd);
+/*
+ * decrypt a payload envelope kept in a file, writing the result
+ * to another file.  This avoids holding either in memory.
+ * in is positioned at the start of the envelope which is len long
+ * out gets the decrypted payload
+ * unc, dn, and passwd as for xcrypt_decrypt()
+ * returns decrypted length or 0 if fails
+ */
+long xcrypt_decrypt_fp (FILE *in, long len, FILE *out,
+    char *unc, char *dn, char *passwd);
+/*
+ * encrypt a payload kept in a file, writing the envelope to another
+ * so that neither is held in memory.
+ * in is positioned at the start of the payload which is len long
+ * out gets the envelope
+ * unc, dn, passwd, and how as for xcrypt_encrypt()
+ * returns envelope length or 0 if fails
+ */
+long xcrypt_encrypt_fp (FILE *in, long len, FILE *out,
+    char *unc, char *dn, char *passwd, int how);
 
 #endif /* __XCRYPT__ */
@@ -664,6 +664,91 @@ int xml_path_opts (XML *xml, int path_sep, int indx_sep)
   return (oldsep);
 }
 
+/*
+ * Node handles let a document that gets filled in over and over 
+ * (like a message template) resolve it's paths just once.
+ */
+
+/*
+ * force an element at path and return a handle for it
+ */
+void *xml_node (XML *xml, char *path)
+{
+  XMLNODE *p;
+
+  return (xml_force (xml, path, &p));
+}
+
+/*
+ * force a text value to a node handle
+ * return 0 if ok
+ */
+int xml_node_set_text (void *node, char *text)
+{
+  XMLNODE *n = (XMLNODE *) node;
+
+  if (n == NULL)
+    return (-1);
+  xmln_free (n->value);
+  n->value = xmln_text_alloc (text, strlen (text));
+  return (0);
+}
+
+/*
+ * set attribute value at a node handle
+ * return non-zero if fails
+ */
+int xml_node_set_attribute (void *node, char *name, char *value)
+{
+  if (node == NULL)
+    return (-1);
+  return (xmln_set_attr ((XMLNODE *) node, name, value) == NULL);
+}
+
+/*
+ * copy a node chain, replacing any of num handles found with the
+ * copied node
+ */
+static XMLNODE *xml_dup_nodes (XMLNODE *node, void **nodes, int num)
+{
+  XMLNODE *n, *head, **p;
+  int i;
+
+  head = NULL;
+  for (p = &head; node != NULL; node = node->next)
+  {
+    *p = n = xmln_alloc (node->type, node->key);
+    p = &n->next;
+    n->attributes = xml_dup_nodes (node->attributes, NULL, 0);
+    if (xmln_isparent (node))
+      n->value = xml_dup_nodes (node->value, nodes, num);
+    else if (node->value != NULL)
+      xmln_set_val (n, node->value, strlen (node->value));
+    for (i = 0; i < num; i++)
+    {
+      if (nodes[i] == node)
+	nodes[i] = n;
+    }
+  }
+  return (head);
+}
+
+/*
+ * copy a document.  Any of num node handles for the original are
+ * replaced with handles for the same nodes in the copy.
+ */
+XML *xml_dup (XML *xml, void **nodes, int num)
+{
+  XML *x;
+
+  if (xml == NULL)
+    return (NULL);
+  x = xml_alloc ();
+  x->path_sep = xml->path_sep;
+  x->indx_sep = xml->indx_sep;
+  x->doc = xml_dup_nodes (xml->doc, nodes, num);
+  return (x);
+}
 
 /*
  * Parse and return XML document in this buf  
@@ -928,6 +1013,34 @@ scratch:
   dbuf_clear (b);
   rdive (x, b, xml_root (x), 0);
   xmldiff ("reverse dive test doesn't match", b, RDiveXML);
+  /* copy and node handle test */
+  debug ("copying...\n");
+  {
+    XML *y;
+    void *nodes[2];
+
+    nodes[0] = xml_node (x, "foo.bar.stuff[2]");
+    nodes[1] = xml_node (x, "foo.bar[1]");
+    y = xml_dup (x, nodes, 2);
+    ch = xml_format (x);
+    ch2 = xml_format (y);
+    if (strcmp (ch, ch2))
+      error ("copy doesn't match\n");
+    free (ch2);
+    xml_node_set_text (nodes[0], "copied stuff");
+    xml_node_set_attribute (nodes[1], "some:attr", "copied value");
+    if (strcmp (xml_get_text (y, "foo.bar.stuff[2]"), "copied stuff"))
+      error ("copy handle text not set\n");
+    if (strcmp (xml_get_attribute (y, "foo.bar[1]", "some:attr"),
+      "copied value"))
+      error ("copy handle attribute not set\n");
+    ch2 = xml_format (x);
+    if (strcmp (ch, ch2))
+      error ("copy changed the original\n");
+    free (ch);
+    free (ch2);
+    xml_free (y);
+  }
   dbuf_free (b);
   xml_free (x);
   info ("%s %s\n", argv[0], Errors?"failed":"passed");
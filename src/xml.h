@@ -181,6 +181,28 @@ int xml_prev (XML *xml, char *path);
  * set the path separators
  */
 int xml_path_opts (XML *xml, int path_sep, int indx_sep);
+/*
+ * Node handles let a document that gets filled in over and over 
+ * (like a message template) resolve it's paths just once.
+ *
+ * force an element at path and return a handle for it
+ */
+void *xml_node (XML *xml, char *path);
+/*
+ * force a text value to a node handle
+ * return 0 if ok
+ */
+int xml_node_set_text (void *node, char *text);
+/*
+ * set attribute value at a node handle
+ * return non-zero if fails
+ */
+int xml_node_set_attribute (void *node, char *name, char *value);
+/*
+ * copy a document.  Any of num node handles for the original are
+ * replaced with handles for the same nodes in the copy.
+ */
+XML *xml_dup (XML *xml, void **nodes, int num);
 /*
  * Parse and return XML document in this buf  
  */
@@ -864,7 +864,7 @@ int xmln_format (XMLNODE *node, DBUF *b)
 XMLNODE *xmln_read (FILE *fp, int doc)
 {
   XMLNODE *x;
-  char *buf, **p;
+  char *buf, *ch, **p;
   int bufsz = 4096, 
       sz = 0, 
       n;
@@ -880,7 +880,8 @@ XMLNODE *xmln_read (FILE *fp, int doc)
     }
   }
   buf[sz] = 0;
-  p = &buf;
+  ch = buf;
+  p = &ch;
   if (doc)
     x = xmln_parse_doc (p);
   else